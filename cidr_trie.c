@@ -0,0 +1,174 @@
+#include "cidr_trie.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+static const unsigned char v4_mapped_prefix[12] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+};
+
+int cidr_trie_init(cidr_trie* t) {
+    memset(t, 0, sizeof(cidr_trie));
+    t->cap = 64;
+    t->nodes = calloc(t->cap, sizeof(cidr_node));
+    if(!t->nodes) {
+        return -1;
+    }
+    t->count = 2;   // both roots
+    return 0;
+}
+
+void cidr_trie_free(cidr_trie* t) {
+    if(t->cap) {
+        free(t->nodes);
+    }
+    memset(t, 0, sizeof(cidr_trie));
+}
+
+static uint32_t cidr_new_node(cidr_trie* t) {
+    if(t->count == t->cap) {
+        cidr_node* nodes = realloc(t->nodes, t->cap * 2 * sizeof(cidr_node));
+        if(!nodes) {
+            return 0;
+        }
+        memset(nodes + t->cap, 0, t->cap * sizeof(cidr_node));
+        t->nodes = nodes;
+        t->cap *= 2;
+    }
+    return t->count++;
+}
+
+static int cidr_is_leaf(const cidr_node* n) {
+    return n->child[0] == CIDR_LEAF;
+}
+
+int cidr_trie_add_prefix(cidr_trie* t, int family, const unsigned char* addr, int prefix_len) {
+    int max = (family == AF_INET) ? 32 : 128;
+    uint32_t idx = (family == AF_INET) ? 0 : 1;
+
+    if(!t->nodes || t->cap == 0 || prefix_len < 0 || prefix_len > max) {
+        return -1;
+    }
+
+    for(int i = 0; i < prefix_len; i++) {
+        if(cidr_is_leaf(&t->nodes[idx])) {
+            return 0;   // covered by a shorter prefix
+        }
+
+        int bit = (addr[i >> 3] >> (7 - (i & 7))) & 1;
+        uint32_t next = t->nodes[idx].child[bit];
+        if(next == 0) {
+            next = cidr_new_node(t);
+            if(next == 0) {
+                return -1;
+            }
+            t->nodes[idx].child[bit] = next;
+        }
+        idx = next;
+    }
+
+    /* longer prefixes below are now redundant, their nodes stay unused */
+    t->nodes[idx].child[0] = CIDR_LEAF;
+    t->nodes[idx].child[1] = CIDR_LEAF;
+    t->rules++;
+    return 0;
+}
+
+/* parse "addr" or "addr/len", -1 if rule is not an IP rule */
+int cidr_trie_add(cidr_trie* t, const char* rule) {
+    char buff[INET6_ADDRSTRLEN + 4];
+    unsigned char addr[16];
+    int prefix_len = -1;
+
+    if(strlen(rule) >= sizeof(buff)) {
+        return -1;
+    }
+    strcpy(buff, rule);
+
+    char* slash = strchr(buff, '/');
+    if(slash) {
+        char* end;
+        *slash = '\0';
+        prefix_len = (int)strtol(slash + 1, &end, 10);
+        if(end == slash + 1 || *end != '\0') {
+            return -1;
+        }
+    }
+
+    if(inet_pton(AF_INET, buff, addr) == 1) {
+        return cidr_trie_add_prefix(t, AF_INET, addr, prefix_len < 0 ? 32 : prefix_len);
+    }
+    if(inet_pton(AF_INET6, buff, addr) == 1) {
+        return cidr_trie_add_prefix(t, AF_INET6, addr, prefix_len < 0 ? 128 : prefix_len);
+    }
+    return -1;
+}
+
+int cidr_trie_match_bytes(const cidr_trie* t, int family, const unsigned char* addr) {
+    int max = 32;
+    uint32_t idx = 0;
+
+    if(!t->nodes) {
+        return 0;
+    }
+
+    if(family == AF_INET6) {
+        // v4-mapped addresses follow the IPv4 rules
+        if(memcmp(addr, v4_mapped_prefix, sizeof(v4_mapped_prefix)) == 0) {
+            addr += sizeof(v4_mapped_prefix);
+        }
+        else {
+            max = 128;
+            idx = 1;
+        }
+    }
+    else if(family != AF_INET) {
+        return 0;
+    }
+
+    for(int i = 0; i < max; i++) {
+        const cidr_node* n = &t->nodes[idx];
+        if(cidr_is_leaf(n)) {
+            return 1;
+        }
+        idx = n->child[(addr[i >> 3] >> (7 - (i & 7))) & 1];
+        if(idx == 0) {
+            return 0;
+        }
+    }
+    return cidr_is_leaf(&t->nodes[idx]);
+}
+
+int cidr_trie_match(const cidr_trie* t, const struct sockaddr* addr) {
+    if(addr->sa_family == AF_INET) {
+        const struct sockaddr_in* sin = (const struct sockaddr_in*)addr;
+        return cidr_trie_match_bytes(t, AF_INET, (const unsigned char*)&sin->sin_addr);
+    }
+    if(addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6* sin6 = (const struct sockaddr_in6*)addr;
+        return cidr_trie_match_bytes(t, AF_INET6, sin6->sin6_addr.s6_addr);
+    }
+    return 0;
+}
+
+int cidr_trie_view(cidr_trie* t, const cidr_node* nodes, uint32_t count, uint32_t rules) {
+    if(count < 2) {
+        return -1;
+    }
+    /* links stay inside the array, a bad file can't send a lookup astray */
+    for(uint32_t i = 0; i < count; i++) {
+        for(int b = 0; b < 2; b++) {
+            uint32_t c = nodes[i].child[b];
+            if(c != CIDR_LEAF && c >= count) {
+                return -1;
+            }
+        }
+    }
+
+    memset(t, 0, sizeof(cidr_trie));
+    t->nodes = (cidr_node*)nodes;
+    t->count = count;
+    t->rules = rules;
+    return 0;
+}
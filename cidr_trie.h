@@ -0,0 +1,33 @@
+#ifndef CIDR_TRIE_H
+#define CIDR_TRIE_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* binary radix trie over raw address bits, one root per family. lookup
+ * walks at most 32/128 nodes however many prefixes are loaded. nodes live
+ * in one flat array with index links so the trie can be copied as is */
+typedef struct cidr_node {
+    uint32_t child[2];      // 0 = none, both CIDR_LEAF = prefix ends here
+} cidr_node;
+
+typedef struct cidr_trie {
+    cidr_node* nodes;       // [0] IPv4 root, [1] IPv6 root
+    uint32_t count;
+    uint32_t cap;           // 0 when viewing nodes owned by someone else
+    uint32_t rules;
+} cidr_trie;
+
+#define CIDR_LEAF   UINT32_MAX
+
+int cidr_trie_init(cidr_trie* t);
+void cidr_trie_free(cidr_trie* t);
+int cidr_trie_add(cidr_trie* t, const char* rule);
+int cidr_trie_add_prefix(cidr_trie* t, int family, const unsigned char* addr, int prefix_len);
+int cidr_trie_match(const cidr_trie* t, const struct sockaddr* addr);
+int cidr_trie_match_bytes(const cidr_trie* t, int family, const unsigned char* addr);
+/* match against nodes copied out of another trie, e.g. from a mapped file.
+ * read only, cidr_trie_free leaves them alone */
+int cidr_trie_view(cidr_trie* t, const cidr_node* nodes, uint32_t count, uint32_t rules);
+
+#endif // CIDR_TRIE_H
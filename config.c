@@ -0,0 +1,342 @@
+#include "config.h"
+#include "logger.h"
+#include "fakeip.h"
+#include "dns_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static size_t config_align(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+static toralize_snapshot* config_new(void) {
+    toralize_snapshot* conf = calloc(1, sizeof(toralize_snapshot));
+    if(!conf || !(conf->upstreams = upstream_set_create())) {
+        free(conf);
+        return NULL;
+    }
+    conf->log_level = LOGGER_WARN;
+    conf->timeout_ms = DEFAULT_TIMEOUT * 1000;
+    conf->fakeip_size = FAKEIP_DEFAULT_SIZE;
+    conf->dns_ttl = 60;
+    conf->dns_negative_ttl = 5;
+    conf->dns_cache_size = DNS_CACHE_DEFAULT_SIZE;
+    return conf;
+}
+
+void config_free(toralize_snapshot* conf) {
+    if(!conf) {
+        return;
+    }
+    upstream_set_unref(conf->upstreams);
+    domain_set_free(&conf->excluded);
+    cidr_trie_free(&conf->excluded_nets);
+    if(conf->image) {
+        munmap(conf->image, conf->image_len);
+    }
+    free(conf);
+}
+
+toralize_snapshot* config_parse(FILE* f) {
+    toralize_snapshot* conf = config_new();
+    if(!conf) {
+        return NULL;
+    }
+    cidr_trie_init(&conf->excluded_nets);
+    domain_set_init(&conf->excluded);
+
+    /* set default config */
+    char tor_host[MAX_AUTH_LEN] = PROXY_HOST;
+    uint16_t tor_port = PROXY_PORT;
+
+    char line[512];
+    while(f && fgets(line, sizeof(line), f)) {
+        /* remove newline */
+        size_t len = strlen(line);
+        if(len > 0 && line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+
+        /* skip comments and empty lines */
+        if(line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+
+        char key[256], value[256];
+        if(sscanf(line, "%255[^=]=%255s", key, value) == 2) {
+            if(strcmp(key, "tor_host") == 0) {
+                strncpy(tor_host, value, MAX_AUTH_LEN - 1);
+            } else if(strcmp(key, "tor_port") == 0) {
+                tor_port = (uint16_t)atoi(value);
+            } else if(strcmp(key, "verbose") == 0) {
+                conf->verbose = atoi(value);
+                if(conf->verbose) {
+                    conf->log_level = LOGGER_DEBUG;
+                }
+            } else if(strcmp(key, "log_level") == 0) {
+                int level = logger_parse_level(value);
+                if(level < 0) {
+                    log_warn("Unknown log level %s", value);
+                }
+                else {
+                    conf->log_level = level;
+                }
+            } else if(strcmp(key, "pipeline") == 0) {
+                conf->pipeline = atoi(value);
+            } else if(strcmp(key, "fastopen") == 0) {
+                conf->fastopen = atoi(value);
+            } else if(strcmp(key, "timeout_ms") == 0) {
+                conf->timeout_ms = atoi(value) > 0 ? atoi(value) : DEFAULT_TIMEOUT * 1000;
+            } else if(strcmp(key, "timeout_app") == 0) {
+                conf->timeout_app = atoi(value);
+            } else if(strcmp(key, "timeout_adaptive") == 0) {
+                conf->timeout_adaptive = atoi(value);
+            } else if(strcmp(key, "upstream") == 0) {
+                if(upstream_add_spec(conf->upstreams, value) != 0) {
+                    log_warn("Ignoring bad upstream %s", value);
+                }
+            } else if(strcmp(key, "upstream_policy") == 0) {
+                int policy = upstream_parse_policy(value);
+                if(policy < 0) {
+                    log_warn("Unknown upstream policy %s, using rr", value);
+                    policy = UPSTREAM_RR;
+                }
+                conf->upstreams->policy = policy;
+            } else if(strcmp(key, "pool_low") == 0) {
+                conf->pool_low = atoi(value);
+            } else if(strcmp(key, "pool_high") == 0) {
+                conf->pool_high = atoi(value);
+            } else if (strcmp(key, "exclude") == 0) {
+                /* IP and CIDR rules go into the trie, the rest are host names */
+                if(cidr_trie_add(&conf->excluded_nets, value) == 0) {
+                    continue;
+                }
+                domain_set_add(&conf->excluded, value);
+            } else if(strcmp(key, "exclude_file") == 0) {
+                strncpy(conf->exclude_file, value, sizeof(conf->exclude_file) - 1);
+            } else if(strcmp(key, "fakeip_size") == 0) {
+                conf->fakeip_size = (uint32_t)atoi(value);
+            } else if(strcmp(key, "tor_dns") == 0) {
+                conf->tor_dns = atoi(value);
+            } else if(strcmp(key, "dns_ttl") == 0) {
+                conf->dns_ttl = (uint32_t)atoi(value);
+            } else if(strcmp(key, "dns_negative_ttl") == 0) {
+                conf->dns_negative_ttl = (uint32_t)atoi(value);
+            } else if(strcmp(key, "dns_cache_size") == 0) {
+                conf->dns_cache_size = (uint32_t)atoi(value);
+            } else if(strcmp(key, "udp") == 0) {
+                conf->udp = atoi(value);
+            } else if(strcmp(key, "stats_file") == 0) {
+                strncpy(conf->stats_file, value, sizeof(conf->stats_file) - 1);
+            } else if(strcmp(key, "reload") == 0) {
+                conf->reload = (strstr(value, "inotify") ? TORALIZE_RELOAD_INOTIFY : 0) |
+                               (strstr(value, "sighup") ? TORALIZE_RELOAD_SIGHUP : 0);
+            }
+        }
+    }
+
+    /* always exclude localhost */
+    cidr_trie_add(&conf->excluded_nets, "127.0.0.0/8");
+    cidr_trie_add(&conf->excluded_nets, "::1");
+
+    domain_set_add(&conf->excluded, "localhost");
+
+    /* no upstream list, the single tor_host/tor_port is the only one */
+    if(conf->upstreams->count == 0) {
+        upstream_add(conf->upstreams, tor_host, tor_port);
+    }
+
+    /* proxy names must resolve for real, not to a fake addr */
+    for(int i = 0; i < conf->upstreams->count; i++) {
+        domain_set_add(&conf->excluded, conf->upstreams->list[i].host);
+    }
+
+    if(conf->exclude_file[0] && domain_set_load_file(&conf->excluded, conf->exclude_file) != 0) {
+        log_error("Failed to load exclude file %s", conf->exclude_file);
+    }
+    if(domain_set_build(&conf->excluded) != 0) {
+        log_error("Failed to index excluded hosts");
+    }
+    return conf;
+}
+
+/* snapshot over a mapped image, the matchers are used in place */
+/* the image's strings are used in place, each has to end in its field */
+static int config_image_terminated(const config_image* img) {
+    for(uint32_t i = 0; i < img->upstream_cnt; i++) {
+        if(!memchr(img->upstreams[i].host, 0, sizeof(img->upstreams[i].host))) {
+            return 0;
+        }
+    }
+    return memchr(img->stats_file, 0, sizeof(img->stats_file)) != NULL;
+}
+
+static toralize_snapshot* config_map(void* map, size_t len, const char* path) {
+    const config_image* img = map;
+    if(img->version != CONFIG_IMAGE_VERSION || img->order != CONFIG_IMAGE_ORDER || img->size != len ||
+       img->upstream_cnt == 0 || img->upstream_cnt > UPSTREAM_MAX || !config_image_terminated(img) ||
+       (uint64_t)img->nets_off + (uint64_t)img->nets_cnt * sizeof(cidr_node) > len ||
+       (uint64_t)img->domains_off + img->domains_len > len) {
+        log_error("Config image %s is damaged or from another version, recompile it", path);
+        return NULL;
+    }
+
+    toralize_snapshot* conf = config_new();
+    if(!conf) {
+        return NULL;
+    }
+    if(cidr_trie_view(&conf->excluded_nets, (const cidr_node*)((char*)map + img->nets_off),
+                      img->nets_cnt, img->nets_rules) != 0 ||
+       domain_set_image_view(&conf->excluded, (char*)map + img->domains_off, img->domains_len) != 0) {
+        log_error("Config image %s is damaged, recompile it", path);
+        config_free(conf);
+        return NULL;
+    }
+    conf->image = map;
+    conf->image_len = len;
+
+    conf->verbose = img->verbose;
+    conf->pipeline = img->pipeline;
+    conf->fastopen = img->fastopen;
+    conf->timeout_ms = img->timeout_ms;
+    conf->timeout_app = img->timeout_app;
+    conf->timeout_adaptive = img->timeout_adaptive;
+    conf->log_level = img->log_level;
+    conf->pool_low = img->pool_low;
+    conf->pool_high = img->pool_high;
+    conf->reload = img->reload;
+    conf->fakeip_size = img->fakeip_size;
+    conf->tor_dns = img->tor_dns;
+    conf->dns_ttl = img->dns_ttl;
+    conf->dns_negative_ttl = img->dns_negative_ttl;
+    conf->dns_cache_size = img->dns_cache_size;
+    conf->udp = img->udp;
+    memcpy(conf->stats_file, img->stats_file, sizeof(conf->stats_file) - 1);
+    conf->upstreams->policy = img->upstream_policy;
+    for(uint32_t i = 0; i < img->upstream_cnt; i++) {
+        upstream_add(conf->upstreams, img->upstreams[i].host, img->upstreams[i].port);
+    }
+    return conf;
+}
+
+/* a compiled image is mapped, anything else is parsed as text */
+toralize_snapshot* config_open(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    if((size_t)st.st_size >= sizeof(config_image)) {
+        void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED) {
+            if(((const config_image*)map)->magic == CONFIG_IMAGE_MAGIC) {
+                close(fd);
+                toralize_snapshot* conf = config_map(map, (size_t)st.st_size, path);
+                if(!conf) {
+                    munmap(map, (size_t)st.st_size);
+                }
+                return conf;
+            }
+            munmap(map, (size_t)st.st_size);
+        }
+    }
+
+    FILE* f = fdopen(fd, "r");
+    if(!f) {
+        close(fd);
+        return NULL;
+    }
+    toralize_snapshot* conf = config_parse(f);
+    fclose(f);
+    return conf;
+}
+
+/* written next to path and renamed over it, a process mapping the old
+ * image keeps reading it and inotify sees one complete file */
+int config_image_write(const toralize_snapshot* conf, const char* path) {
+    size_t nets_len = (size_t)conf->excluded_nets.count * sizeof(cidr_node);
+    size_t domains_len = domain_set_image_size(&conf->excluded);
+    size_t nets_off = config_align(sizeof(config_image));
+    size_t domains_off = config_align(nets_off + nets_len);
+    size_t size = domains_off + domains_len;
+
+    if(size > UINT32_MAX || domains_len == 0) {
+        return -1;
+    }
+
+    /* calloc so padding and unused upstream slots are zero */
+    char* buf = calloc(1, size);
+    if(!buf) {
+        return -1;
+    }
+
+    config_image* img = (config_image*)buf;
+    img->magic = CONFIG_IMAGE_MAGIC;
+    img->version = CONFIG_IMAGE_VERSION;
+    img->order = CONFIG_IMAGE_ORDER;
+    img->size = (uint32_t)size;
+    img->verbose = conf->verbose;
+    img->pipeline = conf->pipeline;
+    img->fastopen = conf->fastopen;
+    img->timeout_ms = conf->timeout_ms;
+    img->timeout_app = conf->timeout_app;
+    img->timeout_adaptive = conf->timeout_adaptive;
+    img->log_level = conf->log_level;
+    img->pool_low = conf->pool_low;
+    img->pool_high = conf->pool_high;
+    img->reload = conf->reload;
+    img->fakeip_size = conf->fakeip_size;
+    img->tor_dns = conf->tor_dns;
+    img->dns_ttl = conf->dns_ttl;
+    img->dns_negative_ttl = conf->dns_negative_ttl;
+    img->dns_cache_size = conf->dns_cache_size;
+    img->udp = conf->udp;
+    img->upstream_policy = conf->upstreams->policy;
+    img->upstream_cnt = (uint32_t)conf->upstreams->count;
+    for(int i = 0; i < conf->upstreams->count; i++) {
+        strcpy(img->upstreams[i].host, conf->upstreams->list[i].host);
+        img->upstreams[i].port = conf->upstreams->list[i].port;
+    }
+    memcpy(img->stats_file, conf->stats_file, sizeof(img->stats_file) - 1);
+
+    img->nets_off = (uint32_t)nets_off;
+    img->nets_cnt = conf->excluded_nets.count;
+    img->nets_rules = conf->excluded_nets.rules;
+    memcpy(buf + nets_off, conf->excluded_nets.nodes, nets_len);
+
+    img->domains_off = (uint32_t)domains_off;
+    img->domains_len = (uint32_t)domains_len;
+    domain_set_image_write(&conf->excluded, buf + domains_off);
+
+    char tmp[PATH_MAX];
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        free(buf);
+        return -1;
+    }
+
+    FILE* f = fopen(tmp, "wb");
+    if(!f) {
+        free(buf);
+        return -1;
+    }
+    int ok = fwrite(buf, 1, size, f) == size;
+    ok = (fclose(f) == 0) && ok;
+    free(buf);
+
+    if(!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "upstream.h"
+#include "domain_set.h"
+#include "cidr_trie.h"
+
+#define PROXY_HOST "127.0.0.1"
+#define PROXY_PORT 9050
+
+/* reload triggers, reload=inotify,sighup */
+#define TORALIZE_RELOAD_INOTIFY 1
+#define TORALIZE_RELOAD_SIGHUP  2
+
+/* an adaptive handshake deadline never goes below this */
+#define TIMEOUT_ADAPTIVE_MIN_MS 50
+
+/* settings compiled from the config file. never changed once published,
+ * a reload builds a new one and swaps the pointer */
+typedef struct toralize_snapshot {
+    int verbose;
+    int pipeline;
+    int fastopen;           // TCP Fast Open to the proxy
+    int timeout_ms;         // whole blocking handshake
+    int timeout_app;        // capped at the app sock's SO_SNDTIMEO
+    int timeout_adaptive;   // this many times an upstream's recent p99, 0 off
+    int log_level;
+    int pool_low;           // refill the proxy sock pool at this many idle
+    int pool_high;          // up to this many, 0 disables the pool
+    upstream_set* upstreams;
+    char exclude_file[256]; // host name list, one rule per line
+    domain_set excluded;    // host names and *.suffix rules
+    cidr_trie excluded_nets;
+    int tor_dns;            // resolve through Tor instead of handing out fake addrs
+    uint32_t dns_ttl;       // secs a Tor answer is cached, SOCKS carries no TTL
+    uint32_t dns_negative_ttl;
+    int udp;                // UDP through UDP ASSOCIATE, not for Tor
+
+    /* only taken from the config loaded at startup */
+    uint32_t fakeip_size;
+    uint32_t dns_cache_size;
+    char stats_file[256];   // handshake stats, %p is replaced by the pid
+    int reload;             // TORALIZE_RELOAD_* bits
+
+    void* image;            // mapped compiled config the matchers point into
+    size_t image_len;
+} toralize_snapshot;
+
+/* compiled config, written by toralize_conf and mapped read only at load
+ * instead of parsing the text. exclude_file is folded into the domain
+ * set, the image stands alone. native byte order and struct layout, a
+ * different version or order is rejected */
+#define CONFIG_IMAGE_MAGIC      0x74726366  // "trcf"
+#define CONFIG_IMAGE_VERSION    5
+#define CONFIG_IMAGE_ORDER      0x01020304
+
+typedef struct config_image_upstream {
+    char host[MAX_DOMAIN_LEN + 1];
+    uint16_t port;
+} config_image_upstream;
+
+typedef struct config_image {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t order;
+    uint32_t size;              // whole image
+    int32_t verbose;
+    int32_t pipeline;
+    int32_t fastopen;
+    int32_t timeout_ms;
+    int32_t timeout_app;
+    int32_t timeout_adaptive;
+    int32_t log_level;
+    int32_t pool_low;
+    int32_t pool_high;
+    int32_t reload;
+    uint32_t fakeip_size;
+    int32_t tor_dns;
+    uint32_t dns_ttl;
+    uint32_t dns_negative_ttl;
+    uint32_t dns_cache_size;
+    int32_t udp;
+    int32_t upstream_policy;
+    uint32_t upstream_cnt;
+    config_image_upstream upstreams[UPSTREAM_MAX];
+    char stats_file[256];
+    uint32_t nets_off;          // cidr_node array, offsets from the image start
+    uint32_t nets_cnt;
+    uint32_t nets_rules;
+    uint32_t domains_off;       // domain_set image
+    uint32_t domains_len;
+} config_image;
+
+/* the config at path, compiled or text. NULL if it can't be read */
+toralize_snapshot* config_open(const char* path);
+/* text config, the built in defaults for a NULL f */
+toralize_snapshot* config_parse(FILE* f);
+int config_image_write(const toralize_snapshot* conf, const char* path);
+void config_free(toralize_snapshot* conf);
+
+#endif // CONFIG_H
@@ -0,0 +1,152 @@
+/* config_bench.c - startup cost of the text config against the compiled
+ * image, with 0, 10k and 100k exclude_file rules: config_open in process,
+ * then spawning /bin/true with libtoralize preloaded on each.
+ * usage: config_bench [libtoralize.so] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include "config.h"
+#include "logger.h"
+
+#define LOADS   50
+#define SPAWNS  200
+
+extern char** environ;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)rng_state;
+}
+
+static void rand_label(char* out, int len) {
+    for(int i = 0; i < len; i++) {
+        out[i] = 'a' + rng() % 26;
+    }
+    out[len] = '\0';
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* mean us per config_open */
+static double time_loads(const char* path) {
+    double start = now_ns();
+    for(int i = 0; i < LOADS; i++) {
+        toralize_snapshot* conf = config_open(path);
+        if(!conf) {
+            return -1;
+        }
+        config_free(conf);
+    }
+    return (now_ns() - start) / LOADS / 1e3;
+}
+
+/* mean us to spawn and reap /bin/true, config NULL runs without preload */
+static double time_spawns(const char* lib, const char* config) {
+    char preload[1024], conf_env[1024];
+    snprintf(preload, sizeof(preload), "LD_PRELOAD=%s", lib);
+    snprintf(conf_env, sizeof(conf_env), "TORALIZE_CONFIG=%s", config ? config : "");
+    char* env[] = { config ? preload : NULL, conf_env, NULL };
+    char* args[] = { "/bin/true", NULL };
+
+    double start = now_ns();
+    for(int i = 0; i < SPAWNS; i++) {
+        pid_t pid;
+        int status;
+        if(posix_spawn(&pid, args[0], NULL, NULL, args, config ? env : env + 1) != 0 ||
+           waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            return -1;
+        }
+    }
+    return (now_ns() - start) / SPAWNS / 1e3;
+}
+
+static int run(int n, const char* lib, double base_us) {
+    char list[] = "/tmp/config_bench.XXXXXX";
+    int fd = mkstemp(list);
+    if(fd < 0) {
+        perror("mkstemp");
+        return -1;
+    }
+    FILE* f = fdopen(fd, "w");
+    for(int i = 0; i < n; i++) {
+        char a[16], b[16];
+        rand_label(a, 6 + rng() % 8);
+        rand_label(b, 4 + rng() % 6);
+        fprintf(f, "%s%s.%s.com\n", (i & 1) ? "*." : "", a, b);
+    }
+    fclose(f);
+
+    char text[64], image[64];
+    snprintf(text, sizeof(text), "%s.conf", list);
+    snprintf(image, sizeof(image), "%s.img", list);
+    f = fopen(text, "w");
+    fprintf(f, "tor_host=127.0.0.1\ntor_port=9050\npipeline=1\n"
+               "exclude=192.168.0.0/16\nexclude=10.0.0.0/8\nexclude=172.16.0.0/12\n");
+    if(n > 0) {
+        fprintf(f, "exclude_file=%s\n", list);
+    }
+    fclose(f);
+
+    int ret = -1;
+    f = fopen(text, "r");
+    toralize_snapshot* conf = config_parse(f);
+    fclose(f);
+    if(!conf || config_image_write(conf, image) != 0) {
+        fprintf(stderr, "failed to compile %s\n", text);
+        goto out;
+    }
+
+    double text_us = time_loads(text);
+    double image_us = time_loads(image);
+    printf("rules=%-7d text_open_us=%-9.1f image_open_us=%-7.1f", n, text_us, image_us);
+    if(lib) {
+        printf(" spawn_us base=%.0f text=%.0f image=%.0f",
+               base_us, time_spawns(lib, text), time_spawns(lib, image));
+    }
+    printf("\n");
+    ret = 0;
+
+out:
+    config_free(conf);
+    unlink(list);
+    unlink(text);
+    unlink(image);
+    return ret;
+}
+
+int main(int argc, char* argv[]) {
+    const char* lib = argc > 1 ? argv[1] : NULL;
+    double base_us = 0;
+
+    if(!lib && access("./libtoralize.so", R_OK) == 0) {
+        lib = "./libtoralize.so";
+    }
+    if(lib && lib[0] != '/') {
+        lib = realpath(lib, NULL);
+    }
+    if(lib && (base_us = time_spawns(lib, NULL)) < 0) {
+        fprintf(stderr, "can't spawn /bin/true, skipping the preload runs\n");
+        lib = NULL;
+    }
+
+    int sizes[] = {0, 10000, 100000};
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if(run(sizes[i], lib, base_us) != 0) {
+            return 1;
+        }
+    }
+    logger_shutdown();
+    return 0;
+}
@@ -0,0 +1,225 @@
+#include "dest_stats.h"
+#include "logger.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* destinations logged at exit, most bytes first */
+#define DEST_STATS_REPORT   32
+
+struct dest_stats {
+    uint64_t hash;
+    const char* host;       // right behind the struct
+    uint16_t port;
+    uint64_t conns;         // closed so far
+    uint64_t bytes[2];      // by DEST_STATS_IN / _OUT
+    uint64_t calls[2];
+    uint64_t ttfb_cnt;      // connect to the first byte the app read
+    uint64_t ttfb_sum_us;
+    uint64_t ttfb_max_us;
+};
+
+typedef struct dest_counts {
+    dest_stats* dest;       // NULL when unused
+    int fd;
+    uint32_t calls[2];
+    uint64_t bytes[2];
+} dest_counts;
+
+static struct {
+    dest_stats* table[DEST_STATS_MAX];  // open addressing, read without the lock
+    int count;
+    pthread_mutex_t mutex;              // guards inserts
+    pthread_key_t key;
+    pthread_once_t once;
+} dests = {
+    .count = 0,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT
+};
+
+static dest_stats dest_other = {
+    .host = "(other)"
+};
+
+static __thread dest_counts dest_local[DEST_STATS_LOCAL];
+static __thread int dest_registered;
+
+/* FNV-1a over host and port */
+static uint64_t dest_hash(const char* host, uint16_t port) {
+    uint64_t h = 14695981039346656037ULL;
+    for(; *host; host++) {
+        h ^= (unsigned char)*host;
+        h *= 1099511628211ULL;
+    }
+    h ^= port;
+    h *= 1099511628211ULL;
+    return h;
+}
+
+static dest_stats* dest_find(const char* host, uint16_t port, uint64_t hash, uint32_t* slot) {
+    uint32_t i = hash & (DEST_STATS_MAX - 1);
+    for(;;) {
+        dest_stats* d = __atomic_load_n(&dests.table[i], __ATOMIC_ACQUIRE);
+        if(!d || (d->hash == hash && d->port == port && strcmp(d->host, host) == 0)) {
+            *slot = i;
+            return d;
+        }
+        i = (i + 1) & (DEST_STATS_MAX - 1);
+    }
+}
+
+/* entry for host:port, created on first use. the table is kept at most
+ * 3/4 full so probing always ends on an empty slot */
+dest_stats* dest_stats_get(const char* host, uint16_t port) {
+    uint64_t hash = dest_hash(host, port);
+    uint32_t slot;
+
+    dest_stats* d = dest_find(host, port, hash, &slot);
+    if(d) {
+        return d;
+    }
+
+    pthread_mutex_lock(&dests.mutex);
+    d = dest_find(host, port, hash, &slot);
+    if(!d && dests.count < DEST_STATS_MAX / 4 * 3) {
+        size_t len = strlen(host);
+        d = calloc(1, sizeof(dest_stats) + len + 1);
+        if(d) {
+            char* name = (char*)(d + 1);
+            memcpy(name, host, len + 1);
+            d->host = name;
+            d->hash = hash;
+            d->port = port;
+            dests.count++;
+            __atomic_store_n(&dests.table[slot], d, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&dests.mutex);
+    return d ? d : &dest_other;
+}
+
+/* move what a thread counted to the destination */
+static void dest_flush(dest_counts* c) {
+    dest_stats* d = c->dest;
+    for(int dir = DEST_STATS_IN; dir <= DEST_STATS_OUT; dir++) {
+        if(c->calls[dir]) {
+            __atomic_add_fetch(&d->calls[dir], c->calls[dir], __ATOMIC_RELAXED);
+            __atomic_add_fetch(&d->bytes[dir], c->bytes[dir], __ATOMIC_RELAXED);
+            c->calls[dir] = 0;
+            c->bytes[dir] = 0;
+        }
+    }
+}
+
+static void dest_release_local(void* arg) {
+    dest_counts* local = arg;
+    for(int i = 0; i < DEST_STATS_LOCAL; i++) {
+        if(local[i].dest) {
+            dest_flush(&local[i]);
+            local[i].dest = NULL;
+        }
+    }
+}
+
+static void dest_init(void) {
+    pthread_key_create(&dests.key, dest_release_local);
+}
+
+/* one read or write on fd returned n, counts stay with the thread */
+void dest_stats_io(dest_stats* d, int fd, int dir, ssize_t n) {
+    dest_counts* c = &dest_local[fd & (DEST_STATS_LOCAL - 1)];
+
+    if(c->dest != d || c->fd != fd) {
+        if(c->dest) {
+            dest_flush(c);
+        }
+        else if(!dest_registered) {
+            // flushed when the thread exits
+            pthread_once(&dests.once, dest_init);
+            pthread_setspecific(dests.key, dest_local);
+            dest_registered = 1;
+        }
+        c->dest = d;
+        c->fd = fd;
+    }
+
+    c->calls[dir]++;
+    if(n > 0) {
+        c->bytes[dir] += n;
+    }
+    if(c->calls[DEST_STATS_IN] + c->calls[DEST_STATS_OUT] >= DEST_STATS_FLUSH) {
+        dest_flush(c);
+    }
+}
+
+void dest_stats_ttfb(dest_stats* d, uint64_t us) {
+    __atomic_add_fetch(&d->ttfb_cnt, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&d->ttfb_sum_us, us, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&d->ttfb_max_us, __ATOMIC_RELAXED);
+    while(us > max && !__atomic_compare_exchange_n(&d->ttfb_max_us, &max, us, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/* fd closes. other threads' counts for it arrive when they flush */
+void dest_stats_close(dest_stats* d, int fd) {
+    dest_counts* c = &dest_local[fd & (DEST_STATS_LOCAL - 1)];
+    if(c->dest == d && c->fd == fd) {
+        dest_flush(c);
+        c->dest = NULL;
+    }
+    __atomic_add_fetch(&d->conns, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t dest_bytes(const dest_stats* d) {
+    return __atomic_load_n(&d->bytes[DEST_STATS_IN], __ATOMIC_RELAXED) +
+           __atomic_load_n(&d->bytes[DEST_STATS_OUT], __ATOMIC_RELAXED);
+}
+
+static int dest_cmp_bytes(const void* a, const void* b) {
+    uint64_t x = dest_bytes(*(dest_stats* const*)a);
+    uint64_t y = dest_bytes(*(dest_stats* const*)b);
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void dest_log(const dest_stats* d) {
+    uint64_t ttfb_cnt = __atomic_load_n(&d->ttfb_cnt, __ATOMIC_RELAXED);
+    log_info("Destination %s:%d: %llu closed, %llu bytes in %llu reads, %llu bytes in %llu writes, "
+             "ttfb avg %llu us max %llu us",
+             d->host, d->port, (unsigned long long)d->conns,
+             (unsigned long long)d->bytes[DEST_STATS_IN], (unsigned long long)d->calls[DEST_STATS_IN],
+             (unsigned long long)d->bytes[DEST_STATS_OUT], (unsigned long long)d->calls[DEST_STATS_OUT],
+             (unsigned long long)(ttfb_cnt ? d->ttfb_sum_us / ttfb_cnt : 0),
+             (unsigned long long)d->ttfb_max_us);
+}
+
+/* log the destinations that carried the most, this thread's counts
+ * flushed first. other live threads' last few calls may be missing */
+void dest_stats_report(void) {
+    if(!logger_enabled(LOGGER_INFO)) {
+        return;
+    }
+    dest_release_local(dest_local);
+
+    dest_stats* list[DEST_STATS_MAX];
+    int n = 0;
+    for(int i = 0; i < DEST_STATS_MAX; i++) {
+        dest_stats* d = __atomic_load_n(&dests.table[i], __ATOMIC_ACQUIRE);
+        if(d) {
+            list[n++] = d;
+        }
+    }
+    qsort(list, n, sizeof(list[0]), dest_cmp_bytes);
+
+    for(int i = 0; i < n && i < DEST_STATS_REPORT; i++) {
+        dest_log(list[i]);
+    }
+    if(n > DEST_STATS_REPORT) {
+        log_info("%d more destinations", n - DEST_STATS_REPORT);
+    }
+    if(dest_bytes(&dest_other) || dest_other.conns) {
+        dest_log(&dest_other);
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef DEST_STATS_H
+#define DEST_STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* traffic through Tor per destination, host (the name behind a fake
+ * addr) and port as the app connected to them. entries are never
+ * removed, so counts can be flushed to one long after its socket is
+ * gone. the table is kept at most 3/4 full, past DEST_STATS_MAX / 4 * 3
+ * destinations the rest share one entry */
+#define DEST_STATS_MAX      1024    // power of two, table slots
+
+/* a thread counts the managed sockets it did I/O on lately on its own,
+ * direct mapped by fd. an entry goes to its destination when the fd is
+ * closed, when another fd takes its place, every DEST_STATS_FLUSH calls
+ * and when the thread exits */
+#define DEST_STATS_LOCAL    64      // power of two
+#define DEST_STATS_FLUSH    256
+
+enum {
+    DEST_STATS_IN = 0,
+    DEST_STATS_OUT
+};
+
+typedef struct dest_stats dest_stats;
+
+dest_stats* dest_stats_get(const char* host, uint16_t port);
+void dest_stats_io(dest_stats* d, int fd, int dir, ssize_t n);
+void dest_stats_ttfb(dest_stats* d, uint64_t us);
+void dest_stats_close(dest_stats* d, int fd);
+void dest_stats_report(void);
+
+#endif // DEST_STATS_H
@@ -0,0 +1,207 @@
+/* dns_bench.c - Tor RESOLVE through dns_cache against the in-process
+ * mock server, delay_us standing in for the round trip through Tor.
+ * for each thread count: all threads look up the same names at once
+ * (cold, coalesced lookups should equal the names), then again from
+ * the cache (warm, ns per lookup over all threads), against one
+ * uncached RESOLVE as the baseline.
+ * usage: dns_bench [-t 1,4,16] [-n names] [-d delay_us] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "dns_cache.h"
+#include "mock_socks5.h"
+#include "socks5_client.h"
+
+#define BENCH_MAX_RUNS  16
+#define WARM_LOOKUPS    200000
+#define BASE_LOOKUPS    50
+
+typedef struct bench_run {
+    dns_cache* cache;
+    socks5_endpoint* ep;
+    char** names;
+    int cnt;
+    pthread_barrier_t* start;
+    uint64_t tor_lookups;
+    uint32_t seed;
+    int errors;
+} bench_run;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int resolve(const char* key, dns_answer* out, void* arg) {
+    bench_run* r = arg;
+    socks5_ctx* ctx = socks5_create_ctx(socks5_endpoint_host(r->ep), socks5_endpoint_port(r->ep));
+    if(!ctx) {
+        return -1;
+    }
+    socks5_set_endpoint(ctx, r->ep);
+    socks5_set_pipelining(ctx, 1);
+    int ret = socks5_tor_resolve(ctx, key, &out->addr, &out->addr_len);
+    socks5_free(ctx);
+    __atomic_add_fetch(&r->tor_lookups, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+static int lookup(bench_run* r, const char* name) {
+    dns_answer answer;
+    if(dns_cache_lookup(r->cache, name, 600000, 5000, resolve, r, &answer) != 0 || answer.error) {
+        __atomic_add_fetch(&r->errors, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+/* every name once, from a different offset per thread */
+static void* cold_main(void* arg) {
+    bench_run* r = arg;
+    uint32_t off = __atomic_add_fetch(&r->seed, 7919, __ATOMIC_RELAXED);
+    pthread_barrier_wait(r->start);
+    for(int i = 0; i < r->cnt; i++) {
+        lookup(r, r->names[(off + i) % r->cnt]);
+    }
+    return NULL;
+}
+
+static void* warm_main(void* arg) {
+    bench_run* r = arg;
+    uint32_t x = __atomic_add_fetch(&r->seed, 7919, __ATOMIC_RELAXED);
+    pthread_barrier_wait(r->start);
+    for(int i = 0; i < WARM_LOOKUPS; i++) {
+        x = x * 1664525u + 1013904223u;
+        lookup(r, r->names[(x >> 8) % r->cnt]);
+    }
+    return NULL;
+}
+
+/* wall ms for threads running fn at once */
+static double run_threads(bench_run* r, int threads, void* (*fn)(void*)) {
+    pthread_t tids[256];
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, threads + 1);
+    r->start = &start;
+
+    for(int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, fn, r);
+    }
+    pthread_barrier_wait(&start);
+    double t0 = now_ns();
+    for(int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double ms = (now_ns() - t0) / 1e6;
+    pthread_barrier_destroy(&start);
+    return ms;
+}
+
+static int parse_list(const char* s, int* out) {
+    int n = 0;
+    while(*s && n < BENCH_MAX_RUNS) {
+        out[n] = atoi(s);
+        if(out[n] <= 0 || out[n] > 256) {
+            return -1;
+        }
+        n++;
+        s = strchr(s, ',');
+        if(!s) {
+            break;
+        }
+        s++;
+    }
+    return n;
+}
+
+int main(int argc, char* argv[]) {
+    int threads[BENCH_MAX_RUNS] = {1, 4, 16};
+    int runs = 3;
+    int cnt = 64;
+    int delay_us = 1000;
+
+    int opt;
+    while((opt = getopt(argc, argv, "t:n:d:")) != -1) {
+        switch(opt) {
+            case 't':
+                runs = parse_list(optarg, threads);
+                break;
+            case 'n':
+                cnt = atoi(optarg);
+                break;
+            case 'd':
+                delay_us = atoi(optarg);
+                break;
+            default:
+                runs = -1;
+                break;
+        }
+    }
+    if(runs <= 0 || cnt <= 0) {
+        fprintf(stderr, "usage: %s [-t 1,4,16] [-n names] [-d delay_us]\n", argv[0]);
+        return 2;
+    }
+
+    mock_socks5_opts mopts;
+    memset(&mopts, 0, sizeof(mopts));
+    mopts.delay_us = delay_us;
+    mock_socks5* mock = mock_socks5_start(&mopts);
+    if(!mock) {
+        fprintf(stderr, "failed to start mock server\n");
+        return 1;
+    }
+    socks5_endpoint* ep = socks5_endpoint_create("127.0.0.1", mock_socks5_port(mock), NULL);
+
+    char** names = malloc(cnt * sizeof(char*));
+    for(int i = 0; i < cnt; i++) {
+        names[i] = malloc(32);
+        snprintf(names[i], 32, "host%d.bench.example", i);
+    }
+
+    bench_run r;
+    memset(&r, 0, sizeof(r));
+    r.ep = ep;
+    r.names = names;
+    r.cnt = cnt;
+
+    // every lookup a Tor round trip
+    double t0 = now_ns();
+    dns_answer answer;
+    for(int i = 0; i < BASE_LOOKUPS; i++) {
+        if(resolve(names[i % cnt], &answer, &r) != 0) {
+            r.errors++;
+        }
+    }
+    double base_us = (now_ns() - t0) / BASE_LOOKUPS / 1e3;
+
+    for(int i = 0; i < runs; i++) {
+        r.cache = dns_cache_create(cnt * 2 > DNS_CACHE_DEFAULT_SIZE ? cnt * 2 : DNS_CACHE_DEFAULT_SIZE);
+        r.tor_lookups = 0;
+        r.errors = 0;
+
+        double cold_ms = run_threads(&r, threads[i], cold_main);
+        uint64_t cold_tor = r.tor_lookups;
+        double warm_ms = run_threads(&r, threads[i], warm_main);
+
+        dns_cache_stats stats;
+        dns_cache_get_stats(r.cache, &stats);
+        printf("threads=%-3d names=%-5d uncached_us=%-8.1f cold_ms=%-8.1f lookups=%-6d tor=%-5llu "
+               "coalesced=%-5llu warm_ns=%-6.1f warm_tor=%llu errors=%d\n",
+               threads[i], cnt, base_us, cold_ms, threads[i] * cnt, (unsigned long long)cold_tor,
+               (unsigned long long)stats.coalesced, warm_ms * 1e6 / WARM_LOOKUPS / threads[i],
+               (unsigned long long)(r.tor_lookups - cold_tor), r.errors);
+        dns_cache_free(r.cache);
+    }
+
+    for(int i = 0; i < cnt; i++) {
+        free(names[i]);
+    }
+    free(names);
+    socks5_endpoint_unref(ep);
+    mock_socks5_stop(mock);
+    return 0;
+}
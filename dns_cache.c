@@ -0,0 +1,287 @@
+#include "dns_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+
+/* entry states */
+enum {
+    DNS_PENDING = 0,    // a lookup is in flight, not on the LRU list
+    DNS_READY,
+    DNS_ABORTED         // lookup failed uncached, unlinked, last waiter frees
+};
+
+typedef struct dns_entry {
+    struct dns_entry* hnext;    // hash chain
+    struct dns_entry* prev;     // LRU, towards most recent
+    struct dns_entry* next;     // LRU, towards least recent
+    uint64_t hash;
+    uint64_t expires_ms;
+    int state;
+    int waiters;                // threads blocked on a PENDING lookup
+    dns_answer answer;
+    char key[];
+} dns_entry;
+
+/* own cache line each, threads on different shards don't share locks */
+typedef struct dns_shard {
+    pthread_mutex_t mutex;
+    pthread_cond_t done;        // a lookup in this shard finished
+    dns_entry** buckets;
+    uint32_t mask;
+    uint32_t count;
+    uint32_t cap;
+    dns_entry lru;              // sentinel, lru.next is the most recent
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t coalesced;
+    uint64_t evicted;
+} __attribute__((aligned(64))) dns_shard;
+
+struct dns_cache {
+    dns_shard shards[DNS_CACHE_SHARDS];
+};
+
+static uint64_t dns_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a, key is already lowercased */
+static uint64_t dns_hash(const char* key) {
+    uint64_t h = 14695981039346656037ULL;
+    for(; *key; key++) {
+        h ^= (unsigned char)*key;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+dns_cache* dns_cache_create(uint32_t size) {
+    if(size == 0 || size > DNS_CACHE_MAX_SIZE) {
+        size = DNS_CACHE_DEFAULT_SIZE;
+    }
+
+    dns_cache* c = aligned_alloc(64, sizeof(dns_cache));
+    if(!c) {
+        return NULL;
+    }
+    memset(c, 0, sizeof(dns_cache));
+
+    uint32_t cap = (size + DNS_CACHE_SHARDS - 1) / DNS_CACHE_SHARDS;
+    uint32_t nbuckets = 1;
+    while(nbuckets < cap) {
+        nbuckets <<= 1;
+    }
+
+    for(int i = 0; i < DNS_CACHE_SHARDS; i++) {
+        dns_shard* s = &c->shards[i];
+        s->buckets = calloc(nbuckets, sizeof(dns_entry*));
+        if(!s->buckets) {
+            dns_cache_free(c);
+            return NULL;
+        }
+        pthread_mutex_init(&s->mutex, NULL);
+        pthread_cond_init(&s->done, NULL);
+        s->mask = nbuckets - 1;
+        s->cap = cap;
+        s->lru.next = &s->lru;
+        s->lru.prev = &s->lru;
+    }
+    return c;
+}
+
+/* no lookups may be in flight */
+void dns_cache_free(dns_cache* c) {
+    if(!c) {
+        return;
+    }
+
+    for(int i = 0; i < DNS_CACHE_SHARDS; i++) {
+        dns_shard* s = &c->shards[i];
+        if(!s->buckets) {
+            break;
+        }
+        for(uint32_t b = 0; b <= s->mask; b++) {
+            dns_entry* e = s->buckets[b];
+            while(e) {
+                dns_entry* next = e->hnext;
+                free(e);
+                e = next;
+            }
+        }
+        free(s->buckets);
+        pthread_mutex_destroy(&s->mutex);
+        pthread_cond_destroy(&s->done);
+    }
+    free(c);
+}
+
+static void dns_lru_unlink(dns_entry* e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void dns_lru_push(dns_shard* s, dns_entry* e) {
+    e->prev = &s->lru;
+    e->next = s->lru.next;
+    s->lru.next->prev = e;
+    s->lru.next = e;
+}
+
+static void dns_hash_unlink(dns_shard* s, dns_entry* e) {
+    dns_entry** pp = &s->buckets[e->hash & s->mask];
+    while(*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    s->count--;
+}
+
+/* drop the least recent answer nobody is waiting on */
+static void dns_evict(dns_shard* s) {
+    for(dns_entry* e = s->lru.prev; e != &s->lru; e = e->prev) {
+        if(e->waiters == 0) {
+            dns_lru_unlink(e);
+            dns_hash_unlink(s, e);
+            free(e);
+            s->evicted++;
+            return;
+        }
+    }
+}
+
+static dns_entry* dns_find(dns_shard* s, const char* key, uint64_t hash) {
+    for(dns_entry* e = s->buckets[hash & s->mask]; e; e = e->hnext) {
+        if(e->hash == hash && strcmp(e->key, key) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* the answer of a lookup another thread was running, shard locked */
+static int dns_wait(dns_shard* s, dns_entry* e, dns_answer* out) {
+    e->waiters++;
+    s->coalesced++;
+    while(e->state == DNS_PENDING) {
+        pthread_cond_wait(&s->done, &s->mutex);
+    }
+    e->waiters--;
+
+    if(e->state == DNS_ABORTED) {
+        if(e->waiters == 0) {
+            free(e);
+        }
+        return -1;
+    }
+    *out = e->answer;
+    return 0;
+}
+
+/* cached answer for key, or fn's once it resolved it. ttl_ms for
+ * answers, neg_ttl_ms for names that don't resolve */
+int dns_cache_lookup(dns_cache* c, const char* key, uint32_t ttl_ms, uint32_t neg_ttl_ms,
+                     dns_cache_fn fn, void* arg, dns_answer* out) {
+    char lower[MAX_DOMAIN_LEN + 1];
+    size_t len = strlen(key);
+
+    if(len > MAX_DOMAIN_LEN) {
+        memset(out, 0, sizeof(*out));
+        return fn(key, out, arg);
+    }
+    for(size_t i = 0; i <= len; i++) {
+        lower[i] = tolower((unsigned char)key[i]);
+    }
+
+    uint64_t hash = dns_hash(lower);
+    dns_shard* s = &c->shards[(hash >> 32) & (DNS_CACHE_SHARDS - 1)];
+
+    pthread_mutex_lock(&s->mutex);
+    dns_entry* e = dns_find(s, lower, hash);
+    if(e && e->state == DNS_PENDING) {
+        int ret = dns_wait(s, e, out);
+        pthread_mutex_unlock(&s->mutex);
+        return ret;
+    }
+    if(e && e->expires_ms > dns_now_ms()) {
+        dns_lru_unlink(e);
+        dns_lru_push(s, e);
+        *out = e->answer;
+        s->hits++;
+        pthread_mutex_unlock(&s->mutex);
+        return 0;
+    }
+
+    if(e) {
+        // expired, looked up again in place
+        dns_lru_unlink(e);
+    }
+    else {
+        if(s->count >= s->cap) {
+            dns_evict(s);
+        }
+        e = malloc(sizeof(dns_entry) + len + 1);
+        if(!e) {
+            pthread_mutex_unlock(&s->mutex);
+            memset(out, 0, sizeof(*out));
+            return fn(key, out, arg);
+        }
+        memcpy(e->key, lower, len + 1);
+        e->hash = hash;
+        e->waiters = 0;
+        e->hnext = s->buckets[hash & s->mask];
+        s->buckets[hash & s->mask] = e;
+        s->count++;
+    }
+    e->state = DNS_PENDING;
+    s->misses++;
+    pthread_mutex_unlock(&s->mutex);
+
+    dns_answer answer;
+    memset(&answer, 0, sizeof(answer));
+    int ret = fn(key, &answer, arg);
+
+    pthread_mutex_lock(&s->mutex);
+    int waiters = e->waiters;
+    if(ret == 0) {
+        e->answer = answer;
+        e->expires_ms = dns_now_ms() + (answer.error ? neg_ttl_ms : ttl_ms);
+        e->state = DNS_READY;
+        dns_lru_push(s, e);
+    }
+    else {
+        dns_hash_unlink(s, e);
+        e->state = DNS_ABORTED;
+        if(waiters == 0) {
+            free(e);
+        }
+    }
+    if(waiters > 0) {
+        pthread_cond_broadcast(&s->done);
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    *out = answer;
+    return ret;
+}
+
+void dns_cache_get_stats(dns_cache* c, dns_cache_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    if(!c) {
+        return;
+    }
+
+    for(int i = 0; i < DNS_CACHE_SHARDS; i++) {
+        dns_shard* s = &c->shards[i];
+        pthread_mutex_lock(&s->mutex);
+        stats->hits += s->hits;
+        stats->misses += s->misses;
+        stats->coalesced += s->coalesced;
+        stats->evicted += s->evicted;
+        stats->entries += s->count;
+        pthread_mutex_unlock(&s->mutex);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include "socks5_proto.h"
+
+/* answers of lookups done through Tor, keyed by lowercased name (or addr
+ * literal for reverse lookups). sharded by hash, each shard with its own
+ * lock, LRU list and TTL expiry. a lookup for a key another thread is
+ * already resolving waits for that answer instead of sending its own */
+#define DNS_CACHE_SHARDS        16      // power of two
+#define DNS_CACHE_DEFAULT_SIZE  4096
+#define DNS_CACHE_MAX_SIZE      (1 << 20)
+
+typedef struct dns_cache dns_cache;
+
+typedef struct dns_answer {
+    int error;                      // EAI_* of a name that doesn't resolve, cached too
+    socklen_t addr_len;             // forward lookups
+    struct sockaddr_storage addr;
+    char name[MAX_DOMAIN_LEN + 1];  // reverse lookups
+} dns_answer;
+
+/* resolves key on a miss. 0 with out filled, error set for a negative
+ * answer, or -1 for a failure not worth caching (proxy unreachable) */
+typedef int (*dns_cache_fn)(const char* key, dns_answer* out, void* arg);
+
+typedef struct dns_cache_stats {
+    uint64_t hits;
+    uint64_t misses;        // lookups that went to fn
+    uint64_t coalesced;     // waited for another thread's lookup
+    uint64_t evicted;       // dropped by LRU before expiring
+    uint32_t entries;
+} dns_cache_stats;
+
+dns_cache* dns_cache_create(uint32_t size);
+void dns_cache_free(dns_cache* c);
+int dns_cache_lookup(dns_cache* c, const char* key, uint32_t ttl_ms, uint32_t neg_ttl_ms,
+                     dns_cache_fn fn, void* arg, dns_answer* out);
+void dns_cache_get_stats(dns_cache* c, dns_cache_stats* stats);
+
+#endif // DNS_CACHE_H
@@ -0,0 +1,149 @@
+/* domain_bench.c - lookup cost of the host exclusion set at 10k, 100k and
+ * 1M rules, with the old linear strcmp scan as a baseline at 10k */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "domain_set.h"
+
+#define QUERIES 1000000
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)rng_state;
+}
+
+static void rand_label(char* out, int len) {
+    for(int i = 0; i < len; i++) {
+        out[i] = 'a' + rng() % 26;
+    }
+    out[len] = '\0';
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double time_lookups(const domain_set* s, char** names, int cnt, int* hits) {
+    double start = now_ns();
+    int h = 0;
+    for(int i = 0; i < QUERIES; i++) {
+        h += domain_set_match(s, names[i % cnt]);
+    }
+    *hits = h;
+    return (now_ns() - start) / QUERIES;
+}
+
+static double time_linear(char** rules, int n, char** names, int cnt) {
+    int queries = QUERIES / 100;
+    volatile int h = 0;
+    double start = now_ns();
+    for(int i = 0; i < queries; i++) {
+        for(int j = 0; j < n; j++) {
+            if(strcmp(rules[j], names[i % cnt]) == 0) {
+                h++;
+                break;
+            }
+        }
+    }
+    return (now_ns() - start) / queries;
+}
+
+static int run(int n) {
+    char path[] = "/tmp/domain_bench.XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0) {
+        perror("mkstemp");
+        return -1;
+    }
+    FILE* f = fdopen(fd, "w");
+
+    /* half exact names, half wildcards */
+    char** rules = malloc(n * sizeof(char*));
+    for(int i = 0; i < n; i++) {
+        char a[16], b[16];
+        rand_label(a, 6 + rng() % 8);
+        rand_label(b, 4 + rng() % 6);
+        rules[i] = malloc(64);
+        snprintf(rules[i], 64, "%s.%s.%s", a, b, (i & 1) ? "net" : "com");
+        fprintf(f, "%s%s\n", (i & 1) ? "*." : "", rules[i]);
+    }
+    fclose(f);
+
+    /* hits on exact names, hits below wildcards, misses sharing the tld */
+    int cnt = 4096;
+    char** hit = malloc(cnt * sizeof(char*));
+    char** miss = malloc(cnt * sizeof(char*));
+    for(int i = 0; i < cnt; i++) {
+        char a[16], b[16];
+        int r = rng() % n;
+        hit[i] = malloc(96);
+        if(r & 1) {
+            rand_label(a, 3 + rng() % 5);
+            snprintf(hit[i], 96, "%s.%s", a, rules[r]);
+        }
+        else {
+            snprintf(hit[i], 96, "%s", rules[r]);
+        }
+        rand_label(a, 3 + rng() % 5);
+        rand_label(b, 6 + rng() % 8);
+        miss[i] = malloc(96);
+        snprintf(miss[i], 96, "www.%s.%s.com", a, b);
+    }
+
+    domain_set s;
+    domain_set_init(&s);
+    double start = now_ns();
+    if(domain_set_load_file(&s, path) != 0 || domain_set_build(&s) != 0) {
+        fprintf(stderr, "failed to load %s\n", path);
+        unlink(path);
+        return -1;
+    }
+    double load_ms = (now_ns() - start) / 1e6;
+    unlink(path);
+
+    int hits, misses;
+    double hit_ns = time_lookups(&s, hit, cnt, &hits);
+    double miss_ns = time_lookups(&s, miss, cnt, &misses);
+
+    printf("entries=%-8d load_ms=%-8.2f hit_ns=%-7.1f miss_ns=%-7.1f hits=%d false_hits=%d",
+           n, load_ms, hit_ns, miss_ns, hits, misses);
+    if(n <= 10000) {
+        printf(" linear_ns=%.1f", time_linear(rules, n, miss, cnt));
+    }
+    printf("\n");
+
+    domain_set_free(&s);
+    for(int i = 0; i < n; i++) {
+        free(rules[i]);
+    }
+    for(int i = 0; i < cnt; i++) {
+        free(hit[i]);
+        free(miss[i]);
+    }
+    free(rules);
+    free(hit);
+    free(miss);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if(argc > 1) {
+        return run(atoi(argv[1])) == 0 ? 0 : 1;
+    }
+
+    int sizes[] = {10000, 100000, 1000000};
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if(run(sizes[i]) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
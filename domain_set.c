@@ -0,0 +1,431 @@
+#include "domain_set.h"
+#include "socks5_proto.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FNV64_OFFSET    0xcbf29ce484222325ULL
+#define FNV64_PRIME     0x100000001b3ULL
+
+static inline unsigned char domain_lower(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static inline uint64_t domain_step(uint64_t h, unsigned char c) {
+    return (h ^ domain_lower(c)) * FNV64_PRIME;
+}
+
+/* FNV-1a over the name read back to front, so the hash of a suffix is a
+ * prefix of the hash of the whole name */
+static uint64_t domain_hash(const char* name, size_t len) {
+    uint64_t h = FNV64_OFFSET;
+    while(len > 0) {
+        h = domain_step(h, name[--len]);
+    }
+    return h;
+}
+
+static inline uint64_t domain_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* blocked filter, all four bits of a key land in one 64-bit word */
+static inline uint64_t domain_bloom_bits(uint64_t m) {
+    return (1ULL << ((m >> 32) & 63)) | (1ULL << ((m >> 38) & 63)) |
+           (1ULL << ((m >> 44) & 63)) | (1ULL << ((m >> 50) & 63));
+}
+
+int domain_set_init(domain_set* s) {
+    memset(s, 0, sizeof(domain_set));
+    return 0;
+}
+
+void domain_set_free(domain_set* s) {
+    for(uint32_t i = 0; i < s->owned_cnt; i++) {
+        free(s->owned[i]);
+    }
+    for(uint32_t i = 0; i < s->map_cnt; i++) {
+        munmap(s->maps[i], s->map_lens[i]);
+    }
+    free(s->owned);
+    free(s->maps);
+    free(s->map_lens);
+    if(!s->names) {
+        free(s->entries);
+        free(s->slots);
+        free(s->bloom);
+    }
+    memset(s, 0, sizeof(domain_set));
+}
+
+/* trim and classify one rule, -1 if there is nothing to add */
+static int domain_parse(const char** name, size_t* len, uint32_t* flags) {
+    const char* p = *name;
+    size_t n = *len;
+
+    while(n > 0 && (*p == ' ' || *p == '\t')) {
+        p++;
+        n--;
+    }
+    while(n > 0 && (p[n - 1] == ' ' || p[n - 1] == '\t' || p[n - 1] == '\r')) {
+        n--;
+    }
+    if(n == 0 || *p == '#') {
+        return -1;
+    }
+
+    *flags = DOMAIN_EXACT;
+    if(n >= 2 && p[0] == '*' && p[1] == '.') {
+        p += 2;
+        n -= 2;
+        *flags = DOMAIN_SUFFIX;
+    }
+    else if(p[0] == '.') {
+        p++;
+        n--;
+        *flags = DOMAIN_SUFFIX;
+    }
+    if(n > 0 && p[n - 1] == '.') {
+        n--;
+    }
+    if(n == 0 || n > MAX_DOMAIN_LEN) {
+        return -1;
+    }
+
+    *name = p;
+    *len = n;
+    return 0;
+}
+
+static int domain_push(domain_set* s, const char* name, size_t len, uint32_t flags) {
+    if(s->names) {
+        return -1;
+    }
+    if(s->count == s->cap) {
+        uint32_t cap = s->cap ? s->cap * 2 : 64;
+        domain_entry* entries = realloc(s->entries, cap * sizeof(domain_entry));
+        if(!entries) {
+            return -1;
+        }
+        s->entries = entries;
+        s->cap = cap;
+    }
+
+    domain_entry* e = &s->entries[s->count++];
+    e->hash = domain_hash(name, len);
+    e->name = (uintptr_t)name;
+    e->len = (uint32_t)len;
+    e->flags = flags;
+    return 0;
+}
+
+int domain_set_add(domain_set* s, const char* rule) {
+    const char* name = rule;
+    size_t len = strlen(rule);
+    uint32_t flags;
+
+    if(domain_parse(&name, &len, &flags) < 0) {
+        return -1;
+    }
+
+    char** owned = realloc(s->owned, (s->owned_cnt + 1) * sizeof(char*));
+    if(!owned) {
+        return -1;
+    }
+    s->owned = owned;
+
+    char* copy = strndup(name, len);
+    if(!copy) {
+        return -1;
+    }
+    if(domain_push(s, copy, len, flags) < 0) {
+        free(copy);
+        return -1;
+    }
+    s->owned[s->owned_cnt++] = copy;
+    return 0;
+}
+
+/* one rule per line, '#' comments. the file stays mapped and entries
+ * point straight into it, nothing is copied */
+int domain_set_load_file(domain_set* s, const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if(st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    size_t size = (size_t)st.st_size;
+    char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    void** maps = realloc(s->maps, (s->map_cnt + 1) * sizeof(void*));
+    if(maps) {
+        s->maps = maps;
+    }
+    size_t* lens = realloc(s->map_lens, (s->map_cnt + 1) * sizeof(size_t));
+    if(lens) {
+        s->map_lens = lens;
+    }
+    if(!maps || !lens) {
+        munmap(map, size);
+        return -1;
+    }
+    s->maps[s->map_cnt] = map;
+    s->map_lens[s->map_cnt] = size;
+    s->map_cnt++;
+
+    const char* p = map;
+    const char* end = map + size;
+    while(p < end) {
+        const char* nl = memchr(p, '\n', end - p);
+        const char* name = p;
+        size_t len = (nl ? nl : end) - p;
+        uint32_t flags;
+
+        if(domain_parse(&name, &len, &flags) == 0 && domain_push(s, name, len, flags) < 0) {
+            return -1;
+        }
+        p = nl ? nl + 1 : end;
+    }
+    return 0;
+}
+
+/* (re)build the hash index and filter over everything added so far */
+int domain_set_build(domain_set* s) {
+    if(s->names) {
+        return 0;
+    }
+
+    uint32_t slots = 16;
+    while(slots < s->count * 2) {
+        slots *= 2;
+    }
+    uint32_t words = 1;
+    while(words * 64 < s->count * 16) {
+        words *= 2;
+    }
+
+    domain_slot* table = calloc(slots, sizeof(domain_slot));
+    uint64_t* bloom = calloc(words, sizeof(uint64_t));
+    if(!table || !bloom) {
+        free(table);
+        free(bloom);
+        return -1;
+    }
+
+    for(uint32_t i = 0; i < s->count; i++) {
+        uint64_t h = s->entries[i].hash;
+        uint32_t pos = (uint32_t)h & (slots - 1);
+        while(table[pos].idx != 0) {
+            pos = (pos + 1) & (slots - 1);
+        }
+        table[pos].idx = i + 1;
+        table[pos].tag = (uint32_t)(h >> 32);
+
+        uint64_t m = domain_mix(h);
+        bloom[m & (words - 1)] |= domain_bloom_bits(m);
+    }
+
+    free(s->slots);
+    free(s->bloom);
+    s->slots = table;
+    s->slot_mask = slots - 1;
+    s->bloom = bloom;
+    s->bloom_mask = words - 1;
+    return 0;
+}
+
+static int domain_probe(const domain_set* s, uint64_t h, const char* name, size_t len, uint32_t flags) {
+    uint64_t m = domain_mix(h);
+    uint64_t bits = domain_bloom_bits(m);
+    if((s->bloom[m & s->bloom_mask] & bits) != bits) {
+        return 0;
+    }
+
+    uint32_t pos = (uint32_t)h & s->slot_mask;
+    uint32_t tag = (uint32_t)(h >> 32);
+    while(s->slots[pos].idx != 0) {
+        if(s->slots[pos].tag == tag) {
+            const domain_entry* e = &s->entries[s->slots[pos].idx - 1];
+            const char* e_name = s->names ? s->names + e->name : (const char*)(uintptr_t)e->name;
+            if((e->flags & flags) && e->hash == h && e->len == len &&
+               strncasecmp(e_name, name, len) == 0) {
+                return 1;
+            }
+        }
+        pos = (pos + 1) & s->slot_mask;
+    }
+    return 0;
+}
+
+/* one pass from the last byte, every label boundary is a suffix to probe:
+ * wildcard rules below the full name, exact rules on the full name */
+int domain_set_match(const domain_set* s, const char* name) {
+    if(!s->slots || s->count == 0) {
+        return 0;
+    }
+
+    size_t len = strlen(name);
+    if(len > 0 && name[len - 1] == '.') {
+        len--;
+    }
+    if(len == 0 || len > MAX_DOMAIN_LEN) {
+        return 0;
+    }
+
+    uint64_t h = FNV64_OFFSET;
+    for(size_t i = len; i-- > 0;) {
+        h = domain_step(h, name[i]);
+        if(i == 0) {
+            return domain_probe(s, h, name, len, DOMAIN_EXACT);
+        }
+        if(name[i - 1] == '.' && domain_probe(s, h, name + i, len - i, DOMAIN_SUFFIX)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* image layout, every part 8 byte aligned:
+ * header, bloom words, slots, entries, names */
+typedef struct domain_image {
+    uint32_t count;
+    uint32_t slot_mask;
+    uint32_t bloom_mask;
+    uint32_t names_len;
+} domain_image;
+
+static size_t domain_align(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+static size_t domain_image_names(const domain_set* s) {
+    size_t n = 0;
+    for(uint32_t i = 0; i < s->count; i++) {
+        n += s->entries[i].len;
+    }
+    return n;
+}
+
+/* 0 if the set was never built */
+size_t domain_set_image_size(const domain_set* s) {
+    if(!s->slots) {
+        return 0;
+    }
+    return sizeof(domain_image) +
+           (size_t)(s->bloom_mask + 1) * sizeof(uint64_t) +
+           domain_align((size_t)(s->slot_mask + 1) * sizeof(domain_slot)) +
+           (size_t)s->count * sizeof(domain_entry) +
+           domain_align(domain_image_names(s));
+}
+
+/* out holds domain_set_image_size bytes, 8 byte aligned */
+void domain_set_image_write(const domain_set* s, void* out) {
+    size_t size = domain_set_image_size(s);
+    if(size == 0) {
+        return;
+    }
+    memset(out, 0, size);
+
+    domain_image* img = out;
+    img->count = s->count;
+    img->slot_mask = s->slot_mask;
+    img->bloom_mask = s->bloom_mask;
+    img->names_len = (uint32_t)domain_image_names(s);
+
+    char* p = (char*)(img + 1);
+    size_t bloom_len = (size_t)(s->bloom_mask + 1) * sizeof(uint64_t);
+    memcpy(p, s->bloom, bloom_len);
+    p += bloom_len;
+
+    size_t slots_len = (size_t)(s->slot_mask + 1) * sizeof(domain_slot);
+    memcpy(p, s->slots, slots_len);
+    p += domain_align(slots_len);
+
+    /* entries keep their order so the slots stay valid */
+    domain_entry* entries = (domain_entry*)p;
+    char* names = p + (size_t)s->count * sizeof(domain_entry);
+    uint64_t off = 0;
+    for(uint32_t i = 0; i < s->count; i++) {
+        const domain_entry* e = &s->entries[i];
+        const char* name = s->names ? s->names + e->name : (const char*)(uintptr_t)e->name;
+        entries[i] = *e;
+        entries[i].name = off;
+        memcpy(names + off, name, e->len);
+        off += e->len;
+    }
+}
+
+/* point s at an image in place, e.g. a read only mapping that outlives s */
+int domain_set_image_view(domain_set* s, const void* image, size_t len) {
+    const domain_image* img = image;
+    if(len < sizeof(domain_image) || ((uintptr_t)image & 7) != 0) {
+        return -1;
+    }
+    if((img->slot_mask & (img->slot_mask + 1)) != 0 || (img->bloom_mask & (img->bloom_mask + 1)) != 0 ||
+       img->count > img->slot_mask) {
+        return -1;
+    }
+
+    size_t bloom_len = (size_t)(img->bloom_mask + 1) * sizeof(uint64_t);
+    size_t slots_len = domain_align((size_t)(img->slot_mask + 1) * sizeof(domain_slot));
+    size_t entries_len = (size_t)img->count * sizeof(domain_entry);
+    if(len < sizeof(domain_image) + bloom_len + slots_len + entries_len + img->names_len) {
+        return -1;
+    }
+
+    /* links and names stay inside the image, a bad file can't send a
+     * lookup astray. fewer used slots than slots, so probing ends */
+    const char* p = (const char*)(img + 1);
+    const domain_slot* slots = (const domain_slot*)(p + bloom_len);
+    const domain_entry* entries = (const domain_entry*)(p + bloom_len + slots_len);
+    uint32_t used = 0;
+    for(uint32_t i = 0; i <= img->slot_mask; i++) {
+        if(slots[i].idx > img->count) {
+            return -1;
+        }
+        used += slots[i].idx != 0;
+    }
+    if(used > img->count) {
+        return -1;
+    }
+    for(uint32_t i = 0; i < img->count; i++) {
+        if(entries[i].name > img->names_len || entries[i].len > img->names_len - entries[i].name) {
+            return -1;
+        }
+    }
+
+    memset(s, 0, sizeof(domain_set));
+    s->bloom = (uint64_t*)p;
+    s->bloom_mask = img->bloom_mask;
+    s->slots = (domain_slot*)(p + bloom_len);
+    s->slot_mask = img->slot_mask;
+    s->entries = (domain_entry*)(p + bloom_len + slots_len);
+    s->count = img->count;
+    s->cap = img->count;
+    s->names = p + bloom_len + slots_len + entries_len;
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef DOMAIN_SET_H
+#define DOMAIN_SET_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* host name exclusion rules. "host.example" matches exactly,
+ * "*.corp.example" (or ".corp.example") matches any name below it.
+ * names are hashed label by label from the right so every suffix of a
+ * looked up name is probed with one pass over its bytes, a Bloom filter
+ * keeps most probes off the hash table */
+#define DOMAIN_EXACT    0x1
+#define DOMAIN_SUFFIX   0x2
+
+typedef struct domain_entry {
+    uint64_t hash;
+    uint64_t name;          // address, not NUL terminated when it points into a
+                            // list file. an offset into names on an image
+    uint32_t len;
+    uint32_t flags;
+} domain_entry;
+
+typedef struct domain_slot {
+    uint32_t idx;           // entry index + 1, 0 = empty
+    uint32_t tag;           // upper hash bits, checked before touching the entry
+} domain_slot;
+
+typedef struct domain_set {
+    domain_entry* entries;
+    uint32_t count;
+    uint32_t cap;
+    domain_slot* slots;
+    uint32_t slot_mask;
+    uint64_t* bloom;
+    uint32_t bloom_mask;    // bits - 1
+    char** owned;           // copies made by domain_set_add
+    uint32_t owned_cnt;
+    void** maps;            // mmapped list files
+    size_t* map_lens;
+    uint32_t map_cnt;
+    const char* names;      // set when viewing an image, nothing is owned then
+} domain_set;
+
+int domain_set_init(domain_set* s);
+void domain_set_free(domain_set* s);
+int domain_set_add(domain_set* s, const char* rule);
+int domain_set_load_file(domain_set* s, const char* path);
+int domain_set_build(domain_set* s);
+int domain_set_match(const domain_set* s, const char* name);
+
+/* a built set as one position independent block, names in a string table
+ * after the index. a set viewing an image can only be matched and freed */
+size_t domain_set_image_size(const domain_set* s);
+void domain_set_image_write(const domain_set* s, void* out);
+int domain_set_image_view(domain_set* s, const void* image, size_t len);
+
+#endif // DOMAIN_SET_H
@@ -0,0 +1,329 @@
+#include "fakeip.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#define FAKEIP_NONE UINT32_MAX
+
+/* one slot per hostname. the address encodes slot and generation, so a
+ * recycled slot never maps an old address to the new name. links are
+ * indexes into the shard's own entries */
+struct fakeip_entry {
+    char* host;
+    uint32_t hash;
+    uint32_t gen;
+    uint32_t hnext;     // hash chain
+    uint32_t prev;      // LRU, towards most recent
+    uint32_t next;      // LRU, towards least recent
+};
+
+/* entry i of shard k is slot i * FAKEIP_SHARDS + k. own cache line each,
+ * threads on different shards don't share locks */
+typedef struct fakeip_shard {
+    pthread_mutex_t mutex;
+    struct fakeip_entry* entries;   // NULL before init and after destroy
+    uint32_t* buckets;
+    uint32_t mask;
+    uint32_t used;          // entries handed out at least once
+    uint32_t head;          // most recently used
+    uint32_t tail;          // least recently used, recycled first
+} __attribute__((aligned(64))) fakeip_shard;
+
+static struct {
+    fakeip_shard shards[FAKEIP_SHARDS];
+    uint32_t cap;           // entries per shard, 0 when not initialized
+    uint32_t slot_bits;
+    uint32_t gen_max;
+    struct in6_addr v6_prefix;
+    pthread_mutex_t mutex;  // init and destroy
+} fakeip = {
+    .shards = { [0 ... FAKEIP_SHARDS - 1] = { .mutex = PTHREAD_MUTEX_INITIALIZER } },
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+/* FNV-1a over the lowercased name, hostnames are case insensitive */
+static uint32_t fakeip_hash(const char* host) {
+    uint32_t h = 2166136261u;
+    for(; *host; host++) {
+        h ^= (unsigned char)tolower((unsigned char)*host);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* top bits of a multiplied hash, buckets use the low bits of the hash */
+static fakeip_shard* fakeip_shard_of(uint32_t hash) {
+    return &fakeip.shards[(hash * 0x9e3779b1u) >> (32 - __builtin_ctz(FAKEIP_SHARDS))];
+}
+
+static void fakeip_shard_free(fakeip_shard* s) {
+    for(uint32_t i = 0; i < s->used; i++) {
+        free(s->entries[i].host);
+    }
+    free(s->entries);
+    free(s->buckets);
+    s->entries = NULL;
+    s->buckets = NULL;
+    s->used = 0;
+}
+
+int fakeip_init(uint32_t size) {
+    if(size == 0 || size > FAKEIP_MAX_SIZE) {
+        size = FAKEIP_DEFAULT_SIZE;
+    }
+
+    uint32_t cap = (size + FAKEIP_SHARDS - 1) / FAKEIP_SHARDS;
+    uint32_t bits = 1;
+    while((1u << bits) < cap * FAKEIP_SHARDS) {
+        bits++;
+    }
+    uint32_t nbuckets = 1;
+    while(nbuckets < cap) {
+        nbuckets <<= 1;
+    }
+
+    pthread_mutex_lock(&fakeip.mutex);
+    if(fakeip.cap) {
+        pthread_mutex_unlock(&fakeip.mutex);
+        return 0;
+    }
+
+    fakeip.slot_bits = bits;
+    // top v4 generation is never used so 255.255.255.255 can't come out
+    fakeip.gen_max = (1u << (28 - bits)) - 1;
+    inet_pton(AF_INET6, FAKEIP_V6_PREFIX, &fakeip.v6_prefix);
+
+    for(int k = 0; k < FAKEIP_SHARDS; k++) {
+        fakeip_shard* s = &fakeip.shards[k];
+        struct fakeip_entry* entries = calloc(cap, sizeof(struct fakeip_entry));
+        uint32_t* buckets = malloc(nbuckets * sizeof(uint32_t));
+        if(!entries || !buckets) {
+            free(entries);
+            free(buckets);
+            for(int j = 0; j < k; j++) {
+                pthread_mutex_lock(&fakeip.shards[j].mutex);
+                fakeip_shard_free(&fakeip.shards[j]);
+                pthread_mutex_unlock(&fakeip.shards[j].mutex);
+            }
+            pthread_mutex_unlock(&fakeip.mutex);
+            return -1;
+        }
+        memset(buckets, 0xff, nbuckets * sizeof(uint32_t));
+
+        pthread_mutex_lock(&s->mutex);
+        s->entries = entries;
+        s->buckets = buckets;
+        s->mask = nbuckets - 1;
+        s->used = 0;
+        s->head = FAKEIP_NONE;
+        s->tail = FAKEIP_NONE;
+        pthread_mutex_unlock(&s->mutex);
+    }
+    __atomic_store_n(&fakeip.cap, cap, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&fakeip.mutex);
+    return 0;
+}
+
+void fakeip_destroy(void) {
+    pthread_mutex_lock(&fakeip.mutex);
+    __atomic_store_n(&fakeip.cap, 0, __ATOMIC_RELEASE);
+    for(int k = 0; k < FAKEIP_SHARDS; k++) {
+        pthread_mutex_lock(&fakeip.shards[k].mutex);
+        fakeip_shard_free(&fakeip.shards[k]);
+        pthread_mutex_unlock(&fakeip.shards[k].mutex);
+    }
+    pthread_mutex_unlock(&fakeip.mutex);
+}
+
+static void lru_unlink(fakeip_shard* s, uint32_t i) {
+    struct fakeip_entry* e = &s->entries[i];
+
+    if(e->prev != FAKEIP_NONE) {
+        s->entries[e->prev].next = e->next;
+    } else {
+        s->head = e->next;
+    }
+
+    if(e->next != FAKEIP_NONE) {
+        s->entries[e->next].prev = e->prev;
+    } else {
+        s->tail = e->prev;
+    }
+}
+
+static void lru_push(fakeip_shard* s, uint32_t i) {
+    struct fakeip_entry* e = &s->entries[i];
+
+    e->prev = FAKEIP_NONE;
+    e->next = s->head;
+    if(s->head != FAKEIP_NONE) {
+        s->entries[s->head].prev = i;
+    }
+    s->head = i;
+    if(s->tail == FAKEIP_NONE) {
+        s->tail = i;
+    }
+}
+
+static void lru_touch(fakeip_shard* s, uint32_t i) {
+    if(s->head != i) {
+        lru_unlink(s, i);
+        lru_push(s, i);
+    }
+}
+
+static void hash_remove(fakeip_shard* s, uint32_t i) {
+    uint32_t* link = &s->buckets[s->entries[i].hash & s->mask];
+    while(*link != FAKEIP_NONE) {
+        if(*link == i) {
+            *link = s->entries[i].hnext;
+            return;
+        }
+        link = &s->entries[*link].hnext;
+    }
+}
+
+/* entry for host in its shard, recycling the shard's least recently used
+ * one when full. must hold the shard mutex */
+static uint32_t fakeip_get_slot(fakeip_shard* s, const char* host, uint32_t hash) {
+    uint32_t i = s->buckets[hash & s->mask];
+
+    for(; i != FAKEIP_NONE; i = s->entries[i].hnext) {
+        if(s->entries[i].hash == hash && strcasecmp(s->entries[i].host, host) == 0) {
+            lru_touch(s, i);
+            return i;
+        }
+    }
+
+    char* copy = strdup(host);
+    if(!copy) {
+        return FAKEIP_NONE;
+    }
+
+    if(s->used < fakeip.cap) {
+        i = s->used++;
+        s->entries[i].gen = 0;
+    }
+    else {
+        i = s->tail;
+        lru_unlink(s, i);
+        hash_remove(s, i);
+        free(s->entries[i].host);
+        s->entries[i].gen = (s->entries[i].gen + 1) % fakeip.gen_max;
+    }
+
+    struct fakeip_entry* e = &s->entries[i];
+    e->host = copy;
+    e->hash = hash;
+    e->hnext = s->buckets[hash & s->mask];
+    s->buckets[hash & s->mask] = i;
+    lru_push(s, i);
+
+    return i;
+}
+
+/* slot and gen for host, -1 if the table is gone or out of memory */
+static int fakeip_alloc(const char* host, uint32_t* slot, uint32_t* gen) {
+    uint32_t hash = fakeip_hash(host);
+    fakeip_shard* s = fakeip_shard_of(hash);
+    int ret = -1;
+
+    pthread_mutex_lock(&s->mutex);
+    if(s->entries) {
+        uint32_t i = fakeip_get_slot(s, host, hash);
+        if(i != FAKEIP_NONE) {
+            *slot = i * FAKEIP_SHARDS + (uint32_t)(s - fakeip.shards);
+            *gen = s->entries[i].gen;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return ret;
+}
+
+int fakeip_alloc4(const char* host, struct in_addr* out) {
+    uint32_t slot, gen;
+
+    if(!host || !out || fakeip_alloc(host, &slot, &gen) != 0) {
+        return -1;
+    }
+    out->s_addr = htonl(FAKEIP_V4_PREFIX | (gen << fakeip.slot_bits) | slot);
+    return 0;
+}
+
+int fakeip_alloc6(const char* host, struct in6_addr* out) {
+    uint32_t slot, gen;
+
+    if(!host || !out || fakeip_alloc(host, &slot, &gen) != 0) {
+        return -1;
+    }
+    gen = htonl(gen);
+    slot = htonl(slot);
+    memcpy(out->s6_addr, fakeip.v6_prefix.s6_addr, 8);
+    memcpy(out->s6_addr + 8, &gen, 4);
+    memcpy(out->s6_addr + 12, &slot, 4);
+    return 0;
+}
+
+/* split a fake address into slot and gen, -1 if outside our ranges */
+static int fakeip_decode(const struct sockaddr* addr, uint32_t* slot, uint32_t* gen) {
+    if(addr->sa_family == AF_INET) {
+        uint32_t ip = ntohl(((const struct sockaddr_in*)addr)->sin_addr.s_addr);
+        if((ip & 0xF0000000u) != FAKEIP_V4_PREFIX) {
+            return -1;
+        }
+        *slot = ip & ((1u << fakeip.slot_bits) - 1);
+        *gen = (ip & 0x0FFFFFFFu) >> fakeip.slot_bits;
+        return 0;
+    }
+
+    if(addr->sa_family == AF_INET6) {
+        const unsigned char* b = ((const struct sockaddr_in6*)addr)->sin6_addr.s6_addr;
+        if(memcmp(b, fakeip.v6_prefix.s6_addr, 8) != 0) {
+            return -1;
+        }
+        memcpy(gen, b + 8, 4);
+        memcpy(slot, b + 12, 4);
+        *gen = ntohl(*gen);
+        *slot = ntohl(*slot);
+        return 0;
+    }
+
+    return -1;
+}
+
+int fakeip_is_fake(const struct sockaddr* addr) {
+    uint32_t slot, gen;
+    return addr && __atomic_load_n(&fakeip.cap, __ATOMIC_ACQUIRE) && fakeip_decode(addr, &slot, &gen) == 0;
+}
+
+/* reverse map a fake address to its hostname. stale addresses whose slot
+ * has been recycled since fail */
+int fakeip_lookup(const struct sockaddr* addr, char* host, size_t host_len) {
+    uint32_t slot, gen;
+    int ret = -1;
+
+    if(!addr || !host || host_len == 0 || fakeip_decode(addr, &slot, &gen) != 0) {
+        return -1;
+    }
+
+    fakeip_shard* s = &fakeip.shards[slot & (FAKEIP_SHARDS - 1)];
+    uint32_t i = slot / FAKEIP_SHARDS;
+
+    pthread_mutex_lock(&s->mutex);
+    if(s->entries && i < s->used) {
+        struct fakeip_entry* e = &s->entries[i];
+        if(e->host && e->gen == gen && strlen(e->host) < host_len) {
+            strcpy(host, e->host);
+            lru_touch(s, i);
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    return ret;
+}
@@ -0,0 +1,26 @@
+#ifndef FAKEIP_H
+#define FAKEIP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/* hostnames handed out by the interposed getaddrinfo get a unique address
+ * from 240.0.0.0/4 (or the ULA prefix below) so connect() can map it back.
+ * sharded by name hash, each shard with its own lock and LRU list. the
+ * low bits of a slot are its shard, a reverse lookup locks only that one */
+#define FAKEIP_SHARDS           16      // power of two
+#define FAKEIP_DEFAULT_SIZE     65536
+#define FAKEIP_MAX_SIZE         (1 << 24)
+#define FAKEIP_V4_PREFIX        0xF0000000u     // 240.0.0.0/4
+#define FAKEIP_V6_PREFIX        "fd74:6f72::"   // fd74:6f72::/64, low 64 bits are gen + slot
+
+int fakeip_init(uint32_t size);
+void fakeip_destroy(void);
+int fakeip_alloc4(const char* host, struct in_addr* out);
+int fakeip_alloc6(const char* host, struct in6_addr* out);
+int fakeip_is_fake(const struct sockaddr* addr);
+int fakeip_lookup(const struct sockaddr* addr, char* host, size_t host_len);
+
+#endif // FAKEIP_H
@@ -0,0 +1,325 @@
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LOGGER_PREFIX       "[TORALIZE] "
+#define LOGGER_DRAIN_MS     20
+
+typedef struct logger_rec {
+    uint16_t len;
+    char msg[LOGGER_MSG_MAX];
+} logger_rec;
+
+/* single producer (the owning thread), single consumer (whoever holds
+ * the drain lock). head and tail on separate cache lines */
+typedef struct logger_ring {
+    uint32_t head;
+    char pad0[60];
+    uint32_t tail;
+    char pad1[60];
+    uint64_t dropped;
+    int owned;                  // 0 once the thread exited, ring can be reused
+    struct logger_ring* next;
+    logger_rec recs[LOGGER_RING_SIZE];
+} logger_ring;
+
+enum {
+    LOGGER_STOPPED = 0,
+    LOGGER_RUNNING,
+    LOGGER_SYNC         // no drain thread, write directly
+};
+
+int logger_level = LOGGER_WARN;
+
+static struct {
+    logger_ring* rings;         // push only, rings are never freed
+    pthread_mutex_t drain;
+    pthread_mutex_t wake_mutex;
+    pthread_cond_t wake;
+    pthread_key_t key;
+    pthread_once_t once;
+    pthread_t thread;
+    int state;
+    uint64_t dropped;
+} logger = {
+    .rings = NULL,
+    .drain = PTHREAD_MUTEX_INITIALIZER,
+    .wake_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+    .state = LOGGER_STOPPED,
+    .dropped = 0
+};
+
+static __thread logger_ring* logger_my_ring;
+
+void logger_set_level(int level) {
+    __atomic_store_n(&logger_level, level, __ATOMIC_RELAXED);
+}
+
+int logger_parse_level(const char* name) {
+    static const char* names[] = {"error", "warn", "info", "debug"};
+
+    for(int i = 0; i <= LOGGER_DEBUG; i++) {
+        if(strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    if(name[0] >= '0' && name[0] <= '9') {
+        int level = atoi(name);
+        return level > LOGGER_DEBUG ? LOGGER_DEBUG : level;
+    }
+    return -1;
+}
+
+static void logger_write_all(const char* buff, size_t len) {
+    while(len > 0) {
+        ssize_t n = write(STDERR_FILENO, buff, len);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buff += n;
+        len -= n;
+    }
+}
+
+/* move everything buffered so far to stderr, one write per 8k */
+static int logger_drain(void) {
+    char out[8192];
+    size_t len = 0;
+    int cnt = 0;
+    uint64_t dropped = 0;
+
+    pthread_mutex_lock(&logger.drain);
+    for(logger_ring* r = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint32_t tail = r->tail;
+
+        while(tail != head) {
+            const logger_rec* rec = &r->recs[tail & (LOGGER_RING_SIZE - 1)];
+            size_t need = sizeof(LOGGER_PREFIX) - 1 + rec->len + 1;
+            if(len + need > sizeof(out)) {
+                logger_write_all(out, len);
+                len = 0;
+            }
+            memcpy(out + len, LOGGER_PREFIX, sizeof(LOGGER_PREFIX) - 1);
+            len += sizeof(LOGGER_PREFIX) - 1;
+            memcpy(out + len, rec->msg, rec->len);
+            len += rec->len;
+            out[len++] = '\n';
+            tail++;
+            cnt++;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+        dropped += __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+    }
+
+    if(dropped) {
+        logger.dropped += dropped;
+        if(len + 64 > sizeof(out)) {
+            logger_write_all(out, len);
+            len = 0;
+        }
+        len += snprintf(out + len, sizeof(out) - len, LOGGER_PREFIX "dropped %llu log messages\n",
+                        (unsigned long long)dropped);
+    }
+    if(len) {
+        logger_write_all(out, len);
+    }
+    pthread_mutex_unlock(&logger.drain);
+    return cnt;
+}
+
+static void* logger_main(void* arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&logger.wake_mutex);
+    while(__atomic_load_n(&logger.state, __ATOMIC_ACQUIRE) == LOGGER_RUNNING) {
+        pthread_mutex_unlock(&logger.wake_mutex);
+        logger_drain();
+        pthread_mutex_lock(&logger.wake_mutex);
+
+        if(__atomic_load_n(&logger.state, __ATOMIC_ACQUIRE) != LOGGER_RUNNING) {
+            break;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOGGER_DRAIN_MS * 1000000L;
+        if(ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&logger.wake, &logger.wake_mutex, &ts);
+    }
+    pthread_mutex_unlock(&logger.wake_mutex);
+    return NULL;
+}
+
+static void logger_release_ring(void* arg) {
+    logger_ring* r = arg;
+    __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+/* a forked child has no drain thread and must not print what the parent
+ * still has buffered. rings of threads that did not survive are freed up */
+static void logger_fork_prepare(void) {
+    pthread_mutex_lock(&logger.drain);
+}
+
+static void logger_fork_parent(void) {
+    pthread_mutex_unlock(&logger.drain);
+}
+
+static void logger_fork_child(void) {
+    for(logger_ring* r = logger.rings; r; r = r->next) {
+        r->tail = r->head;
+        r->dropped = 0;
+        if(r != logger_my_ring) {
+            r->owned = 0;
+        }
+    }
+    if(logger.state == LOGGER_RUNNING) {
+        logger.state = LOGGER_STOPPED;
+    }
+    pthread_mutex_init(&logger.drain, NULL);
+    pthread_mutex_init(&logger.wake_mutex, NULL);
+    pthread_cond_init(&logger.wake, NULL);
+}
+
+static void logger_setup(void) {
+    pthread_key_create(&logger.key, logger_release_ring);
+    pthread_atfork(logger_fork_prepare, logger_fork_parent, logger_fork_child);
+}
+
+static logger_ring* logger_ring_get(void) {
+    if(logger_my_ring) {
+        return logger_my_ring;
+    }
+
+    logger_ring* r;
+    for(r = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int expected = 0;
+        if(__atomic_load_n(&r->owned, __ATOMIC_RELAXED) == 0 &&
+           __atomic_compare_exchange_n(&r->owned, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if(!r) {
+        r = calloc(1, sizeof(logger_ring));
+        if(!r) {
+            return NULL;
+        }
+        r->owned = 1;
+        r->next = __atomic_load_n(&logger.rings, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&logger.rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    logger_my_ring = r;
+    pthread_setspecific(logger.key, r);
+    return r;
+}
+
+/* drain thread is started by the first message, processes that never
+ * log never get one */
+static int logger_start(void) {
+    int state = __atomic_load_n(&logger.state, __ATOMIC_ACQUIRE);
+    if(state != LOGGER_STOPPED) {
+        return state;
+    }
+
+    pthread_once(&logger.once, logger_setup);
+
+    pthread_mutex_lock(&logger.wake_mutex);
+    state = logger.state;
+    if(state == LOGGER_STOPPED) {
+        __atomic_store_n(&logger.state, LOGGER_RUNNING, __ATOMIC_RELEASE);
+        if(pthread_create(&logger.thread, NULL, logger_main, NULL) != 0) {
+            __atomic_store_n(&logger.state, LOGGER_SYNC, __ATOMIC_RELEASE);
+        }
+        state = logger.state;
+    }
+    pthread_mutex_unlock(&logger.wake_mutex);
+    return state;
+}
+
+static void logger_write_sync(const char* format, va_list args) {
+    char buff[sizeof(LOGGER_PREFIX) + LOGGER_MSG_MAX + 1];
+    size_t len = sizeof(LOGGER_PREFIX) - 1;
+
+    memcpy(buff, LOGGER_PREFIX, len);
+    int n = vsnprintf(buff + len, LOGGER_MSG_MAX, format, args);
+    if(n > 0) {
+        len += (n >= LOGGER_MSG_MAX) ? LOGGER_MSG_MAX - 1 : (size_t)n;
+    }
+    buff[len++] = '\n';
+    logger_write_all(buff, len);
+}
+
+/* format into the calling thread's ring, never blocks. a full ring drops
+ * the message and counts it */
+void logger_write(int level, const char* format, ...) {
+    va_list args;
+    (void)level;
+
+    logger_ring* r = NULL;
+    if(logger_start() == LOGGER_RUNNING) {
+        r = logger_ring_get();
+    }
+
+    va_start(args, format);
+    if(!r) {
+        logger_write_sync(format, args);
+        va_end(args);
+        return;
+    }
+
+    uint32_t head = r->head;
+    if(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOGGER_RING_SIZE) {
+        __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+        va_end(args);
+        return;
+    }
+
+    logger_rec* rec = &r->recs[head & (LOGGER_RING_SIZE - 1)];
+    int n = vsnprintf(rec->msg, LOGGER_MSG_MAX, format, args);
+    va_end(args);
+    rec->len = n < 0 ? 0 : (n >= LOGGER_MSG_MAX ? LOGGER_MSG_MAX - 1 : n);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void logger_flush(void) {
+    logger_drain();
+}
+
+/* stop the drain thread and flush, later messages are written directly */
+void logger_shutdown(void) {
+    pthread_mutex_lock(&logger.wake_mutex);
+    int state = logger.state;
+    __atomic_store_n(&logger.state, LOGGER_SYNC, __ATOMIC_RELEASE);
+    pthread_cond_signal(&logger.wake);
+    pthread_mutex_unlock(&logger.wake_mutex);
+
+    if(state == LOGGER_RUNNING) {
+        pthread_join(logger.thread, NULL);
+    }
+    logger_drain();
+}
+
+uint64_t logger_dropped(void) {
+    uint64_t dropped = __atomic_load_n(&logger.dropped, __ATOMIC_RELAXED);
+    for(logger_ring* r = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
@@ -0,0 +1,43 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+
+#define LOGGER_ERROR    0
+#define LOGGER_WARN     1
+#define LOGGER_INFO     2
+#define LOGGER_DEBUG    3
+
+/* levels above this are compiled out, arguments are not even evaluated */
+#ifndef LOGGER_MAX_LEVEL
+#define LOGGER_MAX_LEVEL LOGGER_DEBUG
+#endif
+
+/* messages per thread ring and the longest message kept */
+#define LOGGER_RING_SIZE    256
+#define LOGGER_MSG_MAX      244
+
+extern int logger_level;
+
+#define logger_enabled(level) \
+    ((level) <= LOGGER_MAX_LEVEL && (level) <= __atomic_load_n(&logger_level, __ATOMIC_RELAXED))
+
+#define logger_log(level, ...) do { \
+    if(logger_enabled(level)) { \
+        logger_write((level), __VA_ARGS__); \
+    } \
+} while(0)
+
+#define log_error(...)  logger_log(LOGGER_ERROR, __VA_ARGS__)
+#define log_warn(...)   logger_log(LOGGER_WARN, __VA_ARGS__)
+#define log_info(...)   logger_log(LOGGER_INFO, __VA_ARGS__)
+#define log_debug(...)  logger_log(LOGGER_DEBUG, __VA_ARGS__)
+
+void logger_set_level(int level);
+int logger_parse_level(const char* name);
+void logger_write(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void logger_flush(void);
+void logger_shutdown(void);
+uint64_t logger_dropped(void);
+
+#endif // LOGGER_H
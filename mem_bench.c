@@ -0,0 +1,168 @@
+/* mem_bench.c - memory held per open connection. for each count, that
+ * many ctxs go through CONNECT on a socketpair whose other end answers,
+ * all sharing one proxy, and are kept the way toralize keeps one per
+ * proxied fd. the fd is the app's there, so here the sock is taken
+ * back and closed, the fd limit doesn't bound the count. heap is what
+ * malloc has handed out (mallinfo2), rss the whole process, both per
+ * connection and without the kernel's socket buffers. after the free,
+ * heap shows what the ctx free lists keep for the next connections.
+ * usage: mem_bench [-c 10000,100000] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/socket.h>
+#include "socks5_client.h"
+#include "socks5_proto.h"
+#include "sock_table.h"
+
+#define BENCH_MAX_RUNS  16
+
+static const unsigned char reply[] = {
+    SOCKS5_VERSION, SOCKS5_REP_SUCCESS, 0x00, SOCKS5_ADDR_IPV4, 0, 0, 0, 0, 0, 0
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t heap_used(void) {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+static size_t rss_bytes(void) {
+    long pages = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if(f) {
+        if(fscanf(f, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(f);
+    }
+    return (size_t)pages * sysconf(_SC_PAGESIZE);
+}
+
+/* a ctx past CONNECT, its sock gone as if it were the app's */
+static socks5_ctx* open_conn(socks5_proxy* proxy) {
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        return NULL;
+    }
+    if(write(sv[1], reply, sizeof(reply)) != (ssize_t)sizeof(reply)) {
+        close(sv[0]);
+        close(sv[1]);
+        return NULL;
+    }
+
+    socks5_ctx* ctx = socks5_create_ctx_proxy(proxy);
+    if(!ctx) {
+        close(sv[0]);
+        close(sv[1]);
+        return NULL;
+    }
+    socks5_attach(ctx, sv[0]);
+    int ret = socks5_connect(ctx, "bench.example", 443);
+    close(sv[1]);
+    if(ret < 0) {
+        fprintf(stderr, "CONNECT failed: %s\n", socks5_get_error(ctx));
+        socks5_free(ctx);
+        return NULL;
+    }
+    close(socks5_detach(ctx));
+    return ctx;
+}
+
+static int parse_list(const char* s, int* out) {
+    int n = 0;
+    while(*s && n < BENCH_MAX_RUNS) {
+        out[n] = atoi(s);
+        if(out[n] <= 0) {
+            return -1;
+        }
+        n++;
+        s = strchr(s, ',');
+        if(!s) {
+            break;
+        }
+        s++;
+    }
+    return n;
+}
+
+int main(int argc, char* argv[]) {
+    int counts[BENCH_MAX_RUNS] = {10000, 100000};
+    int runs = 2;
+
+    int opt;
+    while((opt = getopt(argc, argv, "c:")) != -1) {
+        switch(opt) {
+            case 'c':
+                runs = parse_list(optarg, counts);
+                break;
+            default:
+                runs = -1;
+                break;
+        }
+    }
+    if(runs <= 0) {
+        fprintf(stderr, "usage: %s [-c 10000,100000]\n", argv[0]);
+        return 2;
+    }
+
+    socks5_proxy* proxy = socks5_proxy_create("127.0.0.1", 9050, NULL, NULL);
+    if(!proxy) {
+        fprintf(stderr, "no memory\n");
+        return 1;
+    }
+
+    for(int r = 0; r < runs; r++) {
+        int n = counts[r];
+        socks5_ctx** conns = calloc(n, sizeof(socks5_ctx*));
+        if(!conns) {
+            fprintf(stderr, "no memory\n");
+            return 1;
+        }
+
+        // the array is the bench's own, not counted
+        size_t heap0 = heap_used();
+        size_t rss0 = rss_bytes();
+        double t0 = now_ns();
+        int open = 0;
+        for(int i = 0; i < n; i++) {
+            conns[i] = open_conn(proxy);
+            if(!conns[i]) {
+                break;
+            }
+            open++;
+        }
+        double open_ns = now_ns() - t0;
+        size_t heap1 = heap_used();
+        size_t rss1 = rss_bytes();
+
+        t0 = now_ns();
+        for(int i = 0; i < open; i++) {
+            socks5_free(conns[i]);
+        }
+        double free_ns = now_ns() - t0;
+        size_t heap2 = heap_used();
+        free(conns);
+
+        if(open == 0) {
+            fprintf(stderr, "no connection opened\n");
+            return 1;
+        }
+        printf("conns=%-7d heap_per_conn=%-6.0f rss_per_conn=%-6.0f sock_slot=%-4zu "
+               "open_us=%-6.2f free_ns=%-6.0f kept_after_free_kb=%zu\n",
+               open, (double)(heap1 - heap0) / open, (double)(rss1 - rss0) / open,
+               sizeof(managed_sock), open_ns / open / 1000, free_ns / open,
+               (heap2 > heap0 ? heap2 - heap0 : 0) / 1024);
+    }
+
+    socks5_proxy_unref(proxy);
+    return 0;
+}
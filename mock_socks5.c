@@ -0,0 +1,424 @@
+#define _GNU_SOURCE      // sendmmsg, recvmmsg
+#include "mock_socks5.h"
+#include "socks5_proto.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+struct mock_socks5 {
+    mock_socks5_opts opts;
+    char uname[MAX_AUTH_LEN + 1];
+    char passwd[MAX_AUTH_LEN + 1];
+    int listen_sock;
+    uint16_t port;
+    pthread_t thread;
+    uint64_t accepted;
+    int active;             // conn threads still running
+};
+
+/* UDP ASSOCIATE relay, datagrams per recvmmsg and the room for each */
+#define MOCK_UDP_BATCH  64
+#define MOCK_UDP_MTU    2048
+
+typedef struct mock_conn {
+    mock_socks5* m;
+    int sock;
+} mock_conn;
+
+static int mock_read(int sock, unsigned char* buff, size_t len) {
+    while(len > 0) {
+        ssize_t n = read(sock, buff, len);
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buff += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int mock_write(int sock, const unsigned char* buff, size_t len) {
+    while(len > 0) {
+        ssize_t n = send(sock, buff, len, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buff += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int mock_reply(mock_socks5* m, int sock, const unsigned char* buff, size_t len) {
+    if(m->opts.delay_us > 0) {
+        usleep(m->opts.delay_us);
+    }
+    return mock_write(sock, buff, len);
+}
+
+static int mock_auth(mock_socks5* m, int sock) {
+    unsigned char buff[2 + MAX_AUTH_LEN];
+    char uname[MAX_AUTH_LEN + 1], passwd[MAX_AUTH_LEN + 1];
+
+    if(mock_read(sock, buff, 2) < 0 || buff[0] != 0x01) {
+        return -1;
+    }
+    int ulen = buff[1];
+    if(mock_read(sock, buff, ulen + 1) < 0) {
+        return -1;
+    }
+    memcpy(uname, buff, ulen);
+    uname[ulen] = '\0';
+    int plen = buff[ulen];
+    if(mock_read(sock, buff, plen) < 0) {
+        return -1;
+    }
+    memcpy(passwd, buff, plen);
+    passwd[plen] = '\0';
+
+    int ok = strcmp(uname, m->uname) == 0 && strcmp(passwd, m->passwd) == 0;
+    unsigned char res[2] = {0x01, ok ? 0x00 : 0x01};
+    if(mock_reply(m, sock, res, sizeof(res)) < 0) {
+        return -1;
+    }
+    return ok ? 0 : -1;
+}
+
+/* Tor's RESOLVE and RESOLVE_PTR, answered from the request alone: a
+ * name gets 10.x.y.z hashed from it, an addr the name "<addr>.mock" */
+static int mock_resolve(mock_socks5* m, int sock, const unsigned char* req, int rep) {
+    unsigned char res[4 + 1 + MAX_DOMAIN_LEN + 2] = {SOCKS5_VERSION, rep, 0};
+    int len;
+
+    if(req[1] == SOCKS5_CMD_RESOLVE) {
+        uint32_t h = 2166136261u;
+        for(int i = 0; req[3] == SOCKS5_ADDR_DOMAIN && i < req[4]; i++) {
+            h = (h ^ req[5 + i]) * 16777619u;
+        }
+        res[3] = SOCKS5_ADDR_IPV4;
+        res[4] = 10;
+        res[5] = h >> 16;
+        res[6] = h >> 8;
+        res[7] = h;
+        len = 8;
+    }
+    else {
+        char addr[INET6_ADDRSTRLEN];
+        if(!inet_ntop(req[3] == SOCKS5_ADDR_IPV6 ? AF_INET6 : AF_INET, req + 4, addr, sizeof(addr))) {
+            addr[0] = '\0';
+        }
+        res[3] = SOCKS5_ADDR_DOMAIN;
+        res[4] = snprintf((char*)res + 5, MAX_DOMAIN_LEN, "%s.mock", addr);
+        len = 5 + res[4];
+    }
+    res[len++] = 0;
+    res[len++] = 0;
+    return mock_reply(m, sock, res, len);
+}
+
+/* a loopback UDP sock for an association, its port in *port */
+static int mock_relay_open(uint16_t* port) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int udp = socket(AF_INET, SOCK_DGRAM, 0);
+    if(udp < 0) {
+        return -1;
+    }
+    if(bind(udp, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+       getsockname(udp, (struct sockaddr*)&addr, &len) < 0) {
+        close(udp);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return udp;
+}
+
+/* echo every datagram back to its sender as it is, the header naming
+ * the destination reads as the reply's source. until the control conn
+ * closes */
+static void mock_relay(int sock, int udp) {
+    struct mmsghdr msgs[MOCK_UDP_BATCH];
+    struct iovec iovs[MOCK_UDP_BATCH];
+    struct sockaddr_storage from[MOCK_UDP_BATCH];
+    char* bufs = malloc(MOCK_UDP_BATCH * MOCK_UDP_MTU);
+    if(!bufs) {
+        return;
+    }
+
+    struct pollfd fds[2] = {{sock, POLLIN, 0}, {udp, POLLIN, 0}};
+    for(;;) {
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if(fds[0].revents) {
+            char c;
+            if(read(sock, &c, 1) <= 0) {
+                break;
+            }
+        }
+        if(!fds[1].revents) {
+            continue;
+        }
+
+        for(int i = 0; i < MOCK_UDP_BATCH; i++) {
+            iovs[i].iov_base = bufs + i * MOCK_UDP_MTU;
+            iovs[i].iov_len = MOCK_UDP_MTU;
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_name = &from[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(udp, msgs, MOCK_UDP_BATCH, MSG_DONTWAIT, NULL);
+        for(int i = 0; i < n; i++) {
+            iovs[i].iov_len = msgs[i].msg_len;
+        }
+        for(int sent = 0; n > 0 && sent < n; ) {
+            int ret = sendmmsg(udp, msgs + sent, n - sent, 0);
+            if(ret <= 0) {
+                break;
+            }
+            sent += ret;
+        }
+    }
+    free(bufs);
+}
+
+/* method selection, auth and CONNECT (or a Tor lookup, or UDP
+ * ASSOCIATE with the relay sock in *udp). returns the reply code sent */
+static int mock_handshake(mock_socks5* m, int sock, int* udp) {
+    unsigned char buff[4 + 1 + MAX_DOMAIN_LEN + 2];
+
+    if(mock_read(sock, buff, 2) < 0 || buff[0] != SOCKS5_VERSION) {
+        return -1;
+    }
+    int nmethods = buff[1];
+    if(mock_read(sock, buff, nmethods) < 0) {
+        return -1;
+    }
+
+    int want = m->opts.require_auth ? SOCKS5_AUTH_PASSWORD : SOCKS5_AUTH_NONE;
+    int method = SOCKS5_AUTH_NO_ACCEPT;
+    for(int i = 0; i < nmethods; i++) {
+        if(buff[i] == want) {
+            method = want;
+        }
+    }
+
+    unsigned char sel[2] = {SOCKS5_VERSION, method};
+    if(mock_reply(m, sock, sel, sizeof(sel)) < 0 || method == SOCKS5_AUTH_NO_ACCEPT) {
+        return -1;
+    }
+    if(method == SOCKS5_AUTH_PASSWORD && mock_auth(m, sock) < 0) {
+        return -1;
+    }
+
+    if(mock_read(sock, buff, 5) < 0 || buff[0] != SOCKS5_VERSION ||
+       (buff[1] != SOCKS5_CMD_CONNECT && buff[1] != SOCKS5_CMD_UDP_ASSOC &&
+        buff[1] != SOCKS5_CMD_RESOLVE && buff[1] != SOCKS5_CMD_RESOLVE_PTR)) {
+        return -1;
+    }
+
+    int rep = SOCKS5_REP_SUCCESS;
+    int atyp = buff[3];
+    int rest;
+    if(atyp == SOCKS5_ADDR_IPV4) {
+        rest = 4 - 1 + 2;
+    } else if(atyp == SOCKS5_ADDR_IPV6) {
+        rest = 16 - 1 + 2;
+    } else if(atyp == SOCKS5_ADDR_DOMAIN) {
+        rest = buff[4] + 2;
+    }
+    else {
+        rest = 0;
+        rep = SOCKS5_REP_ADDR_NOTSUP;
+    }
+    if(mock_read(sock, buff + 5, rest) < 0) {
+        return -1;
+    }
+
+    // "rep<N>" domains ask for reply code N
+    if(atyp == SOCKS5_ADDR_DOMAIN && buff[4] >= 4 && memcmp(buff + 5, "rep", 3) == 0 &&
+       buff[8] >= '1' && buff[8] <= '8') {
+        rep = buff[8] - '0';
+    }
+
+    if((buff[1] == SOCKS5_CMD_RESOLVE || buff[1] == SOCKS5_CMD_RESOLVE_PTR) && rep == SOCKS5_REP_SUCCESS) {
+        return mock_resolve(m, sock, buff, rep) < 0 ? -1 : rep;
+    }
+
+    uint16_t port = 0;
+    if(buff[1] == SOCKS5_CMD_UDP_ASSOC && rep == SOCKS5_REP_SUCCESS &&
+       (*udp = mock_relay_open(&port)) < 0) {
+        rep = SOCKS5_REP_GEN_FAILURE;
+    }
+
+    unsigned char res[10] = {SOCKS5_VERSION, rep, 0, SOCKS5_ADDR_IPV4, 127, 0, 0, 1, port >> 8, port & 0xFF};
+    if(mock_reply(m, sock, res, sizeof(res)) < 0) {
+        return -1;
+    }
+    return rep;
+}
+
+static void* mock_conn_main(void* arg) {
+    mock_conn* c = arg;
+    mock_socks5* m = c->m;
+    int sock = c->sock;
+    free(c);
+
+    int udp = -1;
+    int rep = mock_handshake(m, sock, &udp);
+    if(udp >= 0) {
+        if(rep == SOCKS5_REP_SUCCESS) {
+            mock_relay(sock, udp);
+        }
+        close(udp);
+    }
+    else if(rep == SOCKS5_REP_SUCCESS) {
+        unsigned char buff[65536];
+        for(;;) {
+            ssize_t n = read(sock, buff, sizeof(buff));
+            if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            if(n <= 0 || mock_write(sock, buff, n) < 0) {
+                break;
+            }
+        }
+    }
+
+    close(sock);
+    __atomic_sub_fetch(&m->active, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void* mock_accept_main(void* arg) {
+    mock_socks5* m = arg;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+
+    for(;;) {
+        int sock = accept(m->listen_sock, NULL, NULL);
+        if(sock < 0) {
+            if(errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+                continue;
+            }
+            break;  // listen sock shut down
+        }
+
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        __atomic_add_fetch(&m->accepted, 1, __ATOMIC_RELAXED);
+
+        mock_conn* c = malloc(sizeof(mock_conn));
+        pthread_t thread;
+        if(!c) {
+            close(sock);
+            continue;
+        }
+        c->m = m;
+        c->sock = sock;
+        __atomic_add_fetch(&m->active, 1, __ATOMIC_RELAXED);
+        if(pthread_create(&thread, &attr, mock_conn_main, c) != 0) {
+            __atomic_sub_fetch(&m->active, 1, __ATOMIC_RELAXED);
+            close(sock);
+            free(c);
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+    return NULL;
+}
+
+mock_socks5* mock_socks5_start(const mock_socks5_opts* opts) {
+    mock_socks5* m = calloc(1, sizeof(mock_socks5));
+    if(!m) {
+        return NULL;
+    }
+    m->opts = *opts;
+    snprintf(m->uname, sizeof(m->uname), "%s", opts->uname ? opts->uname : "");
+    snprintf(m->passwd, sizeof(m->passwd), "%s", opts->passwd ? opts->passwd : "");
+
+    m->listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(m->listen_sock < 0) {
+        free(m);
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(m->listen_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(opts->fastopen) {
+        int qlen = 1024;
+        setsockopt(m->listen_sock, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+    }
+
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(opts->port);
+
+    if(bind(m->listen_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+       listen(m->listen_sock, 1024) < 0 ||
+       getsockname(m->listen_sock, (struct sockaddr*)&addr, &len) < 0) {
+        close(m->listen_sock);
+        free(m);
+        return NULL;
+    }
+    m->port = ntohs(addr.sin_port);
+
+    if(pthread_create(&m->thread, NULL, mock_accept_main, m) != 0) {
+        close(m->listen_sock);
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+uint16_t mock_socks5_port(const mock_socks5* m) {
+    return m->port;
+}
+
+uint64_t mock_socks5_accepted(const mock_socks5* m) {
+    return __atomic_load_n(&m->accepted, __ATOMIC_RELAXED);
+}
+
+/* stop accepting and wait for open conns to be closed by their clients */
+void mock_socks5_stop(mock_socks5* m) {
+    if(!m) {
+        return;
+    }
+
+    shutdown(m->listen_sock, SHUT_RDWR);
+    pthread_join(m->thread, NULL);
+    close(m->listen_sock);
+
+    while(__atomic_load_n(&m->active, __ATOMIC_ACQUIRE) > 0) {
+        usleep(1000);
+    }
+    free(m);
+}
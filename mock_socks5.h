@@ -0,0 +1,28 @@
+#ifndef MOCK_SOCKS5_H
+#define MOCK_SOCKS5_H
+
+#include <stdint.h>
+
+/* in-process SOCKS5 server for benchmarks. speaks no-auth and
+ * uname/passwd, answers CONNECT for a domain "rep<N>..." with reply
+ * code N and everything else with success, then echoes data back.
+ * Tor's RESOLVE and RESOLVE_PTR get made up answers, UDP ASSOCIATE a
+ * loopback relay that echoes datagrams to their sender */
+
+typedef struct mock_socks5_opts {
+    uint16_t port;          // 0 picks a free port
+    int require_auth;       // only offer uname/passwd
+    const char* uname;
+    const char* passwd;
+    int delay_us;           // injected before every reply
+    int fastopen;           // take data in the SYN, needs net.ipv4.tcp_fastopen & 2
+} mock_socks5_opts;
+
+typedef struct mock_socks5 mock_socks5;
+
+mock_socks5* mock_socks5_start(const mock_socks5_opts* opts);
+uint16_t mock_socks5_port(const mock_socks5* m);
+uint64_t mock_socks5_accepted(const mock_socks5* m);
+void mock_socks5_stop(mock_socks5* m);
+
+#endif // MOCK_SOCKS5_H
@@ -0,0 +1,55 @@
+#include "rcu.h"
+#include <pthread.h>
+#include <time.h>
+
+/* readers in each phase, a cache line per slot so threads on different
+ * slots never share one */
+typedef struct rcu_slot {
+    long readers[2];
+} __attribute__((aligned(64))) rcu_slot;
+
+static rcu_slot rcu_slots[RCU_SLOTS];
+static int rcu_phase;
+static int rcu_next_slot;
+static __thread int rcu_slot_idx = -1;
+static pthread_mutex_t rcu_sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int rcu_read_lock(void) {
+    if(rcu_slot_idx < 0) {
+        rcu_slot_idx = __atomic_fetch_add(&rcu_next_slot, 1, __ATOMIC_RELAXED) % RCU_SLOTS;
+    }
+
+    int phase = __atomic_load_n(&rcu_phase, __ATOMIC_RELAXED) & 1;
+    // full barrier, the protected pointer is loaded after we are counted
+    __atomic_add_fetch(&rcu_slots[rcu_slot_idx].readers[phase], 1, __ATOMIC_SEQ_CST);
+    return phase;
+}
+
+void rcu_read_unlock(int phase) {
+    __atomic_sub_fetch(&rcu_slots[rcu_slot_idx].readers[phase], 1, __ATOMIC_RELEASE);
+}
+
+static long rcu_readers(int phase) {
+    long n = 0;
+    for(int i = 0; i < RCU_SLOTS; i++) {
+        n += __atomic_load_n(&rcu_slots[i].readers[phase], __ATOMIC_ACQUIRE);
+    }
+    return n;
+}
+
+/* new readers go to the other phase, the old one drains. twice, since a
+ * reader that picked its phase just before the first flip is counted in
+ * the phase the second flip waits for */
+void rcu_synchronize(void) {
+    struct timespec ts = {0, 1000000};
+
+    pthread_mutex_lock(&rcu_sync_mutex);
+    for(int i = 0; i < 2; i++) {
+        int old = __atomic_load_n(&rcu_phase, __ATOMIC_RELAXED) & 1;
+        __atomic_store_n(&rcu_phase, old ^ 1, __ATOMIC_SEQ_CST);
+        while(rcu_readers(old) != 0) {
+            nanosleep(&ts, NULL);
+        }
+    }
+    pthread_mutex_unlock(&rcu_sync_mutex);
+}
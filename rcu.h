@@ -0,0 +1,16 @@
+#ifndef RCU_H
+#define RCU_H
+
+/* read side sections for data published through one pointer. readers
+ * only bump a counter in their thread's slot, the updater swaps the
+ * pointer, waits in rcu_synchronize for every section that could still
+ * see the old one to end, then frees it. sections may nest and block */
+
+/* threads share slots round-robin beyond this many */
+#define RCU_SLOTS 64
+
+int rcu_read_lock(void);            // returns the phase for unlock
+void rcu_read_unlock(int phase);
+void rcu_synchronize(void);
+
+#endif // RCU_H
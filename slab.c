@@ -0,0 +1,192 @@
+#include "slab.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+/* objects keep max_align_t alignment, a chunk's start has it */
+#define SLAB_ALIGN 16
+
+typedef struct slab_local {
+    void* head;
+    int cnt;
+} slab_local;
+
+static struct {
+    slab_cache* caches[SLAB_MAX_CACHES];
+    int count;
+    pthread_mutex_t mutex;      // guards count, caches only grow
+    pthread_key_t key;
+    pthread_once_t once;
+} slab = {
+    .count = 0,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT
+};
+
+static __thread slab_local slab_locals[SLAB_MAX_CACHES];
+static __thread int slab_registered;
+
+static size_t slab_stride(const slab_cache* c) {
+    size_t size = c->size < sizeof(void*) ? sizeof(void*) : c->size;
+    return (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+}
+
+/* move n objects from the front of l to the shared list of c */
+static void slab_give(slab_cache* c, slab_local* l, int n) {
+    if(n <= 0 || !l->head) {
+        return;
+    }
+
+    void* first = l->head;
+    void* last = first;
+    int moved = 1;
+    while(moved < n && *(void**)last) {
+        last = *(void**)last;
+        moved++;
+    }
+    l->head = *(void**)last;
+    l->cnt -= moved;
+
+    pthread_mutex_lock(&c->mutex);
+    *(void**)last = c->shared;
+    c->shared = first;
+    c->shared_cnt += moved;
+    pthread_mutex_unlock(&c->mutex);
+}
+
+/* thread exit, what it still holds goes to the shared lists */
+static void slab_release_locals(void* arg) {
+    slab_local* locals = arg;
+    int count = __atomic_load_n(&slab.count, __ATOMIC_ACQUIRE);
+
+    for(int i = 0; i < count; i++) {
+        slab_give(slab.caches[i], &locals[i], locals[i].cnt);
+    }
+}
+
+/* a forked child has only the forking thread, no shared list may be
+ * left locked by one that is gone */
+static void slab_fork_prepare(void) {
+    pthread_mutex_lock(&slab.mutex);
+    for(int i = 0; i < slab.count; i++) {
+        pthread_mutex_lock(&slab.caches[i]->mutex);
+    }
+}
+
+static void slab_fork_parent(void) {
+    for(int i = slab.count - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&slab.caches[i]->mutex);
+    }
+    pthread_mutex_unlock(&slab.mutex);
+}
+
+static void slab_init(void) {
+    pthread_key_create(&slab.key, slab_release_locals);
+    pthread_atfork(slab_fork_prepare, slab_fork_parent, slab_fork_parent);
+}
+
+/* this thread's list for c, NULL when c didn't get one */
+static slab_local* slab_local_get(slab_cache* c) {
+    int id = __atomic_load_n(&c->id, __ATOMIC_ACQUIRE);
+    if(id < 0) {
+        pthread_once(&slab.once, slab_init);
+        pthread_mutex_lock(&slab.mutex);
+        id = c->id;
+        if(id < 0 && slab.count < SLAB_MAX_CACHES) {
+            id = slab.count;
+            slab.caches[id] = c;
+            __atomic_store_n(&slab.count, id + 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&c->id, id, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&slab.mutex);
+        if(id < 0) {
+            return NULL;
+        }
+    }
+
+    if(!slab_registered) {
+        pthread_once(&slab.once, slab_init);
+        pthread_setspecific(slab.key, slab_locals);
+        slab_registered = 1;
+    }
+    return &slab_locals[id];
+}
+
+/* half a local list from the shared one, or a new chunk */
+static void slab_refill(slab_cache* c, slab_local* l) {
+    pthread_mutex_lock(&c->mutex);
+    if(c->shared) {
+        void* last = c->shared;
+        int n = 1;
+        while(n < SLAB_LOCAL_MAX / 2 && *(void**)last) {
+            last = *(void**)last;
+            n++;
+        }
+        l->head = c->shared;
+        l->cnt = n;
+        c->shared = *(void**)last;
+        c->shared_cnt -= n;
+        *(void**)last = NULL;
+        pthread_mutex_unlock(&c->mutex);
+        return;
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    char* chunk = malloc(SLAB_CHUNK);
+    if(!chunk) {
+        return;
+    }
+    __atomic_add_fetch(&c->chunks, 1, __ATOMIC_RELAXED);
+
+    size_t stride = slab_stride(c);
+    int n = SLAB_CHUNK / stride;
+    for(int i = n - 1; i >= 0; i--) {
+        void* p = chunk + i * stride;
+        *(void**)p = l->head;
+        l->head = p;
+    }
+    l->cnt += n;
+}
+
+void* slab_alloc(slab_cache* c) {
+    slab_local* l = slab_local_get(c);
+    if(!l) {
+        return malloc(c->size);
+    }
+
+    if(!l->head) {
+        slab_refill(c, l);
+        if(!l->head) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    void* p = l->head;
+    l->head = *(void**)p;
+    l->cnt--;
+    return p;
+}
+
+/* p may come from another thread's list, it joins this one's */
+void slab_free(slab_cache* c, void* p) {
+    if(!p) {
+        return;
+    }
+
+    slab_local* l = slab_local_get(c);
+    if(!l) {
+        free(p);
+        return;
+    }
+
+    *(void**)p = l->head;
+    l->head = p;
+    l->cnt++;
+    if(l->cnt > SLAB_LOCAL_MAX) {
+        slab_give(c, l, SLAB_LOCAL_MAX / 2);
+    }
+}
+
+size_t slab_reserved(const slab_cache* c) {
+    return __atomic_load_n(&c->chunks, __ATOMIC_RELAXED) * SLAB_CHUNK;
+}
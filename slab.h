@@ -0,0 +1,41 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* fixed size objects carved out of SLAB_CHUNK sized chunks. each thread
+ * allocates from and frees to a list of its own, no lock and no malloc
+ * per object. a list past SLAB_LOCAL_MAX hands half of it to the cache's
+ * shared list, which refills threads that run dry, and a thread's list
+ * goes there when it exits. chunks are never given back */
+
+#define SLAB_CHUNK      (64 * 1024)
+#define SLAB_LOCAL_MAX  256
+
+/* caches per process, each one gets a per thread list */
+#define SLAB_MAX_CACHES 4
+
+typedef struct slab_cache {
+    size_t size;
+    int id;                 // of the per thread list, -1 until first use
+    pthread_mutex_t mutex;  // guards the shared list
+    void* shared;           // free objects linked through their first word
+    int shared_cnt;
+    size_t chunks;
+} slab_cache;
+
+#define SLAB_CACHE_INIT(obj_size) { \
+    .size = (obj_size), \
+    .id = -1, \
+    .mutex = PTHREAD_MUTEX_INITIALIZER, \
+    .shared = NULL, \
+    .shared_cnt = 0, \
+    .chunks = 0 \
+}
+
+void* slab_alloc(slab_cache* c);    // uninitialized, NULL with errno ENOMEM
+void slab_free(slab_cache* c, void* p);
+size_t slab_reserved(const slab_cache* c);   // bytes in chunks
+
+#endif // SLAB_H
@@ -0,0 +1,212 @@
+#include "sock_table.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+
+/* directory of chunk pointers indexed by fd / SOCK_TABLE_CHUNK. replaced
+ * by a bigger copy when an fd past the end shows up, old copies stay
+ * around until destroy since lock-free readers may still hold them */
+struct sock_dir {
+    uint32_t size;
+    struct sock_dir* retired;
+    managed_sock* chunks[];
+};
+
+static struct {
+    struct sock_dir* dir;
+    void (*release)(managed_sock* s);
+    pthread_mutex_t mutex;      // growth and chunk allocation only
+} table = {
+    .dir = NULL,
+    .release = NULL,
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static struct sock_dir* sock_dir_alloc(uint32_t size, struct sock_dir* old) {
+    struct sock_dir* d = calloc(1, sizeof(struct sock_dir) + size * sizeof(managed_sock*));
+    if(!d) {
+        return NULL;
+    }
+    d->size = size;
+    d->retired = old;
+    if(old) {
+        memcpy(d->chunks, old->chunks, old->size * sizeof(managed_sock*));
+    }
+    return d;
+}
+
+int sock_table_init(void (*release)(managed_sock* s)) {
+    struct rlimit rl;
+    uint64_t fds = 1024;
+
+    /* size for the soft limit up front, anything above grows on demand */
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        fds = rl.rlim_cur;
+    }
+    if(fds > (1u << 24)) {
+        fds = 1u << 24;
+    }
+
+    pthread_mutex_lock(&table.mutex);
+    if(table.dir) {
+        pthread_mutex_unlock(&table.mutex);
+        return 0;
+    }
+
+    struct sock_dir* d = sock_dir_alloc((fds + SOCK_TABLE_CHUNK - 1) / SOCK_TABLE_CHUNK, NULL);
+    if(!d) {
+        pthread_mutex_unlock(&table.mutex);
+        return -1;
+    }
+    table.release = release;
+    __atomic_store_n(&table.dir, d, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&table.mutex);
+    return 0;
+}
+
+void sock_table_destroy(void) {
+    pthread_mutex_lock(&table.mutex);
+    struct sock_dir* d = table.dir;
+    __atomic_store_n(&table.dir, NULL, __ATOMIC_RELEASE);
+
+    if(d) {
+        for(uint32_t c = 0; c < d->size; c++) {
+            managed_sock* chunk = d->chunks[c];
+            if(!chunk) {
+                continue;
+            }
+            for(int i = 0; i < SOCK_TABLE_CHUNK; i++) {
+                if((chunk[i].state & 1) && table.release) {
+                    table.release(&chunk[i]);
+                }
+            }
+            free(chunk);
+        }
+    }
+
+    while(d) {
+        struct sock_dir* next = d->retired;
+        free(d);
+        d = next;
+    }
+    pthread_mutex_unlock(&table.mutex);
+}
+
+/* lock-free: one load for the directory, one for the chunk, one for the
+ * slot state. unmanaged fds in never touched chunks stop at the second */
+managed_sock* sock_table_find(int fd) {
+    if(fd < 0) {
+        return NULL;
+    }
+
+    struct sock_dir* d = __atomic_load_n(&table.dir, __ATOMIC_ACQUIRE);
+    uint32_t c = (uint32_t)fd / SOCK_TABLE_CHUNK;
+    if(!d || c >= d->size) {
+        return NULL;
+    }
+
+    managed_sock* chunk = __atomic_load_n(&d->chunks[c], __ATOMIC_ACQUIRE);
+    if(!chunk) {
+        return NULL;
+    }
+
+    managed_sock* s = &chunk[fd % SOCK_TABLE_CHUNK];
+    return (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) & 1) ? s : NULL;
+}
+
+/* slot for fd, growing the directory and allocating its chunk if needed */
+static managed_sock* sock_table_slot(int fd) {
+    uint32_t c = (uint32_t)fd / SOCK_TABLE_CHUNK;
+    struct sock_dir* d = __atomic_load_n(&table.dir, __ATOMIC_ACQUIRE);
+
+    if(d && c < d->size) {
+        managed_sock* chunk = __atomic_load_n(&d->chunks[c], __ATOMIC_ACQUIRE);
+        if(chunk) {
+            return &chunk[fd % SOCK_TABLE_CHUNK];
+        }
+    }
+
+    pthread_mutex_lock(&table.mutex);
+    d = table.dir;
+    if(!d) {
+        pthread_mutex_unlock(&table.mutex);
+        return NULL;
+    }
+
+    if(c >= d->size) {
+        uint32_t size = d->size ? d->size : 1;
+        while(size <= c) {
+            size *= 2;
+        }
+        struct sock_dir* nd = sock_dir_alloc(size, d);
+        if(!nd) {
+            pthread_mutex_unlock(&table.mutex);
+            return NULL;
+        }
+        __atomic_store_n(&table.dir, nd, __ATOMIC_RELEASE);
+        d = nd;
+    }
+
+    managed_sock* chunk = d->chunks[c];
+    if(!chunk) {
+        chunk = calloc(SOCK_TABLE_CHUNK, sizeof(managed_sock));
+        if(!chunk) {
+            pthread_mutex_unlock(&table.mutex);
+            return NULL;
+        }
+        __atomic_store_n(&d->chunks[c], chunk, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&table.mutex);
+
+    return &chunk[fd % SOCK_TABLE_CHUNK];
+}
+
+/* register fd and return its slot locked with fields reset. a slot still
+ * in use means the fd was closed behind our back, its old state is
+ * released first */
+managed_sock* sock_table_insert(int fd) {
+    if(fd < 0) {
+        return NULL;
+    }
+
+    managed_sock* s = sock_table_slot(fd);
+    if(!s) {
+        return NULL;
+    }
+
+    sock_table_lock(s);
+    uint32_t state = s->state;
+    if((state & 1) && table.release) {
+        table.release(s);
+    }
+
+    memset((char*)s + offsetof(managed_sock, og_fd), 0, sizeof(managed_sock) - offsetof(managed_sock, og_fd));
+    s->og_fd = fd;
+    s->ep_fd = -1;
+    __atomic_store_n(&s->state, (((state >> 1) + 1) << 1) | 1, __ATOMIC_RELEASE);
+    return s;
+}
+
+/* unregister, caller holds the slot lock. fails if the slot was removed
+ * or re-registered since gen was read */
+int sock_table_remove(managed_sock* s, uint32_t gen) {
+    uint32_t state = s->state;
+    if(!(state & 1) || (state >> 1) != gen) {
+        return -1;
+    }
+    __atomic_store_n(&s->state, (gen + 1) << 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void sock_table_lock(managed_sock* s) {
+    while(__atomic_exchange_n(&s->lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+void sock_table_unlock(managed_sock* s) {
+    __atomic_store_n(&s->lock, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,52 @@
+#ifndef SOCK_TABLE_H
+#define SOCK_TABLE_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include "socks5_proto.h"
+#include "socks5_client.h"
+
+struct upstream;
+struct socks5_udp_relay;
+struct dest_stats;
+
+/* fds per lazily allocated chunk of the table */
+#define SOCK_TABLE_CHUNK 256
+
+/* state of an fd toralize has seen in connect() */
+typedef struct managed_sock {
+    uint32_t state;     // (gen << 1) | in use, owned by sock_table
+    int lock;           // guards the fields below once published
+    int og_fd;
+    socks5_ctx* ctx;
+    int through_tor;
+    char* dest_host;    // strdup()ed for the debug log, NULL unless it is on
+    uint16_t dest_port;
+    int pending;        // non-blocking handshake in progress
+    int want;           // SOCKS5_WANT_* of the pending handshake
+    struct upstream* upstream;  // carrying the pending handshake
+    uint64_t start_us;  // handshake start, ttfb counts from it too
+    int so_error;       // reported through getsockopt(SO_ERROR)
+    int buffered;       // ctx holds bytes read past the CONNECT reply
+    int ep_fd;          // app epoll registration, held back while pending
+    uint32_t ep_events;
+    epoll_data_t ep_data;
+    struct socks5_udp_relay* relay;    // UDP association, its ctx is the control conn
+    struct dest_stats* dest;    // traffic aggregate of a Tor conn
+    int got_data;       // first byte reached the app, ttfb recorded
+} managed_sock;
+
+int sock_table_init(void (*release)(managed_sock* s));
+void sock_table_destroy(void);
+managed_sock* sock_table_find(int fd);
+managed_sock* sock_table_insert(int fd);
+int sock_table_remove(managed_sock* s, uint32_t gen);
+void sock_table_lock(managed_sock* s);
+void sock_table_unlock(managed_sock* s);
+
+/* generation of a slot, changes whenever the fd is registered or removed */
+static inline uint32_t sock_table_gen(const managed_sock* s) {
+    return __atomic_load_n(&s->state, __ATOMIC_ACQUIRE) >> 1;
+}
+
+#endif // SOCK_TABLE_H
@@ -0,0 +1,604 @@
+#include "socks5_batch.h"
+#include "socks5_stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define BATCH_DEPTH     256
+#define BATCH_EVENTS    64
+
+enum {
+    ITEM_QUEUED = 0,
+    ITEM_RUNNING,
+    ITEM_DONE,
+    ITEM_FAILED
+};
+
+typedef struct batch_item {
+    socks5_ctx* ctx;
+    char* host;
+    uint16_t port;
+    int state;
+    int sock;
+    int inflight;       // io_uring ops not completed yet
+    int expired;        // deadline passed, completions are dropped
+    uint64_t done_us;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    struct msghdr msg;
+    socks5_io io;
+} batch_item;
+
+#ifdef HAVE_LINUX_IO_URING_H
+/* user_data is idx << 2 | op, the timer uses the two top values */
+enum {
+    OP_CONNECT = 0,
+    OP_SEND,
+    OP_RECV,
+    OP_CANCEL
+};
+#define OP_TIMER        UINT64_MAX
+#define OP_TIMER_REMOVE (UINT64_MAX - 1)
+
+typedef struct batch_ring {
+    int fd;
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_queued;     // local tail, published on submit
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+    struct __kernel_timespec deadline;
+    int timer_armed;
+    int cancels;            // cancel ops not completed yet
+} batch_ring;
+#endif
+
+struct socks5_batch {
+    int backend;
+    int depth;
+    batch_item* items;
+    int cnt;
+    int cap;
+    int next;           // first item not run yet
+    int epfd;
+#ifdef HAVE_LINUX_IO_URING_H
+    batch_ring ring;
+#endif
+};
+
+static void batch_settle(batch_item* it, int ok) {
+    it->state = ok ? ITEM_DONE : ITEM_FAILED;
+    it->done_us = socks5_stats_now();
+    if(!ok) {
+        it->sock = -1;
+    }
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+static void ring_unmap(batch_ring* r) {
+    if(r->sqes && r->sqes != MAP_FAILED) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if(r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+    if(r->sq_ptr && r->sq_ptr != MAP_FAILED) {
+        munmap(r->sq_ptr, r->sq_size);
+    }
+    if(r->fd >= 0) {
+        close(r->fd);
+    }
+    r->fd = -1;
+}
+
+/* raw setup, no liburing. needs fast poll (5.7) so socket ops wait on
+ * readiness instead of blocking a kernel worker each */
+static int ring_setup(batch_ring* r, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(batch_ring));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;     // every op in flight plus timer and cancels fits
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(r->fd < 0) {
+        return -1;
+    }
+    if(!(p.features & IORING_FEAT_FAST_POLL)) {
+        ring_unmap(r);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(r->cq_size > r->sq_size) {
+            r->sq_size = r->cq_size;
+        }
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_ptr == MAP_FAILED) {
+        ring_unmap(r);
+        return -1;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    }
+    else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if(r->cq_ptr == MAP_FAILED) {
+            ring_unmap(r);
+            return -1;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED) {
+        ring_unmap(r);
+        return -1;
+    }
+
+    char* sq = r->sq_ptr;
+    char* cq = r->cq_ptr;
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->sq_queued = *r->sq_tail;
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static unsigned ring_space(batch_ring* r) {
+    return r->sq_entries - (r->sq_queued - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/* caller checked ring_space */
+static struct io_uring_sqe* ring_sqe(batch_ring* r, int opcode, int fd, uint64_t data) {
+    unsigned idx = r->sq_queued & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = data;
+    r->sq_array[idx] = idx;
+    r->sq_queued++;
+    return sqe;
+}
+
+/* submit everything queued, wait for at least wait completions */
+static int ring_enter(batch_ring* r, unsigned wait) {
+    __atomic_store_n(r->sq_tail, r->sq_queued, __ATOMIC_RELEASE);
+
+    for(;;) {
+        unsigned pending = r->sq_queued - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        int ret = syscall(__NR_io_uring_enter, r->fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(ret >= 0 || errno != EINTR) {
+            return ret;
+        }
+    }
+}
+
+static uint64_t op_data(int idx, int op) {
+    return ((uint64_t)idx << 2) | op;
+}
+
+/* queue what the handshake waits for: write linked to the read behind
+ * it, or the read alone. link makes the read wait for the write */
+static int uring_queue_io(socks5_batch* b, int idx) {
+    batch_item* it = &b->items[idx];
+    int want = socks5_io_prepare(it->ctx, &it->io);
+
+    if(want <= 0) {
+        return want;
+    }
+    if(it->io.send_cnt) {
+        memset(&it->msg, 0, sizeof(it->msg));
+        it->msg.msg_iov = it->io.send;
+        it->msg.msg_iovlen = it->io.send_cnt;
+
+        struct io_uring_sqe* sqe = ring_sqe(&b->ring, IORING_OP_SENDMSG, it->sock, op_data(idx, OP_SEND));
+        sqe->addr = (uintptr_t)&it->msg;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->flags = IOSQE_IO_LINK;
+        it->inflight++;
+    }
+
+    struct io_uring_sqe* sqe = ring_sqe(&b->ring, IORING_OP_RECV, it->sock, op_data(idx, OP_RECV));
+    sqe->addr = (uintptr_t)it->io.recv_buf;
+    sqe->len = it->io.recv_len;
+    it->inflight++;
+    return want;
+}
+
+/* connect -> send -> recv as one chain, a failing op cancels the rest */
+static void uring_start(socks5_batch* b, int idx) {
+    batch_item* it = &b->items[idx];
+
+    it->sock = socks5_connect_prepare(it->ctx, it->host, it->port, &it->addr, &it->addr_len);
+    if(it->sock < 0) {
+        batch_settle(it, 0);
+        return;
+    }
+    it->state = ITEM_RUNNING;
+
+    if(it->addr_len) {
+        struct io_uring_sqe* sqe = ring_sqe(&b->ring, IORING_OP_CONNECT, it->sock, op_data(idx, OP_CONNECT));
+        sqe->addr = (uintptr_t)&it->addr;
+        sqe->off = it->addr_len;
+        sqe->flags = IOSQE_IO_LINK;
+        it->inflight++;
+    }
+    if(uring_queue_io(b, idx) < 0) {
+        socks5_io_cancel(it->ctx, EINVAL);
+        batch_settle(it, 0);
+    }
+}
+
+static void uring_complete(socks5_batch* b, int idx, int op, int res) {
+    batch_item* it = &b->items[idx];
+    int ret;
+
+    if(op == OP_CANCEL) {
+        b->ring.cancels--;
+        return;
+    }
+    it->inflight--;
+    if(it->state != ITEM_RUNNING || it->expired) {
+        return;
+    }
+
+    // -ECANCELED is the rest of a chain broken by a short write
+    if(op == OP_CONNECT && res < 0 && res != -ECANCELED) {
+        socks5_io_cancel(it->ctx, -res);
+        batch_settle(it, 0);
+        return;
+    }
+    if(op != OP_CONNECT && res != -ECANCELED) {
+        ret = op == OP_SEND ? socks5_io_sent(it->ctx, res) : socks5_io_received(it->ctx, res);
+        if(ret <= 0) {
+            batch_settle(it, ret == 0);
+            return;
+        }
+    }
+
+    // what is left is queued again once the last op of the chain is back
+    if(it->inflight == 0 && uring_queue_io(b, idx) < 0) {
+        socks5_io_cancel(it->ctx, EINVAL);
+        batch_settle(it, 0);
+    }
+}
+
+/* deadline passed: cancel the ops of everything still running */
+static void uring_expire(socks5_batch* b, int first, int last) {
+    batch_ring* r = &b->ring;
+
+    for(int i = first; i < last; i++) {
+        batch_item* it = &b->items[i];
+        if(it->state != ITEM_RUNNING || it->expired) {
+            continue;
+        }
+        it->expired = 1;
+        for(int op = OP_CONNECT; op <= OP_RECV; op++) {
+            if(ring_space(r) == 0) {
+                ring_enter(r, 0);
+            }
+            struct io_uring_sqe* sqe = ring_sqe(r, IORING_OP_ASYNC_CANCEL, -1, op_data(i, OP_CANCEL));
+            sqe->addr = op_data(i, op);
+            r->cancels++;
+        }
+    }
+}
+
+static int uring_run(socks5_batch* b, int first, int last, int timeout_ms) {
+    batch_ring* r = &b->ring;
+    int next = first;
+    int active = 0;
+
+    if(timeout_ms > 0) {
+        r->deadline.tv_sec = timeout_ms / 1000;
+        r->deadline.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        struct io_uring_sqe* sqe = ring_sqe(r, IORING_OP_TIMEOUT, -1, OP_TIMER);
+        sqe->addr = (uintptr_t)&r->deadline;
+        sqe->len = 1;
+        r->timer_armed = 1;
+    }
+
+    for(;;) {
+        while(next < last && active < b->depth && ring_space(r) >= 3) {
+            uring_start(b, next);
+            active += b->items[next].state == ITEM_RUNNING;
+            next++;
+        }
+
+        int busy = active > 0 || r->cancels > 0;
+        if(!busy && next >= last) {
+            break;
+        }
+        if(ring_enter(r, busy ? 1 : 0) < 0 && errno != EBUSY) {
+            return -1;
+        }
+
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++) {
+            struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+            if(cqe->user_data == OP_TIMER) {
+                r->timer_armed = 0;
+                uring_expire(b, first, next);
+                next = last;    // nothing new once the deadline passed
+                continue;
+            }
+            if(cqe->user_data == OP_TIMER_REMOVE) {
+                continue;
+            }
+
+            int idx = cqe->user_data >> 2;
+            batch_item* it = &b->items[idx];
+            int was_running = it->state == ITEM_RUNNING;
+            uring_complete(b, idx, cqe->user_data & 3, cqe->res);
+
+            if(it->expired && it->inflight == 0 && it->state == ITEM_RUNNING) {
+                socks5_io_cancel(it->ctx, ETIMEDOUT);
+                batch_settle(it, 0);
+            }
+            if(was_running && it->state != ITEM_RUNNING) {
+                active--;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // items never started because of the deadline
+    for(int i = first; i < last; i++) {
+        if(b->items[i].state == ITEM_QUEUED) {
+            socks5_io_cancel(b->items[i].ctx, ETIMEDOUT);
+            batch_settle(&b->items[i], 0);
+        }
+    }
+
+    if(r->timer_armed) {
+        struct io_uring_sqe* sqe = ring_sqe(r, IORING_OP_TIMEOUT_REMOVE, -1, OP_TIMER_REMOVE);
+        sqe->addr = OP_TIMER;
+        // both the removal and the cancelled timer complete
+        if(ring_enter(r, 2) >= 0) {
+            unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+            __atomic_store_n(r->cq_head, tail, __ATOMIC_RELEASE);
+        }
+        r->timer_armed = 0;
+    }
+    return 0;
+}
+#endif
+
+static int epoll_watch(socks5_batch* b, int op, int sock, int want, int idx) {
+    struct epoll_event ev;
+    ev.events = want == SOCKS5_WANT_READ ? EPOLLIN : EPOLLOUT;
+    ev.data.u32 = idx;
+    return epoll_ctl(b->epfd, op, sock, &ev);
+}
+
+static int epoll_run(socks5_batch* b, int first, int last, int timeout_ms) {
+    struct epoll_event evs[BATCH_EVENTS];
+    uint64_t deadline = timeout_ms > 0 ? socks5_stats_now() + (uint64_t)timeout_ms * 1000 : 0;
+    int next = first;
+    int active = 0;
+
+    for(;;) {
+        while(next < last && active < b->depth) {
+            batch_item* it = &b->items[next];
+            it->sock = socks5_connect_start(it->ctx, it->host, it->port);
+            if(it->sock < 0) {
+                batch_settle(it, 0);
+            }
+            else if(epoll_watch(b, EPOLL_CTL_ADD, it->sock, SOCKS5_WANT_WRITE, next) < 0) {
+                socks5_io_cancel(it->ctx, errno);
+                batch_settle(it, 0);
+            }
+            else {
+                it->state = ITEM_RUNNING;
+                active++;
+            }
+            next++;
+        }
+        if(active == 0 && next >= last) {
+            break;
+        }
+
+        int wait = -1;
+        if(deadline) {
+            uint64_t now = socks5_stats_now();
+            if(now >= deadline) {
+                break;
+            }
+            wait = (int)((deadline - now + 999) / 1000);
+        }
+        int n = epoll_wait(b->epfd, evs, BATCH_EVENTS, wait);
+        if(n < 0 && errno != EINTR) {
+            return -1;
+        }
+
+        for(int i = 0; i < n; i++) {
+            int idx = evs[i].data.u32;
+            batch_item* it = &b->items[idx];
+            int ret = socks5_connect_step(it->ctx);
+
+            if(ret > 0) {
+                epoll_watch(b, EPOLL_CTL_MOD, it->sock, ret, idx);
+                continue;
+            }
+            if(ret == 0) {
+                epoll_ctl(b->epfd, EPOLL_CTL_DEL, it->sock, NULL);
+            }
+            batch_settle(it, ret == 0);     // a failed one is closed, which unregisters it
+            active--;
+        }
+    }
+
+    // past the deadline
+    for(int i = first; i < last; i++) {
+        batch_item* it = &b->items[i];
+        if(it->state == ITEM_RUNNING) {
+            epoll_ctl(b->epfd, EPOLL_CTL_DEL, it->sock, NULL);
+        }
+        if(it->state == ITEM_RUNNING || it->state == ITEM_QUEUED) {
+            socks5_io_cancel(it->ctx, ETIMEDOUT);
+            batch_settle(it, 0);
+        }
+    }
+    return 0;
+}
+
+socks5_batch* socks5_batch_create(int backend, int depth) {
+    socks5_batch* b = calloc(1, sizeof(socks5_batch));
+    if(!b) {
+        return NULL;
+    }
+    b->depth = depth > 0 ? depth : BATCH_DEPTH;
+    b->epfd = -1;
+
+#ifdef HAVE_LINUX_IO_URING_H
+    b->ring.fd = -1;
+    if(backend != SOCKS5_BATCH_EPOLL) {
+        // sq room for the chains of a full window started at once
+        if(ring_setup(&b->ring, b->depth * 3) == 0) {
+            b->backend = SOCKS5_BATCH_URING;
+            return b;
+        }
+        if(backend == SOCKS5_BATCH_URING) {
+            free(b);
+            return NULL;
+        }
+    }
+#else
+    if(backend == SOCKS5_BATCH_URING) {
+        free(b);
+        errno = ENOSYS;
+        return NULL;
+    }
+#endif
+
+    b->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(b->epfd < 0) {
+        free(b);
+        return NULL;
+    }
+    b->backend = SOCKS5_BATCH_EPOLL;
+    return b;
+}
+
+int socks5_batch_backend(const socks5_batch* b) {
+    return b ? b->backend : -1;
+}
+
+int socks5_batch_add(socks5_batch* b, socks5_ctx* ctx, const char* host, uint16_t port) {
+    if(!b || !ctx || !host) {
+        return -1;
+    }
+
+    if(b->cnt == b->cap) {
+        int cap = b->cap ? b->cap * 2 : 64;
+        batch_item* items = realloc(b->items, sizeof(batch_item) * cap);
+        if(!items) {
+            return -1;
+        }
+        b->items = items;
+        b->cap = cap;
+    }
+
+    batch_item* it = &b->items[b->cnt];
+    memset(it, 0, sizeof(batch_item));
+    it->host = strdup(host);
+    if(!it->host) {
+        return -1;
+    }
+    it->ctx = ctx;
+    it->port = port;
+    it->sock = -1;
+    return b->cnt++;
+}
+
+int socks5_batch_run(socks5_batch* b, int timeout_ms) {
+    if(!b) {
+        return -1;
+    }
+
+    int first = b->next;
+    int ret;
+    b->next = b->cnt;
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if(b->backend == SOCKS5_BATCH_URING) {
+        ret = uring_run(b, first, b->cnt, timeout_ms);
+    }
+    else
+#endif
+    ret = epoll_run(b, first, b->cnt, timeout_ms);
+    if(ret < 0) {
+        return -1;
+    }
+
+    int ok = 0;
+    for(int i = first; i < b->cnt; i++) {
+        ok += b->items[i].state == ITEM_DONE;
+    }
+    return ok;
+}
+
+int socks5_batch_result(const socks5_batch* b, int idx, uint64_t* done_us) {
+    if(!b || idx < 0 || idx >= b->cnt) {
+        return -1;
+    }
+    if(done_us) {
+        *done_us = b->items[idx].done_us;
+    }
+    return b->items[idx].state == ITEM_DONE ? b->items[idx].sock : -1;
+}
+
+void socks5_batch_free(socks5_batch* b) {
+    if(!b) {
+        return;
+    }
+
+    for(int i = 0; i < b->cnt; i++) {
+        free(b->items[i].host);
+    }
+    free(b->items);
+    if(b->epfd >= 0) {
+        close(b->epfd);
+    }
+#ifdef HAVE_LINUX_IO_URING_H
+    if(b->ring.fd >= 0) {
+        ring_unmap(&b->ring);
+    }
+#endif
+    free(b);
+}
@@ -0,0 +1,30 @@
+#ifndef SOCKS5_BATCH_H
+#define SOCKS5_BATCH_H
+
+#include <stdint.h>
+#include "socks5_client.h"
+
+/* many handshakes at once from one thread. on io_uring the proxy connect,
+ * handshake write and reply read of each ctx go out as one linked chain,
+ * submitted in batches and reaped by a single completion loop. without
+ * io_uring, the same is driven by epoll and socks5_connect_step */
+
+#define SOCKS5_BATCH_AUTO   0
+#define SOCKS5_BATCH_URING  1
+#define SOCKS5_BATCH_EPOLL  2
+
+typedef struct socks5_batch socks5_batch;
+
+/* depth caps the handshakes in flight, 0 for the default */
+socks5_batch* socks5_batch_create(int backend, int depth);
+int socks5_batch_backend(const socks5_batch* b);
+/* returns the index for socks5_batch_result */
+int socks5_batch_add(socks5_batch* b, socks5_ctx* ctx, const char* host, uint16_t port);
+/* runs everything added since the last run, returns the count connected */
+int socks5_batch_run(socks5_batch* b, int timeout_ms);
+/* the connected sock, still owned by its ctx, or -1 with the error in the
+ * ctx. done_us is the CLOCK_MONOTONIC time it settled */
+int socks5_batch_result(const socks5_batch* b, int idx, uint64_t* done_us);
+void socks5_batch_free(socks5_batch* b);
+
+#endif // SOCKS5_BATCH_H
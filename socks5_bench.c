@@ -0,0 +1,539 @@
+/* socks5_bench.c - socks5_connect against the in-process mock server:
+ * connections per second, handshake latency percentiles and echo
+ * throughput for each thread count. then a burst of -u conns opened at
+ * once, blocking one by one vs socks5_batch on epoll and io_uring, with
+ * the syscalls each took counted by a ptrace'd child. results are
+ * written to stdout as JSON, progress to stderr.
+ * -f connects to the proxy with TCP Fast Open, the mock accepting it,
+ * and counts how many handshakes went out in the SYN.
+ * usage: socks5_bench [-t 1,2,4,8] [-n conns] [-u burst] [-d delay_us] [-b bytes] [-a] [-p] [-f]
+ *        socks5_bench -s port [-d delay_us] [-a] [-f]    (only run the mock) */
+#include "socks5_client.h"
+#include "socks5_batch.h"
+#include "mock_socks5.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#define BENCH_UNAME     "bench"
+#define BENCH_PASSWD    "bench"
+#define BENCH_CHUNK     65536
+#define BENCH_MAX_RUNS  16
+#define BURST_TIMEOUT_MS 30000
+#define BURST_BLOCKING  -1
+
+typedef struct bench_opts {
+    int threads[BENCH_MAX_RUNS];
+    int runs;
+    int conns;              // per thread
+    int burst;              // conns opened at once, 0 skips the burst runs
+    long bytes;             // echoed per thread
+    int delay_us;
+    int auth;
+    int pipeline;
+    int fastopen;
+} bench_opts;
+
+typedef struct bench_thread {
+    const bench_opts* opts;
+    socks5_endpoint* ep;
+    pthread_barrier_t* start;
+    uint32_t* lat_us;       // one per successful connect
+    int ok;
+    int errors;
+    int tfo[3];             // connects by SOCKS5_TFO_* outcome
+    long bytes;
+} bench_thread;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static socks5_ctx* bench_ctx(const bench_opts* opts, socks5_endpoint* ep) {
+    socks5_ctx* ctx = socks5_create_ctx(socks5_endpoint_host(ep), socks5_endpoint_port(ep));
+    if(!ctx) {
+        return NULL;
+    }
+    socks5_set_endpoint(ctx, ep);
+    socks5_set_pipelining(ctx, opts->pipeline);
+    socks5_set_fastopen(ctx, opts->fastopen);
+    if(opts->auth) {
+        socks5_set_auth(ctx, BENCH_UNAME, BENCH_PASSWD);
+    }
+    return ctx;
+}
+
+/* reset instead of FIN so tens of thousands of closed conns do not use
+ * up the ephemeral ports in TIME_WAIT */
+static void bench_close(socks5_ctx* ctx, int sock) {
+    struct linger lin = {1, 0};
+    setsockopt(sock, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    socks5_close(ctx);
+}
+
+static void* bench_connect_main(void* arg) {
+    bench_thread* t = arg;
+    socks5_ctx* ctx = bench_ctx(t->opts, t->ep);
+
+    pthread_barrier_wait(t->start);
+    for(int i = 0; ctx && i < t->opts->conns; i++) {
+        uint64_t start = now_us();
+        int sock = socks5_connect(ctx, "bench.test", 80);
+        if(sock < 0) {
+            t->errors++;
+            continue;
+        }
+        t->lat_us[t->ok++] = (uint32_t)(now_us() - start);
+        t->tfo[socks5_get_fastopen(ctx)]++;
+        bench_close(ctx, sock);
+    }
+    socks5_free(ctx);
+    return NULL;
+}
+
+static void* bench_echo_main(void* arg) {
+    bench_thread* t = arg;
+    socks5_ctx* ctx = bench_ctx(t->opts, t->ep);
+    static char out[BENCH_CHUNK];
+    char in[BENCH_CHUNK];
+
+    int sock = ctx ? socks5_connect(ctx, "echo.test", 80) : -1;
+    pthread_barrier_wait(t->start);
+    if(sock < 0) {
+        t->errors++;
+        socks5_free(ctx);
+        return NULL;
+    }
+
+    while(t->bytes < t->opts->bytes) {
+        ssize_t n = send(sock, out, sizeof(out), MSG_NOSIGNAL);
+        if(n <= 0) {
+            t->errors++;
+            break;
+        }
+        for(ssize_t got = 0; got < n; ) {
+            ssize_t r = recv(sock, in, n - got, 0);
+            if(r <= 0) {
+                t->errors++;
+                goto done;
+            }
+            got += r;
+        }
+        t->bytes += n;
+    }
+done:
+    bench_close(ctx, sock);
+    socks5_free(ctx);
+    return NULL;
+}
+
+/* run fn on nthreads threads started together, returns elapsed us */
+static uint64_t bench_run(void* (*fn)(void*), bench_thread* t, int nthreads) {
+    pthread_t threads[nthreads];
+    pthread_barrier_t start;
+
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for(int i = 0; i < nthreads; i++) {
+        t[i].start = &start;
+        pthread_create(&threads[i], NULL, fn, &t[i]);
+    }
+
+    pthread_barrier_wait(&start);
+    uint64_t begin = now_us();
+    for(int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed = now_us() - begin;
+    pthread_barrier_destroy(&start);
+    return elapsed ? elapsed : 1;
+}
+
+static int cmp_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t pct(const uint32_t* sorted, int n, double p) {
+    int idx = (int)(n * p);
+    return n ? sorted[idx < n ? idx : n - 1] : 0;
+}
+
+typedef struct burst_run {
+    socks5_ctx** ctxs;
+    socks5_batch* batch;    // NULL for blocking
+    int n;
+} burst_run;
+
+static const struct {
+    const char* name;
+    int backend;
+} burst_modes[] = {
+    {"blocking", BURST_BLOCKING},
+    {"epoll", SOCKS5_BATCH_EPOLL},
+    {"io_uring", SOCKS5_BATCH_URING}
+};
+
+static int burst_prepare(burst_run* run, const bench_opts* opts, socks5_endpoint* ep, int backend) {
+    run->n = opts->burst;
+    run->batch = NULL;
+    run->ctxs = calloc(run->n, sizeof(socks5_ctx*));
+    if(!run->ctxs) {
+        return -1;
+    }
+    if(backend != BURST_BLOCKING) {
+        run->batch = socks5_batch_create(backend, 0);
+        if(!run->batch) {
+            free(run->ctxs);
+            return -1;
+        }
+    }
+    for(int i = 0; i < run->n; i++) {
+        run->ctxs[i] = bench_ctx(opts, ep);
+        if(run->batch && run->ctxs[i]) {
+            socks5_batch_add(run->batch, run->ctxs[i], "burst.test", 80);
+        }
+    }
+    return 0;
+}
+
+/* open all of them, lat gets each one's completion time since the start.
+ * returns elapsed us */
+static uint64_t burst_go(burst_run* run, uint32_t* lat, int* ok) {
+    uint64_t start = now_us();
+
+    *ok = 0;
+    if(!run->batch) {
+        for(int i = 0; i < run->n; i++) {
+            if(run->ctxs[i] && socks5_connect(run->ctxs[i], "burst.test", 80) >= 0) {
+                lat[(*ok)++] = (uint32_t)(now_us() - start);
+            }
+        }
+    }
+    else {
+        socks5_batch_run(run->batch, BURST_TIMEOUT_MS);
+        for(int i = 0; i < run->n; i++) {
+            uint64_t done;
+            if(socks5_batch_result(run->batch, i, &done) >= 0) {
+                lat[(*ok)++] = (uint32_t)(done - start);
+            }
+        }
+    }
+    uint64_t elapsed = now_us() - start;
+    return elapsed ? elapsed : 1;
+}
+
+static void burst_finish(burst_run* run) {
+    for(int i = 0; i < run->n; i++) {
+        int sock = socks5_detach(run->ctxs[i]);
+        if(sock >= 0) {
+            struct linger lin = {1, 0};
+            setsockopt(sock, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+            close(sock);
+        }
+        socks5_free(run->ctxs[i]);
+    }
+    socks5_batch_free(run->batch);
+    free(run->ctxs);
+}
+
+/* syscalls made by one burst, run in a child stopped at every syscall
+ * entry and exit. SIGUSR1 from the child brackets the burst so ctx and
+ * ring setup are not counted. -1 when ptrace is not allowed */
+static long burst_syscalls(const bench_opts* opts, socks5_endpoint* ep, int backend) {
+    pid_t pid = fork();
+    if(pid < 0) {
+        return -1;
+    }
+    if(pid == 0) {
+        burst_run run;
+        int ok = 0;
+        if(ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) {
+            _exit(2);
+        }
+        raise(SIGSTOP);
+        if(burst_prepare(&run, opts, ep, backend) < 0) {
+            _exit(2);
+        }
+        uint32_t* lat = malloc(sizeof(uint32_t) * run.n);
+        if(!lat) {
+            _exit(2);
+        }
+        raise(SIGUSR1);
+        burst_go(&run, lat, &ok);
+        raise(SIGUSR1);
+        burst_finish(&run);
+        _exit(ok == run.n ? 0 : 1);
+    }
+
+    int st;
+    long stops = 0;
+    int marks = 0;
+    if(waitpid(pid, &st, 0) != pid || !WIFSTOPPED(st)) {
+        return -1;
+    }
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, (void*)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    while(waitpid(pid, &st, 0) == pid && WIFSTOPPED(st)) {
+        int sig = WSTOPSIG(st);
+        if(sig == (SIGTRAP | 0x80)) {
+            stops += marks == 1;
+            sig = 0;
+        } else if(sig == SIGUSR1) {
+            marks++;
+            sig = 0;
+        }
+        ptrace(PTRACE_SYSCALL, pid, NULL, (void*)(long)sig);
+    }
+    if(!WIFEXITED(st) || WEXITSTATUS(st) != 0) {
+        return -1;
+    }
+    return stops / 2;
+}
+
+static void run_burst(const bench_opts* opts, socks5_endpoint* ep) {
+    int nmodes = sizeof(burst_modes) / sizeof(burst_modes[0]);
+    uint32_t* lat = malloc(sizeof(uint32_t) * opts->burst);
+    int first = 1;
+
+    printf("  \"burst\": {\"conns\": %d, \"modes\": [\n", opts->burst);
+    for(int m = 0; lat && m < nmodes; m++) {
+        burst_run run;
+        int ok;
+
+        if(burst_prepare(&run, opts, ep, burst_modes[m].backend) < 0) {
+            fprintf(stderr, "burst: %s not available\n", burst_modes[m].name);
+            continue;
+        }
+        fprintf(stderr, "burst: %s\n", burst_modes[m].name);
+        uint64_t elapsed = burst_go(&run, lat, &ok);
+        burst_finish(&run);
+        qsort(lat, ok, sizeof(uint32_t), cmp_u32);
+
+        long calls = burst_syscalls(opts, ep, burst_modes[m].backend);
+        char calls_str[32], per_conn[32];
+        if(calls < 0) {
+            snprintf(calls_str, sizeof(calls_str), "null");
+            snprintf(per_conn, sizeof(per_conn), "null");
+        }
+        else {
+            snprintf(calls_str, sizeof(calls_str), "%ld", calls);
+            snprintf(per_conn, sizeof(per_conn), "%.2f", (double)calls / opts->burst);
+        }
+
+        printf("%s    {\"mode\": \"%s\", \"conns\": %d, \"errors\": %d, \"elapsed_us\": %llu, "
+               "\"conns_per_sec\": %.1f, \"latency_us\": {\"p50\": %u, \"p99\": %u, \"max\": %u}, "
+               "\"syscalls\": %s, \"syscalls_per_conn\": %s}",
+               first ? "" : ",\n", burst_modes[m].name, ok, opts->burst - ok,
+               (unsigned long long)elapsed, ok * 1e6 / elapsed,
+               pct(lat, ok, 0.50), pct(lat, ok, 0.99), ok ? lat[ok - 1] : 0,
+               calls_str, per_conn);
+        fflush(stdout);
+        first = 0;
+    }
+    printf("\n  ]}\n");
+    free(lat);
+}
+
+/* every reply code must come back out of socks5_get_error_code and
+ * socks5_get_reply */
+static int check_reply_codes(const bench_opts* opts, socks5_endpoint* ep) {
+    int mismatched = 0;
+
+    for(int code = 1; code <= 8; code++) {
+        char host[32];
+        snprintf(host, sizeof(host), "rep%d.test", code);
+
+        socks5_ctx* ctx = bench_ctx(opts, ep);
+        int sock = ctx ? socks5_connect(ctx, host, 80) : -1;
+        if(sock >= 0 || socks5_get_error_code(ctx) != code || socks5_get_reply(ctx) != code) {
+            fprintf(stderr, "reply code %d: got %d, reply %d\n", code, socks5_get_error_code(ctx),
+                    socks5_get_reply(ctx));
+            mismatched++;
+        }
+        socks5_free(ctx);
+    }
+    return mismatched;
+}
+
+static int run_bench(const bench_opts* opts) {
+    mock_socks5_opts mopts = {
+        .port = 0,
+        .require_auth = opts->auth,
+        .uname = BENCH_UNAME,
+        .passwd = BENCH_PASSWD,
+        .delay_us = opts->delay_us,
+        .fastopen = opts->fastopen
+    };
+    mock_socks5* mock = mock_socks5_start(&mopts);
+    if(!mock) {
+        perror("mock_socks5_start");
+        return 1;
+    }
+
+    int err = 0;
+    socks5_endpoint* ep = socks5_endpoint_create("127.0.0.1", mock_socks5_port(mock), &err);
+    if(!ep) {
+        fprintf(stderr, "Failed to create endpoint\n");
+        mock_socks5_stop(mock);
+        return 1;
+    }
+
+    int mismatched = check_reply_codes(opts, ep);
+
+    printf("{\n  \"bench\": \"socks5_connect\",\n");
+    printf("  \"delay_us\": %d,\n  \"auth\": %s,\n  \"pipeline\": %s,\n  \"fastopen\": %s,\n",
+           opts->delay_us, opts->auth ? "true" : "false", opts->pipeline ? "true" : "false",
+           opts->fastopen ? "true" : "false");
+    printf("  \"conns_per_thread\": %d,\n  \"bytes_per_thread\": %ld,\n", opts->conns, opts->bytes);
+    printf("  \"reply_code_mismatches\": %d,\n  \"runs\": [\n", mismatched);
+
+    for(int r = 0; r < opts->runs; r++) {
+        int nthreads = opts->threads[r];
+        bench_thread* t = calloc(nthreads, sizeof(bench_thread));
+        uint32_t* lat = malloc(sizeof(uint32_t) * nthreads * opts->conns);
+        if(!t || !lat) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+
+        for(int i = 0; i < nthreads; i++) {
+            t[i].opts = opts;
+            t[i].ep = ep;
+            t[i].lat_us = lat + (size_t)i * opts->conns;
+        }
+        fprintf(stderr, "%d threads: connect\n", nthreads);
+        uint64_t conn_us = bench_run(bench_connect_main, t, nthreads);
+
+        // pack the per thread samples together and sort
+        int ok = 0, errors = 0, syn_data = 0, fallback = 0;
+        uint64_t sum = 0;
+        for(int i = 0; i < nthreads; i++) {
+            memmove(lat + ok, t[i].lat_us, sizeof(uint32_t) * t[i].ok);
+            ok += t[i].ok;
+            errors += t[i].errors;
+            syn_data += t[i].tfo[SOCKS5_TFO_SYN_DATA];
+            fallback += t[i].tfo[SOCKS5_TFO_FALLBACK];
+            t[i].ok = 0;
+            t[i].errors = 0;
+        }
+        for(int i = 0; i < ok; i++) {
+            sum += lat[i];
+        }
+        qsort(lat, ok, sizeof(uint32_t), cmp_u32);
+
+        fprintf(stderr, "%d threads: echo\n", nthreads);
+        uint64_t echo_us = bench_run(bench_echo_main, t, nthreads);
+        long bytes = 0;
+        for(int i = 0; i < nthreads; i++) {
+            bytes += t[i].bytes;
+            errors += t[i].errors;
+        }
+
+        printf("    {\"threads\": %d, \"conns\": %d, \"errors\": %d, \"conns_per_sec\": %.1f, "
+               "\"latency_us\": {\"mean\": %llu, \"p50\": %u, \"p90\": %u, \"p99\": %u, \"max\": %u}, "
+               "\"fastopen\": {\"syn_data\": %d, \"fallback\": %d}, \"bytes_per_sec\": %.0f}%s\n",
+               nthreads, ok, errors, ok * 1e6 / conn_us,
+               (unsigned long long)(ok ? sum / ok : 0),
+               pct(lat, ok, 0.50), pct(lat, ok, 0.90), pct(lat, ok, 0.99), ok ? lat[ok - 1] : 0,
+               syn_data, fallback, bytes * 1e6 / echo_us, r + 1 < opts->runs ? "," : "");
+        fflush(stdout);
+
+        free(lat);
+        free(t);
+    }
+    printf("  ]%s\n", opts->burst > 0 ? "," : "");
+    if(opts->burst > 0) {
+        run_burst(opts, ep);
+    }
+    printf("}\n");
+
+    socks5_endpoint_unref(ep);
+    mock_socks5_stop(mock);
+    return mismatched ? 2 : 0;
+}
+
+static int parse_threads(bench_opts* opts, char* list) {
+    opts->runs = 0;
+    for(char* tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        int n = atoi(tok);
+        if(n <= 0 || opts->runs >= BENCH_MAX_RUNS) {
+            return -1;
+        }
+        opts->threads[opts->runs++] = n;
+    }
+    return opts->runs ? 0 : -1;
+}
+
+int main(int argc, char** argv) {
+    bench_opts opts = {
+        .threads = {1, 2, 4, 8},
+        .runs = 4,
+        .conns = 1000,
+        .burst = 1000,
+        .bytes = 64L * 1024 * 1024,
+        .delay_us = 0,
+        .auth = 0,
+        .pipeline = 0,
+        .fastopen = 0
+    };
+    int serve_port = -1;
+    int c;
+
+    while((c = getopt(argc, argv, "t:n:u:d:b:apfs:")) != -1) {
+        switch(c) {
+            case 't':
+                if(parse_threads(&opts, optarg) < 0) {
+                    fprintf(stderr, "Bad thread list: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'n': opts.conns = atoi(optarg); break;
+            case 'u': opts.burst = atoi(optarg); break;
+            case 'd': opts.delay_us = atoi(optarg); break;
+            case 'b': opts.bytes = atol(optarg); break;
+            case 'a': opts.auth = 1; break;
+            case 'p': opts.pipeline = 1; break;
+            case 'f': opts.fastopen = 1; break;
+            case 's': serve_port = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-t 1,2,4,8] [-n conns] [-u burst] [-d delay_us] [-b bytes] [-a] [-p] [-f] [-s port]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(opts.conns <= 0) {
+        opts.conns = 1;
+    }
+
+    // mock only, e.g. as the tor_port for an LD_PRELOAD run
+    if(serve_port >= 0) {
+        mock_socks5_opts mopts = {
+            .port = (uint16_t)serve_port,
+            .require_auth = opts.auth,
+            .uname = BENCH_UNAME,
+            .passwd = BENCH_PASSWD,
+            .delay_us = opts.delay_us,
+            .fastopen = opts.fastopen
+        };
+        mock_socks5* mock = mock_socks5_start(&mopts);
+        if(!mock) {
+            perror("mock_socks5_start");
+            return 1;
+        }
+        fprintf(stderr, "Mock SOCKS5 server on 127.0.0.1:%d\n", mock_socks5_port(mock));
+        for(;;) {
+            pause();
+        }
+    }
+
+    return run_bench(&opts);
+}
@@ -1,62 +1,289 @@
 #include "socks5_client.h"
 #include "socks5_proto.h"
+#include "socks5_stats.h"
+#include "slab.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 
 
+/* handshake states */
+enum {
+    SOCKS5_ST_IDLE = 0,
+    SOCKS5_ST_SEND,     // flushing out queue, then next_state
+    SOCKS5_ST_METHOD,   // waiting for method selection
+    SOCKS5_ST_AUTH,     // waiting for uname/passwd status
+    SOCKS5_ST_REPLY,    // waiting for CONNECT reply
+    SOCKS5_ST_DONE
+};
+
+/* room for method, auth and the longest CONNECT reply plus whatever the
+ * destination sends right behind it */
+#define SOCKS5_IN_BUF 512
+
+/* BND of a reply, atyp, a domain's len byte, addr and port */
+#define SOCKS5_BND_LEN (2 + MAX_DOMAIN_LEN + 2)
+
+/* RFC 8305 connection attempt delay: the next proxy addr is tried when
+ * the one before hasn't connected by then */
+#define SOCKS5_ATTEMPT_DELAY_MS 250
+
+/* resolved proxy addrs, immutable once created and shared by refcount */
+struct socks5_endpoint {
+    int refs;
+    char host[MAX_DOMAIN_LEN + 1];
+    uint16_t port;
+    int family;     // of the addr that last connected, tried first. a hint, updated atomically
+    int count;
+    struct {
+        struct sockaddr_storage addr;
+        socklen_t len;
+    } addrs[SOCKS5_EP_MAX_ADDRS];
+};
+
+/* proxy addr and credentials with the greeting and auth sub-negotiation
+ * pre-serialized. immutable once created and shared by refcount, every
+ * ctx for the same proxy points to one. the greeting offers only the
+ * method we intend to use so a pipelined handshake knows what the proxy
+ * will answer */
+struct socks5_proxy {
+    int refs;
+    uint16_t port;
+    uint8_t use_auth;
+    uint8_t greet_len;
+    uint16_t auth_len;
+    const unsigned char* hello;     // greeting + auth, right behind host
+    char host[];
+};
+
+/* a handshake in progress: what goes out, what came in and the deadline.
+ * allocated when one starts and freed once nothing in it is needed,
+ * a connected ctx has none unless bytes past the reply are held. the
+ * buffers go last and are not cleared */
+typedef struct socks5_hs {
+    uint64_t deadline_us;   // of a blocking handshake, 0 when none
+    uint64_t armed_us;      // proxy sock timeouts last set to what was left then
+    uint64_t t_start;       // phase timestamps, t_start is 0 when not timed
+    uint64_t t_proxy;
+    uint64_t t_nego;
+    struct timeval app_rcvtimeo;
+    struct timeval app_sndtimeo;
+    struct iovec out[2];
+    int out_idx;
+    int out_cnt;
+    int in_off;         // start of the current message
+    int in_len;
+    int in_need;        // bytes of the current message needed at in_off
+    int req_len;
+    int tv_saved;       // app_sock timeouts replaced by ours until restored
+    int t_fresh;        // proxy connect and negotiation are part of this attempt
+    unsigned char req[6 + 1 + MAX_DOMAIN_LEN];   // serialized request
+    unsigned char bound[SOCKS5_BND_LEN];    // BND of a RESOLVE or UDP ASSOCIATE reply, atyp first
+    unsigned char in[SOCKS5_IN_BUF];
+} socks5_hs;
+
+/* what stays for the life of a connection, one cache line */
 struct socks5_ctx {
-    char proxy_host[MAX_DOMAIN_LEN + 1];
-    uint16_t proxy_port;
-    int use_auth;
-    char uname[MAX_AUTH_LEN + 1];
-    char passwd[MAX_AUTH_LEN + 1];
-    int timeout;
+    socks5_proxy* proxy;
+    socks5_endpoint* ep;
+    socks5_hs* hs;
+    char* error_msg;    // malloc()ed at the first error
     int proxy_sock;
+    int app_sock;       // caller's socket to connect on, -1 for our own
+    int timeout_ms;     // whole handshake, not per syscall
     int last_error;
-    int verbose;
-    char error_msg[256];
+    uint8_t state;
+    uint8_t next_state;
+    uint8_t cmd;        // SOCKS5_CMD_* of the request
+    uint8_t tfo;        // SOCKS5_TFO_* of the current proxy conn
+    uint8_t tfo_check;  // read TCP_INFO once the proxy answers
+    uint8_t timeout_app;    // the app sock's SO_SNDTIMEO shortens the deadline
+    uint8_t borrowed;   // proxy_sock is app_sock, never closed here
+    uint8_t nonblock;
+    uint8_t pipelined;  // current attempt went out pipelined
+    uint8_t pipeline;
+    uint8_t fastopen;
+    uint8_t verbose;
+    uint8_t reply;      // SOCKS5_REP_* the proxy failed the request with, 0 if it didn't
 };
 
-socks5_ctx* socks5_create_ctx(const char* host, uint16_t port) {
-    socks5_ctx* ctx = malloc(sizeof(socks5_ctx));
+#define SOCKS5_ERROR_LEN 256
+
+/* ctxs and handshakes come from per thread free lists, a connection
+ * costs no malloc of its own */
+static slab_cache socks5_ctx_cache = SLAB_CACHE_INIT(sizeof(struct socks5_ctx));
+static slab_cache socks5_hs_cache = SLAB_CACHE_INIT(sizeof(socks5_hs));
+
+/* greeting and uname/passwd sub-negotiation, serialized once per proxy */
+static int socks5_build_hello(unsigned char* hello, const char* uname, const char* passwd) {
+    int i = 0;
+
+    hello[i++] = SOCKS5_VERSION;
+    hello[i++] = 1; // auth methods cnt
+    hello[i++] = uname ? SOCKS5_AUTH_PASSWORD : SOCKS5_AUTH_NONE;
+
+    if(uname) {
+        size_t ulen = strnlen(uname, MAX_AUTH_LEN);
+        size_t plen = strnlen(passwd, MAX_AUTH_LEN);
+
+        hello[i++] = 0x01;   // auth version
+        hello[i++] = ulen;
+        memcpy(&hello[i], uname, ulen);
+        i += ulen;
+        hello[i++] = plen;
+        memcpy(&hello[i], passwd, plen);
+        i += plen;
+    }
+    return i;
+}
+
+/* uname NULL for no auth */
+socks5_proxy* socks5_proxy_create(const char* host, uint16_t port, const char* uname, const char* passwd) {
+    unsigned char hello[3 + 3 + 2 * MAX_AUTH_LEN];
+
+    if(!host || (uname && !passwd)) {
+        return NULL;
+    }
+    size_t host_len = strnlen(host, MAX_DOMAIN_LEN);
+    int hello_len = socks5_build_hello(hello, uname, passwd);
+
+    socks5_proxy* proxy = malloc(sizeof(socks5_proxy) + host_len + 1 + hello_len);
+    if(!proxy) {
+        return NULL;
+    }
+    proxy->refs = 1;
+    proxy->port = port;
+    proxy->use_auth = uname != NULL;
+    proxy->greet_len = 3;
+    proxy->auth_len = hello_len - 3;
+    memcpy(proxy->host, host, host_len);
+    proxy->host[host_len] = '\0';
+    proxy->hello = (unsigned char*)proxy->host + host_len + 1;
+    memcpy((unsigned char*)proxy->hello, hello, hello_len);
+    return proxy;
+}
+
+socks5_proxy* socks5_proxy_ref(socks5_proxy* proxy) {
+    if(proxy) {
+        __atomic_add_fetch(&proxy->refs, 1, __ATOMIC_RELAXED);
+    }
+    return proxy;
+}
+
+void socks5_proxy_unref(socks5_proxy* proxy) {
+    if(proxy && __atomic_sub_fetch(&proxy->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(proxy);
+    }
+}
+
+/* ctxs, pools and upstreams holding proxy */
+int socks5_proxy_refs(const socks5_proxy* proxy) {
+    return __atomic_load_n(&proxy->refs, __ATOMIC_RELAXED);
+}
+
+socks5_ctx* socks5_create_ctx_proxy(socks5_proxy* proxy) {
+    if(!proxy) {
+        return NULL;
+    }
+    socks5_ctx* ctx = slab_alloc(&socks5_ctx_cache);
     if(!ctx) {
         return NULL;
     }
 
     memset(ctx, 0, sizeof(socks5_ctx));
-    strncpy(ctx->proxy_host, host, MAX_DOMAIN_LEN);
-    ctx->proxy_host[MAX_DOMAIN_LEN] = '\0';
-    ctx->proxy_port = port;
-    ctx->use_auth = 0;
-    ctx->timeout = DEFAULT_TIMEOUT;
-    ctx->verbose = 0;
+    ctx->proxy = socks5_proxy_ref(proxy);
+    ctx->timeout_ms = DEFAULT_TIMEOUT * 1000;
     ctx->proxy_sock = -1;
-    ctx->last_error = 0;
+    ctx->app_sock = -1;
+    ctx->cmd = SOCKS5_CMD_CONNECT;
+    return ctx;
+}
 
+socks5_ctx* socks5_create_ctx(const char* host, uint16_t port) {
+    socks5_proxy* proxy = socks5_proxy_create(host, port, NULL, NULL);
+    socks5_ctx* ctx = socks5_create_ctx_proxy(proxy);
+    socks5_proxy_unref(proxy);
     return ctx;
 }
 
+/* the proxy is shared, ctx gets one of its own with the credentials */
 void socks5_set_auth(socks5_ctx* ctx, const char* uname, const char* passwd) {
     if(!ctx || !uname || !passwd) {
         return;
     }
-    ctx->use_auth = 1;
-    strncpy(ctx->uname, uname, MAX_AUTH_LEN);
-    ctx->uname[MAX_AUTH_LEN] = '\0';
-    strncpy(ctx->passwd, passwd, MAX_AUTH_LEN);
-    ctx->passwd[MAX_AUTH_LEN] = '\0';
+    socks5_proxy* proxy = socks5_proxy_create(ctx->proxy->host, ctx->proxy->port, uname, passwd);
+    if(!proxy) {
+        return;
+    }
+    socks5_proxy_unref(ctx->proxy);
+    ctx->proxy = proxy;
 }
 
 void socks5_set_timeout(socks5_ctx* ctx, int timeout) {
-    if(!ctx || timeout <= 0) {
+    if(timeout > 0) {
+        socks5_set_timeout_ms(ctx, timeout * 1000);
+    }
+}
+
+/* deadline for all of socks5_connect: proxy connect, negotiation and
+ * reply together, however many syscalls they take */
+void socks5_set_timeout_ms(socks5_ctx* ctx, int timeout_ms) {
+    if(!ctx || timeout_ms <= 0) {
+        return;
+    }
+    ctx->timeout_ms = timeout_ms;
+}
+
+/* cap the deadline at the SO_SNDTIMEO of the sock from socks5_use_sock,
+ * the bound the app set for its own connect(). unset leaves it alone */
+void socks5_set_timeout_from_app(socks5_ctx* ctx, int enable) {
+    if(!ctx) {
+        return;
+    }
+    ctx->timeout_app = enable;
+}
+
+void socks5_set_pipelining(socks5_ctx* ctx, int enable) {
+    if(!ctx) {
+        return;
+    }
+    ctx->pipeline = enable;
+}
+
+/* connect to the proxy with TCP_FASTOPEN_CONNECT. connect() returns at
+ * once and the first handshake write goes out in the SYN when a cookie
+ * for the proxy is cached, so the greeting (or the whole pipelined
+ * handshake) saves a round trip. socks5_get_fastopen tells afterwards */
+void socks5_set_fastopen(socks5_ctx* ctx, int enable) {
+    if(!ctx) {
         return;
     }
-    ctx->timeout = timeout;
+    ctx->fastopen = enable;
+}
+
+int socks5_get_fastopen(const socks5_ctx* ctx) {
+    return ctx ? ctx->tfo : SOCKS5_TFO_OFF;
+}
+
+/* connect to the proxy on sock, an unconnected TCP socket owned by the
+ * caller, instead of a new one. its options and bind addr stay as they
+ * are and ctx never closes it. socks5_connect needs it blocking,
+ * socks5_connect_start non-blocking. -1 goes back to own sockets */
+void socks5_use_sock(socks5_ctx* ctx, int sock) {
+    if(!ctx) {
+        return;
+    }
+    ctx->app_sock = sock;
 }
 
 static void socks5_log(socks5_ctx* ctx, const char* format, ...) {
@@ -85,9 +312,16 @@ static void socks5_set_error(socks5_ctx* ctx, int err_code, const char* format,
     }
 
     ctx->last_error = err_code;
+    ctx->reply = 0;
+    if(!ctx->error_msg) {
+        ctx->error_msg = malloc(SOCKS5_ERROR_LEN);
+        if(!ctx->error_msg) {
+            return;
+        }
+    }
     va_list args;
     va_start(args, format);
-    vsnprintf(ctx->error_msg, sizeof(ctx->error_msg) - 1, format, args);
+    vsnprintf(ctx->error_msg, SOCKS5_ERROR_LEN, format, args);
     va_end(args);
 
     if(ctx->verbose) {
@@ -99,7 +333,7 @@ const char* socks5_get_error(socks5_ctx* ctx) {
     if(!ctx) {
         return "Invalid context";
     }
-    return ctx->error_msg;
+    return ctx->error_msg ? ctx->error_msg : "";
 }
 
 int socks5_get_error_code(socks5_ctx* ctx) {
@@ -109,212 +343,636 @@ int socks5_get_error_code(socks5_ctx* ctx) {
     return ctx->last_error;
 }
 
-static int socks5_connect_to_proxy(socks5_ctx* ctx) {
+/* reply code of a request the proxy refused, apart from the errno
+ * values of the error code. 0 when the last failure wasn't one */
+int socks5_get_reply(socks5_ctx* ctx) {
+    if(!ctx) {
+        return 0;
+    }
+    return ctx->reply;
+}
+
+/* handshake state for a new attempt, the one of an earlier attempt is reused */
+static int socks5_hs_begin(socks5_ctx* ctx) {
+    if(!ctx->hs) {
+        ctx->hs = slab_alloc(&socks5_hs_cache);
+        if(!ctx->hs) {
+            socks5_set_error(ctx, ENOMEM, "No memory for the handshake");
+            return -1;
+        }
+    }
+    memset(ctx->hs, 0, offsetof(socks5_hs, req));
+    return 0;
+}
+
+static void socks5_hs_release(socks5_ctx* ctx) {
+    slab_free(&socks5_hs_cache, ctx->hs);
+    ctx->hs = NULL;
+}
+
+static void socks5_restore_timeouts(socks5_ctx* ctx);
+
+/* on the way out of a handshake call with its result. the state goes
+ * once nothing in it is needed: the attempt failed, or CONNECT went
+ * through and nothing came along with the reply. RESOLVE and UDP
+ * ASSOCIATE keep BND until it is read */
+static int socks5_hs_settle(socks5_ctx* ctx, int ret) {
+    if(!ctx->hs) {
+        return ret;
+    }
+    socks5_restore_timeouts(ctx);
+    if(ret < 0 || ctx->state == SOCKS5_ST_IDLE ||
+       (ctx->state == SOCKS5_ST_DONE && ctx->cmd == SOCKS5_CMD_CONNECT && socks5_buffered(ctx) == 0)) {
+        socks5_hs_release(ctx);
+    }
+    return ret;
+}
+
+socks5_endpoint* socks5_endpoint_create(const char* host, uint16_t port, int* error) {
     struct addrinfo hints, *res, *rp;
-    int sock = -1;
     char port_str[8];
 
-    if(!ctx) {
-        return -1;
+    socks5_endpoint* ep = calloc(1, sizeof(socks5_endpoint));
+    if(!ep) {
+        if(error) {
+            *error = EAI_MEMORY;
+        }
+        return NULL;
     }
-
-    // already connected
-    if(ctx->proxy_sock >= 0) {
-        return ctx->proxy_sock;
+    ep->refs = 1;
+    strncpy(ep->host, host, MAX_DOMAIN_LEN);
+    ep->port = port;
+
+    // numeric hosts skip the resolver
+    struct sockaddr_in* sin = (struct sockaddr_in*)&ep->addrs[0].addr;
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&ep->addrs[0].addr;
+    if(inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        ep->addrs[0].len = sizeof(struct sockaddr_in);
+        ep->count = 1;
+        return ep;
+    }
+    if(inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        ep->addrs[0].len = sizeof(struct sockaddr_in6);
+        ep->count = 1;
+        return ep;
     }
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;    // Allow IPv4 or IPv6
     hints.ai_socktype = SOCK_STREAM;
 
-    snprintf(port_str, sizeof(port_str), "%d", ctx->proxy_port);
-
-    socks5_log(ctx, "Resolving proxy addr: %s:%s", ctx->proxy_host, port_str);
+    snprintf(port_str, sizeof(port_str), "%d", port);
 
-    int ret = getaddrinfo(ctx->proxy_host, port_str, &hints, &res);
+    int ret = getaddrinfo(host, port_str, &hints, &res);
     if(ret != 0) {
-        socks5_set_error(ctx, ret, "Failed to resolve proxy address: %s", gai_strerror(ret));
-        return -1;
+        free(ep);
+        if(error) {
+            *error = ret;
+        }
+        return NULL;
     }
-    
-    // try each addr until successfull connect
-    for (rp = res; rp != NULL; rp = rp->ai_next) {
-        sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if(sock == -1) {
+
+    for(rp = res; rp != NULL && ep->count < SOCKS5_EP_MAX_ADDRS; rp = rp->ai_next) {
+        if(rp->ai_addrlen > sizeof(struct sockaddr_storage)) {
             continue;
         }
+        memcpy(&ep->addrs[ep->count].addr, rp->ai_addr, rp->ai_addrlen);
+        ep->addrs[ep->count].len = rp->ai_addrlen;
+        ep->count++;
+    }
+    freeaddrinfo(res);
+
+    if(ep->count == 0) {
+        free(ep);
+        if(error) {
+            *error = EAI_NONAME;
+        }
+        return NULL;
+    }
+    return ep;
+}
 
-        // socket timeout
-        struct timeval tv;
-        tv.tv_sec = ctx->timeout;
-        tv.tv_usec = 0;
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof(tv));
+/* resolve the same host again, the old endpoint stays valid for its holders */
+socks5_endpoint* socks5_endpoint_refresh(const socks5_endpoint* ep, int* error) {
+    socks5_endpoint* fresh = socks5_endpoint_create(ep->host, ep->port, error);
+    if(fresh) {
+        fresh->family = __atomic_load_n(&ep->family, __ATOMIC_RELAXED);
+    }
+    return fresh;
+}
 
-        socks5_log(ctx, "Connecting to proxy server...");
-        if(connect(sock, rp->ai_addr, rp->ai_addrlen) != -1) {
-            // connect successfull
-            break;
+/* ep's addrs in the order to try them: families interleaved, starting
+ * with the one that connected last */
+static int socks5_endpoint_order(const socks5_endpoint* ep, int* order) {
+    int pref[SOCKS5_EP_MAX_ADDRS];
+    int other[SOCKS5_EP_MAX_ADDRS];
+    int npref = 0;
+    int nother = 0;
+
+    int family = __atomic_load_n(&ep->family, __ATOMIC_RELAXED);
+    if(family == AF_UNSPEC) {
+        family = ep->addrs[0].addr.ss_family;
+    }
+    for(int i = 0; i < ep->count; i++) {
+        if(ep->addrs[i].addr.ss_family == family) {
+            pref[npref++] = i;
         }
+        else {
+            other[nother++] = i;
+        }
+    }
 
-        close(sock);
-        sock = -1;
+    int n = 0;
+    for(int i = 0; i < npref || i < nother; i++) {
+        if(i < npref) {
+            order[n++] = pref[i];
+        }
+        if(i < nother) {
+            order[n++] = other[i];
+        }
     }
+    return n;
+}
 
-    freeaddrinfo(res);
+static void socks5_endpoint_connected(socks5_endpoint* ep, int i) {
+    __atomic_store_n(&ep->family, ep->addrs[i].addr.ss_family, __ATOMIC_RELAXED);
+}
 
-    if(sock == -1) {
-        return -1;
+const char* socks5_endpoint_host(const socks5_endpoint* ep) {
+    return ep->host;
+}
+
+uint16_t socks5_endpoint_port(const socks5_endpoint* ep) {
+    return ep->port;
+}
+
+socks5_endpoint* socks5_endpoint_ref(socks5_endpoint* ep) {
+    if(ep) {
+        __atomic_add_fetch(&ep->refs, 1, __ATOMIC_RELAXED);
     }
+    return ep;
+}
 
-    socks5_log(ctx, "Connected to proxy server");
-    ctx->proxy_sock = sock;
-    return sock;
+void socks5_endpoint_unref(socks5_endpoint* ep) {
+    if(ep && __atomic_sub_fetch(&ep->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(ep);
+    }
 }
 
-static int socks5_do_handshake(socks5_ctx* ctx) {
-    if(!ctx || ctx->proxy_sock < 0) {
-        return -1;
+void socks5_set_endpoint(socks5_ctx* ctx, socks5_endpoint* ep) {
+    if(!ctx) {
+        return;
     }
-    unsigned char buff[MAX_BUFFER_SIZE];
-    int n, i;
+    socks5_endpoint_ref(ep);
+    socks5_endpoint_unref(ctx->ep);
+    ctx->ep = ep;
+}
 
-    socks5_log(ctx, "Sending auth method negotiation");
+socks5_endpoint* socks5_get_endpoint(socks5_ctx* ctx) {
+    return ctx ? ctx->ep : NULL;
+}
 
-    i = 0;
-    buff[i++] = SOCKS5_VERSION;
-    
-    if(ctx->use_auth) {
-        buff[i++] = 2;  // auth methods cnt
-        buff[i++] = SOCKS5_AUTH_NONE;
-        buff[i++] = SOCKS5_AUTH_PASSWORD;
+static void socks5_set_timeouts(int sock, const struct timeval* rcv, const struct timeval* snd) {
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)rcv, sizeof(*rcv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)snd, sizeof(*snd));
+}
+
+/* arm Fast Open on a sock about to be connected */
+static void socks5_fastopen_arm(socks5_ctx* ctx, int sock) {
+    ctx->tfo = SOCKS5_TFO_OFF;
+    ctx->tfo_check = 0;
+    if(!ctx->fastopen) {
+        return;
     }
-    else {
-        buff[i++] = 1; // auth methods cnt
-        buff[i++] = SOCKS5_AUTH_NONE;
+#ifdef TCP_FASTOPEN_CONNECT
+    int one = 1;
+    if(setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one)) == 0) {
+        ctx->tfo_check = 1;
+        return;
     }
+#endif
+    socks5_log(ctx, "Fast Open not available: %s", strerror(errno));
+}
 
-    if(write(ctx->proxy_sock, buff, i) != i) {
-        close(ctx->proxy_sock);
-        ctx->proxy_sock = -1;
+/* first proxy bytes in, the SYN-ACK has long arrived. it says whether
+ * the data in our SYN was taken */
+static void socks5_fastopen_check(socks5_ctx* ctx) {
+    ctx->tfo_check = 0;
+
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if(getsockopt(ctx->proxy_sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return;
+    }
+    if(info.tcpi_options & TCPI_OPT_SYN_DATA) {
+        ctx->tfo = SOCKS5_TFO_SYN_DATA;
+        socks5_log(ctx, "Handshake went out in the SYN");
+    }
+    else {
+        ctx->tfo = SOCKS5_TFO_FALLBACK;
+        socks5_log(ctx, "Fast Open fell back to a plain handshake, no cookie or data not acked");
     }
+}
 
-    socks5_log(ctx, "Reading auth metod selection");
+/* blocking handshake starts, one deadline for all of it */
+static void socks5_deadline_start(socks5_ctx* ctx) {
+    ctx->hs->deadline_us = socks5_stats_now() + (uint64_t)ctx->timeout_ms * 1000;
+    ctx->hs->armed_us = 0;
+}
 
-    n = read(ctx->proxy_sock, buff, 2);
-    if(n != 2) {
-        close(ctx->proxy_sock);
-        ctx->proxy_sock = -1;
-        return -1;
+/* blocking I/O on sock waits no longer than what's left of the deadline.
+ * the sock timeouts are set again only once that drifted by a ms, so a
+ * fast handshake sets them once. -1 once the deadline passed */
+static int socks5_deadline_arm(socks5_ctx* ctx, int sock) {
+    if(!ctx->hs->deadline_us) {
+        return 0;
     }
-
-    if(buff[0] != SOCKS5_VERSION) {
-        close(ctx->proxy_sock);
-        ctx->proxy_sock = -1;
+    uint64_t now = socks5_stats_now();
+    if(now >= ctx->hs->deadline_us) {
+        socks5_set_error(ctx, ETIMEDOUT, "Timed out waiting for proxy");
         return -1;
     }
+    if(ctx->hs->armed_us && now - ctx->hs->armed_us < 1000) {
+        return 0;
+    }
+    uint64_t left = ctx->hs->deadline_us - now;
+    struct timeval tv = {(time_t)(left / 1000000), (suseconds_t)(left % 1000000)};
+    socks5_set_timeouts(sock, &tv, &tv);
+    ctx->hs->armed_us = now;
+    return 0;
+}
 
-    if(buff[1] == SOCKS5_AUTH_NO_ACCEPT) {
-        close(ctx->proxy_sock);
-        ctx->proxy_sock = -1;
-        return -1;
+/* give the caller's socket its own timeouts back, and our own sock none
+ * left from the deadline before it goes to its user */
+static void socks5_restore_timeouts(socks5_ctx* ctx) {
+    if(!ctx->hs) {
+        return;
     }
+    if(ctx->hs->tv_saved) {
+        socks5_set_timeouts(ctx->app_sock, &ctx->hs->app_rcvtimeo, &ctx->hs->app_sndtimeo);
+        ctx->hs->tv_saved = 0;
+    }
+    else if(ctx->hs->armed_us && ctx->proxy_sock >= 0 && !ctx->borrowed) {
+        struct timeval none = {0, 0};
+        socks5_set_timeouts(ctx->proxy_sock, &none, &none);
+    }
+    ctx->hs->deadline_us = 0;
+    ctx->hs->armed_us = 0;
+}
 
-    // if uname, passwd auth, send creds
-    if(buff[1] == SOCKS5_AUTH_PASSWORD) {
-        if(!ctx->use_auth) {
-            close(ctx->proxy_sock);
-            ctx->proxy_sock = -1;
+/* connect the caller's socket. an IPv4 proxy addr is tried v4-mapped on
+ * an AF_INET6 socket. 0 connected or in progress, -1 failed, 1 when no
+ * proxy addr fits the socket's family */
+static int socks5_connect_app_sock(socks5_ctx* ctx) {
+    int sock = ctx->app_sock;
+    int usable = 0;
+
+    if(!ctx->nonblock && !ctx->hs->tv_saved) {
+        socklen_t len = sizeof(struct timeval);
+        memset(&ctx->hs->app_rcvtimeo, 0, sizeof(struct timeval));
+        memset(&ctx->hs->app_sndtimeo, 0, sizeof(struct timeval));
+        getsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &ctx->hs->app_rcvtimeo, &len);
+        len = sizeof(struct timeval);
+        getsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &ctx->hs->app_sndtimeo, &len);
+        ctx->hs->tv_saved = 1;
+
+        // what the app gave its own connect() bounds ours
+        uint64_t app_us = (uint64_t)ctx->hs->app_sndtimeo.tv_sec * 1000000 + ctx->hs->app_sndtimeo.tv_usec;
+        uint64_t now = socks5_stats_now();
+        if(ctx->timeout_app && app_us && ctx->hs->deadline_us && now + app_us < ctx->hs->deadline_us) {
+            ctx->hs->deadline_us = now + app_us;
+        }
+        if(socks5_deadline_arm(ctx, sock) < 0) {
             return -1;
         }
+    }
+    socks5_fastopen_arm(ctx, sock);
+
+    // one fd can't race, the addrs go one after the other in family order
+    int order[SOCKS5_EP_MAX_ADDRS];
+    int cnt = socks5_endpoint_order(ctx->ep, order);
+    for(int k = 0; k < cnt; k++) {
+        int i = order[k];
+        const struct sockaddr* addr = (const struct sockaddr*)&ctx->ep->addrs[i].addr;
+        socklen_t addr_len = ctx->ep->addrs[i].len;
+        struct sockaddr_in6 mapped;
+
+        int ret = connect(sock, addr, addr_len);
+        if(ret < 0 && (errno == EAFNOSUPPORT || errno == EINVAL) && addr->sa_family == AF_INET) {
+            const struct sockaddr_in* in = (const struct sockaddr_in*)addr;
+            memset(&mapped, 0, sizeof(mapped));
+            mapped.sin6_family = AF_INET6;
+            mapped.sin6_port = in->sin_port;
+            mapped.sin6_addr.s6_addr[10] = 0xff;
+            mapped.sin6_addr.s6_addr[11] = 0xff;
+            memcpy(&mapped.sin6_addr.s6_addr[12], &in->sin_addr, 4);
+            ret = connect(sock, (const struct sockaddr*)&mapped, sizeof(mapped));
+        }
 
-        socks5_log(ctx, "Performing username/password authentication");
-
-        i = 0;
-        buff[i++] = 0x01;   // auth version
-
-        //uname
-        buff[i++] = strlen(ctx->uname);
-        memcpy(&buff[i], ctx->uname, strlen(ctx->uname));
-        i += strlen(ctx->uname);
-
-
-        buff[i++] = strlen(ctx->passwd);
-        memcpy(&buff[i], ctx->passwd, strlen(ctx->passwd));
-        i += strlen(ctx->passwd);
+        if(ret == 0 || (ctx->nonblock && errno == EINPROGRESS)) {
+            if(ret == 0) {
+                socks5_endpoint_connected(ctx->ep, i);
+            }
+            ctx->proxy_sock = sock;
+            ctx->borrowed = 1;
+            return 0;
+        }
+        if(errno == EAFNOSUPPORT || errno == EINVAL) {
+            continue;
+        }
+        usable = 1;
+
+        if(!ctx->nonblock) {
+            /* a connect cut short by SO_SNDTIMEO is still going, the
+             * next addr or upstream gets the fd disconnected */
+            struct sockaddr unspec;
+            memset(&unspec, 0, sizeof(unspec));
+            unspec.sa_family = AF_UNSPEC;
+            connect(sock, &unspec, sizeof(unspec));
+            if(ctx->hs->deadline_us && socks5_stats_now() >= ctx->hs->deadline_us) {
+                socks5_set_error(ctx, ETIMEDOUT, "Timed out connecting to proxy %s:%d",
+                                 ctx->proxy->host, ctx->proxy->port);
+                return -1;
+            }
+        }
+    }
+    if(usable) {
+        socks5_set_error(ctx, ECONNREFUSED, "Failed to connect to proxy %s:%d", ctx->proxy->host, ctx->proxy->port);
+        return -1;
+    }
+    return 1;
+}
 
-        if(write(ctx->proxy_sock, buff, i) != i) {
-            close(ctx->proxy_sock);
-            ctx->proxy_sock = -1;
+/* no shared endpoint, resolve once for this ctx */
+static int socks5_resolve(socks5_ctx* ctx) {
+    if(!ctx->ep) {
+        int ret = 0;
+        socks5_log(ctx, "Resolving proxy addr: %s:%d", ctx->proxy->host, ctx->proxy->port);
+        ctx->ep = socks5_endpoint_create(ctx->proxy->host, ctx->proxy->port, &ret);
+        if(!ctx->ep) {
+            socks5_set_error(ctx, ret, "Failed to resolve proxy address: %s", gai_strerror(ret));
             return -1;
         }
-        
-        // read auth res
-        n = read(ctx->proxy_sock, buff, 2);
-        if(n != 2) {
-            close(ctx->proxy_sock);
-            ctx->proxy_sock = -1;
-            return -1;
+    }
+    return 0;
+}
+
+/* RFC 8305 style: attempts on sockets of our own, started
+ * SOCKS5_ATTEMPT_DELAY_MS apart (or as soon as one fails) in
+ * socks5_endpoint_order. the first to connect wins, the rest are
+ * closed. a black-holed addr costs the attempt delay, not the timeout */
+static int socks5_race_proxy(socks5_ctx* ctx) {
+    int order[SOCKS5_EP_MAX_ADDRS];
+    int cnt = socks5_endpoint_order(ctx->ep, order);
+    struct pollfd fds[SOCKS5_EP_MAX_ADDRS];
+    int idx[SOCKS5_EP_MAX_ADDRS];       // addr of each attempt in fds
+    int inflight = 0;
+    int next = 0;
+    int sock = -1;
+    int won = -1;
+
+    // Fast Open connects at once without a SYN, nothing to race. only
+    // the family that went through last time gets it
+    int remembered = __atomic_load_n(&ctx->ep->family, __ATOMIC_RELAXED) != AF_UNSPEC;
+    ctx->tfo = SOCKS5_TFO_OFF;
+    ctx->tfo_check = 0;
+
+    uint64_t now = socks5_stats_now();
+    uint64_t deadline = ctx->hs->deadline_us ? ctx->hs->deadline_us : now + (uint64_t)ctx->timeout_ms * 1000;
+    uint64_t next_at = now;
+
+    socks5_log(ctx, "Connecting to proxy server...");
+    while(sock < 0 && now < deadline) {
+        if(next < cnt && (now >= next_at || inflight == 0)) {
+            int i = order[next++];
+            const struct sockaddr* addr = (const struct sockaddr*)&ctx->ep->addrs[i].addr;
+            int s = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if(s < 0) {
+                continue;
+            }
+            if(next == 1 && remembered) {
+                socks5_fastopen_arm(ctx, s);
+            }
+            if(connect(s, addr, ctx->ep->addrs[i].len) == 0) {
+                sock = s;
+                won = i;
+                break;
+            }
+            if(errno != EINPROGRESS) {
+                close(s);
+                continue;
+            }
+            fds[inflight].fd = s;
+            fds[inflight].events = POLLOUT;
+            fds[inflight].revents = 0;
+            idx[inflight++] = i;
+            next_at = now + SOCKS5_ATTEMPT_DELAY_MS * 1000;
+            continue;
+        }
+        if(inflight == 0) {
+            break;
         }
 
-        if(buff[1] != 0) {
-            close(ctx->proxy_sock);
-            ctx->proxy_sock = -1;
-            return -1;
+        uint64_t wake = (next < cnt && next_at < deadline) ? next_at : deadline;
+        int n = poll(fds, inflight, (int)((wake - now + 999) / 1000));
+        if(n < 0 && errno != EINTR) {
+            break;
         }
+        for(int k = 0; n > 0 && k < inflight; ) {
+            if(!fds[k].revents) {
+                k++;
+                continue;
+            }
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(fds[k].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if(err == 0 && sock < 0) {
+                sock = fds[k].fd;
+                won = idx[k];
+            }
+            else {
+                // failed, the next attempt starts right away
+                close(fds[k].fd);
+                next_at = 0;
+            }
+            fds[k] = fds[--inflight];
+            idx[k] = idx[inflight];
+        }
+        now = socks5_stats_now();
+    }
 
-        socks5_log(ctx, "Authentication successfull");
+    // cancel the ones still in flight
+    for(int k = 0; k < inflight; k++) {
+        close(fds[k].fd);
     }
-    else if(buff[1] != SOCKS5_AUTH_NONE) {
-        socks5_log(ctx, "Unsupported auth method: %d", buff[1]);
-        close(ctx->proxy_sock);
-        ctx->proxy_sock = -1;
+    if(sock < 0) {
+        if(now >= deadline) {
+            socks5_set_error(ctx, ETIMEDOUT, "Timed out connecting to proxy %s:%d", ctx->proxy->host, ctx->proxy->port);
+        }
+        else {
+            socks5_set_error(ctx, ECONNREFUSED, "Failed to connect to proxy %s:%d", ctx->proxy->host, ctx->proxy->port);
+        }
         return -1;
     }
 
-    return 0;
+    // the rest of the handshake is blocking
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+    ctx->hs->armed_us = 0;
+    if(socks5_deadline_arm(ctx, sock) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    if(won != order[0]) {
+        socks5_log(ctx, "Proxy addr %d of %d connected first", won + 1, ctx->ep->count);
+    }
+    socks5_endpoint_connected(ctx->ep, won);
+    return sock;
 }
 
-int socks5_connect(socks5_ctx* ctx, const char* host, uint16_t port) { 
-    if(!ctx || !host) {
+static int socks5_connect_to_proxy(socks5_ctx* ctx) {
+    int sock = -1;
+
+    if(!ctx) {
         return -1;
     }
 
-    // connect to proxy if not connected
-    if(ctx->proxy_sock < 0) {
-        if(socks5_connect_to_proxy(ctx) < 0) {
-            socks5_log(ctx, "Failed to connect to proxy");
+    // already connected
+    if(ctx->proxy_sock >= 0) {
+        return ctx->proxy_sock;
+    }
+
+    if(socks5_resolve(ctx) < 0) {
+        return -1;
+    }
+
+    if(ctx->app_sock >= 0) {
+        int ret = socks5_connect_app_sock(ctx);
+        if(ret == 0) {
+            socks5_log(ctx, "Connected to proxy server");
+            return ctx->proxy_sock;
+        }
+        if(ret < 0) {
             return -1;
         }
+        socks5_log(ctx, "Proxy addr family does not fit the socket, using a new one");
+    }
 
-        // do handshake
-        if(socks5_do_handshake(ctx) < 0) {
-            socks5_log(ctx, "Failed to do handshake");
+    if(ctx->nonblock) {
+        // only fails here on immediate errors, the rest shows up in the handshake
+        int order[SOCKS5_EP_MAX_ADDRS];
+        int cnt = socks5_endpoint_order(ctx->ep, order);
+        for(int k = 0; k < cnt; k++) {
+            const struct sockaddr* addr = (const struct sockaddr*)&ctx->ep->addrs[order[k]].addr;
+            sock = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if(sock == -1) {
+                continue;
+            }
+            socks5_fastopen_arm(ctx, sock);
+            if(connect(sock, addr, ctx->ep->addrs[order[k]].len) == 0 || errno == EINPROGRESS) {
+                break;
+            }
+            close(sock);
+            sock = -1;
+        }
+    }
+    else {
+        // sets its own error, a timeout is not a refusal
+        sock = socks5_race_proxy(ctx);
+        if(sock == -1) {
             return -1;
         }
     }
 
-    unsigned char buff[MAX_BUFFER_SIZE];
-    struct in_addr addr;
-    int i = 0, n;
-    int is_ipv4 = (inet_pton(AF_INET, host, &addr) == 1);
+    if(sock == -1) {
+        socks5_set_error(ctx, ECONNREFUSED, "Failed to connect to proxy %s:%d", ctx->proxy->host, ctx->proxy->port);
+        return -1;
+    }
+
+    socks5_log(ctx, "Connected to proxy server");
+    ctx->proxy_sock = sock;
+    return sock;
+}
 
-    socks5_log(ctx, "Connecting to destination: %s:%d", host, port);
+/* drop the proxy conn of a borrowed socket without closing the fd. a
+ * blocking one is disconnected so it can be connected again */
+static void socks5_release_sock(socks5_ctx* ctx) {
+    if(ctx->nonblock) {
+        shutdown(ctx->proxy_sock, SHUT_RDWR);
+    }
+    else {
+        struct sockaddr unspec;
+        memset(&unspec, 0, sizeof(unspec));
+        unspec.sa_family = AF_UNSPEC;
+        connect(ctx->proxy_sock, &unspec, sizeof(unspec));
+    }
+    ctx->proxy_sock = -1;
+    ctx->borrowed = 0;
+}
+
+/* close the proxy sock after a protocol error */
+static int socks5_abort(socks5_ctx* ctx) {
+    if(ctx->borrowed) {
+        socks5_release_sock(ctx);
+        ctx->state = SOCKS5_ST_IDLE;
+        return -1;
+    }
+    close(ctx->proxy_sock);
+    ctx->proxy_sock = -1;
+    ctx->state = SOCKS5_ST_IDLE;
+    return -1;
+}
+
+static const char* socks5_reply_str(int rep) {
+    switch(rep) {
+        case SOCKS5_REP_GEN_FAILURE:
+            return "General SOCKS server failure";
+        case SOCKS5_REP_CONN_DENIED:
+            return "Connection not allowed by ruleset";
+        case SOCKS5_REP_NET_UNREACH:
+            return "Network unreachable";
+        case SOCKS5_REP_HOST_UNREACH:
+            return "Host unreachable";
+        case SOCKS5_REP_CONN_REFUSED:
+            return "Connection refused";
+        case SOCKS5_REP_TTL_EXPIRED:
+            return "TTL expired";
+        case SOCKS5_REP_CMD_NOTSUP:
+            return "Command not supported";
+        case SOCKS5_REP_ADDR_NOTSUP:
+            return "Address type not supported";
+    }
+    return "Unknown error";
+}
+
+/* serialize the ctx->cmd request into ctx->hs->req */
+static int socks5_build_request(socks5_ctx* ctx, const char* host, uint16_t port) {
+    unsigned char* buff = ctx->hs->req;
+    int i = 0;
 
-    // build connection request
     buff[i++] = SOCKS5_VERSION;
-    buff[i++] = SOCKS5_CMD_CONNECT;
+    buff[i++] = ctx->cmd;
     buff[i++] = 0x00; // reserved
 
-    if(is_ipv4) {
+    if(inet_pton(AF_INET, host, &buff[i + 1]) == 1) {
         buff[i++] = SOCKS5_ADDR_IPV4;
-        memcpy(&buff[i], &addr.s_addr, 4);
         i += 4;
     }
+    else if(inet_pton(AF_INET6, host, &buff[i + 1]) == 1) {
+        buff[i++] = SOCKS5_ADDR_IPV6;
+        i += 16;
+    }
     else {
         // domain name
         size_t host_len = strlen(host);
         if(host_len > MAX_DOMAIN_LEN) {
+            socks5_set_error(ctx, -1, "Destination host name too long");
             return -1;
         }
 
@@ -323,120 +981,1076 @@ int socks5_connect(socks5_ctx* ctx, const char* host, uint16_t port) {
         memcpy(&buff[i], host, host_len);
         i += host_len;
     }
-    
 
     // port (network byte order)
     buff[i++] = (port >> 8) & 0xFF;
     buff[i++] = port & 0xFF;
 
-    // send connection req
-    if(write(ctx->proxy_sock, buff, i) != i) {
-        socks5_log(ctx, "Failed to send connection request");
-        close(ctx->proxy_sock);
-        ctx->proxy_sock = -1;
+    ctx->hs->req_len = i;
+    return i;
+}
+
+/* append to the out queue, flushed by the SEND state */
+static void socks5_queue(socks5_ctx* ctx, const void* data, int len) {
+    ctx->hs->out[ctx->hs->out_cnt].iov_base = (void*)data;
+    ctx->hs->out[ctx->hs->out_cnt].iov_len = len;
+    ctx->hs->out_cnt++;
+}
+
+/* switch to SEND, then to next_state once the queue is flushed */
+static void socks5_send_then(socks5_ctx* ctx, int next_state) {
+    ctx->hs->out_idx = 0;
+    ctx->state = SOCKS5_ST_SEND;
+    ctx->next_state = next_state;
+}
+
+/* n bytes of the out queue went out */
+static void socks5_sent(socks5_ctx* ctx, size_t n) {
+    // first bytes out means the proxy TCP connect has completed
+    if(ctx->hs->t_start && !ctx->hs->t_proxy) {
+        ctx->hs->t_proxy = socks5_stats_now();
+    }
+
+    while(n > 0 && ctx->hs->out_idx < ctx->hs->out_cnt) {
+        struct iovec* iov = &ctx->hs->out[ctx->hs->out_idx];
+        if(n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ctx->hs->out_idx++;
+        }
+        else {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+            n = 0;
+        }
+    }
+}
+
+/* write queued iovecs, partial writes are resumed on the next call */
+static int socks5_flush(socks5_ctx* ctx) {
+    while(ctx->hs->out_idx < ctx->hs->out_cnt) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = ctx->hs->out + ctx->hs->out_idx;
+        msg.msg_iovlen = ctx->hs->out_cnt - ctx->hs->out_idx;
+
+        if(socks5_deadline_arm(ctx, ctx->proxy_sock) < 0) {
+            return -1;
+        }
+        // MSG_NOSIGNAL: a proxy that went away must not SIGPIPE the app
+        ssize_t n = sendmsg(ctx->proxy_sock, &msg, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            // EINPROGRESS: Fast Open without a cookie, the SYN is out and
+            // the data follows once connected
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+                return SOCKS5_WANT_WRITE;
+            }
+            socks5_set_error(ctx, errno, "Failed to send to proxy: %s", strerror(errno));
+            return -1;
+        }
+        socks5_sent(ctx, n);
+    }
+    ctx->hs->out_cnt = 0;
+    return 0;
+}
+
+/* buffer in_need bytes of the current message, one recv for as much as
+ * fits. bytes past it are kept for the next message, or for the caller
+ * once the handshake is done */
+static void socks5_compact(socks5_ctx* ctx) {
+    memmove(ctx->hs->in, ctx->hs->in + ctx->hs->in_off, ctx->hs->in_len - ctx->hs->in_off);
+    ctx->hs->in_len -= ctx->hs->in_off;
+    ctx->hs->in_off = 0;
+}
+
+static int socks5_fill(socks5_ctx* ctx) {
+    while(ctx->hs->in_len - ctx->hs->in_off < ctx->hs->in_need) {
+        if(ctx->hs->in_off + ctx->hs->in_need > SOCKS5_IN_BUF) {
+            socks5_compact(ctx);
+        }
+        if(socks5_deadline_arm(ctx, ctx->proxy_sock) < 0) {
+            return -1;
+        }
+
+        ssize_t n = recv(ctx->proxy_sock, ctx->hs->in + ctx->hs->in_len, SOCKS5_IN_BUF - ctx->hs->in_len, 0);
+        if(n > 0) {
+            ctx->hs->in_len += n;
+            continue;
+        }
+        if(n == 0) {
+            socks5_set_error(ctx, ECONNRESET, "Proxy closed connection during handshake");
+            return -1;
+        }
+        if(errno == EINTR) {
+            continue;
+        }
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return SOCKS5_WANT_READ;
+        }
+        socks5_set_error(ctx, errno, "Failed to read from proxy: %s", strerror(errno));
         return -1;
     }
+    return 0;
+}
 
-    // read res
-    n = read(ctx->proxy_sock, buff, 4);
-    if(n != 4) {
-        close(ctx->proxy_sock);
-        ctx->proxy_sock = -1;
+/* done with n bytes of the current message */
+static void socks5_consume(socks5_ctx* ctx, int n) {
+    ctx->hs->in_off += n;
+    if(ctx->hs->in_off == ctx->hs->in_len) {
+        ctx->hs->in_off = 0;
+        ctx->hs->in_len = 0;
+    }
+}
+
+static void socks5_expect(socks5_ctx* ctx, int state) {
+    if(state == SOCKS5_ST_REPLY && ctx->hs->t_start && !ctx->hs->t_nego) {
+        ctx->hs->t_nego = socks5_stats_now();
+    }
+    ctx->state = state;
+    // reply header plus first addr byte, which is the len for domains
+    ctx->hs->in_need = (state == SOCKS5_ST_REPLY) ? 5 : 2;
+}
+
+/* queue the handshake for ctx->hs->req. pipelined mode sends greeting, auth
+ * and CONNECT in one writev, otherwise start with the greeting alone */
+static void socks5_start_handshake(socks5_ctx* ctx, int pipelined) {
+    static const unsigned char greet_auth[] = {
+        SOCKS5_VERSION, 2, SOCKS5_AUTH_NONE, SOCKS5_AUTH_PASSWORD
+    };
+
+    ctx->hs->out_cnt = 0;
+    ctx->hs->in_off = 0;
+    ctx->hs->in_len = 0;
+    ctx->pipelined = pipelined;
+
+    if(pipelined) {
+        socks5_log(ctx, "Sending pipelined handshake");
+        socks5_queue(ctx, ctx->proxy->hello, ctx->proxy->greet_len + ctx->proxy->auth_len);
+        socks5_queue(ctx, ctx->hs->req, ctx->hs->req_len);
+    }
+    else {
+        socks5_log(ctx, "Sending auth method negotiation");
+        if(ctx->proxy->use_auth) {
+            socks5_queue(ctx, greet_auth, sizeof(greet_auth));
+        }
+        else {
+            socks5_queue(ctx, ctx->proxy->hello, ctx->proxy->greet_len);
+        }
+    }
+    socks5_send_then(ctx, SOCKS5_ST_METHOD);
+}
+
+static int socks5_connect_to_proxy(socks5_ctx* ctx);
+
+/* queue CONNECT, or stop here when the ctx is only being negotiated */
+static int socks5_send_request(socks5_ctx* ctx) {
+    if(ctx->hs->req_len == 0) {
+        ctx->state = SOCKS5_ST_DONE;
+        return 0;
+    }
+    socks5_queue(ctx, ctx->hs->req, ctx->hs->req_len);
+    socks5_send_then(ctx, SOCKS5_ST_REPLY);
+    return 0;
+}
+
+static int socks5_on_method(socks5_ctx* ctx) {
+    const unsigned char* msg = ctx->hs->in + ctx->hs->in_off;
+    int method = msg[1];
+
+    if(msg[0] != SOCKS5_VERSION) {
+        socks5_set_error(ctx, -1, "Invalid SOCKS version in method reply");
+        return -1;
+    }
+    socks5_consume(ctx, 2);
+
+    if(ctx->pipelined) {
+        if(method != ctx->proxy->hello[2]) {
+            socks5_log(ctx, "Proxy selected auth method %d, falling back to sequential handshake", method);
+            if(ctx->nonblock) {
+                // a new socket would not be the fd the caller is already polling
+                socks5_set_error(ctx, method, "Proxy rejected pipelined handshake");
+                return -1;
+            }
+
+            // proxy already saw our auth/CONNECT bytes, start over on a fresh conn
+            socks5_abort(ctx);
+            if(socks5_connect_to_proxy(ctx) < 0) {
+                return -1;
+            }
+            socks5_start_handshake(ctx, 0);
+            return 0;
+        }
+
+        socks5_expect(ctx, ctx->proxy->use_auth ? SOCKS5_ST_AUTH : SOCKS5_ST_REPLY);
+        return 0;
+    }
+
+    if(method == SOCKS5_AUTH_NO_ACCEPT) {
+        socks5_set_error(ctx, SOCKS5_AUTH_NO_ACCEPT, "No acceptable auth method");
         return -1;
     }
 
-    if(buff[0] != SOCKS5_VERSION) {
-        close(ctx->proxy_sock);
-        ctx->proxy_sock = -1;
+    // if uname, passwd auth, send creds
+    if(method == SOCKS5_AUTH_PASSWORD) {
+        if(!ctx->proxy->use_auth) {
+            socks5_set_error(ctx, method, "Proxy requires authentication");
+            return -1;
+        }
+
+        socks5_log(ctx, "Performing username/password authentication");
+
+        // sub-negotiation is pre-serialized right after the greeting
+        socks5_queue(ctx, ctx->proxy->hello + ctx->proxy->greet_len, ctx->proxy->auth_len);
+        socks5_send_then(ctx, SOCKS5_ST_AUTH);
+        return 0;
+    }
+
+    if(method != SOCKS5_AUTH_NONE) {
+        socks5_set_error(ctx, method, "Unsupported auth method: %d", method);
+        return -1;
+    }
+
+    return socks5_send_request(ctx);
+}
+
+static int socks5_on_auth(socks5_ctx* ctx) {
+    const unsigned char* msg = ctx->hs->in + ctx->hs->in_off;
+
+    if(msg[1] != 0) {
+        socks5_set_error(ctx, msg[1], "Username/password authentication failed");
+        return -1;
+    }
+    socks5_consume(ctx, 2);
+
+    socks5_log(ctx, "Authentication successfull");
+
+    if(ctx->pipelined) {
+        socks5_expect(ctx, SOCKS5_ST_REPLY);
+        return 0;
+    }
+
+    return socks5_send_request(ctx);
+}
+
+static int socks5_on_reply(socks5_ctx* ctx) {
+    const unsigned char* msg = ctx->hs->in + ctx->hs->in_off;
+
+    if(msg[0] != SOCKS5_VERSION) {
+        socks5_set_error(ctx, -1, "Invalid SOCKS version in reply");
         return -1;
     }
 
     // check res status
-    if(buff[1] != SOCKS5_REP_SUCCESS) {
-        const char* error_msg = "Unknown error";
+    if(msg[1] != SOCKS5_REP_SUCCESS) {
+        socks5_set_error(ctx, msg[1], "%s", socks5_reply_str(msg[1]));
+        ctx->reply = msg[1];
+        return -1;
+    }
 
-        switch(buff[1]) {
-            case SOCKS5_REP_GEN_FAILURE:
-                error_msg = "General SOCKS server failure";
-                break;
-            case SOCKS5_REP_CONN_DENIED:
-                error_msg = "Connection not allowed by ruleset";
-                break;
-            case SOCKS5_REP_NET_UNREACH:
-                error_msg = "Network unreachable";
-                break;
-            case SOCKS5_REP_HOST_UNREACH:
-                error_msg = "Host unreachable";
-                break;
-            case SOCKS5_REP_CONN_REFUSED:
-                error_msg = "Connection refused";
-                break;
-            case SOCKS5_REP_TTL_EXPIRED:
-                error_msg = "TTL expired";
+    // bound addr and port are read and dropped after CONNECT
+    int atyp = msg[3];
+    int total;
+
+    if(atyp == SOCKS5_ADDR_IPV4) {
+        total = 4 + 4 + 2;
+    } else if(atyp == SOCKS5_ADDR_IPV6) {
+        total = 4 + 16 + 2;
+    } else if(atyp == SOCKS5_ADDR_DOMAIN) {
+        total = 4 + 1 + msg[4] + 2;
+    }
+    else { 
+        socks5_set_error(ctx, -1, "Unknown addr type in res: %d", atyp);
+        return -1;
+    }
+
+    if(ctx->hs->in_len - ctx->hs->in_off < total) {
+        ctx->hs->in_need = total;
+        return 0;
+    }
+
+    // kept for RESOLVE and UDP ASSOCIATE, where it is the answer
+    if(ctx->cmd != SOCKS5_CMD_CONNECT) {
+        memcpy(ctx->hs->bound, msg + 3, total - 3);
+    }
+    socks5_consume(ctx, total);
+    ctx->state = SOCKS5_ST_DONE;
+    return 0;
+}
+
+static void socks5_stats_start(socks5_ctx* ctx, int fresh) {
+    ctx->hs->t_start = socks5_stats_enabled() ? socks5_stats_now() : 0;
+    ctx->hs->t_proxy = fresh ? 0 : ctx->hs->t_start;
+    ctx->hs->t_nego = 0;
+    ctx->hs->t_fresh = fresh;
+}
+
+/* record the phases of a timed attempt, or its failure by reply code.
+ * must run before socks5_abort resets the state */
+static void socks5_stats_done(socks5_ctx* ctx, int ret) {
+    if(!ctx->hs || !ctx->hs->t_start) {
+        return;
+    }
+
+    if(ret < 0) {
+        int code = SOCKS5_STATS_CODE_OTHER;
+        const unsigned char* msg = ctx->hs->in + ctx->hs->in_off;
+        if(ctx->state == SOCKS5_ST_REPLY && ctx->hs->in_len - ctx->hs->in_off >= 2 && msg[0] == SOCKS5_VERSION) {
+            code = msg[1];
+        }
+        socks5_stats_code(code);
+        ctx->hs->t_start = 0;
+        return;
+    }
+
+    uint64_t now = socks5_stats_now();
+    if(ctx->hs->t_fresh && ctx->hs->t_proxy && ctx->hs->t_nego) {
+        socks5_stats_add(SOCKS5_PHASE_PROXY, ctx->hs->t_proxy - ctx->hs->t_start);
+        socks5_stats_add(SOCKS5_PHASE_NEGOTIATE, ctx->hs->t_nego - ctx->hs->t_proxy);
+    }
+    if(ctx->hs->t_nego) {
+        socks5_stats_add(SOCKS5_PHASE_REPLY, now - ctx->hs->t_nego);
+    }
+    socks5_stats_add(SOCKS5_PHASE_TOTAL, now - ctx->hs->t_start);
+    socks5_stats_code(0);
+    ctx->hs->t_start = 0;
+}
+
+/* in_need bytes of the current message are buffered */
+static int socks5_on_message(socks5_ctx* ctx) {
+    if(ctx->tfo_check) {
+        socks5_fastopen_check(ctx);
+    }
+    if(ctx->state == SOCKS5_ST_METHOD) {
+        return socks5_on_method(ctx);
+    }
+    if(ctx->state == SOCKS5_ST_AUTH) {
+        return socks5_on_auth(ctx);
+    }
+    return socks5_on_reply(ctx);
+}
+
+static int socks5_step(socks5_ctx* ctx) {
+    for(;;) {
+        int ret = 0;
+
+        switch(ctx->state) {
+            case SOCKS5_ST_DONE:
+                socks5_stats_done(ctx, 0);
+                return 0;
+            case SOCKS5_ST_SEND:
+                ret = socks5_flush(ctx);
+                if(ret == 0) {
+                    socks5_expect(ctx, ctx->next_state);
+                }
                 break;
-            case SOCKS5_REP_CMD_NOTSUP:
-                error_msg = "Command not supported";
+            case SOCKS5_ST_METHOD:
+            case SOCKS5_ST_AUTH:
+            case SOCKS5_ST_REPLY:
+                ret = socks5_fill(ctx);
+                if(ret == 0) {
+                    ret = socks5_on_message(ctx);
+                }
                 break;
-            case SOCKS5_REP_ADDR_NOTSUP:
-                error_msg = "Address type not supported";
+            default:
+                socks5_set_error(ctx, -1, "No handshake in progress");
+                ret = -1;
                 break;
         }
 
-        close(ctx->proxy_sock);
-        ctx->proxy_sock = -1;
+        if(ret < 0) {
+            socks5_stats_done(ctx, -1);
+            return socks5_abort(ctx);
+        }
+        if(ret > 0) {
+            return ret;
+        }
+    }
+}
+
+int socks5_connect_step(socks5_ctx* ctx) {
+    if(!ctx || ctx->proxy_sock < 0) {
         return -1;
     }
+    return socks5_hs_settle(ctx, socks5_step(ctx));
+}
 
-    // skip rest of res (bound addr and port)
-    int atyp = buff[3];
-    int addr_len = 0;
+/* build request and queue handshake, proxy sock must be open */
+static int socks5_begin(socks5_ctx* ctx, const char* host, uint16_t port, int fresh) {
+    if(socks5_build_request(ctx, host, port) < 0) {
+        return -1;
+    }
 
-    if(atyp == SOCKS5_ADDR_IPV4) {
-        addr_len = 4;
-    } else if(atyp == SOCKS5_ADDR_IPV6) {
-        addr_len = 16;
-    } else if(atyp == SOCKS5_ADDR_DOMAIN) {
-        // first read domain len byte
-        n = read(ctx->proxy_sock, buff, 1);
-        if(n != 1) {
-            close(ctx->proxy_sock);
-            ctx->proxy_sock = -1;
-            return -1;
+    if(fresh) {
+        socks5_start_handshake(ctx, ctx->pipeline);
+    }
+    else {
+        // already negotiated, only CONNECT is left
+        ctx->hs->out_cnt = 0;
+        ctx->hs->in_off = 0;
+        ctx->hs->in_len = 0;
+        socks5_queue(ctx, ctx->hs->req, ctx->hs->req_len);
+        socks5_send_then(ctx, SOCKS5_ST_REPLY);
+    }
+    return 0;
+}
+
+int socks5_connect_start(socks5_ctx* ctx, const char* host, uint16_t port) {
+    if(!ctx || !host) {
+        return -1;
+    }
+
+    if(socks5_hs_begin(ctx) < 0) {
+        return -1;
+    }
+
+    socks5_log(ctx, "Starting non-blocking connect to %s:%d", host, port);
+
+    int fresh = ctx->proxy_sock < 0;
+    ctx->nonblock = 1;
+    socks5_stats_start(ctx, fresh);
+    if(fresh && socks5_connect_to_proxy(ctx) < 0) {
+        socks5_log(ctx, "Failed to connect to proxy");
+        socks5_stats_done(ctx, -1);
+        return socks5_hs_settle(ctx, -1);
+    }
+
+    if(socks5_begin(ctx, host, port, fresh) < 0) {
+        socks5_stats_done(ctx, -1);
+        return socks5_hs_settle(ctx, socks5_abort(ctx));
+    }
+    return ctx->proxy_sock;
+}
+
+/* like socks5_connect_start, but the proxy connect is left to the
+ * caller: returns a new non-blocking sock and the proxy addr to connect
+ * it to, *addr_len 0 when ctx already has a negotiated sock. the
+ * handshake is then driven with socks5_io_prepare/_sent/_received */
+int socks5_connect_prepare(socks5_ctx* ctx, const char* host, uint16_t port,
+                           struct sockaddr_storage* addr, socklen_t* addr_len) {
+    if(!ctx || !host || !addr || !addr_len) {
+        return -1;
+    }
+
+    if(socks5_hs_begin(ctx) < 0) {
+        return -1;
+    }
+
+    int fresh = ctx->proxy_sock < 0;
+    ctx->nonblock = 1;
+    *addr_len = 0;
+    socks5_stats_start(ctx, fresh);
+
+    if(fresh) {
+        if(socks5_resolve(ctx) < 0) {
+            socks5_stats_done(ctx, -1);
+            return socks5_hs_settle(ctx, -1);
+        }
+        // no Fast Open here, the caller's connect and send can't take EINPROGRESS
+        ctx->tfo = SOCKS5_TFO_OFF;
+        ctx->tfo_check = 0;
+
+        // first addr only, trying the next one needs a round trip back here
+        for(int i = 0; i < ctx->ep->count && ctx->proxy_sock < 0; i++) {
+            ctx->proxy_sock = socket(ctx->ep->addrs[i].addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            memcpy(addr, &ctx->ep->addrs[i].addr, ctx->ep->addrs[i].len);
+            *addr_len = ctx->ep->addrs[i].len;
+        }
+        if(ctx->proxy_sock < 0) {
+            socks5_set_error(ctx, errno, "Failed to create socket: %s", strerror(errno));
+            socks5_stats_done(ctx, -1);
+            return socks5_hs_settle(ctx, -1);
         }
-        addr_len = buff[0];
     }
-    else { 
-        socks5_log(ctx, "Unknown addr type in res: %d", atyp);
-        close(ctx->proxy_sock);
-        ctx->proxy_sock = -1;
+
+    if(socks5_begin(ctx, host, port, fresh) < 0) {
+        socks5_stats_done(ctx, -1);
+        return socks5_hs_settle(ctx, socks5_abort(ctx));
+    }
+    return ctx->proxy_sock;
+}
+
+/* what the handshake waits for: bytes to send, and the buffer the next
+ * bytes from the proxy go to. recv_buf is also set while sending, the
+ * reply read can be queued right behind the write */
+int socks5_io_prepare(socks5_ctx* ctx, socks5_io* io) {
+    if(!ctx || !io || ctx->proxy_sock < 0) {
         return -1;
     }
 
-    // skip addr and port
-    unsigned char skip_buff[MAX_BUFFER_SIZE];
-    int remaining = addr_len + 2;
+    io->send_cnt = 0;
+    io->recv_buf = NULL;
+    io->recv_len = 0;
 
-    while(remaining > 0) {
-        n = read(ctx->proxy_sock, skip_buff, remaining > MAX_BUFFER_SIZE ? MAX_BUFFER_SIZE : remaining);
-        if(n <= 0) {
-            close(ctx->proxy_sock);
-            ctx->proxy_sock = -1;
-            return -1;
+    if(ctx->state == SOCKS5_ST_DONE) {
+        return 0;
+    }
+    if(ctx->state == SOCKS5_ST_SEND) {
+        for(int i = ctx->hs->out_idx; i < ctx->hs->out_cnt; i++) {
+            io->send[io->send_cnt++] = ctx->hs->out[i];
         }
-        remaining -= n;
+    }
+    else if(ctx->state < SOCKS5_ST_METHOD || ctx->state > SOCKS5_ST_REPLY) {
+        return -1;
+    }
+
+    socks5_compact(ctx);
+    io->recv_buf = ctx->hs->in + ctx->hs->in_len;
+    io->recv_len = SOCKS5_IN_BUF - ctx->hs->in_len;
+    return io->send_cnt ? SOCKS5_WANT_WRITE : SOCKS5_WANT_READ;
+}
+
+/* failed completion, res is -errno */
+static int socks5_io_failed(socks5_ctx* ctx, int res, const char* what) {
+    socks5_set_error(ctx, -res, "Failed to %s proxy: %s", what, strerror(-res));
+    socks5_stats_done(ctx, -1);
+    return socks5_hs_settle(ctx, socks5_abort(ctx));
+}
+
+/* a write of the prepared send iovecs completed with res, bytes or
+ * -errno. 0 done, -1 failed and closed, or what to prepare next */
+int socks5_io_sent(socks5_ctx* ctx, int res) {
+    if(!ctx || ctx->proxy_sock < 0 || ctx->state != SOCKS5_ST_SEND) {
+        return -1;
+    }
+    if(res < 0) {
+        return socks5_io_failed(ctx, res, "send to");
+    }
+
+    socks5_sent(ctx, res);
+    if(ctx->hs->out_idx < ctx->hs->out_cnt) {
+        return SOCKS5_WANT_WRITE;
+    }
+    ctx->hs->out_cnt = 0;
+    socks5_expect(ctx, ctx->next_state);
+    if(ctx->state == SOCKS5_ST_DONE) {
+        return socks5_hs_settle(ctx, 0);
+    }
+    return SOCKS5_WANT_READ;
+}
+
+/* a read into the prepared recv_buf completed with res, bytes or -errno */
+int socks5_io_received(socks5_ctx* ctx, int res) {
+    if(!ctx || ctx->proxy_sock < 0 || ctx->state < SOCKS5_ST_METHOD || ctx->state > SOCKS5_ST_REPLY) {
+        return -1;
+    }
+    if(res < 0) {
+        return socks5_io_failed(ctx, res, "read from");
+    }
+    if(res == 0) {
+        socks5_set_error(ctx, ECONNRESET, "Proxy closed connection during handshake");
+        socks5_stats_done(ctx, -1);
+        return socks5_hs_settle(ctx, socks5_abort(ctx));
+    }
+
+    ctx->hs->in_len += res;
+    while(ctx->state >= SOCKS5_ST_METHOD && ctx->state <= SOCKS5_ST_REPLY &&
+          ctx->hs->in_len - ctx->hs->in_off >= ctx->hs->in_need) {
+        if(socks5_on_message(ctx) < 0) {
+            socks5_stats_done(ctx, -1);
+            return socks5_hs_settle(ctx, socks5_abort(ctx));
+        }
+    }
+
+    if(ctx->state == SOCKS5_ST_DONE) {
+        socks5_stats_done(ctx, 0);
+        return socks5_hs_settle(ctx, 0);
+    }
+    return ctx->state == SOCKS5_ST_SEND ? SOCKS5_WANT_WRITE : SOCKS5_WANT_READ;
+}
+
+/* give up on a handshake driven by the caller, or one never started,
+ * err is an errno */
+void socks5_io_cancel(socks5_ctx* ctx, int err) {
+    if(!ctx) {
+        return;
+    }
+    if(err == ETIMEDOUT) {
+        socks5_set_error(ctx, err, "Timed out waiting for proxy");
+    }
+    else {
+        socks5_set_error(ctx, err, "Proxy handshake failed: %s", strerror(err));
+    }
+    socks5_stats_done(ctx, -1);
+    if(ctx->proxy_sock >= 0) {
+        socks5_abort(ctx);
+    }
+    socks5_hs_settle(ctx, -1);
+}
+
+int socks5_connect(socks5_ctx* ctx, const char* host, uint16_t port) { 
+    if(!ctx || !host) {
+        return -1;
+    }
+
+    if(socks5_hs_begin(ctx) < 0) {
+        return -1;
+    }
+
+    socks5_log(ctx, "Connecting to destination: %s:%d", host, port);
+
+    // connect to proxy if not connected
+    int fresh = ctx->proxy_sock < 0;
+    ctx->nonblock = 0;
+    socks5_deadline_start(ctx);
+    socks5_stats_start(ctx, fresh);
+    if(fresh && socks5_connect_to_proxy(ctx) < 0) {
+        socks5_log(ctx, "Failed to connect to proxy");
+        socks5_stats_done(ctx, -1);
+        return socks5_hs_settle(ctx, -1);
+    }
+
+    if(socks5_begin(ctx, host, port, fresh) < 0) {
+        socks5_stats_done(ctx, -1);
+        socks5_restore_timeouts(ctx);
+        return socks5_hs_settle(ctx, socks5_abort(ctx));
+    }
+
+    // blocking sock, a WANT_* here means the deadline passed
+    int ret = socks5_step(ctx);
+    socks5_restore_timeouts(ctx);
+    if(ret > 0) {
+        socks5_set_error(ctx, ETIMEDOUT, "Timed out waiting for proxy");
+        socks5_stats_done(ctx, -1);
+        return socks5_hs_settle(ctx, socks5_abort(ctx));
+    }
+    if(ret < 0) {
+        socks5_log(ctx, "Failed to do handshake");
+        return socks5_hs_settle(ctx, -1);
     }
 
     socks5_log(ctx, "Successfully connected to %s:%d via SOCKS5 proxy", host, port);
-    return ctx->proxy_sock;
+    return socks5_hs_settle(ctx, ctx->proxy_sock);
 
 };
 
+/* one Tor lookup on a proxy conn of its own, or the negotiated sock
+ * from socks5_attach. Tor ends the stream after answering, the answer
+ * is copied to bound */
+static int socks5_lookup(socks5_ctx* ctx, int cmd, const char* host, unsigned char* bound) {
+    int app_sock = ctx->app_sock;
+    ctx->app_sock = -1;
+    ctx->cmd = cmd;
+    int ret = socks5_connect(ctx, host, 0);
+    ctx->cmd = SOCKS5_CMD_CONNECT;
+    ctx->app_sock = app_sock;
+    socks5_close(ctx);
+    if(ret < 0) {
+        return -1;
+    }
+    memcpy(bound, ctx->hs->bound, SOCKS5_BND_LEN);
+    socks5_hs_release(ctx);
+    return 0;
+}
+
+/* resolve host through Tor with RESOLVE, the exit does the DNS lookup.
+ * a name that doesn't resolve fails with the proxy's reply code,
+ * usually SOCKS5_REP_HOST_UNREACH. blocking */
+int socks5_tor_resolve(socks5_ctx* ctx, const char* host, struct sockaddr_storage* addr, socklen_t* addr_len) {
+    unsigned char bound[SOCKS5_BND_LEN];
+
+    if(!ctx || !host || !addr || !addr_len) {
+        return -1;
+    }
+
+    socks5_log(ctx, "Resolving %s through the proxy", host);
+    if(socks5_lookup(ctx, SOCKS5_CMD_RESOLVE, host, bound) < 0) {
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    if(bound[0] == SOCKS5_ADDR_IPV4) {
+        struct sockaddr_in* sin = (struct sockaddr_in*)addr;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, bound + 1, 4);
+        *addr_len = sizeof(struct sockaddr_in);
+        return 0;
+    }
+    if(bound[0] == SOCKS5_ADDR_IPV6) {
+        struct sockaddr_in6* sin6 = (struct sockaddr_in6*)addr;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, bound + 1, 16);
+        *addr_len = sizeof(struct sockaddr_in6);
+        return 0;
+    }
+    socks5_set_error(ctx, -1, "RESOLVE answered with addr type %d", bound[0]);
+    return -1;
+}
+
+/* name of addr through Tor with RESOLVE_PTR, the port is ignored. blocking */
+int socks5_tor_resolve_ptr(socks5_ctx* ctx, const struct sockaddr* addr, char* host, size_t host_len) {
+    char literal[INET6_ADDRSTRLEN];
+    unsigned char bound[SOCKS5_BND_LEN];
+
+    if(!ctx || !addr || !host || host_len == 0) {
+        return -1;
+    }
+
+    if(addr->sa_family == AF_INET) {
+        inet_ntop(AF_INET, &((const struct sockaddr_in*)addr)->sin_addr, literal, sizeof(literal));
+    }
+    else if(addr->sa_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6*)addr)->sin6_addr, literal, sizeof(literal));
+    }
+    else {
+        socks5_set_error(ctx, EAFNOSUPPORT, "RESOLVE_PTR needs an IPv4 or IPv6 addr");
+        return -1;
+    }
+
+    socks5_log(ctx, "Resolving %s back to a name through the proxy", literal);
+    if(socks5_lookup(ctx, SOCKS5_CMD_RESOLVE_PTR, literal, bound) < 0) {
+        return -1;
+    }
+
+    if(bound[0] != SOCKS5_ADDR_DOMAIN) {
+        socks5_set_error(ctx, -1, "RESOLVE_PTR answered with addr type %d", bound[0]);
+        return -1;
+    }
+    size_t len = bound[1];
+    if(len >= host_len) {
+        socks5_set_error(ctx, ENOSPC, "Name of %s too long for the buffer", literal);
+        return -1;
+    }
+    memcpy(host, bound + 2, len);
+    host[len] = '\0';
+    return 0;
+}
+
+/* UDP ASSOCIATE: *relay is where datagrams go, with the header from
+ * socks5_udp_header in front. the association lasts as long as the
+ * proxy conn, the returned sock, stays open. a relay given as the
+ * unspecified addr is the proxy's own. blocking */
+int socks5_udp_associate(socks5_ctx* ctx, struct sockaddr_storage* relay, socklen_t* relay_len) {
+    if(!ctx || !relay || !relay_len) {
+        return -1;
+    }
+
+    // we don't know the addr we'll send from yet, 0.0.0.0:0 says so
+    ctx->cmd = SOCKS5_CMD_UDP_ASSOC;
+    int app_sock = ctx->app_sock;
+    ctx->app_sock = -1;
+    int ret = socks5_connect(ctx, "0.0.0.0", 0);
+    ctx->app_sock = app_sock;
+    ctx->cmd = SOCKS5_CMD_CONNECT;
+    if(ret < 0) {
+        return -1;
+    }
+
+    // the handshake state goes now, the association may last long
+    unsigned char bnd[SOCKS5_BND_LEN];
+    memcpy(bnd, ctx->hs->bound, SOCKS5_BND_LEN);
+    socks5_hs_release(ctx);
+
+    memset(relay, 0, sizeof(*relay));
+    if(bnd[0] == SOCKS5_ADDR_IPV4) {
+        struct sockaddr_in* sin = (struct sockaddr_in*)relay;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, bnd + 1, 4);
+        memcpy(&sin->sin_port, bnd + 1 + 4, 2);
+        *relay_len = sizeof(struct sockaddr_in);
+    }
+    else if(bnd[0] == SOCKS5_ADDR_IPV6) {
+        struct sockaddr_in6* sin6 = (struct sockaddr_in6*)relay;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, bnd + 1, 16);
+        memcpy(&sin6->sin6_port, bnd + 1 + 16, 2);
+        *relay_len = sizeof(struct sockaddr_in6);
+    }
+    else {
+        socks5_set_error(ctx, SOCKS5_REP_ADDR_NOTSUP, "UDP relay given by name, not supported");
+        ctx->reply = SOCKS5_REP_ADDR_NOTSUP;
+        socks5_close(ctx);
+        return -1;
+    }
+
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    int unspec = (relay->ss_family == AF_INET)
+        ? ((struct sockaddr_in*)relay)->sin_addr.s_addr == htonl(INADDR_ANY)
+        : IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6*)relay)->sin6_addr);
+    if(unspec && getpeername(ctx->proxy_sock, (struct sockaddr*)&peer, &peer_len) == 0) {
+        uint16_t port = ((struct sockaddr_in*)relay)->sin_port;   // same offset in both
+        memcpy(relay, &peer, peer_len);
+        *relay_len = peer_len;
+        ((struct sockaddr_in*)relay)->sin_port = port;
+    }
+
+    socks5_log(ctx, "UDP association open");
+    return ctx->proxy_sock;
+}
+
+/* new ctx with the settings of tmpl, sharing its proxy and endpoint */
+static socks5_ctx* socks5_clone(const socks5_ctx* tmpl) {
+    socks5_ctx* ctx = socks5_create_ctx_proxy(tmpl->proxy);
+    if(!ctx) {
+        return NULL;
+    }
+    ctx->timeout_ms = tmpl->timeout_ms;
+    ctx->timeout_app = tmpl->timeout_app;
+    ctx->verbose = tmpl->verbose;
+    ctx->pipeline = tmpl->pipeline;
+    ctx->fastopen = tmpl->fastopen;
+    socks5_set_endpoint(ctx, tmpl->ep);
+    return ctx;
+}
+
+/* hand the outcome of ctx to t and free ctx */
+static int socks5_many_done(socks5_ctx* ctx, socks5_target* t, int ret) {
+    if(ret == 0) {
+        size_t len = socks5_buffered(ctx);
+        if(len > 0) {
+            t->early = malloc(len);
+            if(!t->early) {
+                t->error = ENOMEM;
+                socks5_free(ctx);
+                return -1;
+            }
+            t->early_len = socks5_read_buffered(ctx, t->early, len, 0);
+        }
+        t->fd = socks5_detach(ctx);
+    }
+    else {
+        t->error = ctx->last_error ? ctx->last_error : -1;
+    }
+    socks5_free(ctx);
+    return ret == 0 ? 0 : -1;
+}
+
+/* connect to all targets through the proxy of ctx at once from this
+ * thread, up to max_inflight handshakes at a time (0 for all). each one
+ * gets a ctx like ctx, all driven by one poll loop. timeout_ms bounds the
+ * whole call, 0 uses the ctx timeout. returns the count connected */
+int socks5_connect_many(socks5_ctx* ctx, socks5_target* targets, int n, int max_inflight, int timeout_ms) {
+    if(!ctx || !targets || n < 0) {
+        return -1;
+    }
+
+    for(int i = 0; i < n; i++) {
+        targets[i].fd = -1;
+        targets[i].error = 0;
+        targets[i].early = NULL;
+        targets[i].early_len = 0;
+    }
+    if(n == 0) {
+        return 0;
+    }
+
+    // resolved once here, shared by every attempt
+    if(socks5_resolve(ctx) < 0) {
+        for(int i = 0; i < n; i++) {
+            targets[i].error = ctx->last_error;
+        }
+        return 0;
+    }
+
+    if(max_inflight <= 0 || max_inflight > n) {
+        max_inflight = n;
+    }
+    struct pollfd* pfds = malloc(sizeof(struct pollfd) * max_inflight);
+    socks5_ctx** slots = malloc(sizeof(socks5_ctx*) * max_inflight);
+    int* owner = malloc(sizeof(int) * max_inflight);    // target of each slot
+    if(!pfds || !slots || !owner) {
+        free(pfds);
+        free(slots);
+        free(owner);
+        return -1;
+    }
+
+    uint64_t deadline = socks5_stats_now() + (uint64_t)(timeout_ms > 0 ? timeout_ms : ctx->timeout_ms) * 1000;
+    int next = 0;
+    int active = 0;
+    int ok = 0;
+    int err = ETIMEDOUT;
+
+    socks5_log(ctx, "Connecting to %d destinations, %d at a time", n, max_inflight);
+
+    for(;;) {
+        while(active < max_inflight && next < n) {
+            socks5_target* t = &targets[next++];
+            socks5_ctx* c = socks5_clone(ctx);
+            if(!c) {
+                t->error = ENOMEM;
+                continue;
+            }
+            int sock = socks5_connect_start(c, t->host, t->port);
+            if(sock < 0) {
+                socks5_many_done(c, t, -1);
+                continue;
+            }
+            slots[active] = c;
+            owner[active] = t - targets;
+            pfds[active].fd = sock;
+            pfds[active].events = POLLOUT;
+            pfds[active].revents = 0;
+            active++;
+        }
+        if(active == 0) {
+            break;
+        }
+
+        uint64_t now = socks5_stats_now();
+        if(now >= deadline) {
+            break;
+        }
+        int ready = poll(pfds, active, (int)((deadline - now + 999) / 1000));
+        if(ready < 0 && errno != EINTR) {
+            err = errno;
+            break;
+        }
+
+        // finished slots are filled from the end, i is looked at again
+        for(int i = 0; ready > 0 && i < active; ) {
+            if(!pfds[i].revents) {
+                i++;
+                continue;
+            }
+
+            int ret = socks5_connect_step(slots[i]);
+            if(ret > 0) {
+                pfds[i].events = ret == SOCKS5_WANT_READ ? POLLIN : POLLOUT;
+                pfds[i].revents = 0;
+                i++;
+                continue;
+            }
+            if(socks5_many_done(slots[i], &targets[owner[i]], ret) == 0) {
+                ok++;
+            }
+            active--;
+            slots[i] = slots[active];
+            owner[i] = owner[active];
+            pfds[i] = pfds[active];
+        }
+    }
+
+    // past the deadline
+    for(int i = 0; i < active; i++) {
+        socks5_io_cancel(slots[i], err);
+        socks5_many_done(slots[i], &targets[owner[i]], -1);
+    }
+    for(; next < n; next++) {
+        targets[next].error = err;
+    }
+
+    free(pfds);
+    free(slots);
+    free(owner);
+    return ok;
+}
+
+/* connect to the proxy and finish method negotiation and auth without
+ * sending CONNECT. blocking, the sock can later be handed to another ctx
+ * with socks5_attach */
+int socks5_negotiate(socks5_ctx* ctx) {
+    if(!ctx) {
+        return -1;
+    }
+
+    if(socks5_hs_begin(ctx) < 0) {
+        return -1;
+    }
+
+    ctx->nonblock = 0;
+    socks5_deadline_start(ctx);
+    if(ctx->proxy_sock < 0 && socks5_connect_to_proxy(ctx) < 0) {
+        return socks5_hs_settle(ctx, -1);
+    }
+
+    // no request, t_start stays 0 and nothing is timed
+    socks5_start_handshake(ctx, 0);
+
+    int ret = socks5_step(ctx);
+    socks5_restore_timeouts(ctx);
+    if(ret > 0) {
+        socks5_set_error(ctx, ETIMEDOUT, "Timed out waiting for proxy");
+        return socks5_hs_settle(ctx, socks5_abort(ctx));
+    }
+    if(ret < 0) {
+        return socks5_hs_settle(ctx, -1);
+    }
+    return socks5_hs_settle(ctx, ctx->proxy_sock);
+}
+
+/* bytes read past the CONNECT reply. they are the start of the
+ * destination's stream and come before anything still in the sock */
+int socks5_buffered(const socks5_ctx* ctx) {
+    if(!ctx || !ctx->hs || ctx->state != SOCKS5_ST_DONE) {
+        return 0;
+    }
+    return ctx->hs->in_len - ctx->hs->in_off;
+}
+
+/* copy out up to len buffered bytes, peek leaves them buffered */
+size_t socks5_read_buffered(socks5_ctx* ctx, void* buf, size_t len, int peek) {
+    size_t n = socks5_buffered(ctx);
+    if(n > len) {
+        n = len;
+    }
+    if(n == 0) {
+        return 0;
+    }
+
+    memcpy(buf, ctx->hs->in + ctx->hs->in_off, n);
+    if(!peek) {
+        socks5_consume(ctx, n);
+        socks5_hs_settle(ctx, 0);
+    }
+    return n;
+}
+
+/* take ownership of the proxy sock away from ctx */
+int socks5_detach(socks5_ctx* ctx) {
+    if(!ctx) {
+        return -1;
+    }
+
+    int sock = ctx->proxy_sock;
+    ctx->proxy_sock = -1;
+    ctx->borrowed = 0;
+    ctx->state = SOCKS5_ST_IDLE;
+    socks5_hs_release(ctx);
+    return sock;
+}
+
+/* use an already negotiated proxy sock, the next connect only sends CONNECT */
+int socks5_attach(socks5_ctx* ctx, int sock) {
+    if(!ctx || sock < 0) {
+        return -1;
+    }
+
+    socks5_close(ctx);
+    socks5_hs_release(ctx);
+    ctx->proxy_sock = sock;
+    ctx->state = SOCKS5_ST_IDLE;
+    return 0;
+}
+
+/* the proxy sock was dup2()ed onto the caller's sock: go on with that
+ * one as if connected there, borrowed, and close our own */
+int socks5_rebind(socks5_ctx* ctx, int sock) {
+    if(!ctx || sock < 0) {
+        return -1;
+    }
+
+    if(ctx->proxy_sock >= 0 && ctx->proxy_sock != sock && !ctx->borrowed) {
+        close(ctx->proxy_sock);
+    }
+    ctx->proxy_sock = sock;
+    ctx->app_sock = sock;
+    ctx->borrowed = 1;
+    return 0;
+}
 
 void socks5_close(socks5_ctx* ctx) {
     if(!ctx) {
         return;
     }
 
+    // a borrowed sock stays open, closing it is up to its owner
+    if(ctx->borrowed) {
+        ctx->proxy_sock = -1;
+        ctx->borrowed = 0;
+    }
     if(ctx->proxy_sock >= 0) {
         close(ctx-> proxy_sock);
         ctx->proxy_sock = -1;
@@ -449,5 +2063,9 @@ void socks5_free(socks5_ctx* ctx) {
     }
 
     socks5_close(ctx);
-    free(ctx);
+    socks5_hs_release(ctx);
+    socks5_endpoint_unref(ctx->ep);
+    socks5_proxy_unref(ctx->proxy);
+    free(ctx->error_msg);
+    slab_free(&socks5_ctx_cache, ctx);
 }
@@ -3,17 +3,95 @@
 
 #include <stdint.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 typedef struct socks5_ctx socks5_ctx;
+typedef struct socks5_endpoint socks5_endpoint;
+typedef struct socks5_proxy socks5_proxy;
+
+/* max resolved addrs kept per proxy endpoint */
+#define SOCKS5_EP_MAX_ADDRS 8
+
+/* socks5_connect_step results besides 0 (done) and -1 (failed) */
+#define SOCKS5_WANT_READ    1
+#define SOCKS5_WANT_WRITE   2
+
+/* TCP Fast Open outcome of the last fresh proxy connect */
+#define SOCKS5_TFO_OFF      0   // not tried
+#define SOCKS5_TFO_SYN_DATA 1   // the proxy took the handshake bytes in the SYN
+#define SOCKS5_TFO_FALLBACK 2   // no cookie yet or the data was not acked, a plain handshake ran
+
+/* one step of a handshake driven by the caller's own I/O loop */
+typedef struct socks5_io {
+    struct iovec send[2];
+    int send_cnt;
+    void* recv_buf;
+    size_t recv_len;
+} socks5_io;
+
+/* one destination of socks5_connect_many. fd is the connected sock, now
+ * the caller's, or -1 with error as socks5_get_error_code gives it.
+ * early holds what the destination sent along with the proxy reply,
+ * it is malloc()ed and comes before anything read from fd */
+typedef struct socks5_target {
+    const char* host;
+    uint16_t port;
+    int fd;
+    int error;
+    void* early;
+    size_t early_len;
+} socks5_target;
+
+socks5_endpoint* socks5_endpoint_create(const char* host, uint16_t port, int* error);
+socks5_endpoint* socks5_endpoint_refresh(const socks5_endpoint* ep, int* error);
+socks5_endpoint* socks5_endpoint_ref(socks5_endpoint* ep);
+void socks5_endpoint_unref(socks5_endpoint* ep);
+const char* socks5_endpoint_host(const socks5_endpoint* ep);
+uint16_t socks5_endpoint_port(const socks5_endpoint* ep);
+
+socks5_proxy* socks5_proxy_create(const char* host, uint16_t port, const char* uname, const char* passwd);
+socks5_proxy* socks5_proxy_ref(socks5_proxy* proxy);
+void socks5_proxy_unref(socks5_proxy* proxy);
+int socks5_proxy_refs(const socks5_proxy* proxy);
 
 socks5_ctx *socks5_create_ctx(const char* host, uint16_t port);
+socks5_ctx* socks5_create_ctx_proxy(socks5_proxy* proxy);
+void socks5_set_endpoint(socks5_ctx* ctx, socks5_endpoint* ep);
+socks5_endpoint* socks5_get_endpoint(socks5_ctx* ctx);
 void socks5_set_auth(socks5_ctx* ctx, const char* uname, const char* passwd);
 void socks5_set_timeout(socks5_ctx* ctx, int timeout_secs);
+void socks5_set_timeout_ms(socks5_ctx* ctx, int timeout_ms);
+void socks5_set_timeout_from_app(socks5_ctx* ctx, int enable);
+void socks5_set_pipelining(socks5_ctx* ctx, int enable);
+void socks5_set_fastopen(socks5_ctx* ctx, int enable);
+int socks5_get_fastopen(const socks5_ctx* ctx);
+void socks5_use_sock(socks5_ctx* ctx, int sock);
 int socks5_connect(socks5_ctx* ctx, const char* host, uint16_t port);
+int socks5_connect_start(socks5_ctx* ctx, const char* host, uint16_t port);
+int socks5_connect_step(socks5_ctx* ctx);
+int socks5_connect_prepare(socks5_ctx* ctx, const char* host, uint16_t port,
+                           struct sockaddr_storage* addr, socklen_t* addr_len);
+int socks5_io_prepare(socks5_ctx* ctx, socks5_io* io);
+int socks5_io_sent(socks5_ctx* ctx, int res);
+int socks5_io_received(socks5_ctx* ctx, int res);
+void socks5_io_cancel(socks5_ctx* ctx, int err);
+int socks5_connect_many(socks5_ctx* ctx, socks5_target* targets, int n, int max_inflight, int timeout_ms);
+int socks5_tor_resolve(socks5_ctx* ctx, const char* host, struct sockaddr_storage* addr, socklen_t* addr_len);
+int socks5_tor_resolve_ptr(socks5_ctx* ctx, const struct sockaddr* addr, char* host, size_t host_len);
+int socks5_udp_associate(socks5_ctx* ctx, struct sockaddr_storage* relay, socklen_t* relay_len);
+int socks5_buffered(const socks5_ctx* ctx);
+size_t socks5_read_buffered(socks5_ctx* ctx, void* buf, size_t len, int peek);
+int socks5_negotiate(socks5_ctx* ctx);
+int socks5_detach(socks5_ctx* ctx);
+int socks5_attach(socks5_ctx* ctx, int sock);
+int socks5_rebind(socks5_ctx* ctx, int sock);
 void socks5_close(socks5_ctx* ctx);
 void socks5_free(socks5_ctx* ctx);
 void socks5_set_verbose(socks5_ctx* ctx, int verbose);
 const char* socks5_get_error(socks5_ctx* ctx);
 int socks5_get_error_code(socks5_ctx* ctx);
+int socks5_get_reply(socks5_ctx* ctx);
 
 #endif // SOCKS5_CLIENT_H
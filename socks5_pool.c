@@ -0,0 +1,331 @@
+#include "socks5_pool.h"
+#include "socks5_proto.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+/* seconds between health checks of idle socks, also the retry delay
+ * after a failed refill */
+#define SOCKS5_POOL_CHECK_SECS 5
+
+struct socks5_pool {
+    int refs;               // owner + refill thread
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    socks5_proxy* proxy;
+    socks5_endpoint* ep;
+    int timeout_ms;         // whole negotiation of one sock
+    int low;
+    int high;
+    int* socks;             // idle negotiated socks, used as a stack
+    int count;
+    int running;
+    int stop;
+    socks5_pool_stats stats;
+    struct socks5_pool* next;
+};
+
+/* every live pool, walked by the fork handlers */
+static struct {
+    socks5_pool* head;
+    pthread_mutex_t mutex;
+    pthread_once_t once;
+} pools = {
+    .head = NULL,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT
+};
+
+static void socks5_pool_unref(socks5_pool* pool) {
+    if(__atomic_sub_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    for(int i = 0; i < pool->count; i++) {
+        close(pool->socks[i]);
+    }
+    socks5_endpoint_unref(pool->ep);
+    socks5_proxy_unref(pool->proxy);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->socks);
+    free(pool);
+}
+
+static void socks5_pool_init_sync(socks5_pool* pool) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&pool->mutex, NULL);
+}
+
+/* idle socks must not be shared with a forked child, two processes
+ * would end up sending CONNECT on the same proxy conn */
+static void socks5_pool_fork_prepare(void) {
+    pthread_mutex_lock(&pools.mutex);
+    for(socks5_pool* p = pools.head; p; p = p->next) {
+        pthread_mutex_lock(&p->mutex);
+    }
+}
+
+static void socks5_pool_fork_parent(void) {
+    for(socks5_pool* p = pools.head; p; p = p->next) {
+        pthread_mutex_unlock(&p->mutex);
+    }
+    pthread_mutex_unlock(&pools.mutex);
+}
+
+static void socks5_pool_fork_child(void) {
+    for(socks5_pool* p = pools.head; p; p = p->next) {
+        for(int i = 0; i < p->count; i++) {
+            close(p->socks[i]);
+        }
+        p->count = 0;
+        if(p->running) {
+            // the refill thread did not survive the fork, drop its ref
+            p->running = 0;
+            p->refs--;
+        }
+        socks5_pool_init_sync(p);
+    }
+    pthread_mutex_init(&pools.mutex, NULL);
+}
+
+static void socks5_pool_register_fork(void) {
+    pthread_atfork(socks5_pool_fork_prepare, socks5_pool_fork_parent, socks5_pool_fork_child);
+}
+
+socks5_pool* socks5_pool_create(socks5_proxy* proxy, socks5_endpoint* ep, int low, int high) {
+    if(!proxy || !ep || high <= 0) {
+        return NULL;
+    }
+    if(low > high) {
+        low = high;
+    }
+
+    socks5_pool* pool = calloc(1, sizeof(socks5_pool));
+    if(!pool) {
+        return NULL;
+    }
+    pool->socks = malloc(high * sizeof(int));
+    if(!pool->socks) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->refs = 1;
+    pool->proxy = socks5_proxy_ref(proxy);
+    pool->ep = socks5_endpoint_ref(ep);
+    pool->timeout_ms = DEFAULT_TIMEOUT * 1000;
+    pool->low = low;
+    pool->high = high;
+    socks5_pool_init_sync(pool);
+
+    pthread_once(&pools.once, socks5_pool_register_fork);
+    pthread_mutex_lock(&pools.mutex);
+    pool->next = pools.head;
+    pools.head = pool;
+    pthread_mutex_unlock(&pools.mutex);
+    return pool;
+}
+
+/* stop refilling and close idle socks. a refill thread blocked on the
+ * proxy holds its own ref and frees the pool when it gets out */
+void socks5_pool_destroy(socks5_pool* pool) {
+    if(!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pools.mutex);
+    for(socks5_pool** p = &pools.head; *p; p = &(*p)->next) {
+        if(*p == pool) {
+            *p = pool->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pools.mutex);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = 1;
+    for(int i = 0; i < pool->count; i++) {
+        close(pool->socks[i]);
+    }
+    pool->count = 0;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    socks5_pool_unref(pool);
+}
+
+void socks5_pool_set_timeout_ms(socks5_pool* pool, int timeout_ms) {
+    if(!pool || timeout_ms <= 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    pool->timeout_ms = timeout_ms;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* new socks go to ep, idle ones to the old proxy are left to the health
+ * check */
+void socks5_pool_set_endpoint(socks5_pool* pool, socks5_endpoint* ep) {
+    if(!pool || !ep) {
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    socks5_endpoint* old = pool->ep;
+    pool->ep = socks5_endpoint_ref(ep);
+    pthread_mutex_unlock(&pool->mutex);
+    socks5_endpoint_unref(old);
+}
+
+/* an idle negotiated sock has nothing to read, EOF or stray bytes mean
+ * the proxy gave up on it */
+static int socks5_pool_healthy(int sock) {
+    char c;
+    ssize_t n = recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void socks5_pool_check(socks5_pool* pool) {
+    for(int i = 0; i < pool->count;) {
+        if(socks5_pool_healthy(pool->socks[i])) {
+            i++;
+            continue;
+        }
+        close(pool->socks[i]);
+        pool->socks[i] = pool->socks[--pool->count];
+        pool->stats.dropped++;
+    }
+}
+
+/* one negotiated sock, called without the pool lock */
+static int socks5_pool_open(socks5_proxy* proxy, socks5_endpoint* ep, int timeout_ms) {
+    socks5_ctx* ctx = socks5_create_ctx_proxy(proxy);
+    if(!ctx) {
+        return -1;
+    }
+
+    socks5_set_endpoint(ctx, ep);
+    socks5_set_timeout_ms(ctx, timeout_ms);
+
+    int sock = -1;
+    if(socks5_negotiate(ctx) >= 0) {
+        sock = socks5_detach(ctx);
+        // handed to the app via dup2, which clears it on the app fd
+        fcntl(sock, F_SETFD, FD_CLOEXEC);
+    }
+    socks5_free(ctx);
+    return sock;
+}
+
+static void socks5_pool_wait(socks5_pool* pool) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += SOCKS5_POOL_CHECK_SECS;
+    pthread_cond_timedwait(&pool->cond, &pool->mutex, &ts);
+}
+
+static void* socks5_pool_refill(void* arg) {
+    socks5_pool* pool = arg;
+
+    pthread_mutex_lock(&pool->mutex);
+    while(!pool->stop) {
+        socks5_pool_check(pool);
+
+        if(pool->count > pool->low || pool->count >= pool->high) {
+            socks5_pool_wait(pool);
+            continue;
+        }
+
+        while(!pool->stop && pool->count < pool->high) {
+            socks5_endpoint* ep = socks5_endpoint_ref(pool->ep);
+            int timeout_ms = pool->timeout_ms;
+            pthread_mutex_unlock(&pool->mutex);
+
+            int sock = socks5_pool_open(pool->proxy, ep, timeout_ms);
+            socks5_endpoint_unref(ep);
+
+            pthread_mutex_lock(&pool->mutex);
+            if(sock < 0) {
+                // proxy down, retry on the next check instead of spinning
+                socks5_pool_wait(pool);
+                break;
+            }
+            if(pool->stop || pool->count >= pool->high) {
+                close(sock);
+                break;
+            }
+            pool->socks[pool->count++] = sock;
+            pool->stats.opened++;
+        }
+    }
+    pool->running = 0;
+    pthread_mutex_unlock(&pool->mutex);
+
+    socks5_pool_unref(pool);
+    return NULL;
+}
+
+/* negotiated sock or -1 when the pool is empty. the refill thread is
+ * started on first use so processes that never connect open nothing */
+int socks5_pool_get(socks5_pool* pool) {
+    int sock = -1;
+
+    if(!pool) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    if(!pool->running && !pool->stop) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        __atomic_add_fetch(&pool->refs, 1, __ATOMIC_RELAXED);
+        if(pthread_create(&thread, &attr, socks5_pool_refill, pool) == 0) {
+            pool->running = 1;
+        }
+        else {
+            __atomic_sub_fetch(&pool->refs, 1, __ATOMIC_RELAXED);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    while(pool->count > 0) {
+        sock = pool->socks[--pool->count];
+        if(socks5_pool_healthy(sock)) {
+            break;
+        }
+        close(sock);
+        pool->stats.dropped++;
+        sock = -1;
+    }
+
+    if(sock >= 0) {
+        pool->stats.hits++;
+    }
+    else {
+        pool->stats.misses++;
+    }
+    if(pool->count <= pool->low) {
+        pthread_cond_signal(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return sock;
+}
+
+void socks5_pool_get_stats(socks5_pool* pool, socks5_pool_stats* stats) {
+    if(!pool || !stats) {
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->mutex);
+}
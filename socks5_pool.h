@@ -0,0 +1,28 @@
+#ifndef SOCKS5_POOL_H
+#define SOCKS5_POOL_H
+
+#include <stdint.h>
+#include "socks5_client.h"
+
+/* proxy socks that are connected and past method negotiation/auth, so a
+ * connection taken from the pool only pays for CONNECT. every sock is
+ * opened through the one proxy (and its credentials) the pool holds. a background
+ * thread refills up to high once the pool drops to low and drops idle
+ * socks the proxy has closed */
+typedef struct socks5_pool socks5_pool;
+
+typedef struct socks5_pool_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t opened;
+    uint64_t dropped;   // idle socks that failed a health check
+} socks5_pool_stats;
+
+socks5_pool* socks5_pool_create(socks5_proxy* proxy, socks5_endpoint* ep, int low, int high);
+void socks5_pool_destroy(socks5_pool* pool);
+void socks5_pool_set_timeout_ms(socks5_pool* pool, int timeout_ms);
+void socks5_pool_set_endpoint(socks5_pool* pool, socks5_endpoint* ep);
+int socks5_pool_get(socks5_pool* pool);
+void socks5_pool_get_stats(socks5_pool* pool, socks5_pool_stats* stats);
+
+#endif // SOCKS5_POOL_H
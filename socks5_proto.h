@@ -13,6 +13,11 @@
 #define SOCKS5_CMD_BIND         0x02
 #define SOCKS5_CMD_UDP_ASSOC    0x03
 
+/* Tor extensions, the answer comes back in BND.ADDR and Tor closes
+ * the stream after it */
+#define SOCKS5_CMD_RESOLVE      0xF0    // name to IPv4/IPv6 addr
+#define SOCKS5_CMD_RESOLVE_PTR  0xF1    // addr to name
+
 /* SOCKS5 ADDR types */
 #define SOCKS5_ADDR_IPV4        0x01
 #define SOCKS5_ADDR_DOMAIN      0x03
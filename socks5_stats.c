@@ -0,0 +1,146 @@
+#include "socks5_stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static socks5_stats_file* stats;
+static __thread socks5_stats_slot* stats_slot;
+
+int socks5_stats_open(const char* path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        return -1;
+    }
+    if(ftruncate(fd, sizeof(socks5_stats_file)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    socks5_stats_file* f = mmap(NULL, sizeof(socks5_stats_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(f == MAP_FAILED) {
+        return -1;
+    }
+
+    f->version = SOCKS5_STATS_VERSION;
+    f->slots = SOCKS5_STATS_SLOTS;
+    f->buckets = SOCKS5_STATS_BUCKETS;
+    f->pid = getpid();
+    f->started = time(NULL);
+    // readers check magic last so they never see a half filled header
+    __atomic_store_n(&f->magic, SOCKS5_STATS_MAGIC, __ATOMIC_RELEASE);
+    __atomic_store_n(&stats, f, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* stop recording. the mapping is left in place since other threads may
+ * be in the middle of an update */
+void socks5_stats_close(void) {
+    __atomic_store_n(&stats, NULL, __ATOMIC_RELEASE);
+}
+
+int socks5_stats_enabled(void) {
+    return __atomic_load_n(&stats, __ATOMIC_RELAXED) != NULL;
+}
+
+uint64_t socks5_stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int socks5_stats_bucket(uint64_t us) {
+    if(us < (1u << SOCKS5_STATS_SUB_BITS)) {
+        return (int)us;
+    }
+
+    int msb = 63 - __builtin_clzll(us);
+    int shift = msb - SOCKS5_STATS_SUB_BITS;
+    int idx = ((shift + 1) << SOCKS5_STATS_SUB_BITS) + (int)((us >> shift) & ((1u << SOCKS5_STATS_SUB_BITS) - 1));
+    return idx < SOCKS5_STATS_BUCKETS ? idx : SOCKS5_STATS_BUCKETS - 1;
+}
+
+/* largest value that lands in bucket idx */
+uint64_t socks5_stats_bucket_max(int idx) {
+    if(idx < (1 << SOCKS5_STATS_SUB_BITS)) {
+        return idx;
+    }
+
+    int shift = (idx >> SOCKS5_STATS_SUB_BITS) - 1;
+    uint64_t sub = idx & ((1u << SOCKS5_STATS_SUB_BITS) - 1);
+    return (((1ull << SOCKS5_STATS_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+/* this thread's slot. with more threads than slots some share one,
+ * updates are atomic adds so that only costs contention */
+static socks5_stats_slot* socks5_stats_slot_get(socks5_stats_file* f) {
+    if(!stats_slot) {
+        uint32_t idx = __atomic_fetch_add(&f->next_slot, 1, __ATOMIC_RELAXED);
+        stats_slot = &f->slot[idx % SOCKS5_STATS_SLOTS];
+    }
+    return stats_slot;
+}
+
+void socks5_stats_add(int phase, uint64_t us) {
+    socks5_stats_file* f = __atomic_load_n(&stats, __ATOMIC_ACQUIRE);
+    if(!f || phase < 0 || phase >= SOCKS5_PHASES) {
+        return;
+    }
+
+    socks5_stats_hist* h = &socks5_stats_slot_get(f)->phases[phase];
+    __atomic_fetch_add(&h->buckets[socks5_stats_bucket(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+    while(us > max && !__atomic_compare_exchange_n(&h->max_us, &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void socks5_stats_code(int code) {
+    socks5_stats_file* f = __atomic_load_n(&stats, __ATOMIC_ACQUIRE);
+    if(!f) {
+        return;
+    }
+    if(code < 0 || code >= SOCKS5_STATS_CODE_OTHER) {
+        code = SOCKS5_STATS_CODE_OTHER;
+    }
+    __atomic_fetch_add(&socks5_stats_slot_get(f)->codes[code], 1, __ATOMIC_RELAXED);
+}
+
+const socks5_stats_file* socks5_stats_map(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(socks5_stats_file)) {
+        close(fd);
+        return NULL;
+    }
+
+    const socks5_stats_file* f = mmap(NULL, sizeof(socks5_stats_file), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(f == MAP_FAILED) {
+        return NULL;
+    }
+
+    if(__atomic_load_n(&f->magic, __ATOMIC_ACQUIRE) != SOCKS5_STATS_MAGIC ||
+       f->version != SOCKS5_STATS_VERSION || f->slots != SOCKS5_STATS_SLOTS ||
+       f->buckets != SOCKS5_STATS_BUCKETS) {
+        munmap((void*)f, sizeof(socks5_stats_file));
+        return NULL;
+    }
+    return f;
+}
+
+void socks5_stats_unmap(const socks5_stats_file* f) {
+    if(f) {
+        munmap((void*)f, sizeof(socks5_stats_file));
+    }
+}
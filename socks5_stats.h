@@ -0,0 +1,68 @@
+#ifndef SOCKS5_STATS_H
+#define SOCKS5_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* handshake phase latencies and reply code counters in a shared mmapped
+ * file, so an outside reader can watch a running process. histograms
+ * are log-linear (HDR style): 8 sub-buckets per power of two of
+ * microseconds, at most 12.5% error. each thread records into its own
+ * slot, readers sum the slots */
+
+#define SOCKS5_STATS_MAGIC      0x74727374  // "trst"
+#define SOCKS5_STATS_VERSION    1
+#define SOCKS5_STATS_SLOTS      32
+#define SOCKS5_STATS_SUB_BITS   3
+#define SOCKS5_STATS_BUCKETS    304         // up to 2^40 us
+
+enum {
+    SOCKS5_PHASE_PROXY = 0,     // TCP connect to the proxy
+    SOCKS5_PHASE_NEGOTIATE,     // method selection and auth
+    SOCKS5_PHASE_REPLY,         // CONNECT until the proxy replied
+    SOCKS5_PHASE_FIXUP,         // handing the proxy sock to the app fd
+    SOCKS5_PHASE_TOTAL,
+    SOCKS5_PHASES
+};
+
+/* [0] success, [1..8] SOCKS5 reply codes, [9] anything else */
+#define SOCKS5_STATS_CODE_OTHER 9
+#define SOCKS5_STATS_CODES      16
+
+typedef struct socks5_stats_hist {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t buckets[SOCKS5_STATS_BUCKETS];
+} socks5_stats_hist;
+
+typedef struct socks5_stats_slot {
+    uint64_t codes[SOCKS5_STATS_CODES];
+    socks5_stats_hist phases[SOCKS5_PHASES];
+} __attribute__((aligned(64))) socks5_stats_slot;
+
+typedef struct socks5_stats_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t buckets;
+    int32_t pid;
+    uint32_t next_slot;         // handed out round-robin to threads
+    uint64_t started;           // unix time
+    socks5_stats_slot slot[SOCKS5_STATS_SLOTS] __attribute__((aligned(64)));
+} socks5_stats_file;
+
+/* writer */
+int socks5_stats_open(const char* path);
+void socks5_stats_close(void);
+int socks5_stats_enabled(void);
+uint64_t socks5_stats_now(void);
+void socks5_stats_add(int phase, uint64_t us);
+void socks5_stats_code(int code);
+
+/* reader */
+const socks5_stats_file* socks5_stats_map(const char* path);
+void socks5_stats_unmap(const socks5_stats_file* f);
+uint64_t socks5_stats_bucket_max(int idx);
+
+#endif // SOCKS5_STATS_H
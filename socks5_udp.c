@@ -0,0 +1,297 @@
+#define _GNU_SOURCE      // sendmmsg, recvmmsg
+#include "socks5_udp.h"
+#include "socks5_proto.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+/* raw syscalls, in a preloaded process sendmmsg/recvmmsg are ours and
+ * would wrap the datagrams a second time */
+static int udp_sendmmsg(int fd, struct mmsghdr* msgs, unsigned int n, int flags) {
+    return (int)syscall(SYS_sendmmsg, fd, msgs, n, flags);
+}
+
+static int udp_recvmmsg(int fd, struct mmsghdr* msgs, unsigned int n, int flags, struct timespec* timeout) {
+    return (int)syscall(SYS_recvmmsg, fd, msgs, n, flags, timeout);
+}
+
+/* header for a datagram to dst, returns its len. a v4-mapped dst is
+ * sent as IPv4, relays don't all speak IPv6 */
+int socks5_udp_header(unsigned char* hdr, const struct sockaddr* dst) {
+    hdr[0] = 0;     // RSV
+    hdr[1] = 0;
+    hdr[2] = 0;     // FRAG, fragments are not supported
+
+    if(dst->sa_family == AF_INET) {
+        const struct sockaddr_in* sin = (const struct sockaddr_in*)dst;
+        hdr[3] = SOCKS5_ADDR_IPV4;
+        memcpy(hdr + 4, &sin->sin_addr, 4);
+        memcpy(hdr + 8, &sin->sin_port, 2);
+        return SOCKS5_UDP_HDR_V4;
+    }
+    if(dst->sa_family == AF_INET6) {
+        const struct sockaddr_in6* sin6 = (const struct sockaddr_in6*)dst;
+        if(IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            hdr[3] = SOCKS5_ADDR_IPV4;
+            memcpy(hdr + 4, &sin6->sin6_addr.s6_addr[12], 4);
+            memcpy(hdr + 8, &sin6->sin6_port, 2);
+            return SOCKS5_UDP_HDR_V4;
+        }
+        hdr[3] = SOCKS5_ADDR_IPV6;
+        memcpy(hdr + 4, &sin6->sin6_addr, 16);
+        memcpy(hdr + 20, &sin6->sin6_port, 2);
+        return SOCKS5_UDP_HDR_V6;
+    }
+    return -1;
+}
+
+/* sendmmsg with each datagram's msg_name as its destination, sent to
+ * the relay with the header as an extra first iovec. returns how many
+ * went out, msg_len without the header */
+int socks5_udp_sendmmsg(int fd, socks5_udp_relay* relay, struct mmsghdr* msgs, unsigned int n, int flags) {
+    unsigned char hdrs[SOCKS5_UDP_BATCH][SOCKS5_UDP_HDR_V6];
+    struct iovec iovs[SOCKS5_UDP_BATCH][SOCKS5_UDP_IOV_MAX];
+    struct mmsghdr out[SOCKS5_UDP_BATCH];
+
+    if(n > SOCKS5_UDP_BATCH) {
+        n = SOCKS5_UDP_BATCH;
+    }
+
+    int hdr_len = 0;
+    for(unsigned int i = 0; i < n; i++) {
+        const struct msghdr* m = &msgs[i].msg_hdr;
+        int len = m->msg_name ? socks5_udp_header(hdrs[i], m->msg_name) : -1;
+        if(len < 0 || m->msg_iovlen >= SOCKS5_UDP_IOV_MAX) {
+            // the ones before still go out, this one fails on its own call
+            if(i == 0) {
+                errno = !m->msg_name ? EDESTADDRREQ : len < 0 ? EAFNOSUPPORT : EMSGSIZE;
+                return -1;
+            }
+            n = i;
+            break;
+        }
+        hdr_len = len;
+
+        iovs[i][0].iov_base = hdrs[i];
+        iovs[i][0].iov_len = len;
+        memcpy(&iovs[i][1], m->msg_iov, m->msg_iovlen * sizeof(struct iovec));
+
+        out[i].msg_hdr = *m;
+        out[i].msg_hdr.msg_name = &relay->addr;
+        out[i].msg_hdr.msg_namelen = relay->addr_len;
+        out[i].msg_hdr.msg_iov = iovs[i];
+        out[i].msg_hdr.msg_iovlen = m->msg_iovlen + 1;
+        out[i].msg_len = 0;
+    }
+    __atomic_store_n(&relay->hdr_len, hdr_len, __ATOMIC_RELAXED);
+
+    int ret = udp_sendmmsg(fd, out, n, flags);
+    for(int i = 0; i < ret; i++) {
+        msgs[i].msg_len = out[i].msg_len - out[i].msg_hdr.msg_iov[0].iov_len;
+    }
+    return ret;
+}
+
+static int udp_same_addr(const struct sockaddr_storage* a, const struct sockaddr_storage* b) {
+    if(a->ss_family != b->ss_family) {
+        return 0;
+    }
+    if(a->ss_family == AF_INET) {
+        const struct sockaddr_in* x = (const struct sockaddr_in*)a;
+        const struct sockaddr_in* y = (const struct sockaddr_in*)b;
+        return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+    }
+    const struct sockaddr_in6* x = (const struct sockaddr_in6*)a;
+    const struct sockaddr_in6* y = (const struct sockaddr_in6*)b;
+    return x->sin6_port == y->sin6_port && memcmp(&x->sin6_addr, &y->sin6_addr, 16) == 0;
+}
+
+/* source of a relayed datagram from its header, in the app socket's
+ * family. returns the header len, 0 for one the socket can't report */
+static int udp_parse(const unsigned char* hdr, size_t len, int family, struct sockaddr_storage* src, socklen_t* src_len) {
+    if(len < SOCKS5_UDP_HDR_V4 || hdr[0] != 0 || hdr[1] != 0 || hdr[2] != 0) {
+        return 0;
+    }
+
+    memset(src, 0, sizeof(*src));
+    if(hdr[3] == SOCKS5_ADDR_IPV4 && family == AF_INET) {
+        struct sockaddr_in* sin = (struct sockaddr_in*)src;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, hdr + 4, 4);
+        memcpy(&sin->sin_port, hdr + 8, 2);
+        *src_len = sizeof(struct sockaddr_in);
+        return SOCKS5_UDP_HDR_V4;
+    }
+
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)src;
+    sin6->sin6_family = AF_INET6;
+    *src_len = sizeof(struct sockaddr_in6);
+    if(hdr[3] == SOCKS5_ADDR_IPV4 && family == AF_INET6) {
+        sin6->sin6_addr.s6_addr[10] = 0xff;
+        sin6->sin6_addr.s6_addr[11] = 0xff;
+        memcpy(&sin6->sin6_addr.s6_addr[12], hdr + 4, 4);
+        memcpy(&sin6->sin6_port, hdr + 8, 2);
+        return SOCKS5_UDP_HDR_V4;
+    }
+    if(hdr[3] == SOCKS5_ADDR_IPV6 && family == AF_INET6 && len >= SOCKS5_UDP_HDR_V6) {
+        memcpy(&sin6->sin6_addr, hdr + 4, 16);
+        memcpy(&sin6->sin6_port, hdr + 20, 2);
+        return SOCKS5_UDP_HDR_V6;
+    }
+    return 0;
+}
+
+/* copy len bytes at off of an iovec chain to buf, or buf into it */
+static size_t udp_iov_copy(const struct iovec* iov, size_t cnt, size_t off, void* buf, size_t len, int out) {
+    size_t done = 0;
+    for(size_t i = 0; i < cnt && done < len; i++) {
+        if(off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        size_t n = iov[i].iov_len - off;
+        if(n > len - done) {
+            n = len - done;
+        }
+        if(out) {
+            memcpy((char*)iov[i].iov_base + off, (char*)buf + done, n);
+        }
+        else {
+            memcpy((char*)buf + done, (char*)iov[i].iov_base + off, n);
+        }
+        done += n;
+        off = 0;
+    }
+    return done;
+}
+
+/* the payload isn't where the app wants it: its header was shorter or
+ * longer than the iovec received into, or it came direct from a peer,
+ * or an earlier datagram of the batch was dropped. gathered from the
+ * received hdr and chain and scattered into the app's msg */
+static size_t udp_relocate(const unsigned char* hdr, size_t hdr_len, const struct msghdr* from,
+                           size_t len, size_t skip, struct msghdr* to, int* flags) {
+    size_t payload = len - skip;
+    char* buf = malloc(payload ? payload : 1);
+    if(!buf) {
+        return 0;
+    }
+
+    // a datagram shorter than the header iovec has nothing past it
+    size_t in_hdr = len < hdr_len ? len : hdr_len;
+    size_t n = 0;
+    if(skip < in_hdr) {
+        memcpy(buf, hdr + skip, in_hdr - skip);
+        n = in_hdr - skip;
+    }
+    n += udp_iov_copy(from->msg_iov + 1, from->msg_iovlen - 1, skip > hdr_len ? skip - hdr_len : 0,
+                      buf + n, payload - n, 0);
+
+    size_t copied = udp_iov_copy(to->msg_iov, to->msg_iovlen, 0, buf, n, 1);
+    if(copied < n) {
+        *flags |= MSG_TRUNC;
+    }
+    free(buf);
+    return copied;
+}
+
+/* recvmmsg into the app's msgs with the header received into an iovec
+ * of its own, msg_name gets the source from the header. datagrams that
+ * didn't come through the relay are passed on as they are, ones with
+ * a header the socket can't report (fragments, names) are dropped */
+int socks5_udp_recvmmsg(int fd, const socks5_udp_relay* relay, struct mmsghdr* msgs, unsigned int n,
+                        int flags, struct timespec* timeout) {
+    unsigned char hdrs[SOCKS5_UDP_BATCH][SOCKS5_UDP_HDR_V6];
+    struct iovec iovs[SOCKS5_UDP_BATCH][SOCKS5_UDP_IOV_MAX];
+    struct sockaddr_storage from[SOCKS5_UDP_BATCH];
+    struct mmsghdr in[SOCKS5_UDP_BATCH];
+
+    if(n > SOCKS5_UDP_BATCH) {
+        n = SOCKS5_UDP_BATCH;
+    }
+
+    size_t hdr_len = __atomic_load_n(&relay->hdr_len, __ATOMIC_RELAXED);
+    if(hdr_len == 0) {
+        hdr_len = relay->family == AF_INET6 ? SOCKS5_UDP_HDR_V6 : SOCKS5_UDP_HDR_V4;
+    }
+
+    for(unsigned int i = 0; i < n; i++) {
+        const struct msghdr* m = &msgs[i].msg_hdr;
+        if(m->msg_iovlen >= SOCKS5_UDP_IOV_MAX) {
+            if(i == 0) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            n = i;
+            break;
+        }
+        iovs[i][0].iov_base = hdrs[i];
+        iovs[i][0].iov_len = hdr_len;
+        memcpy(&iovs[i][1], m->msg_iov, m->msg_iovlen * sizeof(struct iovec));
+
+        in[i].msg_hdr = *m;
+        in[i].msg_hdr.msg_name = &from[i];
+        in[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        in[i].msg_hdr.msg_iov = iovs[i];
+        in[i].msg_hdr.msg_iovlen = m->msg_iovlen + 1;
+        in[i].msg_len = 0;
+    }
+
+    for(;;) {
+        int ret = udp_recvmmsg(fd, in, n, flags, timeout);
+        if(ret <= 0) {
+            return ret;
+        }
+
+        int k = 0;
+        for(int i = 0; i < ret; i++) {
+            struct msghdr* m = &msgs[k].msg_hdr;
+            size_t len = in[i].msg_len;
+            int msg_flags = in[i].msg_hdr.msg_flags;
+
+            struct sockaddr_storage src;
+            socklen_t src_len;
+            size_t skip = 0;
+            if(udp_same_addr(&from[i], &relay->addr)) {
+                // an IPv6 header longer than the last send's ran on into the app's iovecs
+                if(hdr_len < SOCKS5_UDP_HDR_V6 && len > hdr_len && hdrs[i][3] == SOCKS5_ADDR_IPV6) {
+                    size_t more = len < SOCKS5_UDP_HDR_V6 ? len - hdr_len : SOCKS5_UDP_HDR_V6 - hdr_len;
+                    udp_iov_copy(in[i].msg_hdr.msg_iov + 1, in[i].msg_hdr.msg_iovlen - 1, 0,
+                                 hdrs[i] + hdr_len, more, 0);
+                }
+                skip = udp_parse(hdrs[i], len, relay->family, &src, &src_len);
+                if(skip == 0) {
+                    continue;
+                }
+            }
+            else {
+                memcpy(&src, &from[i], in[i].msg_hdr.msg_namelen);
+                src_len = in[i].msg_hdr.msg_namelen;
+            }
+
+            // the common case: header as long as expected, payload in place
+            size_t payload = len - skip;
+            if(skip != hdr_len || k != i) {
+                payload = udp_relocate(hdrs[i], hdr_len, &in[i].msg_hdr, len, skip, m, &msg_flags);
+            }
+
+            if(m->msg_name) {
+                memcpy(m->msg_name, &src, src_len < m->msg_namelen ? src_len : m->msg_namelen);
+                m->msg_namelen = src_len;
+            }
+            // ancillary data stays in the buffer of the msg it came with
+            m->msg_controllen = (k == i) ? in[i].msg_hdr.msg_controllen : 0;
+            m->msg_flags = msg_flags;
+            msgs[k].msg_len = payload;
+            k++;
+        }
+        if(k > 0) {
+            return k;
+        }
+        // only dropped datagrams, wait for the next
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef SOCKS5_UDP_H
+#define SOCKS5_UDP_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>     // struct mmsghdr wants _GNU_SOURCE before it
+
+/* datagrams through a UDP ASSOCIATE relay. every datagram carries the
+ * SOCKS UDP header (RSV, FRAG, ATYP, DST.ADDR, DST.PORT) in front, which
+ * goes in an iovec of its own: the app's buffers are handed to one
+ * sendmmsg/recvmmsg as they are, nothing is copied per datagram. the
+ * relay association itself comes from socks5_udp_associate */
+#define SOCKS5_UDP_BATCH    64      // datagrams per call, more are left for the next
+#define SOCKS5_UDP_IOV_MAX  16      // iovecs per datagram, the header's included
+#define SOCKS5_UDP_HDR_V4   10
+#define SOCKS5_UDP_HDR_V6   22
+
+/* an association as its app socket uses it. addr is in the socket's
+ * family, a v4 relay is v4-mapped for an AF_INET6 socket */
+typedef struct socks5_udp_relay {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int family;         // of the app socket, sources are reported in it
+    int hdr_len;        // header of the last send, replies are received alike
+} socks5_udp_relay;
+
+int socks5_udp_header(unsigned char* hdr, const struct sockaddr* dst);
+int socks5_udp_sendmmsg(int fd, socks5_udp_relay* relay, struct mmsghdr* msgs, unsigned int n, int flags);
+int socks5_udp_recvmmsg(int fd, const socks5_udp_relay* relay, struct mmsghdr* msgs, unsigned int n,
+                        int flags, struct timespec* timeout);
+
+#endif // SOCKS5_UDP_H
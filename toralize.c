@@ -1,3 +1,4 @@
+#define _GNU_SOURCE      // sendmmsg, recvmmsg
 #include "toralize.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,341 +14,1921 @@
 #include <fcntl.h>
 #include <dlfcn.h>
 #include <ctype.h>
+#include <time.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
 
 
 /* func ptrs for og sock funcs */
 static int (*original_connect)(int sockfd, const struct sockaddr* addr, socklen_t);
 static int(*original_close)(int fd);
-static ssize_t (*original_send)(int sockfd, const void* buf, size_t len, int flags);
 static ssize_t (*original_recv)(int sockfd, void* buf, size_t len, int flags);
-static ssize_t (*original_write)(int fd, const void* buf, size_t count);
 static ssize_t (*original_read)(int fd, void* buf, size_t count);
+static ssize_t (*original_send)(int sockfd, const void* buf, size_t len, int flags);
+static ssize_t (*original_write)(int fd, const void* buf, size_t count);
+static ssize_t (*original_readv)(int fd, const struct iovec* iov, int iovcnt);
+static ssize_t (*original_writev)(int fd, const struct iovec* iov, int iovcnt);
+static ssize_t (*original_sendto)(int sockfd, const void* buf, size_t len, int flags,
+                                  const struct sockaddr* dest_addr, socklen_t addrlen);
+static ssize_t (*original_sendmsg)(int sockfd, const struct msghdr* msg, int flags);
+static int (*original_sendmmsg)(int sockfd, struct mmsghdr* msgvec, unsigned int vlen, int flags);
+static ssize_t (*original_recvfrom)(int sockfd, void* buf, size_t len, int flags,
+                                    struct sockaddr* src_addr, socklen_t* addrlen);
+static ssize_t (*original_recvmsg)(int sockfd, struct msghdr* msg, int flags);
+static int (*original_recvmmsg)(int sockfd, struct mmsghdr* msgvec, unsigned int vlen, int flags,
+                                struct timespec* timeout);
+static int (*original_getsockopt)(int sockfd, int level, int optname, void* optval, socklen_t* optlen);
+static int (*original_poll)(struct pollfd* fds, nfds_t nfds, int timeout);
+static int (*original_select)(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds, struct timeval* timeout);
+static int (*original_epoll_ctl)(int epfd, int op, int fd, struct epoll_event* event);
+static int (*original_epoll_wait)(int epfd, struct epoll_event* events, int maxevents, int timeout);
+static int (*original_getaddrinfo)(const char* node, const char* service, const struct addrinfo* hints, struct addrinfo** res);
+static int (*original_getnameinfo)(const struct sockaddr* addr, socklen_t addrlen, char* host, socklen_t hostlen,
+                                   char* serv, socklen_t servlen, int flags);
+
+/* originals are looked up on first use, so a process only pays dlsym for
+ * the hooks it calls. racing threads store the same pointer */
+#define ORIGINAL(name) ({ \
+    if(!original_##name) { \
+        original_##name = load_original(#name); \
+    } \
+    original_##name; })
+
+/* number of sockets with a non-blocking handshake in flight,
+ * poll/select/epoll_wait pass straight through while it is 0 */
+static int pending_cnt;
+
+/* sockets whose ctx holds bytes read past the CONNECT reply. read, recv,
+ * poll and select only look them up while buffered_cnt is non zero,
+ * epoll_wait walks the list, which grows as needed */
+#define BUFFERED_INIT 64
+static int buffered_cnt;
+static struct {
+    pthread_mutex_t mutex;
+    int* fds;
+    int cnt;
+    int cap;
+} buffered_list = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .fds = NULL,
+    .cnt = 0,
+    .cap = 0
+};
+
+/* sockets with a UDP association. the send and recv hooks only look
+ * them up while udp_cnt is non zero, udp_mutex keeps two threads from
+ * associating the same socket */
+static int udp_cnt;
+static pthread_mutex_t udp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* current config, one atomic load away for every connect. the
+ * SocksPorts in it keep their resolved addr, shared by every ctx and
+ * replaced only on refresh, and their pool of pre-negotiated socks */
+static toralize_snapshot* config_current;
+
+/* Tor answers for tor_dns, names and addr literals. sized by the
+ * startup config */
+static dns_cache* dns_forward;
+static dns_cache* dns_reverse;
+
+/* wakes the reload thread, written from the SIGHUP handler */
+static int reload_efd = -1;
+
+/* the reload thread, joined at exit. a fork child has none of its own */
+static pthread_t reload_thread;
+static pid_t reload_pid;
+static int reload_stop;
+
+/* the snapshot stays valid until config_exit */
+static toralize_snapshot* config_enter(int* phase) {
+    *phase = rcu_read_lock();
+    return __atomic_load_n(&config_current, __ATOMIC_ACQUIRE);
+}
+
+static void config_exit(int phase) {
+    rcu_read_unlock(phase);
+}
+
+static int is_host_excluded(const toralize_snapshot* conf, const char* host) {
+    unsigned char addr[16];
+
+    /* literal addrs go through the CIDR rules */
+    if(inet_pton(AF_INET, host, addr) == 1) {
+        return cidr_trie_match_bytes(&conf->excluded_nets, AF_INET, addr);
+    }
+    if(inet_pton(AF_INET6, host, addr) == 1) {
+        return cidr_trie_match_bytes(&conf->excluded_nets, AF_INET6, addr);
+    }
+
+    return domain_set_match(&conf->excluded, host);
+}
+
+
+static void release_socket(managed_sock* s);
+static void proxy_refresh(upstream* u, socks5_endpoint* failed);
+static void open_stats_file(const char* path);
+static void config_watch_start(void);
+static void config_watch_stop(void);
+
+/* resolve next definition of an interposed symbol */
+static void* load_original(const char* name) {
+    dlerror();
+    void* sym = dlsym(RTLD_NEXT, name);
+    char* err = dlerror();
+    if(err) {
+        fprintf(stderr, "dlsym error: %s\n", err);
+        exit(1);
+    }
+    return sym;
+}
+
+static void config_publish(toralize_snapshot* conf) {
+    logger_set_level(conf->log_level);
+    __atomic_store_n(&config_current, conf, __ATOMIC_SEQ_CST);
+}
+
+/* resolve the upstreams of a newly published snapshot and fill their
+ * pools. getaddrinfo comes back through us and has to see the proxy
+ * names as excluded */
+static void config_start_upstreams(toralize_snapshot* conf) {
+    for(int i = 0; i < conf->upstreams->count; i++) {
+        upstream* u = &conf->upstreams->list[i];
+        proxy_refresh(u, NULL);
+
+        pthread_mutex_lock(&u->mutex);
+        if(conf->pool_high > 0 && u->ep) {
+            socks5_pool* pool = socks5_pool_create(u->proxy, u->ep, conf->pool_low, conf->pool_high);
+            if(!pool) {
+                log_error("Failed to create proxy pool for %s:%d", u->host, u->port);
+                pthread_mutex_unlock(&u->mutex);
+                continue;
+            }
+            socks5_pool_set_timeout_ms(pool, conf->timeout_ms);
+            __atomic_store_n(&u->pool, pool, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&u->mutex);
+    }
+}
+
+/* init the library */
+static void init_toralize() {
+    pthread_mutex_lock(&toralize_config.mutex);
+
+    if(toralize_config.init) {
+        pthread_mutex_unlock(&toralize_config.mutex);
+        return;
+    }
+
+    /* read config file if exists, kept absolute for reloads after a chdir */
+    char* config_path = getenv("TORALIZE_CONFIG");
+    if(!config_path) {
+        config_path = DEFAULT_CONFIG_FILE;
+    }
+    char* full_path = realpath(config_path, NULL);
+    strncpy(toralize_config.config_path, full_path ? full_path : config_path, sizeof(toralize_config.config_path) - 1);
+    free(full_path);
+
+    /* a compiled image is mapped as is, text is parsed */
+    toralize_snapshot* conf = config_open(toralize_config.config_path);
+    if(!conf) {
+        conf = config_parse(NULL);
+    }
+    if(!conf) {
+        fprintf(stderr, "toralize: out of memory loading config\n");
+        exit(1);
+    }
+    toralize_config.reload = conf->reload;
+
+    if(fakeip_init(conf->fakeip_size) != 0) {
+        log_error("Failed to allocate fake address table");
+    }
+    dns_forward = dns_cache_create(conf->dns_cache_size);
+    dns_reverse = dns_cache_create(conf->dns_cache_size);
+    if(!dns_forward || !dns_reverse) {
+        log_error("Failed to allocate DNS cache");
+    }
+    if(conf->stats_file[0]) {
+        open_stats_file(conf->stats_file);
+    }
+
+    /* init socket tracking table */
+    if(sock_table_init(release_socket) != 0) {
+        log_error("Failed to allocate socket table");
+    }
+
+    config_publish(conf);
+    toralize_config.init = 1;
+    for(int i = 0; i < conf->upstreams->count; i++) {
+        log_info("Initialized with Tor proxy at %s:%d", conf->upstreams->list[i].host, conf->upstreams->list[i].port);
+    }
+
+    pthread_mutex_unlock(&toralize_config.mutex);
+
+    /* resolve once, after unlocking since getaddrinfo comes back through us */
+    config_start_upstreams(conf);
+    config_watch_start();
+}
+
+/* swap in a fresh snapshot, free the old one once no connect can still
+ * be reading it. an unchanged upstream list keeps its set so resolved
+ * addrs, health and pooled socks carry over */
+static void config_reload(void) {
+    toralize_snapshot* next = config_open(toralize_config.config_path);
+    if(!next) {
+        log_warn("Failed to reload %s, keeping current config", toralize_config.config_path);
+        return;
+    }
+
+    toralize_snapshot* old = __atomic_load_n(&config_current, __ATOMIC_ACQUIRE);
+    int fresh = 1;
+    if(upstream_set_same(old->upstreams, next->upstreams) &&
+       old->pool_low == next->pool_low && old->pool_high == next->pool_high) {
+        upstream_set_unref(next->upstreams);
+        next->upstreams = upstream_set_ref(old->upstreams);
+        fresh = 0;
+    }
+
+    config_publish(next);
+    rcu_synchronize();
+    config_free(old);
+
+    if(fresh) {
+        config_start_upstreams(next);
+    }
+    else {
+        /* kept pools open their socks under the new deadline */
+        for(int i = 0; i < next->upstreams->count; i++) {
+            upstream* u = &next->upstreams->list[i];
+            socks5_pool_set_timeout_ms(__atomic_load_n(&u->pool, __ATOMIC_ACQUIRE), next->timeout_ms);
+        }
+    }
+    log_info("Reloaded %s", toralize_config.config_path);
+}
+
+static void config_sighup(int sig) {
+    (void)sig;
+    int err = errno;
+    uint64_t one = 1;
+    ssize_t n = write(reload_efd, &one, sizeof(one));
+    (void)n;
+    errno = err;
+}
+
+/* watch the dirs, editors replace files by rename */
+static int config_watch_add(int ifd, const char* path) {
+    char dir[PATH_MAX];
+    strncpy(dir, path, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+
+    char* slash = strrchr(dir, '/');
+    if(slash == dir) {
+        slash[1] = '\0';
+    }
+    else if(slash) {
+        *slash = '\0';
+    }
+    else {
+        strcpy(dir, ".");
+    }
+    return inotify_add_watch(ifd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+}
+
+static const char* config_basename(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+/* does the inotify batch in buf touch the config or the exclude file */
+static int config_touched(const char* buf, ssize_t len) {
+    char exclude_file[sizeof(((toralize_snapshot*)0)->exclude_file)];
+    int phase;
+    toralize_snapshot* conf = config_enter(&phase);
+    strcpy(exclude_file, conf->exclude_file);
+    config_exit(phase);
+
+    for(ssize_t off = 0; off < len; ) {
+        const struct inotify_event* ev = (const struct inotify_event*)(buf + off);
+        if(ev->len > 0 && (strcmp(ev->name, config_basename(toralize_config.config_path)) == 0 ||
+                           (exclude_file[0] && strcmp(ev->name, config_basename(exclude_file)) == 0))) {
+            return 1;
+        }
+        off += sizeof(struct inotify_event) + ev->len;
+    }
+    return 0;
+}
+
+static void* config_watch_main(void* arg) {
+    (void)arg;
+    int ifd = -1;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    if(toralize_config.reload & TORALIZE_RELOAD_INOTIFY) {
+        ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if(ifd < 0 || config_watch_add(ifd, toralize_config.config_path) < 0) {
+            log_error("Failed to watch %s: %s", toralize_config.config_path, strerror(errno));
+        }
+        toralize_snapshot* conf = __atomic_load_n(&config_current, __ATOMIC_ACQUIRE);
+        if(ifd >= 0 && conf->exclude_file[0] && config_watch_add(ifd, conf->exclude_file) < 0) {
+            log_warn("Failed to watch %s: %s", conf->exclude_file, strerror(errno));
+        }
+    }
+
+    struct pollfd fds[2] = {
+        { .fd = reload_efd, .events = POLLIN },
+        { .fd = ifd, .events = POLLIN }
+    };
+
+    for(;;) {
+        if(ORIGINAL(poll)(fds, 2, -1) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if(__atomic_load_n(&reload_stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        int touched = 0;
+        if(fds[0].revents & POLLIN) {
+            uint64_t n;
+            touched = ORIGINAL(read)(reload_efd, &n, sizeof(n)) > 0;
+        }
+        if(fds[1].revents & POLLIN) {
+            ssize_t len;
+            while((len = ORIGINAL(read)(ifd, buf, sizeof(buf))) > 0) {
+                touched |= config_touched(buf, len);
+            }
+        }
+        if(!touched) {
+            continue;
+        }
+
+        /* let a burst of writes settle, then load once */
+        while(ORIGINAL(poll)(fds, 2, 100) > 0) {
+            uint64_t n;
+            if(fds[0].revents & POLLIN) {
+                ORIGINAL(read)(reload_efd, &n, sizeof(n));
+            }
+            if(fds[1].revents & POLLIN) {
+                while(ORIGINAL(read)(ifd, buf, sizeof(buf)) > 0);
+            }
+        }
+        if(__atomic_load_n(&reload_stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        config_reload();
+    }
+    if(ifd >= 0) {
+        ORIGINAL(close)(ifd);
+    }
+    return NULL;
+}
+
+/* reload thread for reload=inotify,sighup. it never takes signals, the
+ * SIGHUP handler runs on whatever app thread and only wakes it */
+static void config_watch_start(void) {
+    if(!toralize_config.reload) {
+        return;
+    }
+
+    reload_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(reload_efd < 0) {
+        log_error("Failed to create reload eventfd: %s", strerror(errno));
+        return;
+    }
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    int err = pthread_create(&reload_thread, NULL, config_watch_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if(err != 0) {
+        log_error("Failed to start reload thread: %s", strerror(err));
+        return;
+    }
+    reload_pid = getpid();
+
+    if(toralize_config.reload & TORALIZE_RELOAD_SIGHUP) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = config_sighup;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGHUP, &sa, NULL);
+    }
+}
+
+/* wait out a reload in progress and end the thread, nothing frees a
+ * snapshot after this */
+static void config_watch_stop(void) {
+    if(reload_pid != getpid()) {
+        return;
+    }
+    __atomic_store_n(&reload_stop, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    ssize_t n = ORIGINAL(write)(reload_efd, &one, sizeof(one));
+    (void)n;
+    pthread_join(reload_thread, NULL);
+    reload_pid = 0;
+}
+
+/* map the handshake stats file, each %p in path becomes our pid */
+static void open_stats_file(const char* path) {
+    char name[sizeof(((toralize_snapshot*)0)->stats_file) + 32];
+    size_t len = 0;
+
+    for(const char* p = path; *p && len < sizeof(name) - 16; p++) {
+        if(p[0] == '%' && p[1] == 'p') {
+            len += snprintf(name + len, sizeof(name) - len, "%d", (int)getpid());
+            p++;
+        }
+        else {
+            name[len++] = *p;
+        }
+    }
+    name[len] = '\0';
+
+    if(socks5_stats_open(name) != 0) {
+        log_error("Failed to create stats file %s: %s", name, strerror(errno));
+        return;
+    }
+    log_info("Writing handshake stats to %s", name);
+}
+
+/* re-resolve an upstream unless another thread already replaced failed */
+static void proxy_refresh(upstream* u, socks5_endpoint* failed) {
+    int err = 0;
+    if(upstream_refresh(u, failed, &err) != 0) {
+        log_warn("Failed to resolve proxy %s: %s", u->host, gai_strerror(err));
+        return;
+    }
+    log_debug("Resolved proxy %s:%d", u->host, u->port);
+}
+
+/* proxy conn dropped under us, as opposed to a SOCKS5 error reply */
+static int proxy_sock_lost(socks5_ctx* ctx) {
+    int err = socks5_get_error_code(ctx);
+    return err == ECONNRESET || err == EPIPE;
+}
+
+/* proxy itself unreachable, its addr may have changed */
+static void proxy_check_failure(upstream* u, socks5_ctx* ctx) {
+    int err = socks5_get_error_code(ctx);
+    if(err == ECONNREFUSED || err == EHOSTUNREACH || err == ENETUNREACH) {
+        socks5_endpoint* ep = socks5_get_endpoint(ctx);
+        if(ep) {
+            proxy_refresh(u, ep);
+        }
+    }
+}
+
+/* deadline for a handshake through u. adaptive: N times its recent p99,
+ * only ever shortens timeout_ms */
+static int proxy_timeout_ms(const toralize_snapshot* conf, upstream* u) {
+    int ms = conf->timeout_ms;
+    if(conf->timeout_adaptive > 0) {
+        uint64_t p99 = upstream_latency_pct(u, 99);
+        if(p99) {
+            uint64_t adaptive = p99 * conf->timeout_adaptive / 1000;
+            if(adaptive < TIMEOUT_ADAPTIVE_MIN_MS) {
+                adaptive = TIMEOUT_ADAPTIVE_MIN_MS;
+            }
+            if(adaptive < (uint64_t)ms) {
+                ms = (int)adaptive;
+            }
+        }
+    }
+    return ms;
+}
+
+/* SOCKS5 ctx for u with its cached proxy addr, no lookup per connection.
+ * a pooled proxy sock is already past negotiation, only CONNECT is left.
+ * otherwise the proxy conn is made on the app's own fd */
+static socks5_ctx* proxy_ctx(const toralize_snapshot* conf, upstream* u, int sockfd, int* pooled) {
+    socks5_ctx* ctx = socks5_create_ctx_proxy(u->proxy);
+    if(!ctx) {
+        return NULL;
+    }
+
+    socks5_set_verbose(ctx, conf->verbose);
+    socks5_set_pipelining(ctx, conf->pipeline);
+    socks5_set_fastopen(ctx, conf->fastopen);
+    socks5_set_timeout_ms(ctx, proxy_timeout_ms(conf, u));
+    socks5_set_timeout_from_app(ctx, conf->timeout_app);
+    socks5_use_sock(ctx, sockfd);
+
+    socks5_endpoint* ep = upstream_acquire(u);
+    socks5_set_endpoint(ctx, ep);
+    socks5_endpoint_unref(ep);
+
+    *pooled = socks5_pool_get(__atomic_load_n(&u->pool, __ATOMIC_ACQUIRE));
+    if(*pooled >= 0) {
+        socks5_attach(ctx, *pooled);
+    }
+    return ctx;
+}
+
+/* report a finished handshake to the upstream that carried it */
+static void proxy_done(upstream* u, socks5_ctx* ctx, int ret, uint64_t start_us) {
+    int tfo = socks5_get_fastopen(ctx);
+    if(tfo != SOCKS5_TFO_OFF) {
+        __atomic_add_fetch(&u->tfo[tfo], 1, __ATOMIC_RELAXED);
+        if(tfo == SOCKS5_TFO_FALLBACK) {
+            log_debug("Fast Open to %s:%d fell back, no cookie yet or data not acked", u->host, u->port);
+        }
+    }
+
+    int err = socks5_get_error_code(ctx);
+    int result = upstream_result(ret, socks5_get_reply(ctx));
+    if(ret < 0 && err == ETIMEDOUT) {
+        /* counts at what it took so far, a deadline too tight for the
+         * proxy's latency right now widens itself */
+        upstream_latency_add(u, upstream_now_us() - start_us);
+    }
+    if(result == UPSTREAM_DOWN) {
+        proxy_check_failure(u, ctx);
+    }
+    upstream_done(u, result, upstream_now_us() - start_us);
+}
+
+/* what a Tor lookup asks for, addr NULL for RESOLVE */
+typedef struct tor_lookup {
+    const toralize_snapshot* conf;
+    const struct sockaddr* addr;
+} tor_lookup;
+
+static int tor_lookup_once(const tor_lookup* l, socks5_ctx* ctx, const char* key, dns_answer* out) {
+    if(l->addr) {
+        return socks5_tor_resolve_ptr(ctx, l->addr, out->name, sizeof(out->name));
+    }
+    return socks5_tor_resolve(ctx, key, &out->addr, &out->addr_len);
+}
+
+/* dns_cache_fn, RESOLVE or RESOLVE_PTR on the first upstream that
+ * answers. a SOCKS5 error reply is Tor saying there is no record */
+static int tor_resolve(const char* key, dns_answer* out, void* arg) {
+    const tor_lookup* l = arg;
+    upstream* u;
+    uint32_t tried = 0;
+
+    while((u = upstream_pick(l->conf->upstreams, tried)) != NULL) {
+        tried |= 1u << (u - l->conf->upstreams->list);
+        uint64_t start_us = upstream_now_us();
+
+        int pooled;
+        socks5_ctx* ctx = proxy_ctx(l->conf, u, -1, &pooled);
+        if(!ctx) {
+            upstream_done(u, UPSTREAM_ABANDONED, 0);
+            return -1;
+        }
+
+        int ret = tor_lookup_once(l, ctx, key, out);
+        if(ret < 0 && pooled >= 0 && proxy_sock_lost(ctx)) {
+            log_info("Pooled proxy sock went away, retrying on a new one");
+            ret = tor_lookup_once(l, ctx, key, out);
+        }
+        proxy_done(u, ctx, ret, start_us);
+
+        int reply = socks5_get_reply(ctx);
+        if(ret < 0) {
+            log_debug("Tor lookup of %s failed: %s", key, socks5_get_error(ctx));
+        }
+        socks5_free(ctx);
+
+        if(ret == 0) {
+            return 0;
+        }
+        if(upstream_result(ret, reply) != UPSTREAM_DOWN) {
+            out->error = EAI_NONAME;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* start handing out what the handshake read past the reply, slot locked */
+static void buffered_add(managed_sock* s) {
+    int n = socks5_buffered(s->ctx);
+    if(s->buffered || n == 0) {
+        return;
+    }
+
+    __atomic_store_n(&s->buffered, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&buffered_cnt, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&buffered_list.mutex);
+    if(buffered_list.cnt == buffered_list.cap) {
+        int cap = buffered_list.cap ? buffered_list.cap * 2 : BUFFERED_INIT;
+        int* fds = realloc(buffered_list.fds, cap * sizeof(int));
+        if(fds) {
+            buffered_list.fds = fds;
+            buffered_list.cap = cap;
+        }
+    }
+    int listed = buffered_list.cnt < buffered_list.cap;
+    if(listed) {
+        buffered_list.fds[buffered_list.cnt++] = s->og_fd;
+    }
+    pthread_mutex_unlock(&buffered_list.mutex);
+    if(!listed) {
+        log_error("No memory to list socket %d, epoll_wait won't report the %d bytes it holds", s->og_fd, n);
+    }
+    log_debug("Holding %d bytes read past the proxy reply for %d", n, s->og_fd);
+}
+
+static void buffered_drop(managed_sock* s) {
+    if(!s->buffered) {
+        return;
+    }
+
+    __atomic_store_n(&s->buffered, 0, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&buffered_cnt, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&buffered_list.mutex);
+    for(int i = 0; i < buffered_list.cnt; i++) {
+        if(buffered_list.fds[i] == s->og_fd) {
+            buffered_list.fds[i] = buffered_list.fds[--buffered_list.cnt];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&buffered_list.mutex);
+}
+
+static int has_buffered(int fd) {
+    managed_sock* s = sock_table_find(fd);
+    return s && __atomic_load_n(&s->buffered, __ATOMIC_RELAXED);
+}
+
+/* copy out what the handshake buffered for fd, 0 if nothing */
+static size_t read_buffered(int fd, void* buf, size_t len, int peek) {
+    if(__atomic_load_n(&buffered_cnt, __ATOMIC_RELAXED) == 0 || len == 0 || !has_buffered(fd)) {
+        return 0;
+    }
+
+    managed_sock* s = sock_table_find(fd);
+    size_t n = 0;
+
+    sock_table_lock(s);
+    if(s->buffered) {
+        n = socks5_read_buffered(s->ctx, buf, len, peek);
+        if(socks5_buffered(s->ctx) == 0) {
+            buffered_drop(s);
+        }
+    }
+    sock_table_unlock(s);
+    return n;
+}
+
+/* the app moved n bytes on fd, or the call failed. unmanaged fds stop
+ * at the table lookup, a pending sock's I/O is the handshake's own and
+ * not counted. the slot isn't locked, a dest read off a slot being
+ * reused only puts a call on the wrong destination */
+static ssize_t count_io(int fd, int dir, ssize_t n) {
+    managed_sock* s = sock_table_find(fd);
+    if(!s || !s->dest || __atomic_load_n(&s->pending, __ATOMIC_RELAXED)) {
+        return n;
+    }
+
+    int err = errno;
+    dest_stats* dest = s->dest;
+    dest_stats_io(dest, fd, dir, n);
+    if(dir == DEST_STATS_IN && n > 0 && !__atomic_load_n(&s->got_data, __ATOMIC_RELAXED) &&
+       !__atomic_exchange_n(&s->got_data, 1, __ATOMIC_RELAXED)) {
+        dest_stats_ttfb(dest, upstream_now_us() - s->start_us);
+    }
+    errno = err;
+    return n;
+}
+
+/* drop per-socket state, called with the slot locked */
+static void release_socket(managed_sock* s) {
+    if(s->pending) {
+        s->pending = 0;
+        __atomic_sub_fetch(&pending_cnt, 1, __ATOMIC_RELAXED);
+        upstream_done(s->upstream, UPSTREAM_ABANDONED, 0);
+        upstream_set_unref(s->upstream->set);
+    }
+    s->upstream = NULL;
+    buffered_drop(s);
+    free(s->dest_host);
+    s->dest_host = NULL;
+    if(s->dest) {
+        dest_stats_close(s->dest, s->og_fd);
+        s->dest = NULL;
+    }
+
+    /* the association ends with its control conn */
+    if(s->relay) {
+        free(s->relay);
+        s->relay = NULL;
+        __atomic_sub_fetch(&udp_cnt, 1, __ATOMIC_RELAXED);
+        socks5_close(s->ctx);
+        socks5_free(s->ctx);
+    }
+    else if(s->through_tor && s->ctx) {
+        socks5_close(s->ctx);
+        socks5_free(s->ctx);
+    }
+    s->ctx = NULL;
+}
+
+static managed_sock* register_socket(int fd, socks5_ctx* ctx, int through_tor, const char* host, uint16_t port, upstream* pending, uint64_t start_us) {
+    managed_sock* s = sock_table_insert(fd);
+    if(!s) {
+        return NULL;
+    }
+
+    s->ctx = ctx;
+    s->through_tor = through_tor;
+    s->dest_host = logger_enabled(LOGGER_DEBUG) ? strdup(host) : NULL;
+    s->dest_port = port;
+    s->dest = dest_stats_get(host, port);
+    s->start_us = start_us;
+    if(pending) {
+        s->pending = 1;
+        s->want = SOCKS5_WANT_WRITE;
+        s->upstream = pending;
+        upstream_set_ref(pending->set);     // outlives a reload until done
+        __atomic_add_fetch(&pending_cnt, 1, __ATOMIC_RELAXED);
+    }
+    else if(ctx) {
+        buffered_add(s);
+    }
+
+    sock_table_unlock(s);
+    return s;
+}
+
+/* advance a pending handshake. on completion the app's epoll registration
+ * is restored so its own EPOLLOUT fires, on failure the socket is shut
+ * down so the app sees HUP and getsockopt(SO_ERROR) reports the error.
+ * gen guards against the fd having been closed and reused meanwhile */
+static int drive_pending(managed_sock* s, uint32_t gen) {
+    sock_table_lock(s);
+
+    if(sock_table_gen(s) != gen || !s->pending) {
+        int ret = (sock_table_gen(s) == gen && !s->so_error) ? 0 : -1;
+        sock_table_unlock(s);
+        return ret;
+    }
+
+    int fd = s->og_fd;
+    int ret = socks5_connect_step(s->ctx);
+
+    if(ret > 0) {
+        if(s->ep_fd >= 0 && ret != s->want) {
+            struct epoll_event ev;
+            ev.events = (ret == SOCKS5_WANT_READ) ? EPOLLIN : EPOLLOUT;
+            ev.data.u64 = TORALIZE_EP_TAG | (uint32_t)fd;
+            ORIGINAL(epoll_ctl)(s->ep_fd, EPOLL_CTL_MOD, fd, &ev);
+        }
+        s->want = ret;
+        sock_table_unlock(s);
+        return ret;
+    }
+
+    s->pending = 0;
+    __atomic_sub_fetch(&pending_cnt, 1, __ATOMIC_RELAXED);
+    proxy_done(s->upstream, s->ctx, ret, s->start_us);
+    upstream_set_unref(s->upstream->set);
+    s->upstream = NULL;
+
+    if(ret < 0) {
+        log_warn("Failed to connect through Tor: %s", socks5_get_error(s->ctx));
+        s->so_error = ECONNREFUSED;
+        shutdown(fd, SHUT_RDWR);
+    }
+    else {
+        log_debug("Connected to %s:%d through tor", s->dest_host ? s->dest_host : "?", s->dest_port);
+        buffered_add(s);
+    }
+
+    if(s->ep_fd >= 0) {
+        struct epoll_event ev;
+        ev.events = s->ep_events;
+        ev.data = s->ep_data;
+        ORIGINAL(epoll_ctl)(s->ep_fd, EPOLL_CTL_MOD, fd, &ev);
+    }
+    sock_table_unlock(s);
+    return ret;
+}
+
+/* managed sock of fd if its handshake is still running */
+static managed_sock* find_pending(int fd) {
+    if(__atomic_load_n(&pending_cnt, __ATOMIC_RELAXED) == 0) {
+        return NULL;
+    }
+    managed_sock* s = sock_table_find(fd);
+    if(s && s->pending) {
+        return s;
+    }
+    return NULL;
+}
+
+/* remaining ms of a poll-style timeout, -1 stays infinite */
+static int remaining_ms(int timeout, const struct timespec* start) {
+    if(timeout < 0) {
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+    return elapsed >= timeout ? 0 : (int)(timeout - elapsed);
+}
+
+static int extract_addr_info(const struct sockaddr* addr, socklen_t addrlen, char* host, size_t host_len, uint16_t* port) {
+    if(addr->sa_family == AF_INET) {
+        struct sockaddr_in* addr_in = (struct sockaddr_in*)addr;
+        inet_ntop(AF_INET, &(addr_in->sin_addr), host, host_len);
+        *port = ntohs(addr_in->sin_port);
+        return 0;
+    }
+    else if(addr->sa_family == AF_INET6) {
+        struct sockaddr_in6* addr_in6 = (struct sockaddr_in6*)addr;
+        inet_ntop(AF_INET6, &(addr_in6->sin6_addr), host, host_len);
+        *port = ntohs(addr_in6->sin6_port);
+        return 0;
+    }
+    else {
+        return -1;
+    }
+}
+
+
+static int connect_through(const toralize_snapshot* conf, int sockfd, const struct sockaddr* addr, socklen_t addrlen) {
+    /* connect() again on a socket we already handle */
+    managed_sock* s = sock_table_find(sockfd);
+    if(s && s->through_tor) {
+        if(s->pending && drive_pending(s, sock_table_gen(s)) > 0) {
+            errno = EALREADY;
+            return -1;
+        }
+        errno = s->so_error ? s->so_error : EISCONN;
+        s->so_error = 0;
+        return -1;
+    }
+
+    if(!addr || (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)) {
+        log_debug("Unknown address family, using direct connection");
+        return ORIGINAL(connect)(sockfd, addr, addrlen);
+    }
+
+    /* excluded nets are matched on the raw addr, no formatting needed */
+    int fake = fakeip_is_fake(addr);
+    if(!fake && cidr_trie_match(&conf->excluded_nets, addr)) {
+        if(logger_enabled(LOGGER_DEBUG)) {
+            char excluded[INET6_ADDRSTRLEN];
+            uint16_t excluded_port;
+            extract_addr_info(addr, addrlen, excluded, sizeof(excluded), &excluded_port);
+            log_debug("Host %s is excluded, using direct connection", excluded);
+        }
+        return ORIGINAL(connect)(sockfd, addr, addrlen);
+    }
+
+    /* extract host and port from sockaddr */
+    char host[256];
+    uint16_t port = 0;
+    extract_addr_info(addr, addrlen, host, sizeof(host), &port);
+
+    /* fake addr from our getaddrinfo, connect to the name it stands for */
+    if(fake && fakeip_lookup(addr, host, sizeof(host)) != 0) {
+        log_warn("Stale fake address %s, mapping was recycled", host);
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    log_debug("Intercepting connection to %s:%d", host, port);
+
+    /* assoc SOCKS5 con with original sock */
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    int nonblock = flags >= 0 && (flags & O_NONBLOCK);
+
+    /* pick a SocksPort. one that fails before answering is skipped for
+     * the next, CONNECT never reached the destination through it */
+    socks5_ctx* ctx = NULL;
+    upstream* u = NULL;
+    uint64_t start_us = 0;
+    uint32_t tried = 0;
+    int res = -1;
+
+    while((u = upstream_pick(conf->upstreams, tried)) != NULL) {
+        if(ctx) {
+            log_info("Trying next upstream %s:%d", u->host, u->port);
+            socks5_free(ctx);
+        }
+        tried |= 1u << (u - conf->upstreams->list);
+        start_us = upstream_now_us();
+
+        int pooled;
+        ctx = proxy_ctx(conf, u, sockfd, &pooled);
+        if(!ctx) {
+            upstream_done(u, UPSTREAM_ABANDONED, 0);
+            errno = ECONNREFUSED;
+            return -1;
+        }
+
+        /* non-blocking app socket: the handshake result comes later */
+        if(nonblock) {
+            res = socks5_connect_start(ctx, host, port);
+            if(res >= 0) {
+                break;
+            }
+        }
+        else {
+            res = socks5_connect(ctx, host, port);
+            if(res < 0 && pooled >= 0 && proxy_sock_lost(ctx)) {
+                log_info("Pooled proxy sock went away, retrying on a new one");
+                res = socks5_connect(ctx, host, port);
+            }
+            proxy_done(u, ctx, res < 0 ? -1 : 0, start_us);
+            if(res >= 0) {
+                break;
+            }
+        }
+
+        log_warn("Failed to connect through Tor: %s", socks5_get_error(ctx));
+        if(nonblock) {
+            proxy_done(u, ctx, -1, start_us);
+        }
+        if(upstream_result(-1, socks5_get_reply(ctx)) != UPSTREAM_DOWN) {
+            break;
+        }
+    }
+
+    if(res < 0) {
+        socks5_free(ctx);
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    uint64_t fixup_us = socks5_stats_enabled() ? socks5_stats_now() : 0;
+
+    /* drive the handshake from poll/select/epoll_wait. a pooled proxy
+     * sock is handed over right away */
+    if(nonblock) {
+        if(res != sockfd) {
+            if(dup2(res, sockfd) < 0) {
+                log_error("Failed to hand proxy sock to %d", sockfd);
+                upstream_done(u, UPSTREAM_ABANDONED, 0);
+                socks5_free(ctx);
+                errno = ECONNREFUSED;
+                return -1;
+            }
+            socks5_rebind(ctx, sockfd);
+            fcntl(sockfd, F_SETFL, flags);
+        }
+
+        s = register_socket(sockfd, ctx, 1, host, port, u, start_us);
+        if(!s) {
+            log_error("Failed to register managed socket %d", sockfd);
+            upstream_done(u, UPSTREAM_ABANDONED, 0);
+            socks5_free(ctx);
+            errno = ENOBUFS;
+            return -1;
+        }
+        if(fixup_us) {
+            socks5_stats_add(SOCKS5_PHASE_FIXUP, socks5_stats_now() - fixup_us);
+        }
+
+        int ret = drive_pending(s, sock_table_gen(s));
+        if(ret == 0) {
+            return 0;
+        }
+        if(ret < 0) {
+            s->so_error = 0;
+            errno = ECONNREFUSED;
+            return -1;
+        }
+        errno = EINPROGRESS;
+        return -1;
+    }
+
+    /* pooled proxy sock, splice it over the app's fd. the ctx goes on
+     * with the app's fd, the pool's is closed */
+    if(res != sockfd) {
+        if(dup2(res, sockfd) < 0) {
+            log_error("Failed to hand proxy sock to %d", sockfd);
+            socks5_free(ctx);
+            errno = ECONNREFUSED;
+            return -1;
+        }
+        socks5_rebind(ctx, sockfd);
+
+        /* restore og sock flags */
+        fcntl(sockfd, F_SETFL, flags);
+    }
+
+    /* register sock for tracking */
+    if(!register_socket(sockfd, ctx, 1, host, port, NULL, start_us)) {
+        log_error("Failed to register managed socket %d", sockfd);
+    }
+    if(fixup_us) {
+        socks5_stats_add(SOCKS5_PHASE_FIXUP, socks5_stats_now() - fixup_us);
+    }
+
+    log_debug("Connected to %s:%d through tor", host, port);
+    return 0;
+}
+
+/* association of fd once it has one, checked without a lookup while no
+ * socket has */
+static socks5_udp_relay* udp_find(int fd) {
+    if(__atomic_load_n(&udp_cnt, __ATOMIC_RELAXED) == 0) {
+        return NULL;
+    }
+    managed_sock* s = sock_table_find(fd);
+    return s ? __atomic_load_n(&s->relay, __ATOMIC_ACQUIRE) : NULL;
+}
+
+/* UDP ASSOCIATE for fd through the first upstream that takes it. 1 with
+ * *relay set, 0 for a socket that isn't UDP, -1 failed */
+static int udp_associate(const toralize_snapshot* conf, int fd, socks5_udp_relay** relay) {
+    int type, family;
+    socklen_t len = sizeof(int);
+    if(ORIGINAL(getsockopt)(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_DGRAM) {
+        return 0;
+    }
+    len = sizeof(int);
+    if(ORIGINAL(getsockopt)(fd, SOL_SOCKET, SO_DOMAIN, &family, &len) < 0 ||
+       (family != AF_INET && family != AF_INET6)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&udp_mutex);
+    *relay = udp_find(fd);
+    if(*relay) {
+        pthread_mutex_unlock(&udp_mutex);
+        return 1;
+    }
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = 0;
+    socks5_ctx* ctx = NULL;
+    upstream* u = NULL;
+    uint32_t tried = 0;
+    int res = -1;
+
+    while((u = upstream_pick(conf->upstreams, tried)) != NULL) {
+        socks5_free(ctx);
+        tried |= 1u << (u - conf->upstreams->list);
+        uint64_t start_us = upstream_now_us();
+
+        int pooled;
+        ctx = proxy_ctx(conf, u, -1, &pooled);
+        if(!ctx) {
+            upstream_done(u, UPSTREAM_ABANDONED, 0);
+            break;
+        }
+        res = socks5_udp_associate(ctx, &addr, &addr_len);
+        if(res < 0 && pooled >= 0 && proxy_sock_lost(ctx)) {
+            log_info("Pooled proxy sock went away, retrying on a new one");
+            res = socks5_udp_associate(ctx, &addr, &addr_len);
+        }
+        proxy_done(u, ctx, res < 0 ? -1 : 0, start_us);
+        if(res >= 0) {
+            break;
+        }
+
+        log_warn("Failed to associate UDP: %s", socks5_get_error(ctx));
+        if(upstream_result(-1, socks5_get_reply(ctx)) != UPSTREAM_DOWN) {
+            break;
+        }
+    }
+
+    socks5_udp_relay* r = res >= 0 ? calloc(1, sizeof(*r)) : NULL;
+    if(r && family == AF_INET6 && addr.ss_family == AF_INET) {
+        /* sent from a v6 socket the relay's addr has to be v4-mapped */
+        struct sockaddr_in* sin = (struct sockaddr_in*)&addr;
+        struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&r->addr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = sin->sin_port;
+        sin6->sin6_addr.s6_addr[10] = 0xff;
+        sin6->sin6_addr.s6_addr[11] = 0xff;
+        memcpy(&sin6->sin6_addr.s6_addr[12], &sin->sin_addr, 4);
+        r->addr_len = sizeof(struct sockaddr_in6);
+    }
+    else if(r && family == addr.ss_family) {
+        memcpy(&r->addr, &addr, addr_len);
+        r->addr_len = addr_len;
+    }
+    else if(r) {
+        log_warn("UDP relay is IPv6, socket %d is IPv4", fd);
+        free(r);
+        r = NULL;
+    }
+
+    managed_sock* s = r ? sock_table_insert(fd) : NULL;
+    if(!s) {
+        free(r);
+        socks5_close(ctx);
+        socks5_free(ctx);
+        pthread_mutex_unlock(&udp_mutex);
+        errno = ENETUNREACH;
+        return -1;
+    }
+
+    r->family = family;
+    s->ctx = ctx;
+    __atomic_store_n(&s->relay, r, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&udp_cnt, 1, __ATOMIC_RELAXED);
+    sock_table_unlock(s);
+    pthread_mutex_unlock(&udp_mutex);
+
+    log_debug("UDP socket %d associated through %s:%d", fd, u->host, u->port);
+    *relay = r;
+    return 1;
+}
+
+/* how a datagram to dst leaves fd: 1 through *relay, 0 direct, -1 failed */
+static int udp_route(const toralize_snapshot* conf, int fd, const struct sockaddr* dst, socks5_udp_relay** relay) {
+    if(!conf->udp || !dst || (dst->sa_family != AF_INET && dst->sa_family != AF_INET6)) {
+        return 0;
+    }
+
+    /* the header carries an addr, the name behind a fake one is lost */
+    if(fakeip_is_fake(dst)) {
+        log_warn("UDP to a name from getaddrinfo can't be relayed on %d", fd);
+        errno = ENETUNREACH;
+        return -1;
+    }
+    if(cidr_trie_match(&conf->excluded_nets, dst)) {
+        return 0;
+    }
+
+    *relay = udp_find(fd);
+    if(*relay) {
+        return 1;
+    }
+    return udp_associate(conf, fd, relay);
+}
+
+static ssize_t udp_send(int fd, socks5_udp_relay* relay, const struct msghdr* msg, int flags) {
+    struct mmsghdr m;
+    m.msg_hdr = *msg;
+    m.msg_len = 0;
+    if(socks5_udp_sendmmsg(fd, relay, &m, 1, flags) < 0) {
+        return -1;
+    }
+    return m.msg_len;
+}
+
+/* one datagram through the relay, msg_name and friends updated */
+static ssize_t udp_recv(int fd, socks5_udp_relay* relay, struct msghdr* msg, int flags) {
+    struct mmsghdr m;
+    m.msg_hdr = *msg;
+    m.msg_len = 0;
+    if(socks5_udp_recvmmsg(fd, relay, &m, 1, flags, NULL) < 0) {
+        return -1;
+    }
+    msg->msg_namelen = m.msg_hdr.msg_namelen;
+    msg->msg_controllen = m.msg_hdr.msg_controllen;
+    msg->msg_flags = m.msg_hdr.msg_flags;
+    return m.msg_len;
+}
+
+static ssize_t udp_recvfrom(int fd, socks5_udp_relay* relay, void* buf, size_t len, int flags,
+                            struct sockaddr* src_addr, socklen_t* addrlen) {
+    struct iovec iov = {buf, len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = src_addr;
+    msg.msg_namelen = (src_addr && addrlen) ? *addrlen : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    ssize_t n = udp_recv(fd, relay, &msg, flags);
+    if(n >= 0 && src_addr && addrlen) {
+        *addrlen = msg.msg_namelen;
+    }
+    return n;
+}
+
+/* the whole connect runs on one snapshot, a reload meanwhile waits for
+ * it before freeing the old one */
+int connect(int sockfd, const struct sockaddr* addr, socklen_t addrlen) {
+    if(!toralize_config.init) {
+        init_toralize();
+    }
+
+    int phase;
+    toralize_snapshot* conf = config_enter(&phase);
+    int ret = connect_through(conf, sockfd, addr, addrlen);
+    config_exit(phase);
+    return ret;
+}
+
+int close(int fd) {
+    if(!toralize_config.init) {
+        return ORIGINAL(close)(fd);
+    }
+
+    /* unmanaged fds stop at the table lookup */
+    managed_sock* s = sock_table_find(fd);
+    if(s) {
+        uint32_t gen = sock_table_gen(s);
+
+        sock_table_lock(s);
+        if(sock_table_remove(s, gen) == 0) {
+            log_debug("Closing managed socket %d", fd);
+            release_socket(s);
+        }
+        sock_table_unlock(s);
+    }
+
+    return ORIGINAL(close)(fd);
+}
+
+ssize_t read(int fd, void* buf, size_t count) {
+    if(!toralize_config.init) {
+        init_toralize();
+    }
+
+    size_t n = read_buffered(fd, buf, count, 0);
+    if(n > 0) {
+        return count_io(fd, DEST_STATS_IN, n);
+    }
+    return count_io(fd, DEST_STATS_IN, ORIGINAL(read)(fd, buf, count));
+}
+
+/* finish a recv that got n held bytes into buf. MSG_WAITALL still
+ * wants the rest from the socket */
+static ssize_t recv_rest(int fd, void* buf, size_t len, int flags, size_t n) {
+    if((flags & MSG_WAITALL) && !(flags & MSG_PEEK) && n < len) {
+        ssize_t more = ORIGINAL(recv)(fd, (char*)buf + n, len - n, flags);
+        if(more > 0) {
+            n += more;
+        }
+    }
+    return (flags & MSG_PEEK) ? (ssize_t)n : count_io(fd, DEST_STATS_IN, n);
+}
+
+/* recvmsg on a sock holding early data: the held bytes are scattered
+ * over msg_iov, 0 if it holds none. the handshake holds at most 512, a
+ * bigger read is short like any read of a stream. no address or control
+ * data, as the kernel reports for a connected stream */
+static ssize_t recvmsg_buffered(int fd, struct msghdr* msg, int flags) {
+    char held[512];
+    size_t total = 0;
+    for(size_t i = 0; i < msg->msg_iovlen; i++) {
+        total += msg->msg_iov[i].iov_len;
+    }
+
+    size_t n = read_buffered(fd, held, total < sizeof(held) ? total : sizeof(held), flags & MSG_PEEK);
+    if(n == 0) {
+        return 0;
+    }
+
+    /* MSG_WAITALL fills the rest of the iovecs from the socket */
+    int waitall = (flags & MSG_WAITALL) && !(flags & MSG_PEEK);
+    size_t off = 0;
+    size_t got = n;
+    for(size_t i = 0; i < msg->msg_iovlen; i++) {
+        char* base = msg->msg_iov[i].iov_base;
+        size_t part = msg->msg_iov[i].iov_len;
+        size_t used = n - off < part ? n - off : part;
+        memcpy(base, held + off, used);
+        off += used;
+        if(used == part) {
+            continue;
+        }
+        if(!waitall) {
+            break;
+        }
+
+        ssize_t more = ORIGINAL(recv)(fd, base + used, part - used, flags);
+        if(more <= 0) {
+            break;
+        }
+        got += more;
+        if((size_t)more < part - used) {
+            break;
+        }
+    }
+    msg->msg_namelen = 0;
+    msg->msg_controllen = 0;
+    msg->msg_flags = 0;
+    return (flags & MSG_PEEK) ? (ssize_t)got : count_io(fd, DEST_STATS_IN, got);
+}
+
+ssize_t write(int fd, const void* buf, size_t count) {
+    if(!toralize_config.init) {
+        return ORIGINAL(write)(fd, buf, count);
+    }
+    return count_io(fd, DEST_STATS_OUT, ORIGINAL(write)(fd, buf, count));
+}
+
+ssize_t readv(int fd, const struct iovec* iov, int iovcnt) {
+    if(!toralize_config.init) {
+        init_toralize();
+    }
+
+    /* buffered bytes fill the first iovec, the sock isn't read this time */
+    if(iovcnt > 0 && iov[0].iov_len > 0) {
+        size_t n = read_buffered(fd, iov[0].iov_base, iov[0].iov_len, 0);
+        if(n > 0) {
+            return count_io(fd, DEST_STATS_IN, n);
+        }
+    }
+    return count_io(fd, DEST_STATS_IN, ORIGINAL(readv)(fd, iov, iovcnt));
+}
+
+ssize_t writev(int fd, const struct iovec* iov, int iovcnt) {
+    if(!toralize_config.init) {
+        return ORIGINAL(writev)(fd, iov, iovcnt);
+    }
+    return count_io(fd, DEST_STATS_OUT, ORIGINAL(writev)(fd, iov, iovcnt));
+}
+
+ssize_t recv(int sockfd, void* buf, size_t len, int flags) {
+    if(!toralize_config.init) {
+        init_toralize();
+    }
+
+    /* a UDP association strips the relay's header here too */
+    socks5_udp_relay* relay = udp_find(sockfd);
+    if(relay) {
+        return udp_recvfrom(sockfd, relay, buf, len, flags, NULL, NULL);
+    }
+
+    /* peeked bytes are counted once read */
+    size_t n = read_buffered(sockfd, buf, len, flags & MSG_PEEK);
+    if(n == 0) {
+        ssize_t ret = ORIGINAL(recv)(sockfd, buf, len, flags);
+        return (flags & MSG_PEEK) ? ret : count_io(sockfd, DEST_STATS_IN, ret);
+    }
+    return recv_rest(sockfd, buf, len, flags, n);
+}
 
-/* logging */
-static void toralize_log(const char* format, ...) {
+ssize_t send(int sockfd, const void* buf, size_t len, int flags) {
+    if(!toralize_config.init) {
+        return ORIGINAL(send)(sockfd, buf, len, flags);
+    }
+    return count_io(sockfd, DEST_STATS_OUT, ORIGINAL(send)(sockfd, buf, len, flags));
+}
 
-    va_list args;
-    va_start(args, format);
+int getsockopt(int sockfd, int level, int optname, void* optval, socklen_t* optlen) {
+    if(!toralize_config.init) {
+        init_toralize();
+    }
 
-    fprintf(stderr, "[TORALIZE] ");
-    vfprintf(stderr, format, args);
-    fprintf(stderr, "\n");
+    if(level == SOL_SOCKET && optname == SO_ERROR && optval && optlen && *optlen >= sizeof(int)) {
+        managed_sock* s = sock_table_find(sockfd);
+        if(s && s->through_tor) {
+            if(s->pending) {
+                *(int*)optval = EINPROGRESS;
+                *optlen = sizeof(int);
+                return 0;
+            }
+            if(s->so_error) {
+                *(int*)optval = s->so_error;
+                *optlen = sizeof(int);
+                s->so_error = 0;
+                return 0;
+            }
+        }
+    }
 
-    va_end(args);
+    return ORIGINAL(getsockopt)(sockfd, level, optname, optval, optlen);
 }
 
-static int is_host_excluded(const char* host) {
-    for(int i = 0; i < toralize_config.excluded_cnt; i++) {
-        if(strcmp(toralize_config.excluded[i], host) == 0) {
-            return 1;
-        }
+/* datagrams to anywhere not excluded go through the socket's UDP
+ * association when udp is on, made on the first of them */
+ssize_t sendto(int sockfd, const void* buf, size_t len, int flags, const struct sockaddr* dest_addr, socklen_t addrlen) {
+    if(!toralize_config.init) {
+        init_toralize();
     }
-    return 0;
+    if(!dest_addr) {
+        return count_io(sockfd, DEST_STATS_OUT, ORIGINAL(sendto)(sockfd, buf, len, flags, dest_addr, addrlen));
+    }
+
+    int phase;
+    toralize_snapshot* conf = config_enter(&phase);
+    socks5_udp_relay* relay = NULL;
+    int route = udp_route(conf, sockfd, dest_addr, &relay);
+    config_exit(phase);
+
+    if(route <= 0) {
+        /* a connected TCP sock ignores dest_addr, still counted */
+        return route < 0 ? -1 : count_io(sockfd, DEST_STATS_OUT,
+                                         ORIGINAL(sendto)(sockfd, buf, len, flags, dest_addr, addrlen));
+    }
+    struct iovec iov = {(void*)buf, len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void*)dest_addr;
+    msg.msg_namelen = addrlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    return udp_send(sockfd, relay, &msg, flags);
 }
 
+ssize_t sendmsg(int sockfd, const struct msghdr* msg, int flags) {
+    if(!toralize_config.init) {
+        init_toralize();
+    }
+    if(!msg || !msg->msg_name) {
+        return count_io(sockfd, DEST_STATS_OUT, ORIGINAL(sendmsg)(sockfd, msg, flags));
+    }
 
-/* init the library */
-static void init_toralize() {
-    pthread_mutex_lock(&toralize_config.mutex);
+    int phase;
+    toralize_snapshot* conf = config_enter(&phase);
+    socks5_udp_relay* relay = NULL;
+    int route = udp_route(conf, sockfd, msg->msg_name, &relay);
+    config_exit(phase);
 
-    if(toralize_config.init) {
-        pthread_mutex_unlock(&toralize_config.mutex);
-        return;
+    if(route <= 0) {
+        return route < 0 ? -1 : count_io(sockfd, DEST_STATS_OUT, ORIGINAL(sendmsg)(sockfd, msg, flags));
     }
+    return udp_send(sockfd, relay, msg, flags);
+}
 
-    /* set default config */
-    strncpy(toralize_config.tor_host, PROXY_HOST, MAX_AUTH_LEN -1);
-    toralize_config.tor_port = PROXY_PORT;
+/* a batch goes out in one call as long as its datagrams take the same
+ * route, the rest is left for the next call as sendmmsg allows */
+int sendmmsg(int sockfd, struct mmsghdr* msgvec, unsigned int vlen, int flags) {
+    if(!toralize_config.init) {
+        init_toralize();
+    }
+    if(!msgvec || vlen == 0) {
+        return ORIGINAL(sendmmsg)(sockfd, msgvec, vlen, flags);
+    }
 
-    /* read config file if exists */
-    char* config_path = getenv("TORALIZE_CONFIG");
-    if(!config_path) {
-        config_path = DEFAULT_CONFIG_FILE;
+    int phase;
+    toralize_snapshot* conf = config_enter(&phase);
+    socks5_udp_relay* relay = NULL;
+    int route = udp_route(conf, sockfd, msgvec[0].msg_hdr.msg_name, &relay);
+    unsigned int n = 1;
+    while(route >= 0 && n < vlen) {
+        socks5_udp_relay* next = NULL;
+        if(udp_route(conf, sockfd, msgvec[n].msg_hdr.msg_name, &next) != route) {
+            break;
+        }
+        n++;
     }
-FILE *config_file = fopen(config_path, "r");
-    if(config_file) {
-        char line[512];
-        while(fgets(line, sizeof(line), config_file)) {
-            /* remove newline */
-            size_t len = strlen(line);
-            if(len > 0 && line[len - 1] == '\n') {
-                line[len - 1] = '\0';
-            }
+    config_exit(phase);
 
-            /* skip comments and empty lines */
-            if(line[0] == '#' || line[0] == '\0') {
-                continue;
-            }
+    if(route < 0) {
+        return -1;
+    }
+    if(route == 0) {
+        return ORIGINAL(sendmmsg)(sockfd, msgvec, n, flags);
+    }
+    return socks5_udp_sendmmsg(sockfd, relay, msgvec, n, flags);
+}
 
-            char key[256], value[256];
-            if(sscanf(line, "%255[^=]=%255s", key, value) == 2) {
-                if(strcmp(key, "tor_host") == 0) {
-                    strncpy(toralize_config.tor_host, value, MAX_AUTH_LEN - 1);
-                } else if(strcmp(key, "tor_port") == 0) {
-                    toralize_config.tor_port = (uint16_t)atoi(value);
-                } else if(strcmp(key, "verbose") == 0) {
-                    toralize_config.verbose = atoi(value);
-                } else if (strcmp(key, "exclude") == 0) {
-                    /* add to excluded hosts */
-                    toralize_config.excluded_cnt++;
-                    toralize_config.excluded = realloc(
-                            toralize_config.excluded,
-                            toralize_config.excluded_cnt * sizeof(char*)
-                            );
-                    toralize_config.excluded[toralize_config.excluded_cnt - 1] = strdup(value);
-                }
-            }
+ssize_t recvfrom(int sockfd, void* buf, size_t len, int flags, struct sockaddr* src_addr, socklen_t* addrlen) {
+    if(!toralize_config.init) {
+        init_toralize();
+    }
+
+    socks5_udp_relay* relay = udp_find(sockfd);
+    if(relay) {
+        return udp_recvfrom(sockfd, relay, buf, len, flags, src_addr, addrlen);
+    }
+
+    /* held early data first, with no source as for any connected stream */
+    size_t n = read_buffered(sockfd, buf, len, flags & MSG_PEEK);
+    if(n > 0) {
+        if(src_addr && addrlen) {
+            *addrlen = 0;
         }
-        fclose(config_file);
+        return recv_rest(sockfd, buf, len, flags, n);
     }
+    ssize_t ret = ORIGINAL(recvfrom)(sockfd, buf, len, flags, src_addr, addrlen);
+    return (flags & MSG_PEEK) ? ret : count_io(sockfd, DEST_STATS_IN, ret);
+}
 
-    /* always exclude localhost */
-    if(!is_host_excluded("127.0.0.1")) {
-            toralize_config.excluded_cnt++;
-            toralize_config.excluded = realloc(
-                    toralize_config.excluded,
-                    toralize_config.excluded_cnt * sizeof(char*)
-                    );
-            toralize_config.excluded[toralize_config.excluded_cnt - 1] = strdup("127.0.0.1");
+ssize_t recvmsg(int sockfd, struct msghdr* msg, int flags) {
+    if(!toralize_config.init) {
+        init_toralize();
     }
 
-    if(!is_host_excluded("localhost")) {
-        toralize_config.excluded_cnt++;
-        toralize_config.excluded = realloc(
-                toralize_config.excluded,
-                toralize_config.excluded_cnt * sizeof(char*)
-                );
-        toralize_config.excluded[toralize_config.excluded_cnt - 1] = strdup("localhost");
+    socks5_udp_relay* relay = udp_find(sockfd);
+    if(relay && msg) {
+        return udp_recv(sockfd, relay, msg, flags);
     }
 
-    /* load original functions */
-    
-    dlerror();
-    original_connect = dlsym(RTLD_NEXT, "connect");
-    char* err_connect = dlerror();
-    if(err_connect) {
-        fprintf(stderr, "dlsym error: %s\n", err_connect);
-        exit(1);
+    ssize_t n = msg ? recvmsg_buffered(sockfd, msg, flags) : 0;
+    if(n > 0) {
+        return n;
     }
+    ssize_t ret = ORIGINAL(recvmsg)(sockfd, msg, flags);
+    return (flags & MSG_PEEK) ? ret : count_io(sockfd, DEST_STATS_IN, ret);
+}
 
+int recvmmsg(int sockfd, struct mmsghdr* msgvec, unsigned int vlen, int flags, struct timespec* timeout) {
+    if(!toralize_config.init) {
+        init_toralize();
+    }
 
-    dlerror();
-    original_close = dlsym(RTLD_NEXT, "close");
-    char* err_close = dlerror();
-    if(err_close) {
-        fprintf(stderr, "dlsym error: %s\n", err_close);
-        exit(1);
+    socks5_udp_relay* relay = udp_find(sockfd);
+    if(!relay || !msgvec) {
+        return ORIGINAL(recvmmsg)(sockfd, msgvec, vlen, flags, timeout);
     }
+    return socks5_udp_recvmmsg(sockfd, relay, msgvec, vlen, flags, timeout);
+}
 
-    dlerror();
-    original_send = dlsym(RTLD_NEXT, "send");
-    char* err_send = dlerror();
-    if(err_send) {
-        fprintf(stderr, "dlsym error: %s\n", err_send);
-        exit(1);
+/* fds holding handshake bytes are readable right away, the rest only get
+ * a non-blocking look. 0 if none of fds holds any */
+static int poll_buffered(struct pollfd* fds, nfds_t nfds) {
+    nfds_t i;
+    for(i = 0; i < nfds; i++) {
+        if((fds[i].events & POLLIN) && has_buffered(fds[i].fd)) {
+            break;
+        }
     }
-    
-    dlerror();
-    original_recv = dlsym(RTLD_NEXT, "recv");
-    char* err_recv = dlerror();
-    if(err_recv) {
-        fprintf(stderr, "dlsym error: %s\n", err_recv);
-        exit(1);
+    if(i == nfds) {
+        return 0;
     }
-    
-    dlerror();
-    original_write = dlsym(RTLD_NEXT, "write");
-    char* err_write = dlerror();
-    if(err_write) {
-        fprintf(stderr, "dlsym error: %s\n", err_write);
-        exit(1);
+
+    int n = ORIGINAL(poll)(fds, nfds, 0);
+    if(n < 0) {
+        return n;
+    }
+    for(; i < nfds; i++) {
+        if((fds[i].events & POLLIN) && has_buffered(fds[i].fd)) {
+            if(!fds[i].revents) {
+                n++;
+            }
+            fds[i].revents |= POLLIN;
+        }
     }
+    return n;
+}
 
+int poll(struct pollfd* fds, nfds_t nfds, int timeout) {
+    if(!toralize_config.init) {
+        init_toralize();
+    }
 
-    dlerror();
-    original_read = dlsym(RTLD_NEXT, "read");
-    char* err_read = dlerror();
-    if(err_read) {
-        fprintf(stderr, "dlsym error: %s\n", err_read);
-        exit(1);
+    if(__atomic_load_n(&pending_cnt, __ATOMIC_RELAXED) == 0 &&
+       __atomic_load_n(&buffered_cnt, __ATOMIC_RELAXED) == 0) {
+        return ORIGINAL(poll)(fds, nfds, timeout);
     }
 
-    /* init socket tracking table */
-    memset(managed_socks, 0, sizeof(managed_socks));
-    for(int i = 0; i < MAX_MANAGED_SOCKS; i++) {
-        managed_socks[i].og_fd = -1;
+    struct { managed_sock* s; uint32_t gen; short events; } stack_slots[256], *slots;
+    slots = nfds <= 256 ? stack_slots : malloc(nfds * sizeof(*slots));
+    if(!slots) {
+        return ORIGINAL(poll)(fds, nfds, timeout);
     }
 
-    toralize_config.init = 1;
-    toralize_log("Initialized with Tor proxy at %s:%d", toralize_config.tor_host, toralize_config.tor_port);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    pthread_mutex_unlock(&toralize_config.mutex);
-}
+    for(;;) {
+        int settled = 0;
 
-static int register_socket(int fd, socks5_ctx* ctx, int through_tor, const char* host, uint16_t port) {
-    for(int i = 0; i < MAX_MANAGED_SOCKS; i++) {
-        if(managed_socks[i].og_fd == -1) {
-                managed_socks[i].og_fd = fd;
-                managed_socks[i].ctx = ctx;
-                managed_socks[i].through_tor = through_tor;
-                strncpy(managed_socks[i].dest_host, host, sizeof(managed_socks[i].dest_host) - 1);
-                managed_socks[i].dest_port = port;
-                return 0;
+        if(__atomic_load_n(&buffered_cnt, __ATOMIC_RELAXED) > 0) {
+            int n = poll_buffered(fds, nfds);
+            if(n != 0) {
+                if(slots != stack_slots) {
+                    free(slots);
+                }
+                return n;
+            }
         }
-    }
-    return -1;
-}
 
-/* find managed sock by fd */
-static int find_sock_index(int fd) {
-    for(int i = 0; i < MAX_MANAGED_SOCKS; i++) {
-        if(managed_socks[i].og_fd == fd) {
-            return i;
+        /* wait for what the handshake needs, not what the app asked for */
+        for(nfds_t i = 0; i < nfds; i++) {
+            slots[i].s = find_pending(fds[i].fd);
+            if(slots[i].s) {
+                slots[i].gen = sock_table_gen(slots[i].s);
+                slots[i].events = fds[i].events;
+                fds[i].events = (slots[i].s->want == SOCKS5_WANT_READ) ? POLLIN : POLLOUT;
+            }
+        }
+
+        int n = ORIGINAL(poll)(fds, nfds, remaining_ms(timeout, &start));
+
+        for(nfds_t i = 0; i < nfds; i++) {
+            if(!slots[i].s) {
+                continue;
+            }
+            fds[i].events = slots[i].events;
+            if(n > 0 && fds[i].revents) {
+                if(drive_pending(slots[i].s, slots[i].gen) <= 0) {
+                    settled = 1;
+                }
+                fds[i].revents = 0;
+                n--;
+            }
+        }
+
+        /* a settled handshake is reported by the next poll round */
+        if(n < 0 || (!settled && (n > 0 || remaining_ms(timeout, &start) == 0))) {
+            if(slots != stack_slots) {
+                free(slots);
+            }
+            return n;
         }
     }
-    return -1;
 }
 
-static int extract_addr_info(const struct sockaddr* addr, socklen_t addrlen, char* host, size_t host_len, uint16_t* port) {
-    if(addr->sa_family == AF_INET) {
-        struct sockaddr_in* addr_in = (struct sockaddr_in*)addr;
-        inet_ntop(AF_INET, &(addr_in->sin_addr), host, host_len);
-        *port = ntohs(addr_in->sin_port);
-        return 0;
+/* select flavour of poll_buffered */
+static int select_buffered(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds) {
+    fd_set held;
+    int cnt = 0;
+
+    FD_ZERO(&held);
+    for(int fd = 0; fd < nfds; fd++) {
+        if(FD_ISSET(fd, readfds) && has_buffered(fd)) {
+            FD_SET(fd, &held);
+            cnt++;
+        }
     }
-    else if(addr->sa_family == AF_INET6) {
-        struct sockaddr_in6* addr_in6 = (struct sockaddr_in6*)addr;
-        inet_ntop(AF_INET6, &(addr_in6->sin6_addr), host, host_len);
-        *port = ntohs(addr_in6->sin6_port);
+    if(cnt == 0) {
         return 0;
     }
-    else {
-        return -1;
+
+    struct timeval tv = {0, 0};
+    int n = ORIGINAL(select)(nfds, readfds, writefds, exceptfds, &tv);
+    if(n < 0) {
+        return n;
+    }
+    for(int fd = 0; fd < nfds; fd++) {
+        if(FD_ISSET(fd, &held) && !FD_ISSET(fd, readfds)) {
+            FD_SET(fd, readfds);
+            n++;
+        }
     }
+    return n;
 }
 
-
-int connect(int sockfd, const struct sockaddr* addr, socklen_t addrlen) {
+int select(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds, struct timeval* timeout) {
     if(!toralize_config.init) {
         init_toralize();
     }
 
-    /* extract host and port from sockaddr */
-    char host[256];
-    uint16_t port;
-
-    if(extract_addr_info(addr, addrlen, host, sizeof(host), &port) != 0) {
-        toralize_log("Unknown address family, using direct connection");
-        return original_connect(sockfd, addr, addrlen);
-    }
-    
-    /* check if host is excluded */
-    if(is_host_excluded(host)) {
-        toralize_log("Host %s is excluded, using direct connection", host);
-        register_socket(sockfd, NULL, 0, host,  port);
-        return original_connect(sockfd, addr, addrlen);
+    if(__atomic_load_n(&pending_cnt, __ATOMIC_RELAXED) == 0 &&
+       (!readfds || __atomic_load_n(&buffered_cnt, __ATOMIC_RELAXED) == 0)) {
+        return ORIGINAL(select)(nfds, readfds, writefds, exceptfds, timeout);
     }
 
-    toralize_log("Intercepting connection to %s:%d", host, port);
+    int timeout_ms = timeout ? (int)(timeout->tv_sec * 1000 + timeout->tv_usec / 1000) : -1;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    fd_set rd, wr, ex;
+    FD_ZERO(&rd);
+    FD_ZERO(&wr);
+    FD_ZERO(&ex);
+    if(readfds) rd = *readfds;
+    if(writefds) wr = *writefds;
+    if(exceptfds) ex = *exceptfds;
+
+    for(;;) {
+        fd_set r = rd, w = wr, e = ex;
+        int settled = 0;
+
+        if(readfds && __atomic_load_n(&buffered_cnt, __ATOMIC_RELAXED) > 0) {
+            int n = select_buffered(nfds, &r, &w, &e);
+            if(n < 0) {
+                return n;
+            }
+            if(n > 0) {
+                *readfds = r;
+                if(writefds) *writefds = w;
+                if(exceptfds) *exceptfds = e;
+                return n;
+            }
+        }
 
-    /* create SOCKS5 ctx for Tor */
-    socks5_ctx* ctx = socks5_create_ctx(toralize_config.tor_host, toralize_config.tor_port);
-    if(!ctx) {
-        errno = ECONNREFUSED;
-        return -1;
-    }
+        for(int fd = 0; fd < nfds; fd++) {
+            if(!FD_ISSET(fd, &r) && !FD_ISSET(fd, &w)) {
+                continue;
+            }
+            managed_sock* s = find_pending(fd);
+            if(!s) {
+                continue;
+            }
+            FD_CLR(fd, &r);
+            FD_CLR(fd, &w);
+            if(s->want == SOCKS5_WANT_READ) {
+                FD_SET(fd, &r);
+            } else {
+                FD_SET(fd, &w);
+            }
+        }
 
-    /* set verbose */
-    socks5_set_verbose(ctx, toralize_config.verbose);
+        int left = remaining_ms(timeout_ms, &start);
+        struct timeval tv = { left / 1000, (left % 1000) * 1000 };
+        int n = ORIGINAL(select)(nfds, &r, &w, &e, left < 0 ? NULL : &tv);
+        if(n < 0) {
+            return n;
+        }
 
-    /* connect through tor */
-    int res = socks5_connect(ctx, host, port);
-    if(res < 0) {
-        toralize_log("Failed to connect through Tor: %s", socks5_get_error(ctx));
-        socks5_free(ctx);
-        errno = ECONNREFUSED;
-        return -1;
-    }
+        for(int fd = 0; fd < nfds && n > 0; fd++) {
+            if(!FD_ISSET(fd, &r) && !FD_ISSET(fd, &w)) {
+                continue;
+            }
+            managed_sock* s = find_pending(fd);
+            if(!s) {
+                continue;
+            }
+            if(drive_pending(s, sock_table_gen(s)) <= 0) {
+                settled = 1;
+            }
+            n -= FD_ISSET(fd, &r) + FD_ISSET(fd, &w);
+            FD_CLR(fd, &r);
+            FD_CLR(fd, &w);
+        }
 
-    /* assoc SOCKS5 con with original sock */
-    int flags = fcntl(sockfd, F_GETFL, 0);
+        if(settled || (n == 0 && left != 0)) {
+            continue;
+        }
 
-    /* get cpy tor sock */
-    int tor_sock = dup(res);
-    if(tor_sock < 0) {
-        toralize_log("Failed to dup Tor sock");
-        socks5_close(ctx);
-        socks5_free(ctx);
-        errno = ECONNREFUSED;
-        return -1;
+        if(readfds) *readfds = r;
+        if(writefds) *writefds = w;
+        if(exceptfds) *exceptfds = e;
+        if(timeout) {
+            left = remaining_ms(timeout_ms, &start);
+            timeout->tv_sec = left / 1000;
+            timeout->tv_usec = (left % 1000) * 1000;
+        }
+        return n;
+    }
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event* event) {
+    if(!toralize_config.init) {
+        init_toralize();
     }
 
-    /* close original sock and replace with tor sock */
-    dup2(tor_sock, sockfd);
-    close(tor_sock);
+    managed_sock* s = find_pending(fd);
+    if(!s) {
+        /* epoll_wait reports held handshake bytes through this registration */
+        if(__atomic_load_n(&buffered_cnt, __ATOMIC_RELAXED) > 0 && has_buffered(fd)) {
+            s = sock_table_find(fd);
+            sock_table_lock(s);
+            s->ep_fd = (op == EPOLL_CTL_DEL) ? -1 : epfd;
+            if(event) {
+                s->ep_events = event->events;
+                s->ep_data = event->data;
+            }
+            sock_table_unlock(s);
+        }
+        return ORIGINAL(epoll_ctl)(epfd, op, fd, event);
+    }
 
-    /* restore og sock flags */
-    fcntl(sockfd, F_SETFL, flags);
+    sock_table_lock(s);
+    if(!s->pending) {
+        sock_table_unlock(s);
+        return ORIGINAL(epoll_ctl)(epfd, op, fd, event);
+    }
 
-    /* register sock for tracking */
-    register_socket(sockfd, ctx, 1, host, port);
+    int ret;
+    if(op == EPOLL_CTL_DEL) {
+        s->ep_fd = -1;
+        ret = ORIGINAL(epoll_ctl)(epfd, op, fd, event);
+    }
+    else {
+        /* keep the app's interest aside and register for the handshake */
+        struct epoll_event ev;
+        ev.events = (s->want == SOCKS5_WANT_READ) ? EPOLLIN : EPOLLOUT;
+        ev.data.u64 = TORALIZE_EP_TAG | (uint32_t)fd;
+
+        ret = ORIGINAL(epoll_ctl)(epfd, op, fd, &ev);
+        if(ret == 0 && event) {
+            s->ep_fd = epfd;
+            s->ep_events = event->events;
+            s->ep_data = event->data;
+        }
+    }
+    sock_table_unlock(s);
+    return ret;
+}
 
-    toralize_log("Connected to %s:%d through tor", host, port);
-    return 0;
+/* sockets registered on epfd that hold handshake bytes, as EPOLLIN events */
+static int epoll_buffered(int epfd, struct epoll_event* events, int maxevents) {
+    int k = 0;
+
+    pthread_mutex_lock(&buffered_list.mutex);
+    for(int i = 0; i < buffered_list.cnt && k < maxevents; i++) {
+        managed_sock* s = sock_table_find(buffered_list.fds[i]);
+        if(s && s->buffered && s->ep_fd == epfd && (s->ep_events & EPOLLIN)) {
+            events[k].events = EPOLLIN;
+            events[k].data = s->ep_data;
+            k++;
+        }
+    }
+    pthread_mutex_unlock(&buffered_list.mutex);
+    return k;
 }
 
-int close(int fd) {
+int epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout) {
     if(!toralize_config.init) {
-        return original_close(fd);
+        init_toralize();
+    }
+
+    if(__atomic_load_n(&pending_cnt, __ATOMIC_RELAXED) == 0 &&
+       __atomic_load_n(&buffered_cnt, __ATOMIC_RELAXED) == 0) {
+        return ORIGINAL(epoll_wait)(epfd, events, maxevents, timeout);
     }
 
-    int idx = find_sock_index(fd);
-    if(idx >= 0) {
-        toralize_log("Closing managed socket %d", fd);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(;;) {
+        int held = 0;
+        if(__atomic_load_n(&buffered_cnt, __ATOMIC_RELAXED) > 0) {
+            held = epoll_buffered(epfd, events, maxevents);
+            if(held == maxevents) {
+                return held;
+            }
+        }
 
-        if(managed_socks[idx].through_tor && managed_socks[idx].ctx) {
-            socks5_close(managed_socks[idx].ctx);
-            socks5_free(managed_socks[idx].ctx);
+        /* held events are ready now, only take what else is */
+        int n = ORIGINAL(epoll_wait)(epfd, events + held, maxevents - held, held ? 0 : remaining_ms(timeout, &start));
+        if(n <= 0) {
+            return held ? held : n;
         }
 
-        managed_socks[idx].og_fd = -1;
-        managed_socks[idx].ctx = NULL;
-    }
+        /* drop handshake wakeups, the app's own registration is restored
+         * once the handshake settles and reports on the next round */
+        int j = held;
+        for(int i = held; i < held + n; i++) {
+            if((events[i].data.u64 & TORALIZE_EP_TAG_MASK) == TORALIZE_EP_TAG) {
+                managed_sock* s = find_pending((int)(events[i].data.u64 & 0xffffffff));
+                if(s) {
+                    drive_pending(s, sock_table_gen(s));
+                }
+                continue;
+            }
 
-    return original_close(fd);
-}
-    
-int getaddrinfo(const char* node, const char* service, const struct addrinfo* hints, struct addrinfo** res) {
-    static int (*original_getaddrinfo)(const char*, const char*, const struct addrinfo*, struct addrinfo**);
+            // same sock as a held event, report it once
+            int dup = 0;
+            for(int h = 0; h < held; h++) {
+                if(events[h].data.u64 == events[i].data.u64) {
+                    events[h].events |= events[i].events;
+                    dup = 1;
+                    break;
+                }
+            }
+            if(!dup) {
+                events[j++] = events[i];
+            }
+        }
 
-    if(!original_getaddrinfo) {
-        dlerror();
-        original_getaddrinfo = dlsym(RTLD_NEXT, "getaddrinfo");
-        char* err = dlerror();
-        if(err) {
-            fprintf(stderr, "dlsym error loading getaddrinfo: %s\n", err);
-            exit(1);
+        if(j > 0) {
+            return j;
+        }
+        /* settled handshakes show up immediately, so only give up on timeout */
+        if(timeout == 0) {
+            return ORIGINAL(epoll_wait)(epfd, events, maxevents, 0);
         }
     }
+}
+    
+/* node's addr from Tor, through the cache. -1 when it gets a fake addr
+ * instead: a literal, no upstream answering or a family Tor didn't give */
+static int tor_getaddrinfo(const toralize_snapshot* conf, const char* node, int family, dns_answer* answer) {
+    unsigned char literal[16];
+    if(!dns_forward || inet_pton(AF_INET, node, literal) == 1 || inet_pton(AF_INET6, node, literal) == 1) {
+        return -1;
+    }
 
-    char* error = dlerror();
-    if(error != NULL) {
-        fprintf(stderr, "dlsym error: %s\n", error);
-        exit(1);
+    tor_lookup l = { conf, NULL };
+    if(dns_cache_lookup(dns_forward, node, conf->dns_ttl * 1000, conf->dns_negative_ttl * 1000,
+                        tor_resolve, &l, answer) != 0) {
+        log_warn("Failed to resolve %s through Tor, using a fake address", node);
+        return -1;
     }
+    if(!answer->error && family != AF_UNSPEC && answer->addr.ss_family != family) {
+        return -1;
+    }
+    return 0;
+}
 
+int getaddrinfo(const char* node, const char* service, const struct addrinfo* hints, struct addrinfo** res) {
     if(!toralize_config.init) {
         init_toralize();
     }
 
-    if(!node || is_host_excluded(node)) {
-        return original_getaddrinfo(node, service, hints, res);
+    int phase;
+    toralize_snapshot* conf = config_enter(&phase);
+    int excluded = !node || is_host_excluded(conf, node);
+    dns_answer answer;
+    const dns_answer* tor = NULL;
+    if(!excluded && conf->tor_dns &&
+       tor_getaddrinfo(conf, node, hints ? hints->ai_family : AF_UNSPEC, &answer) == 0) {
+        tor = &answer;
     }
+    config_exit(phase);
 
-    toralize_log("DNS resolution for %s will go through connect() later", node);
+    if(excluded) {
+        return ORIGINAL(getaddrinfo)(node, service, hints, res);
+    }
+    if(tor && tor->error) {
+        return tor->error;
+    }
 
-    /* for non-excluded hosts, resolve via socks later
-     * for now, resolve placeholder addr to be replaced in connect */
+    /* for non-excluded hosts, resolve via socks later. hand out a fake
+     * addr that connect() maps back to the name, or the one Tor resolved */
     
     struct addrinfo* ai = malloc(sizeof(struct addrinfo));
     if(!ai) {
@@ -369,7 +1950,7 @@ int getaddrinfo(const char* node, const char* service, const struct addrinfo* hi
     }
 
     if(ai->ai_family == AF_UNSPEC) {
-        ai->ai_family = AF_INET;
+        ai->ai_family = tor ? tor->addr.ss_family : AF_INET;
     }
 
     /* allocate and set sockaddr */
@@ -396,7 +1977,19 @@ int getaddrinfo(const char* node, const char* service, const struct addrinfo* hi
             }
         }
 
-        sin->sin_addr.s_addr = inet_addr("240.0.0.1");
+        if(tor) {
+            sin->sin_addr = ((const struct sockaddr_in*)&tor->addr)->sin_addr;
+        }
+        else if(fakeip_alloc4(node, &sin->sin_addr) != 0) {
+            free(sin);
+            free(ai);
+            return EAI_MEMORY;
+        }
+        else {
+            char fake[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &sin->sin_addr, fake, sizeof(fake));
+            log_debug("Mapped %s to fake address %s", node, fake);
+        }
         
         ai->ai_addr = (struct sockaddr*)sin;
         ai->ai_addrlen = sizeof(struct sockaddr_in);
@@ -424,7 +2017,14 @@ int getaddrinfo(const char* node, const char* service, const struct addrinfo* hi
             }
         }
 
-        inet_pton(AF_INET6, "::1", &sin6->sin6_addr);
+        if(tor) {
+            sin6->sin6_addr = ((const struct sockaddr_in6*)&tor->addr)->sin6_addr;
+        }
+        else if(fakeip_alloc6(node, &sin6->sin6_addr) != 0) {
+            free(sin6);
+            free(ai);
+            return EAI_MEMORY;
+        }
 
         ai->ai_addr = (struct sockaddr*)sin6;
         ai->ai_addrlen = sizeof(struct sockaddr_in6);
@@ -450,6 +2050,69 @@ int getaddrinfo(const char* node, const char* service, const struct addrinfo* hi
     return 0;
 }
 
+/* a fake addr gives back the name it stands for, with tor_dns other
+ * addrs outside the excluded nets are looked up with RESOLVE_PTR */
+int getnameinfo(const struct sockaddr* addr, socklen_t addrlen, char* host, socklen_t hostlen,
+                char* serv, socklen_t servlen, int flags) {
+    if(!toralize_config.init) {
+        init_toralize();
+    }
+
+    if(!addr || !host || hostlen == 0 || (flags & NI_NUMERICHOST) ||
+       (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)) {
+        return ORIGINAL(getnameinfo)(addr, addrlen, host, hostlen, serv, servlen, flags);
+    }
+
+    /* 0 with the name in answer, an EAI_* code for none, -1 asks libc */
+    dns_answer answer;
+    int found = -1;
+
+    int phase;
+    toralize_snapshot* conf = config_enter(&phase);
+    if(fakeip_is_fake(addr)) {
+        found = fakeip_lookup(addr, answer.name, sizeof(answer.name)) == 0 ? 0 : EAI_NONAME;
+    }
+    else if(conf->tor_dns && dns_reverse && !cidr_trie_match(&conf->excluded_nets, addr)) {
+        char literal[INET6_ADDRSTRLEN];
+        uint16_t port;
+        extract_addr_info(addr, addrlen, literal, sizeof(literal), &port);
+
+        tor_lookup l = { conf, addr };
+        if(dns_cache_lookup(dns_reverse, literal, conf->dns_ttl * 1000, conf->dns_negative_ttl * 1000,
+                            tor_resolve, &l, &answer) == 0) {
+            found = answer.error;
+        }
+        else {
+            found = EAI_AGAIN;
+        }
+    }
+    config_exit(phase);
+
+    if(found < 0) {
+        return ORIGINAL(getnameinfo)(addr, addrlen, host, hostlen, serv, servlen, flags);
+    }
+
+    /* no name, numeric like libc unless the caller requires one */
+    if(found != 0) {
+        if(flags & NI_NAMEREQD) {
+            return found;
+        }
+        return ORIGINAL(getnameinfo)(addr, addrlen, host, hostlen, serv, servlen, flags | NI_NUMERICHOST);
+    }
+
+    if(strlen(answer.name) >= hostlen) {
+        return EAI_OVERFLOW;
+    }
+    if(serv && servlen > 0) {
+        int ret = ORIGINAL(getnameinfo)(addr, addrlen, NULL, 0, serv, servlen, flags);
+        if(ret != 0) {
+            return ret;
+        }
+    }
+    strcpy(host, answer.name);
+    return 0;
+}
+
 /* library constructor */
 __attribute__((constructor))
 static void toralize_init(void) {
@@ -460,20 +2123,41 @@ static void toralize_init(void) {
 /* library destructor */
 __attribute__((destructor))
 static void toralize_destroy(void) {
-    /* free excluded hosts */
-    for(int i = 0; i < toralize_config.excluded_cnt; i++) {
-        free(toralize_config.excluded[i]);
-    }
-    free(toralize_config.excluded);
-
-    /* close any open SOCKS connections */
-    for(int i = 0; i < MAX_MANAGED_SOCKS; i++) {
-        if(managed_socks[i].og_fd != -1 && managed_socks[i].ctx) {
-            socks5_close(managed_socks[i].ctx);
-            socks5_free(managed_socks[i].ctx);
+    config_watch_stop();
+
+    /* the stats are logged, the tables, caches and snapshot all stay: a
+     * thread still in a hook may be using them as the process exits */
+    toralize_snapshot* conf = __atomic_load_n(&config_current, __ATOMIC_ACQUIRE);
+    for(int i = 0; conf && i < conf->upstreams->count; i++) {
+        upstream* u = &conf->upstreams->list[i];
+        if(u->pool) {
+            socks5_pool_stats stats;
+            socks5_pool_get_stats(u->pool, &stats);
+            log_info("Proxy pool %s:%d: %llu hits, %llu misses, %llu opened, %llu dropped",
+                         u->host, u->port,
+                         (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                         (unsigned long long)stats.opened, (unsigned long long)stats.dropped);
         }
+        log_info("Upstream %s:%d: ewma %u us, %d consecutive failures",
+                     u->host, u->port, u->ewma_us, u->fails);
+        if(u->tfo[SOCKS5_TFO_SYN_DATA] || u->tfo[SOCKS5_TFO_FALLBACK]) {
+            log_info("Upstream %s:%d: Fast Open %llu in the SYN, %llu fell back", u->host, u->port,
+                         (unsigned long long)u->tfo[SOCKS5_TFO_SYN_DATA],
+                         (unsigned long long)u->tfo[SOCKS5_TFO_FALLBACK]);
+        }
+    }
+    dest_stats_report();
+
+    dns_cache_stats dns;
+    dns_cache_get_stats(dns_forward, &dns);
+    if(dns.misses) {
+        log_info("Tor DNS: %llu hits, %llu lookups, %llu coalesced, %llu evicted",
+                     (unsigned long long)dns.hits, (unsigned long long)dns.misses,
+                     (unsigned long long)dns.coalesced, (unsigned long long)dns.evicted);
     }
+    socks5_stats_close();
 
-    pthread_mutex_destroy(&toralize_config.mutex);
+    /* flush whatever is still buffered, later lines are written directly */
+    logger_shutdown();
 }
 
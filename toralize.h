@@ -9,41 +9,54 @@
 #include <netinet/in.h>
 #include "socks5_proto.h"
 #include "socks5_client.h"
+#include "socks5_pool.h"
+#include "upstream.h"
+#include "logger.h"
+#include "fakeip.h"
+#include "sock_table.h"
+#include "cidr_trie.h"
+#include "domain_set.h"
+#include "socks5_stats.h"
+#include "rcu.h"
+#include "config.h"
+#include "dns_cache.h"
+#include "socks5_udp.h"
+#include "dest_stats.h"
 #include <netdb.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
 
 
-#define PROXY_HOST "127.0.0.1"
-#define PROXY_PORT 9050
 #define DEFAULT_CONFIG_FILE "toralize.conf"
-#define MAX_MANAGED_SOCKS 1024
 
-/* global state */
+/* epoll data tag for sockets whose SOCKS5 handshake is still running */
+#define TORALIZE_EP_TAG 0x746f720000000000ULL
+#define TORALIZE_EP_TAG_MASK 0xffffffff00000000ULL
+
+/* global state, set once at startup */
 static struct {
-    char tor_host[MAX_AUTH_LEN];
-    uint16_t tor_port;
     int init;
-    int verbose;
     pthread_mutex_t mutex;
-    char** excluded;
-    int excluded_cnt;
+    char config_path[256];
+    int reload;             // TORALIZE_RELOAD_* bits of the startup config
 } toralize_config = {
     .init = 0,
-    .verbose = 0,
-    .excluded = NULL,
-    .excluded_cnt = 0
+    .config_path = "",
+    .reload = 0
 };
 
-/* map of wrapped socket fd to their contexts */
-static struct {
-    int og_fd;
-    socks5_ctx* ctx;
-    int through_tor;
-    char dest_host[MAX_AUTH_LEN];
-    uint16_t dest_port;
-} managed_socks[MAX_MANAGED_SOCKS];
-
 int connect(int, const struct sockaddr* addr, socklen_t addr_len);
 int close(int fd);
+ssize_t read(int fd, void* buf, size_t count);
+ssize_t recv(int sockfd, void* buf, size_t len, int flags);
 int getaddrinfo(const char* node, const char* service, const struct addrinfo* hints, struct addrinfo** res);
+int getnameinfo(const struct sockaddr* addr, socklen_t addrlen, char* host, socklen_t hostlen,
+                char* serv, socklen_t servlen, int flags);
+int getsockopt(int sockfd, int level, int optname, void* optval, socklen_t* optlen);
+int poll(struct pollfd* fds, nfds_t nfds, int timeout);
+int select(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds, struct timeval* timeout);
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event* event);
+int epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout);
 
 #endif // TORALIZE_H
@@ -0,0 +1,42 @@
+/* toralize_conf.c - compile a text config, with its exclude_file, into
+ * the binary image libtoralize maps at load instead of parsing.
+ * point TORALIZE_CONFIG at the output. usage: toralize_conf <config> <image> */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "config.h"
+#include "logger.h"
+
+int main(int argc, char** argv) {
+    if(argc != 3) {
+        fprintf(stderr, "usage: %s <config> <image>\n", argv[0]);
+        return 2;
+    }
+
+    FILE* f = fopen(argv[1], "r");
+    if(!f) {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    toralize_snapshot* conf = config_parse(f);
+    fclose(f);
+    if(!conf) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    int ret = 0;
+    if(config_image_write(conf, argv[2]) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", argv[2], strerror(errno));
+        ret = 1;
+    }
+    else {
+        printf("%s: %u host rules, %u net rules, %d upstreams\n", argv[2],
+               conf->excluded.count, conf->excluded_nets.rules, conf->upstreams->count);
+    }
+
+    config_free(conf);
+    logger_shutdown();
+    return ret;
+}
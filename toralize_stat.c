@@ -0,0 +1,112 @@
+/* toralize_stat.c - print per phase handshake latency percentiles and
+ * reply code counts from a running process' stats file.
+ * usage: toralize_stat <stats_file> [interval_secs] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "socks5_stats.h"
+
+static const char* phase_names[SOCKS5_PHASES] = {
+    "proxy", "negotiate", "reply", "fixup", "total"
+};
+
+static const char* code_names[SOCKS5_STATS_CODE_OTHER + 1] = {
+    "success", "general failure", "not allowed", "net unreachable",
+    "host unreachable", "refused", "ttl expired", "cmd unsupported",
+    "addr unsupported", "other"
+};
+
+/* all slots summed, counters are read while writers keep going */
+static void sum_hist(const socks5_stats_file* f, int phase, socks5_stats_hist* out) {
+    memset(out, 0, sizeof(socks5_stats_hist));
+    for(int i = 0; i < SOCKS5_STATS_SLOTS; i++) {
+        const socks5_stats_hist* h = &f->slot[i].phases[phase];
+        out->sum_us += __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+        if(max > out->max_us) {
+            out->max_us = max;
+        }
+        for(int b = 0; b < SOCKS5_STATS_BUCKETS; b++) {
+            uint64_t n = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+            out->buckets[b] += n;
+            out->count += n;    // from buckets so percentiles add up
+        }
+    }
+}
+
+static uint64_t percentile(const socks5_stats_hist* h, double p) {
+    uint64_t rank = (uint64_t)(h->count * p);
+    uint64_t seen = 0;
+
+    if(rank >= h->count) {
+        rank = h->count - 1;
+    }
+    for(int b = 0; b < SOCKS5_STATS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if(seen > rank) {
+            uint64_t v = socks5_stats_bucket_max(b);
+            return v < h->max_us ? v : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+static void print_stats(const socks5_stats_file* f) {
+    socks5_stats_hist h;
+
+    printf("pid %d, up %llds\n", f->pid, (long long)(time(NULL) - (time_t)f->started));
+    printf("%-10s %10s %10s %10s %10s %10s %10s\n", "phase", "count", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+    for(int i = 0; i < SOCKS5_PHASES; i++) {
+        sum_hist(f, i, &h);
+        if(h.count == 0) {
+            printf("%-10s %10d %10s %10s %10s %10s %10s\n", phase_names[i], 0, "-", "-", "-", "-", "-");
+            continue;
+        }
+        printf("%-10s %10llu %10llu %10llu %10llu %10llu %10llu\n", phase_names[i],
+               (unsigned long long)h.count,
+               (unsigned long long)(h.sum_us / h.count),
+               (unsigned long long)percentile(&h, 0.50),
+               (unsigned long long)percentile(&h, 0.90),
+               (unsigned long long)percentile(&h, 0.99),
+               (unsigned long long)h.max_us);
+    }
+
+    for(int c = 0; c <= SOCKS5_STATS_CODE_OTHER; c++) {
+        uint64_t n = 0;
+        for(int i = 0; i < SOCKS5_STATS_SLOTS; i++) {
+            n += __atomic_load_n(&f->slot[i].codes[c], __ATOMIC_RELAXED);
+        }
+        if(n || c == 0) {
+            printf("%-17s %llu\n", code_names[c], (unsigned long long)n);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s <stats_file> [interval_secs]\n", argv[0]);
+        return 1;
+    }
+
+    const socks5_stats_file* f = socks5_stats_map(argv[1]);
+    if(!f) {
+        fprintf(stderr, "%s: not a toralize stats file\n", argv[1]);
+        return 1;
+    }
+
+    int interval = argc > 2 ? atoi(argv[2]) : 0;
+    for(;;) {
+        print_stats(f);
+        if(interval <= 0) {
+            break;
+        }
+        printf("\n");
+        fflush(stdout);
+        sleep(interval);
+    }
+
+    socks5_stats_unmap(f);
+    return 0;
+}
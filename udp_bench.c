@@ -0,0 +1,232 @@
+/* udp_bench.c - datagrams through a UDP ASSOCIATE relay of the
+ * in-process mock server, which echoes them back. for each batch size:
+ * socks5_udp_sendmmsg/recvmmsg with the header in its own iovec, against
+ * sendto/recvfrom of one datagram at a time with header and payload
+ * copied through a buffer, the same number in flight for both.
+ * usage: udp_bench [-b 1,8,64] [-s size] [-n packets] */
+#define _GNU_SOURCE      // sendmmsg, recvmmsg
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "mock_socks5.h"
+#include "socks5_client.h"
+#include "socks5_udp.h"
+
+#define BENCH_MAX_RUNS  16
+#define BENCH_MAX_SIZE  1400
+#define RECV_WAIT_MS    1000
+
+typedef struct bench_run {
+    int fd;
+    socks5_udp_relay relay;
+    struct sockaddr_in dst;
+    int batch;
+    int size;
+    int packets;
+    uint64_t syscalls;
+    int lost;
+} bench_run;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int wait_readable(int fd) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    return poll(&pfd, 1, RECV_WAIT_MS) > 0;
+}
+
+/* a batch at a time, header prepended and stripped by the kernel's
+ * scatter-gather */
+static void run_batched(bench_run* r, char* bufs) {
+    struct mmsghdr msgs[SOCKS5_UDP_BATCH];
+    struct iovec iovs[SOCKS5_UDP_BATCH];
+    struct sockaddr_in src[SOCKS5_UDP_BATCH];
+
+    for(int done = 0; done < r->packets; ) {
+        int n = r->packets - done < r->batch ? r->packets - done : r->batch;
+        for(int i = 0; i < n; i++) {
+            iovs[i].iov_base = bufs + i * BENCH_MAX_SIZE;
+            iovs[i].iov_len = r->size;
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_name = &r->dst;
+            msgs[i].msg_hdr.msg_namelen = sizeof(r->dst);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        for(int sent = 0; sent < n; ) {
+            int ret = socks5_udp_sendmmsg(r->fd, &r->relay, msgs + sent, n - sent, 0);
+            r->syscalls++;
+            if(ret <= 0) {
+                r->lost += n - sent;
+                break;
+            }
+            sent += ret;
+        }
+
+        int got = 0;
+        while(got < n && wait_readable(r->fd)) {
+            for(int i = got; i < n; i++) {
+                iovs[i].iov_len = BENCH_MAX_SIZE;
+                msgs[i].msg_hdr.msg_name = &src[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(src[i]);
+            }
+            int ret = socks5_udp_recvmmsg(r->fd, &r->relay, msgs + got, n - got, MSG_DONTWAIT, NULL);
+            r->syscalls++;
+            if(ret > 0) {
+                got += ret;
+            }
+        }
+        r->lost += n - got;
+        done += n;
+    }
+}
+
+/* one datagram per call, header and payload copied together */
+static void run_single(bench_run* r, char* bufs) {
+    unsigned char pkt[SOCKS5_UDP_HDR_V6 + BENCH_MAX_SIZE];
+    int hdr_len = socks5_udp_header(pkt, (struct sockaddr*)&r->dst);
+
+    for(int done = 0; done < r->packets; ) {
+        int n = r->packets - done < r->batch ? r->packets - done : r->batch;
+        for(int i = 0; i < n; i++) {
+            memcpy(pkt + hdr_len, bufs + i * BENCH_MAX_SIZE, r->size);
+            r->syscalls++;
+            if(sendto(r->fd, pkt, hdr_len + r->size, 0, (struct sockaddr*)&r->relay.addr, r->relay.addr_len) < 0) {
+                r->lost++;
+            }
+        }
+
+        int got = 0;
+        while(got < n && wait_readable(r->fd)) {
+            struct sockaddr_in src;
+            socklen_t src_len = sizeof(src);
+            r->syscalls++;
+            ssize_t len = recvfrom(r->fd, pkt, sizeof(pkt), MSG_DONTWAIT, (struct sockaddr*)&src, &src_len);
+            if(len >= hdr_len) {
+                memcpy(bufs + got * BENCH_MAX_SIZE, pkt + hdr_len, len - hdr_len);
+                got++;
+            }
+        }
+        r->lost += n - got;
+        done += n;
+    }
+}
+
+static int parse_list(const char* s, int* out) {
+    int n = 0;
+    while(*s && n < BENCH_MAX_RUNS) {
+        out[n] = atoi(s);
+        if(out[n] <= 0 || out[n] > SOCKS5_UDP_BATCH) {
+            return -1;
+        }
+        n++;
+        s = strchr(s, ',');
+        if(!s) {
+            break;
+        }
+        s++;
+    }
+    return n;
+}
+
+int main(int argc, char* argv[]) {
+    int batches[BENCH_MAX_RUNS] = {1, 8, 64};
+    int runs = 3;
+    int size = 512;
+    int packets = 200000;
+
+    int opt;
+    while((opt = getopt(argc, argv, "b:s:n:")) != -1) {
+        switch(opt) {
+            case 'b':
+                runs = parse_list(optarg, batches);
+                break;
+            case 's':
+                size = atoi(optarg);
+                break;
+            case 'n':
+                packets = atoi(optarg);
+                break;
+            default:
+                runs = -1;
+                break;
+        }
+    }
+    if(runs <= 0 || size <= 0 || size > BENCH_MAX_SIZE || packets <= 0) {
+        fprintf(stderr, "usage: %s [-b 1,8,64] [-s size] [-n packets]\n", argv[0]);
+        return 2;
+    }
+
+    mock_socks5_opts mopts;
+    memset(&mopts, 0, sizeof(mopts));
+    mock_socks5* mock = mock_socks5_start(&mopts);
+    if(!mock) {
+        fprintf(stderr, "failed to start mock server\n");
+        return 1;
+    }
+
+    bench_run r;
+    memset(&r, 0, sizeof(r));
+    socks5_ctx* ctx = socks5_create_ctx("127.0.0.1", mock_socks5_port(mock));
+    if(!ctx || socks5_udp_associate(ctx, &r.relay.addr, &r.relay.addr_len) < 0) {
+        fprintf(stderr, "UDP ASSOCIATE failed: %s\n", ctx ? socks5_get_error(ctx) : "no memory");
+        return 1;
+    }
+    r.relay.family = AF_INET;
+
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    r.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(r.fd < 0 || bind(r.fd, (struct sockaddr*)&local, sizeof(local)) < 0) {
+        perror("udp socket");
+        return 1;
+    }
+    // the relay echoes, the destination is only named in the header
+    r.dst.sin_family = AF_INET;
+    r.dst.sin_port = htons(9);
+    inet_pton(AF_INET, "192.0.2.1", &r.dst.sin_addr);
+    r.size = size;
+    r.packets = packets;
+
+    char* bufs = malloc(SOCKS5_UDP_BATCH * BENCH_MAX_SIZE);
+    memset(bufs, 'x', SOCKS5_UDP_BATCH * BENCH_MAX_SIZE);
+
+    for(int i = 0; i < runs; i++) {
+        r.batch = batches[i];
+
+        r.syscalls = 0;
+        r.lost = 0;
+        double t0 = now_ns();
+        run_single(&r, bufs);
+        double single_s = (now_ns() - t0) / 1e9;
+        double single_calls = (double)r.syscalls / packets;
+        int single_lost = r.lost;
+
+        r.syscalls = 0;
+        r.lost = 0;
+        t0 = now_ns();
+        run_batched(&r, bufs);
+        double batched_s = (now_ns() - t0) / 1e9;
+
+        printf("batch=%-3d size=%-5d packets=%-7d single_pps=%-9.0f calls=%-5.2f lost=%-4d "
+               "mmsg_pps=%-9.0f calls=%-5.2f lost=%-4d speedup=%.2f\n",
+               r.batch, size, packets, packets / single_s, single_calls, single_lost,
+               packets / batched_s, (double)r.syscalls / packets, r.lost, single_s / batched_s);
+    }
+
+    free(bufs);
+    close(r.fd);
+    socks5_free(ctx);
+    mock_socks5_stop(mock);
+    return 0;
+}
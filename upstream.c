@@ -0,0 +1,336 @@
+#include "upstream.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/* idle time after which half of an upstream's latency estimate is
+ * forgotten, so an instance that was slow once gets probed again */
+#define UPSTREAM_DECAY_MS 10000
+
+uint64_t upstream_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+upstream_set* upstream_set_create(void) {
+    upstream_set* set = calloc(1, sizeof(upstream_set));
+    if(set) {
+        set->refs = 1;
+    }
+    return set;
+}
+
+upstream_set* upstream_set_ref(upstream_set* set) {
+    if(set) {
+        __atomic_add_fetch(&set->refs, 1, __ATOMIC_RELAXED);
+    }
+    return set;
+}
+
+/* the last ref closes the pools */
+void upstream_set_unref(upstream_set* set) {
+    if(set && __atomic_sub_fetch(&set->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        upstream_free(set);
+        free(set);
+    }
+}
+
+/* same SocksPorts in the same order under the same policy */
+int upstream_set_same(const upstream_set* a, const upstream_set* b) {
+    if(a->count != b->count || a->policy != b->policy) {
+        return 0;
+    }
+    for(int i = 0; i < a->count; i++) {
+        if(a->list[i].port != b->list[i].port || strcmp(a->list[i].host, b->list[i].host) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int upstream_add(upstream_set* set, const char* host, uint16_t port) {
+    if(set->count >= UPSTREAM_MAX || strlen(host) > MAX_DOMAIN_LEN || port == 0) {
+        return -1;
+    }
+
+    upstream* u = &set->list[set->count];
+    memset(u, 0, sizeof(upstream));
+    u->proxy = socks5_proxy_create(host, port, NULL, NULL);
+    if(!u->proxy) {
+        return -1;
+    }
+    strcpy(u->host, host);
+    u->port = port;
+    u->set = set;
+    pthread_mutex_init(&u->mutex, NULL);
+    set->count++;
+    return 0;
+}
+
+/* "host:port" or "[v6addr]:port" */
+int upstream_add_spec(upstream_set* set, const char* spec) {
+    char host[MAX_DOMAIN_LEN + 1];
+    const char* colon;
+    size_t len;
+
+    if(spec[0] == '[') {
+        const char* end = strchr(spec, ']');
+        if(!end || end[1] != ':') {
+            return -1;
+        }
+        spec++;
+        len = end - spec;
+        colon = end + 1;
+    }
+    else {
+        colon = strrchr(spec, ':');
+        if(!colon) {
+            return -1;
+        }
+        len = colon - spec;
+    }
+
+    if(len == 0 || len > MAX_DOMAIN_LEN) {
+        return -1;
+    }
+    memcpy(host, spec, len);
+    host[len] = '\0';
+
+    char* end;
+    long port = strtol(colon + 1, &end, 10);
+    if(end == colon + 1 || *end != '\0' || port <= 0 || port > 65535) {
+        return -1;
+    }
+    return upstream_add(set, host, (uint16_t)port);
+}
+
+int upstream_parse_policy(const char* name) {
+    if(strcmp(name, "rr") == 0) {
+        return UPSTREAM_RR;
+    }
+    if(strcmp(name, "least") == 0) {
+        return UPSTREAM_LEAST;
+    }
+    if(strcmp(name, "ewma") == 0) {
+        return UPSTREAM_EWMA;
+    }
+    return -1;
+}
+
+void upstream_free(upstream_set* set) {
+    for(int i = 0; i < set->count; i++) {
+        upstream* u = &set->list[i];
+        socks5_pool_destroy(u->pool);
+        socks5_endpoint_unref(u->ep);
+        socks5_proxy_unref(u->proxy);
+        pthread_mutex_destroy(&u->mutex);
+    }
+    memset(set, 0, sizeof(upstream_set));
+}
+
+/* resolve u again unless another thread already replaced failed. NULL
+ * failed means the first resolution */
+int upstream_refresh(upstream* u, socks5_endpoint* failed, int* error) {
+    socks5_endpoint* ep = socks5_endpoint_create(u->host, u->port, error);
+    if(!ep) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&u->mutex);
+    socks5_endpoint* old = u->ep;
+    if(old == failed) {
+        u->ep = ep;
+        socks5_pool_set_endpoint(u->pool, ep);
+        ep = old;
+    }
+    pthread_mutex_unlock(&u->mutex);
+
+    socks5_endpoint_unref(ep);
+    return 0;
+}
+
+/* ref to u's current endpoint, NULL if it never resolved */
+socks5_endpoint* upstream_acquire(upstream* u) {
+    pthread_mutex_lock(&u->mutex);
+    socks5_endpoint* ep = socks5_endpoint_ref(u->ep);
+    pthread_mutex_unlock(&u->mutex);
+
+    if(!ep && upstream_refresh(u, NULL, NULL) == 0) {
+        pthread_mutex_lock(&u->mutex);
+        ep = socks5_endpoint_ref(u->ep);
+        pthread_mutex_unlock(&u->mutex);
+    }
+    return ep;
+}
+
+static uint64_t upstream_score(const upstream_set* set, const upstream* u, uint64_t now_ms) {
+    uint64_t out = __atomic_load_n(&u->outstanding, __ATOMIC_RELAXED);
+
+    if(set->policy == UPSTREAM_LEAST) {
+        return out;
+    }
+
+    // unmeasured upstreams score lowest and get tried first
+    uint64_t ewma = __atomic_load_n(&u->ewma_us, __ATOMIC_RELAXED);
+    uint64_t last = __atomic_load_n(&u->last_ms, __ATOMIC_RELAXED);
+    uint64_t halvings = now_ms > last ? (now_ms - last) / UPSTREAM_DECAY_MS : 0;
+    ewma = halvings >= 32 ? 0 : ewma >> halvings;
+    return (ewma + 1) * (out + 1);
+}
+
+/* choose an upstream for a new connection and count it as outstanding.
+ * upstreams in backoff are skipped, if all are the one coming back
+ * first is probed. bit i of tried excludes list[i], NULL once all are */
+upstream* upstream_pick(upstream_set* set, uint32_t tried) {
+    if(set->count == 0) {
+        return NULL;
+    }
+
+    uint64_t now_ms = upstream_now_us() / 1000;
+    uint32_t start = __atomic_fetch_add(&set->rr, 1, __ATOMIC_RELAXED);
+    upstream* best = NULL;
+    uint64_t best_score = UINT64_MAX;
+
+    // rotating start spreads ties across upstreams
+    for(int i = 0; i < set->count; i++) {
+        int idx = (start + i) % set->count;
+        upstream* u = &set->list[idx];
+        if((tried & (1u << idx)) || __atomic_load_n(&u->down_until_ms, __ATOMIC_RELAXED) > now_ms) {
+            continue;
+        }
+        if(set->policy == UPSTREAM_RR) {
+            // the turns of skipped upstreams are used up too, or the
+            // one after an upstream in backoff would also get its turns
+            if(i > 0) {
+                __atomic_fetch_add(&set->rr, i, __ATOMIC_RELAXED);
+            }
+            best = u;
+            break;
+        }
+        uint64_t score = upstream_score(set, u, now_ms);
+        if(score < best_score) {
+            best = u;
+            best_score = score;
+        }
+    }
+
+    if(!best) {
+        uint64_t soonest = UINT64_MAX;
+        for(int i = 0; i < set->count; i++) {
+            uint64_t until = __atomic_load_n(&set->list[i].down_until_ms, __ATOMIC_RELAXED);
+            if(!(tried & (1u << i)) && until < soonest) {
+                best = &set->list[i];
+                soonest = until;
+            }
+        }
+        if(!best) {
+            return NULL;
+        }
+    }
+
+    __atomic_add_fetch(&best->outstanding, 1, __ATOMIC_RELAXED);
+    return best;
+}
+
+/* SOCKS5 error replies come from a working proxy, anything else (socket
+ * errors, timeouts, garbage) counts against the upstream. reply is the
+ * socks5_get_reply code, never an errno */
+int upstream_result(int ret, int reply) {
+    if(ret == 0) {
+        return UPSTREAM_OK;
+    }
+    if(reply >= SOCKS5_REP_GEN_FAILURE && reply <= SOCKS5_REP_ADDR_NOTSUP) {
+        return UPSTREAM_ERROR;
+    }
+    return UPSTREAM_DOWN;
+}
+
+static int upstream_lat_bucket(uint64_t us) {
+    int b = 0;
+    while(us > 1 && b < UPSTREAM_LAT_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/* racing updates only lose a sample, or halve a bucket twice */
+void upstream_latency_add(upstream* u, uint64_t latency_us) {
+    __atomic_add_fetch(&u->lat[upstream_lat_bucket(latency_us)], 1, __ATOMIC_RELAXED);
+    if(__atomic_add_fetch(&u->lat_cnt, 1, __ATOMIC_RELAXED) < UPSTREAM_LAT_WINDOW) {
+        return;
+    }
+
+    uint32_t cnt = 0;
+    for(int i = 0; i < UPSTREAM_LAT_BUCKETS; i++) {
+        uint32_t n = __atomic_load_n(&u->lat[i], __ATOMIC_RELAXED) / 2;
+        __atomic_store_n(&u->lat[i], n, __ATOMIC_RELAXED);
+        cnt += n;
+    }
+    __atomic_store_n(&u->lat_cnt, cnt, __ATOMIC_RELAXED);
+}
+
+/* upper bound of the bucket holding the pct-th percentile of recent
+ * handshakes, up to twice the real value. 0 without enough samples */
+uint64_t upstream_latency_pct(upstream* u, int pct) {
+    uint32_t lat[UPSTREAM_LAT_BUCKETS];
+    uint64_t cnt = 0;
+    for(int i = 0; i < UPSTREAM_LAT_BUCKETS; i++) {
+        lat[i] = __atomic_load_n(&u->lat[i], __ATOMIC_RELAXED);
+        cnt += lat[i];
+    }
+    if(cnt < UPSTREAM_LAT_MIN) {
+        return 0;
+    }
+
+    uint64_t rank = (cnt * pct + 99) / 100;
+    uint64_t seen = 0;
+    for(int i = 0; i < UPSTREAM_LAT_BUCKETS; i++) {
+        seen += lat[i];
+        if(seen >= rank) {
+            return 2ull << i;
+        }
+    }
+    return 2ull << (UPSTREAM_LAT_BUCKETS - 1);
+}
+
+void upstream_done(upstream* u, int result, uint64_t latency_us) {
+    if(!u) {
+        return;
+    }
+
+    __atomic_sub_fetch(&u->outstanding, 1, __ATOMIC_RELAXED);
+
+    switch(result) {
+        case UPSTREAM_OK: {
+            // ewma with alpha 1/8, racing updates only lose a sample
+            uint32_t ewma = __atomic_load_n(&u->ewma_us, __ATOMIC_RELAXED);
+            uint32_t sample = latency_us > UINT32_MAX ? UINT32_MAX : (uint32_t)latency_us;
+            ewma = ewma ? ewma - ewma / 8 + sample / 8 : sample;
+            __atomic_store_n(&u->ewma_us, ewma ? ewma : 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&u->last_ms, upstream_now_us() / 1000, __ATOMIC_RELAXED);
+            upstream_latency_add(u, latency_us);
+        }
+        // fall through
+        case UPSTREAM_ERROR:
+            __atomic_store_n(&u->fails, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&u->down_until_ms, 0, __ATOMIC_RELAXED);
+            break;
+        case UPSTREAM_DOWN: {
+            int fails = __atomic_add_fetch(&u->fails, 1, __ATOMIC_RELAXED);
+            if(fails >= UPSTREAM_MAX_FAILS) {
+                int shift = fails - UPSTREAM_MAX_FAILS;
+                uint64_t backoff = UPSTREAM_BACKOFF_MS << (shift > 5 ? 5 : shift);
+                if(backoff > UPSTREAM_BACKOFF_MAX_MS) {
+                    backoff = UPSTREAM_BACKOFF_MAX_MS;
+                }
+                __atomic_store_n(&u->down_until_ms, upstream_now_us() / 1000 + backoff, __ATOMIC_RELAXED);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "socks5_proto.h"
+#include "socks5_client.h"
+#include "socks5_pool.h"
+
+#define UPSTREAM_MAX 16
+
+/* consecutive proxy failures before an upstream is taken out of rotation,
+ * it comes back after a backoff that doubles per further failure */
+#define UPSTREAM_MAX_FAILS      3
+#define UPSTREAM_BACKOFF_MS     1000
+#define UPSTREAM_BACKOFF_MAX_MS 30000
+
+/* recent handshake latencies, power of two buckets of us. counts are
+ * halved once UPSTREAM_LAT_WINDOW are in so old samples fade, and no
+ * percentile is given below UPSTREAM_LAT_MIN samples */
+#define UPSTREAM_LAT_BUCKETS    32
+#define UPSTREAM_LAT_WINDOW     1024
+#define UPSTREAM_LAT_MIN        32
+
+/* selection policies */
+enum {
+    UPSTREAM_RR = 0,    // round-robin
+    UPSTREAM_LEAST,     // fewest handshakes in flight
+    UPSTREAM_EWMA       // lowest handshake latency, weighted by load
+};
+
+/* handshake outcomes for upstream_done */
+enum {
+    UPSTREAM_OK = 0,
+    UPSTREAM_ERROR,     // proxy answered with a SOCKS5 error, it is alive
+    UPSTREAM_DOWN,      // proxy refused, reset or timed out
+    UPSTREAM_ABANDONED  // app closed the socket mid handshake
+};
+
+/* one SocksPort. stats are updated with relaxed atomics, pick reads
+ * them without locking */
+typedef struct upstream {
+    char host[MAX_DOMAIN_LEN + 1];
+    uint16_t port;
+    pthread_mutex_t mutex;      // guards ep swaps
+    socks5_proxy* proxy;        // shared by every ctx through this upstream
+    socks5_endpoint* ep;
+    socks5_pool* pool;
+    int outstanding;
+    uint32_t ewma_us;           // 0 until the first handshake completes
+    uint64_t last_ms;           // when ewma_us was last updated
+    int fails;
+    uint64_t down_until_ms;
+    uint64_t tfo[3];            // proxy connects by SOCKS5_TFO_* outcome
+    uint32_t lat[UPSTREAM_LAT_BUCKETS];
+    uint32_t lat_cnt;
+    struct upstream_set* set;
+} upstream;
+
+/* refcounted so a config reload can drop a set while handshakes on its
+ * upstreams are still in flight */
+typedef struct upstream_set {
+    upstream list[UPSTREAM_MAX];
+    int count;
+    int policy;
+    uint32_t rr;
+    int refs;
+} upstream_set;
+
+upstream_set* upstream_set_create(void);
+upstream_set* upstream_set_ref(upstream_set* set);
+void upstream_set_unref(upstream_set* set);
+int upstream_set_same(const upstream_set* a, const upstream_set* b);
+int upstream_add(upstream_set* set, const char* host, uint16_t port);
+int upstream_add_spec(upstream_set* set, const char* spec);
+int upstream_parse_policy(const char* name);
+void upstream_free(upstream_set* set);
+
+int upstream_refresh(upstream* u, socks5_endpoint* failed, int* error);
+socks5_endpoint* upstream_acquire(upstream* u);
+upstream* upstream_pick(upstream_set* set, uint32_t tried);
+void upstream_done(upstream* u, int result, uint64_t latency_us);
+int upstream_result(int ret, int reply);
+void upstream_latency_add(upstream* u, uint64_t latency_us);
+uint64_t upstream_latency_pct(upstream* u, int pct);
+uint64_t upstream_now_us(void);
+
+#endif // UPSTREAM_H
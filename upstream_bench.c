@@ -0,0 +1,311 @@
+/* upstream_bench.c - connections spread over several in-process mock
+ * SocksPorts and one port that refuses, once per selection policy. mock
+ * i answers after i * delay_us, the dead port comes last. checks that
+ * every connect got through, that the dead port was put in backoff and
+ * tried only a handful of times, and how the live ports shared the load:
+ * evenly for rr, the fastest most for least and ewma, none starved by
+ * least. first checks that pooled and direct ctxs share the upstream's
+ * one proxy. one line per check to stdout, exits 1 if one failed.
+ * usage: upstream_bench [-m mocks] [-n conns] [-t threads] [-d delay_us] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "upstream.h"
+#include "mock_socks5.h"
+#include "socks5_client.h"
+
+#define BENCH_MAX_MOCKS (UPSTREAM_MAX - 1)
+
+typedef struct bench_thread {
+    upstream_set* set;
+    int conns;
+    pthread_barrier_t* start;
+    int ok[UPSTREAM_MAX];       // connects that went through list[i]
+    int tries[UPSTREAM_MAX];
+    int errors;
+} bench_thread;
+
+/* reset instead of FIN, see socks5_bench */
+static void bench_close(socks5_ctx* ctx, int sock) {
+    struct linger lin = {1, 0};
+    setsockopt(sock, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    socks5_free(ctx);
+}
+
+/* the failover loop of toralize's connect: next upstream until one
+ * connects or answers with a SOCKS5 error */
+static int bench_connect(bench_thread* t) {
+    upstream* u;
+    uint32_t tried = 0;
+
+    while((u = upstream_pick(t->set, tried)) != NULL) {
+        int idx = u - t->set->list;
+        tried |= 1u << idx;
+        t->tries[idx]++;
+        uint64_t start_us = upstream_now_us();
+
+        socks5_ctx* ctx = socks5_create_ctx_proxy(u->proxy);
+        socks5_endpoint* ep = upstream_acquire(u);
+        if(!ctx || !ep) {
+            upstream_done(u, UPSTREAM_ABANDONED, 0);
+            socks5_endpoint_unref(ep);
+            socks5_free(ctx);
+            return -1;
+        }
+        socks5_set_endpoint(ctx, ep);
+        socks5_endpoint_unref(ep);
+
+        int sock = socks5_connect(ctx, "bench.test", 80);
+        int result = upstream_result(sock < 0 ? -1 : 0, socks5_get_reply(ctx));
+        upstream_done(u, result, upstream_now_us() - start_us);
+        if(sock >= 0) {
+            t->ok[idx]++;
+            bench_close(ctx, sock);
+            return 0;
+        }
+        socks5_free(ctx);
+        if(result != UPSTREAM_DOWN) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+static void* bench_main(void* arg) {
+    bench_thread* t = arg;
+
+    pthread_barrier_wait(t->start);
+    for(int i = 0; i < t->conns; i++) {
+        if(bench_connect(t) != 0) {
+            t->errors++;
+        }
+    }
+    return NULL;
+}
+
+/* a loopback port nothing listens on */
+static uint16_t dead_port(void) {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock < 0 || bind(sock, (struct sockaddr*)&sin, sizeof(sin)) != 0 ||
+       getsockname(sock, (struct sockaddr*)&sin, &len) != 0) {
+        if(sock >= 0) {
+            close(sock);
+        }
+        return 0;
+    }
+    close(sock);
+    return ntohs(sin.sin_port);
+}
+
+/* what toralize does for a pooled connect: a ctx on the upstream's
+ * proxy with a sock taken from its pool */
+static int pooled_connect(upstream* u, socks5_ctx** out) {
+    socks5_ctx* ctx = socks5_create_ctx_proxy(u->proxy);
+    socks5_endpoint* ep = upstream_acquire(u);
+    socks5_set_endpoint(ctx, ep);
+    socks5_endpoint_unref(ep);
+
+    int sock = socks5_pool_get(u->pool);
+    if(sock < 0 || socks5_attach(ctx, sock) != 0) {
+        socks5_free(ctx);
+        return -1;
+    }
+    *out = ctx;
+    return socks5_connect(ctx, "bench.test", 80);
+}
+
+/* the pool and every ctx through an upstream, pooled or not, hold refs
+ * to the one proxy the upstream created. the pool is filled and idle
+ * while counting, low 0 keeps it from refilling behind the check */
+static int check_shared_proxy(mock_socks5* mock) {
+    upstream_set* set = upstream_set_create();
+    if(!set || upstream_add(set, "127.0.0.1", mock_socks5_port(mock)) != 0) {
+        upstream_set_unref(set);
+        return -1;
+    }
+    upstream* u = &set->list[0];
+    socks5_endpoint* ep = upstream_acquire(u);
+    u->pool = socks5_pool_create(u->proxy, ep, 0, 2);
+    socks5_endpoint_unref(ep);
+
+    socks5_pool_stats stats = {0};
+    socks5_pool_get(u->pool);
+    for(int i = 0; i < 1000 && stats.opened < 2; i++) {
+        usleep(1000);
+        socks5_pool_get_stats(u->pool, &stats);
+    }
+    int idle = socks5_proxy_refs(u->proxy);
+
+    socks5_ctx* pooled = NULL;
+    int pooled_sock = pooled_connect(u, &pooled);
+    int with_pooled = socks5_proxy_refs(u->proxy);
+
+    socks5_ctx* direct = socks5_create_ctx_proxy(u->proxy);
+    int with_both = socks5_proxy_refs(u->proxy);
+    socks5_free(direct);
+    socks5_free(pooled);
+    int after = socks5_proxy_refs(u->proxy);
+
+    /* the upstream's own, the pool's, then one per ctx */
+    int ok = stats.opened == 2 && pooled_sock >= 0 && idle == 2 && with_pooled == 3 &&
+             with_both == 4 && after == 2;
+    printf("shared_proxy opened=%llu pooled_sock=%s refs=%d,%d,%d,%d %s\n",
+           (unsigned long long)stats.opened, pooled_sock >= 0 ? "ok" : "failed",
+           idle, with_pooled, with_both, after, ok ? "ok" : "proxy not shared");
+    upstream_set_unref(set);
+    return ok ? 0 : -1;
+}
+
+/* run one policy, print its line, 0 if every check held */
+static int run_policy(const char* name, mock_socks5** mocks, int cnt, uint16_t dead, int conns, int threads) {
+    upstream_set* set = upstream_set_create();
+    if(!set) {
+        return -1;
+    }
+    set->policy = upstream_parse_policy(name);
+    for(int i = 0; i < cnt; i++) {
+        upstream_add(set, "127.0.0.1", mock_socks5_port(mocks[i]));
+    }
+    upstream_add(set, "127.0.0.1", dead);
+
+    bench_thread* t = calloc(threads, sizeof(bench_thread));
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for(int i = 0; i < threads; i++) {
+        t[i].set = set;
+        t[i].conns = conns / threads + (i < conns % threads);
+        t[i].start = &start;
+        pthread_create(&tids[i], NULL, bench_main, &t[i]);
+    }
+
+    pthread_barrier_wait(&start);
+    uint64_t begin = upstream_now_us();
+    for(int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    uint64_t elapsed_ms = (upstream_now_us() - begin) / 1000;
+    pthread_barrier_destroy(&start);
+
+    int ok[UPSTREAM_MAX] = {0};
+    int tries[UPSTREAM_MAX] = {0};
+    int errors = 0;
+    for(int i = 0; i < threads; i++) {
+        for(int j = 0; j < set->count; j++) {
+            ok[j] += t[i].ok[j];
+            tries[j] += t[i].tries[j];
+        }
+        errors += t[i].errors;
+    }
+
+    printf("policy=%-5s conns=%-6d ms=%-6llu errors=%d dead_tries=%d ok=", name, conns,
+           (unsigned long long)elapsed_ms, errors, tries[cnt]);
+    for(int i = 0; i < cnt; i++) {
+        printf("%s%d", i ? "," : "", ok[i]);
+    }
+
+    /* every thread may pick the dead port before its third failure and
+     * again each time its backoff runs out */
+    const char* bad = NULL;
+    int mean = conns / cnt;
+    int max_dead = UPSTREAM_MAX_FAILS + threads * (1 + (int)(elapsed_ms / UPSTREAM_BACKOFF_MS));
+    if(errors) {
+        bad = "connects failed";
+    }
+    else if(ok[cnt] || set->list[cnt].fails < UPSTREAM_MAX_FAILS) {
+        bad = "dead port not in backoff";
+    }
+    else if(tries[cnt] > max_dead) {
+        bad = "dead port tried too often";
+    }
+    for(int i = 0; !bad && i < cnt; i++) {
+        if(set->policy == UPSTREAM_RR && (ok[i] < mean - mean / 5 || ok[i] > mean + mean / 5)) {
+            bad = "rr spread off by more than 20%";
+        }
+        else if(set->policy != UPSTREAM_RR && ok[i] > ok[0]) {
+            bad = "a slower port got more than the fastest";
+        }
+        else if(set->policy == UPSTREAM_LEAST && ok[i] == 0) {
+            bad = "least starved a port";
+        }
+    }
+    printf(" %s\n", bad ? bad : "ok");
+
+    free(tids);
+    free(t);
+    upstream_set_unref(set);
+    return bad ? -1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    int cnt = 3;
+    int conns = 3000;
+    int threads = 4;
+    int delay_us = 500;
+
+    int opt;
+    while((opt = getopt(argc, argv, "m:n:t:d:")) != -1) {
+        switch(opt) {
+            case 'm':
+                cnt = atoi(optarg);
+                break;
+            case 'n':
+                conns = atoi(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'd':
+                delay_us = atoi(optarg);
+                break;
+            default:
+                cnt = -1;
+                break;
+        }
+    }
+    if(cnt < 2 || cnt > BENCH_MAX_MOCKS || conns < cnt || threads <= 0) {
+        fprintf(stderr, "usage: %s [-m mocks] [-n conns] [-t threads] [-d delay_us]\n", argv[0]);
+        return 2;
+    }
+
+    mock_socks5* mocks[BENCH_MAX_MOCKS];
+    for(int i = 0; i < cnt; i++) {
+        mock_socks5_opts mopts;
+        memset(&mopts, 0, sizeof(mopts));
+        mopts.delay_us = i * delay_us;
+        mocks[i] = mock_socks5_start(&mopts);
+        if(!mocks[i]) {
+            fprintf(stderr, "failed to start mock server\n");
+            return 1;
+        }
+    }
+    uint16_t dead = dead_port();
+    if(!dead) {
+        fprintf(stderr, "no free port for the dead upstream\n");
+        return 1;
+    }
+
+    static const char* policies[] = {"rr", "least", "ewma"};
+    int failed = check_shared_proxy(mocks[0]) != 0;
+    for(size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if(run_policy(policies[i], mocks, cnt, dead, conns, threads) != 0) {
+            failed = 1;
+        }
+    }
+
+    for(int i = 0; i < cnt; i++) {
+        mock_socks5_stop(mocks[i]);
+    }
+    return failed;
+}